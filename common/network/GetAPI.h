@@ -23,6 +23,7 @@
 #include <pthread.h>
 #include <rfb/PixelBuffer.h>
 #include <rfb/PixelFormat.h>
+#include <rfb/Region.h>
 #include <stdint.h>
 #include <map>
 #include <string>
@@ -35,7 +36,7 @@ namespace network {
     GetAPIMessager(const char *passwdfile_);
 
     // from main thread
-    void mainUpdateScreen(rfb::PixelBuffer *pb);
+    void mainUpdateScreen(rfb::PixelBuffer *pb, const rfb::Region &changed);
     void mainUpdateBottleneckStats(const char userid[], const char stats[]);
     void mainClearBottleneckStats(const char userid[]);
     void mainUpdateServerFrameStats(uint8_t changedPerc, uint32_t all,
@@ -52,12 +53,25 @@ namespace network {
     uint8_t *netGetScreenshot(uint16_t w, uint16_t h,
                               const uint8_t q, const bool dedup,
                               uint32_t &len, uint8_t *staging);
+    // Changes whenever the screen does
+    uint64_t netScreenGen();
+    // Copies the JPEG if it fits and is newer than gen, returns its
+    // length. Zero when there is nothing new or no CPU budget left.
+    uint32_t netGetPreview(uint16_t w, uint16_t h, const uint8_t q,
+                           uint64_t &gen, uint8_t *buf, uint32_t room);
     uint8_t netAddUser(const char name[], const char pw[], const bool write);
     uint8_t netRemoveUser(const char name[]);
     uint8_t netGiveControlTo(const char name[]);
     void netGetBottleneckStats(char *buf, uint32_t len);
     void netGetFrameStats(char *buf, uint32_t len);
     uint8_t netServerFrameStatsReady();
+    void netCancelFrameStats();
+    // The encoding pipeline's metrics in the Prometheus text format.
+    // Copies them if they fit, returns their length.
+    uint32_t netGetMetrics(char *buf, uint32_t len);
+
+    // Readable (eventfd) whenever the main thread publishes frame stats
+    int netFrameStatsFd() const { return frameStatsFd; }
 
     enum USER_ACTION {
       //USER_ADD, - handled locally for interactivity
@@ -88,11 +102,30 @@ namespace network {
     pthread_mutex_t screenMutex;
     rfb::ManagedPixelBuffer screenPb;
     uint16_t screenW, screenH;
-    uint64_t screenHash;
+    uint64_t screenGen;
+
+    // Changes not yet copied to screenPb, only used by the main thread
+    rfb::Region screenDamage;
 
-    std::vector<uint8_t> cachedJpeg;
-    uint16_t cachedW, cachedH;
-    uint8_t cachedQ;
+    struct cachedJpeg_t {
+      cachedJpeg_t(): w(0), h(0), q(0), gen(0), lastUsed(0) {}
+
+      uint16_t w, h;
+      uint8_t q;
+      uint64_t gen;
+      uint64_t lastUsed;
+      std::vector<uint8_t> data;
+    };
+    enum { JPEG_CACHE_SIZE = 4 };
+    cachedJpeg_t cachedJpegs[JPEG_CACHE_SIZE];
+    uint64_t jpegCacheTick;
+
+    cachedJpeg_t *findJpeg(uint16_t w, uint16_t h, const uint8_t q);
+    cachedJpeg_t *encodeJpeg(uint16_t w, uint16_t h, const uint8_t q);
+
+    // Encoding time spent on previews in the current second, in us
+    uint64_t previewWindow, previewUsed;
+    bool previewBudgetLeft();
 
     std::map<std::string, std::string> bottleneckStats;
     pthread_mutex_t statMutex;
@@ -123,6 +156,9 @@ namespace network {
     std::map<std::string, clientFrameStats_t> clientFrameStats;
     serverFrameStats_t serverFrameStats;
     pthread_mutex_t frameStatMutex;
+    int frameStatsFd;
+
+    void notifyFrameStats();
 
     uint8_t ownerConnected;
     uint8_t activeUsers;
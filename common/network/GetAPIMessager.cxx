@@ -20,19 +20,36 @@
 
 #include <inttypes.h>
 #include <network/GetAPI.h>
+#include <network/credstore.h>
+#include <rfb/Configuration.h>
 #include <rfb/ConnParams.h>
 #include <rfb/EncodeManager.h>
 #include <rfb/LogWriter.h>
 #include <rfb/JpegCompressor.h>
-#include <rfb/xxhash.h>
+#include <rfb/Metrics.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
 using namespace network;
 using namespace rfb;
 
 static LogWriter vlog("GetAPIMessager");
 
+static IntParameter previewCPUBudget("PreviewCPUBudget",
+                                     "Milliseconds per second the live preview API "
+                                     "may spend encoding", 100, 0, 1000);
+
+static uint64_t usNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 struct TightJPEGConfiguration {
     int quality;
     int subsampling;
@@ -52,8 +69,8 @@ static const struct TightJPEGConfiguration conf[10] = {
 };
 
 GetAPIMessager::GetAPIMessager(const char *passwdfile_): passwdfile(passwdfile_),
-					screenW(0), screenH(0), screenHash(0),
-					cachedW(0), cachedH(0), cachedQ(0),
+					screenW(0), screenH(0), screenGen(0),
+					jpegCacheTick(0), previewWindow(0), previewUsed(0),
 					ownerConnected(0), activeUsers(0) {
 
 	pthread_mutex_init(&screenMutex, NULL);
@@ -63,36 +80,58 @@ GetAPIMessager::GetAPIMessager(const char *passwdfile_): passwdfile(passwdfile_)
 	pthread_mutex_init(&userInfoMutex, NULL);
 
 	serverFrameStats.inprogress = 0;
+
+	frameStatsFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (frameStatsFd < 0)
+		vlog.error("Failed to create frame stats eventfd");
+}
+
+void GetAPIMessager::notifyFrameStats() {
+	const uint64_t one = 1;
+
+	if (frameStatsFd >= 0 && write(frameStatsFd, &one, sizeof(one)) < 0 &&
+	    errno != EAGAIN)
+		vlog.error("Failed to signal frame stats: %s", strerror(errno));
 }
 
 // from main thread
-void GetAPIMessager::mainUpdateScreen(rfb::PixelBuffer *pb) {
+void GetAPIMessager::mainUpdateScreen(rfb::PixelBuffer *pb, const Region &changed) {
+	screenDamage.assign_union(changed);
+
+	// Whatever changed meanwhile is copied next time
 	if (pthread_mutex_trylock(&screenMutex))
 		return;
 
-	int stride;
-	const rdr::U8 * const buf = pb->getBuffer(pb->getRect(), &stride);
+	if (pb->width() != screenW || pb->height() != screenH ||
+	    !pb->getPF().equal(screenPb.getPF())) {
+		// Starts from the clock, so no id from a previous run comes back
+		if (!screenGen)
+			screenGen = (uint64_t) time(NULL) << 32;
 
-	if (pb->width() != screenW || pb->height() != screenH) {
-		screenHash = 0;
 		screenW = pb->width();
 		screenH = pb->height();
 		screenPb.setPF(pb->getPF());
 		screenPb.setSize(screenW, screenH);
 
-		cachedW = cachedH = cachedQ = 0;
-		cachedJpeg.clear();
+		screenDamage = pb->getRect();
 	}
 
-	const uint64_t newHash = XXH64(buf, pb->area() * 4, 0);
-	if (newHash != screenHash) {
-		cachedW = cachedH = cachedQ = 0;
-		cachedJpeg.clear();
+	screenDamage.assign_intersect(pb->getRect());
+	if (!screenDamage.is_empty()) {
+		std::vector<Rect> rects;
+		std::vector<Rect>::const_iterator i;
+
+		screenDamage.get_rects(&rects);
+		for (i = rects.begin(); i != rects.end(); i++) {
+			const rdr::U8 *data;
+			int stride;
+
+			data = pb->getBuffer(*i, &stride);
+			screenPb.imageRect(*i, data, stride);
+		}
 
-		screenHash = newHash;
-		rdr::U8 *rw = screenPb.getBufferRW(screenPb.getRect(), &stride);
-		memcpy(rw, buf, screenW * screenH * 4);
-		screenPb.commitBufferRW(screenPb.getRect());
+		screenDamage.clear();
+		__sync_add_and_fetch(&screenGen, 1);
 	}
 
 	pthread_mutex_unlock(&screenMutex);
@@ -142,6 +181,8 @@ void GetAPIMessager::mainUpdateServerFrameStats(uint8_t changedPerc,
 	serverFrameStats.h = h;
 
 	pthread_mutex_unlock(&frameStatMutex);
+
+	notifyFrameStats();
 }
 
 void GetAPIMessager::mainUpdateClientFrameStats(const char userid[], uint32_t render,
@@ -158,6 +199,8 @@ void GetAPIMessager::mainUpdateClientFrameStats(const char userid[], uint32_t re
 	clientFrameStats[userid] = s;
 
 	pthread_mutex_unlock(&frameStatMutex);
+
+	notifyFrameStats();
 }
 
 void GetAPIMessager::mainUpdateUserInfo(const uint8_t ownerConn, const uint8_t numUsers) {
@@ -170,6 +213,77 @@ void GetAPIMessager::mainUpdateUserInfo(const uint8_t ownerConn, const uint8_t n
 	pthread_mutex_unlock(&userInfoMutex);
 }
 
+// Called with screenMutex held
+GetAPIMessager::cachedJpeg_t *GetAPIMessager::findJpeg(uint16_t w, uint16_t h,
+	const uint8_t q) {
+
+	unsigned i;
+	for (i = 0; i < JPEG_CACHE_SIZE; i++) {
+		cachedJpeg_t &c = cachedJpegs[i];
+
+		if (c.w == w && c.h == h && c.q == q && c.gen == screenGen) {
+			c.lastUsed = ++jpegCacheTick;
+			return &c;
+		}
+	}
+
+	return NULL;
+}
+
+// Called with screenMutex held, the least recently used slot gets the image
+GetAPIMessager::cachedJpeg_t *GetAPIMessager::encodeJpeg(uint16_t w, uint16_t h,
+	const uint8_t q) {
+
+	cachedJpeg_t *slot = &cachedJpegs[0];
+	unsigned i;
+	for (i = 1; i < JPEG_CACHE_SIZE; i++) {
+		if (cachedJpegs[i].lastUsed < slot->lastUsed)
+			slot = &cachedJpegs[i];
+	}
+
+	JpegCompressor jc;
+	int quality, subsampling;
+
+	quality = conf[q].quality;
+	subsampling = conf[q].subsampling;
+
+	jc.clear();
+	int stride;
+
+	if (w != screenW || h != screenH) {
+		float xdiff = w / (float) screenW;
+		float ydiff = h / (float) screenH;
+		const float diff = xdiff < ydiff ? xdiff : ydiff;
+
+		const uint16_t neww = screenW * diff;
+		const uint16_t newh = screenH * diff;
+
+		const PixelBuffer *scaled = progressiveBilinearScale(&screenPb, neww, newh, diff);
+		const rdr::U8 * const buf = scaled->getBuffer(scaled->getRect(), &stride);
+
+		jc.compress(buf, stride, scaled->getRect(),
+				scaled->getPF(), quality, subsampling);
+
+		delete scaled;
+	} else {
+		const rdr::U8 * const buf = screenPb.getBuffer(screenPb.getRect(), &stride);
+
+		jc.compress(buf, stride, screenPb.getRect(),
+				screenPb.getPF(), quality, subsampling);
+	}
+
+	slot->data.resize(jc.length());
+	memcpy(&slot->data[0], jc.data(), jc.length());
+
+	slot->q = q;
+	slot->w = w;
+	slot->h = h;
+	slot->gen = screenGen;
+	slot->lastUsed = ++jpegCacheTick;
+
+	return slot;
+}
+
 // from network threads
 uint8_t *GetAPIMessager::netGetScreenshot(uint16_t w, uint16_t h,
 	const uint8_t q, const bool dedup,
@@ -192,75 +306,96 @@ uint8_t *GetAPIMessager::netGetScreenshot(uint16_t w, uint16_t h,
 	if (pthread_mutex_lock(&screenMutex))
 		return NULL;
 
-	if (w == cachedW && h == cachedH && q == cachedQ) {
+	const cachedJpeg_t *c = findJpeg(w, h, q);
+	if (c) {
 		if (dedup) {
-			// Return the hash of the unchanged image
-			sprintf((char *) staging, "%" PRIx64, screenHash);
+			// Return the id of the unchanged image
+			sprintf((char *) staging, "%016" PRIx64, screenGen);
 			ret = staging;
 			len = 16;
 		} else {
 			// Return the cached image
-			len = cachedJpeg.size();
+			len = c->data.size();
 			ret = staging;
-			memcpy(ret, &cachedJpeg[0], len);
+			memcpy(ret, &c->data[0], len);
 
 			vlog.info("Returning cached screenshot");
 		}
 	} else {
 		// Encode the new JPEG, cache it
-		JpegCompressor jc;
-		int quality, subsampling;
-
-		quality = conf[q].quality;
-		subsampling = conf[q].subsampling;
+		c = encodeJpeg(w, h, q);
 
-		jc.clear();
-		int stride;
+		if (w != screenW || h != screenH)
+			vlog.info("Returning scaled screenshot");
+		else
+			vlog.info("Returning normal screenshot");
 
-		if (w != screenW || h != screenH) {
-			float xdiff = w / (float) screenW;
-			float ydiff = h / (float) screenH;
-			const float diff = xdiff < ydiff ? xdiff : ydiff;
+		len = c->data.size();
+		ret = staging;
+		memcpy(ret, &c->data[0], len);
+	}
 
-			const uint16_t neww = screenW * diff;
-			const uint16_t newh = screenH * diff;
+	pthread_mutex_unlock(&screenMutex);
 
-			const PixelBuffer *scaled = progressiveBilinearScale(&screenPb, neww, newh, diff);
-			const rdr::U8 * const buf = scaled->getBuffer(scaled->getRect(), &stride);
+	return ret;
+}
 
-			jc.compress(buf, stride, scaled->getRect(),
-					scaled->getPF(), quality, subsampling);
+uint64_t GetAPIMessager::netScreenGen() {
+	return __sync_add_and_fetch(&screenGen, 0);
+}
 
-			cachedJpeg.resize(jc.length());
-			memcpy(&cachedJpeg[0], jc.data(), jc.length());
+uint32_t GetAPIMessager::netGetPreview(uint16_t w, uint16_t h, const uint8_t q,
+	uint64_t &gen, uint8_t *buf, uint32_t room) {
 
-			delete scaled;
+	uint32_t len = 0;
 
-			vlog.info("Returning scaled screenshot");
-		} else {
-			const rdr::U8 * const buf = screenPb.getBuffer(screenPb.getRect(), &stride);
+	if (q > 9 || pthread_mutex_lock(&screenMutex))
+		return 0;
 
-			jc.compress(buf, stride, screenPb.getRect(),
-					screenPb.getPF(), quality, subsampling);
+	if (w > screenW)
+		w = screenW;
+	if (h > screenH)
+		h = screenH;
 
-			cachedJpeg.resize(jc.length());
-			memcpy(&cachedJpeg[0], jc.data(), jc.length());
+	if (w && h && gen != screenGen) {
+		// Watchers of the same size share the encode through the cache
+		const cachedJpeg_t *c = findJpeg(w, h, q);
 
-			vlog.info("Returning normal screenshot");
+		if (!c && previewBudgetLeft()) {
+			const uint64_t start = usNow();
+			c = encodeJpeg(w, h, q);
+			previewUsed += usNow() - start;
 		}
 
-		cachedQ = q;
-		cachedW = w;
-		cachedH = h;
-
-		len = cachedJpeg.size();
-		ret = staging;
-		memcpy(ret, &cachedJpeg[0], len);
+		if (c) {
+			len = c->data.size();
+			if (len <= room) {
+				memcpy(buf, &c->data[0], len);
+				gen = c->gen;
+			}
+		}
 	}
 
 	pthread_mutex_unlock(&screenMutex);
 
-	return ret;
+	return len;
+}
+
+// Called with screenMutex held
+bool GetAPIMessager::previewBudgetLeft() {
+	const uint64_t budget = previewCPUBudget * 1000;
+	const uint64_t now = usNow();
+
+	// What went over the budget is paid back by the following seconds
+	if (now - previewWindow >= 1000000) {
+		const uint64_t windows = (now - previewWindow) / 1000000;
+
+		previewWindow += windows * 1000000;
+		previewUsed = previewUsed > windows * budget ?
+		              previewUsed - windows * budget : 0;
+	}
+
+	return previewUsed < budget;
 }
 
 #define USERNAME_LEN sizeof(((struct kasmpasswd_entry_t *)0)->user)
@@ -289,31 +424,13 @@ uint8_t GetAPIMessager::netAddUser(const char name[], const char pw[], const boo
 	act.data.owner = 0;
 	act.data.write = write;
 
-	if (pthread_mutex_lock(&userMutex))
-		return 0;
-
-        // This needs to be handled locally for proper interactivity
-        // (consider adding users when nobody is connected).
-        // The mutex and atomic rename keep things in sync.
-
-        struct kasmpasswd_t *set = readkasmpasswd(passwdfile);
-        unsigned s;
-        for (s = 0; s < set->num; s++) {
-          if (!strcmp(set->entries[s].user, act.data.user)) {
-            vlog.error("Can't create user %s, already exists", act.data.user);
-            goto out;
-          }
-        }
-
-        s = set->num++;
-        set->entries = (struct kasmpasswd_entry_t *) realloc(set->entries,
-                                                                 set->num * sizeof(struct kasmpasswd_entry_t));
-        set->entries[s] = act.data;
-
-        writekasmpasswd(passwdfile, set);
-        vlog.info("User %s created", act.data.user);
-out:
-	pthread_mutex_unlock(&userMutex);
+	// This needs to be handled locally for proper interactivity
+	// (consider adding users when nobody is connected).
+	// The store's lock and atomic rename keep things in sync.
+	if (credstore_add(&act.data))
+		vlog.info("User %s created", act.data.user);
+	else
+		vlog.error("Can't create user %s, already exists", act.data.user);
 
 	return 1;
 }
@@ -629,3 +746,33 @@ uint8_t GetAPIMessager::netServerFrameStatsReady() {
 
 	return ret;
 }
+
+void GetAPIMessager::netCancelFrameStats() {
+	if (pthread_mutex_lock(&frameStatMutex))
+		return;
+
+	// The queued request may still be served, the next one clears it
+	serverFrameStats.inprogress = 0;
+
+	pthread_mutex_unlock(&frameStatMutex);
+}
+
+uint32_t GetAPIMessager::netGetMetrics(char *buf, uint32_t len) {
+	char *out = NULL;
+	size_t outlen = 0;
+	FILE *f;
+
+	// Only atomic counters are read, nothing here waits for the main thread
+	f = open_memstream(&out, &outlen);
+	if (!f)
+		return 0;
+
+	Metrics::write(f);
+	fclose(f);
+
+	if (outlen < len)
+		memcpy(buf, out, outlen + 1);
+	free(out);
+
+	return outlen;
+}
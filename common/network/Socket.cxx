@@ -123,8 +123,21 @@ void Socket::setFd(int fd)
   fcntl(fd, F_SETFD, FD_CLOEXEC);
 #endif
 
-  instream = new rdr::FdInStream(fd);
-  outstream = new rdr::FdOutStream(fd);
+  rdr::FdInStream* in = new rdr::FdInStream(fd);
+  rdr::FdOutStream* out = new rdr::FdOutStream(fd);
+
+  // Large rects can go out with zero-copy on TCP sockets
+  if (out->enableZeroCopy())
+    in->setZeroCopyStream(out);
+
+  setStreams(in, out);
+}
+
+// For sockets that need more than plain reads and writes on the fd
+void Socket::setStreams(rdr::FdInStream* in, rdr::FdOutStream* out)
+{
+  instream = in;
+  outstream = out;
   isShutdown_ = false;
 }
 
@@ -173,10 +186,10 @@ Socket* SocketListener::accept() {
   return s;
 }
 
-void SocketListener::listen(int sock)
+void SocketListener::listen(int sock, int backlog)
 {
   // - Set it to be a listening socket
-  if (::listen(sock, 5) < 0) {
+  if (::listen(sock, backlog) < 0) {
     int e = errorNumber;
     closesocket(sock);
     throw SocketException("unable to set socket to listening mode", e);
@@ -48,6 +48,9 @@ namespace network {
 
     virtual bool cork(bool enable) = 0;
 
+    // Is the kernel doing the TLS encryption (kTLS)?
+    virtual bool isKernelTLS() { return false; }
+
     // information about the remote end of the socket
     virtual char* getPeerAddress() = 0; // a string e.g. "192.168.0.1"
     virtual char* getPeerEndpoint() = 0; // <address>::<port>
@@ -60,6 +63,7 @@ namespace network {
     Socket();
 
     void setFd(int fd);
+    void setStreams(rdr::FdInStream* in, rdr::FdOutStream* out);
 
   private:
     rdr::FdInStream* instream;
@@ -87,7 +91,7 @@ namespace network {
     // accept() returns a new Socket object if there is a connection
     // attempt in progress AND if the connection passes the filter
     // if one is installed.  Otherwise, returns 0.
-    Socket* accept();
+    virtual Socket* accept();
 
     virtual int getMyPort() = 0;
 
@@ -100,7 +104,7 @@ namespace network {
   protected:
     SocketListener();
 
-    void listen(int fd);
+    void listen(int fd, int backlog = 5);
 
     // createSocket() should create a new socket of the correct class
     // for the given file descriptor
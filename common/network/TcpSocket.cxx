@@ -40,12 +40,15 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <wordexp.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include "credstore.h"
 #include "websocket.h"
 
 #include <network/GetAPI.h>
 #include <network/TcpSocket.h>
+#include <network/WebSocketStreams.h>
 #include <rfb/LogWriter.h>
 #include <rfb/Configuration.h>
 #include <rfb/ServerCore.h>
@@ -78,6 +81,7 @@ static rfb::LogWriter vlog("TcpSocket");
 
 static rfb::BoolParameter UseIPv4("UseIPv4", "Use IPv4 for incoming and outgoing connections.", true);
 static rfb::BoolParameter UseIPv6("UseIPv6", "Use IPv6 for incoming and outgoing connections.", true);
+static rfb::BoolParameter kernelTLS("KernelTLS", "Let the kernel encrypt websocket TLS traffic (kTLS), if it can", false);
 
 rfb::StringParameter httpDir("httpd",
                              "Directory containing files to serve via HTTP",
@@ -122,23 +126,30 @@ int network::getSockPort(int sock)
   }
 }
 
-WebSocket::WebSocket(int sock) : Socket(sock)
+WebSocket::WebSocket(int sock, struct ssl_st* ssl, bool framed,
+                     const char* peer_)
+  : Socket(), peer(rfb::strDup(peer_)), ktls(false)
 {
+  if (framed) {
+    WebSocketOutStream* out = new WebSocketOutStream(sock, ssl);
+    ktls = out->kernelTLS();
+    setStreams(new WebSocketInStream(sock, ssl, out->getSSLMutex()), out);
+  } else {
+    setFd(sock);
+  }
+}
+
+WebSocket::~WebSocket() {
+  delete [] peer;
 }
 
 char* WebSocket::getPeerAddress() {
-  struct sockaddr_un addr;
-  socklen_t len = sizeof(struct sockaddr_un);
-  if (getpeername(getFd(), (struct sockaddr *) &addr, &len) != 0) {
-    vlog.error("unable to get peer name for socket");
-    return rfb::strDup("websocket");
-  }
-  return rfb::strDup(addr.sun_path + 1);
+  return rfb::strDup(peer);
 }
 
 char* WebSocket::getPeerEndpoint() {
   char buf[1024];
-  sprintf(buf, "%s::websocket", getPeerAddress());
+  snprintf(buf, sizeof(buf), "%s::websocket", peer);
 
   return rfb::strDup(buf);
 }
@@ -521,6 +532,31 @@ static uint8_t serverFrameStatsReadyCb(void *messager)
   return msgr->netServerFrameStatsReady();
 }
 
+static void cancelFrameStatsCb(void *messager)
+{
+  GetAPIMessager *msgr = (GetAPIMessager *) messager;
+  msgr->netCancelFrameStats();
+}
+
+static uint64_t screenGenCb(void *messager)
+{
+  GetAPIMessager *msgr = (GetAPIMessager *) messager;
+  return msgr->netScreenGen();
+}
+
+static uint32_t previewCb(void *messager, uint16_t w, uint16_t h, const uint8_t q,
+                          uint64_t *gen, uint8_t *buf, uint32_t len)
+{
+  GetAPIMessager *msgr = (GetAPIMessager *) messager;
+  return msgr->netGetPreview(w, h, q, *gen, buf, len);
+}
+
+static uint32_t metricsCb(void *messager, char *buf, uint32_t len)
+{
+  GetAPIMessager *msgr = (GetAPIMessager *) messager;
+  return msgr->netGetMetrics(buf, len);
+}
+
 
 WebsocketListener::WebsocketListener(const struct sockaddr *listenaddr,
                          socklen_t listenaddrlen,
@@ -569,27 +605,25 @@ WebsocketListener::WebsocketListener(const struct sockaddr *listenaddr,
     throw SocketException("failed to bind socket, is someone else on our -websocketPort?", e);
   }
 
-  listen(sock); // sets the internal fd
+  // The websocket front end accepts in bulk, give bursts of browsers,
+  // pollers and health checks room to queue
+  listen(sock, SOMAXCONN);
+  listenSock = sock;
 
   //
-  // External TCP socket now created. Create the internal ones
+  // Upgraded connections are handed to the main loop through a pipe,
+  // which stands in for the listening socket
   //
-  internalSocket = socket(AF_UNIX, SOCK_STREAM, 0);
-
-  char sockname[32];
-  sprintf(sockname, ".KasmVNCSock%u", getpid());
+  int handoff[2];
+  if (pipe(handoff) < 0)
+    throw SocketException("unable to create websocket handoff pipe",
+                          errorNumber);
+  fcntl(handoff[0], F_SETFD, FD_CLOEXEC);
+  fcntl(handoff[0], F_SETFL, O_NONBLOCK);
+  fcntl(handoff[1], F_SETFD, FD_CLOEXEC);
 
-  struct sockaddr_un addr;
-  addr.sun_family = AF_UNIX;
-  strcpy(addr.sun_path, sockname);
-  addr.sun_path[0] = '\0';
-
-  if (bind(internalSocket, (struct sockaddr *) &addr,
-           sizeof(sa_family_t) + strlen(sockname))) {
-    throw SocketException("failed to bind socket", errorNumber);
-  }
-
-  listen(internalSocket);
+  fd = handoff[0];
+  handoffFd = handoff[1];
 
   settings.passwdfile = NULL;
 
@@ -598,16 +632,21 @@ WebsocketListener::WebsocketListener(const struct sockaddr *listenaddr,
     settings.passwdfile = strdup(wexp.we_wordv[0]);
   wordfree(&wexp);
 
+  if (settings.passwdfile)
+    credstore_open(settings.passwdfile);
+
   settings.disablebasicauth = disablebasicauth;
   settings.cert = cert;
   settings.key = certkey;
   settings.ssl_only = sslonly;
+  settings.ktls = kernelTLS;
   settings.verbose = vlog.getLevel() >= vlog.LEVEL_DEBUG;
   settings.httpdir = NULL;
   if (httpdir && httpdir[0])
     settings.httpdir = realpath(httpdir, NULL);
 
   settings.listen_sock = sock;
+  settings.handoff_fd = handoffFd;
 
   settings.messager = messager = new GetAPIMessager(settings.passwdfile);
   settings.screenshotCb = screenshotCb;
@@ -626,13 +665,37 @@ WebsocketListener::WebsocketListener(const struct sockaddr *listenaddr,
   settings.numActiveUsersCb = numActiveUsersCb;
   settings.getClientFrameStatsNumCb = getClientFrameStatsNumCb;
   settings.serverFrameStatsReadyCb = serverFrameStatsReadyCb;
+  settings.cancelFrameStatsCb = cancelFrameStatsCb;
+  settings.frame_stats_fd = messager->netFrameStatsFd();
+
+  settings.screenGenCb = screenGenCb;
+  settings.previewCb = previewCb;
+  settings.metricsCb = metricsCb;
 
   pthread_t tid;
   pthread_create(&tid, NULL, start_server, NULL);
 }
 
+Socket* WebsocketListener::accept() {
+  char peer[128], byte;
+  struct ssl_st* ssl;
+  int sock, framed;
+
+  if (read(fd, &byte, 1) != 1 ||
+      !ws_handoff_take(&sock, &ssl, &framed, peer, sizeof(peer)))
+    throw SocketException("no websocket connection to accept", EAGAIN);
+
+  Socket* s = new WebSocket(sock, ssl, framed, peer);
+  if (filter && !filter->verifyConnection(s)) {
+    delete s;
+    return NULL;
+  }
+
+  return s;
+}
+
 Socket* WebsocketListener::createSocket(int fd) {
-  return new WebSocket(fd);
+  return new WebSocket(fd, NULL, false, "websocket");
 }
 
 void WebsocketListener::getMyAddresses(std::list<char*>* result) {
@@ -678,7 +741,7 @@ void WebsocketListener::getMyAddresses(std::list<char*>* result) {
 }
 
 int WebsocketListener::getMyPort() {
-  return getSockPort(getFd());
+  return getSockPort(listenSock);
 }
 
 
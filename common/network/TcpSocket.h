@@ -40,6 +40,8 @@
 
 #include <list>
 
+struct ssl_st;
+
 /* Tunnelling support. */
 #define TUNNEL_PORT_OFFSET 5500
 
@@ -64,14 +66,24 @@ namespace network {
     bool enableNagles(bool enable);
   };
 
+  // A client handed over by the websocket front end. Binary websocket
+  // clients are framed in-process, directly on their own socket, while
+  // the older protocols still go through a proxied socket pair.
   class WebSocket : public Socket {
   public:
-    WebSocket(int sock);
+    WebSocket(int sock, struct ssl_st* ssl, bool framed, const char* peer);
+    virtual ~WebSocket();
 
     virtual char* getPeerAddress();
     virtual char* getPeerEndpoint();
 
     virtual bool cork(bool enable) { return true; }
+
+    virtual bool isKernelTLS() { return ktls; }
+
+  private:
+    char* peer;
+    bool ktls;
   };
 
   class TcpListener : public SocketListener {
@@ -94,18 +106,20 @@ namespace network {
                       bool disablebasicauth,
                       const char *httpdir);
 
+    virtual Socket* accept();
+
     virtual int getMyPort();
 
     static void getMyAddresses(std::list<char*>* result);
 
-    int internalSocket;
-
     virtual GetAPIMessager *getMessager() { return messager; }
 
   protected:
     virtual Socket* createSocket(int fd);
   private:
     GetAPIMessager *messager;
+    int listenSock;
+    int handoffFd;
   };
 
   void createLocalTcpListeners(std::list<SocketListener*> *listeners,
@@ -0,0 +1,459 @@
+/* Copyright (C) 2021 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <openssl/err.h>
+
+#include <network/WebSocketStreams.h>
+#include <rdr/Exception.h>
+
+using namespace network;
+
+static const size_t RAW_SIZE = 65536;
+
+// Header and payload together fill one TLS record
+static const size_t MAX_TLS_PAYLOAD = 16384 - 4;
+
+static const int MAX_IOV = 64;
+
+static const rdr::U8 OPCODE_CONTINUATION = 0x0;
+static const rdr::U8 OPCODE_BINARY = 0x2;
+static const rdr::U8 OPCODE_CLOSE = 0x8;
+
+// poll() rather than select(), as there may be thousands of clients
+static int pollFd(int fd, bool write, int timeoutms)
+{
+  struct pollfd pfd;
+  int n;
+
+  pfd.fd = fd;
+  pfd.events = write ? POLLOUT : POLLIN;
+
+  do {
+    n = poll(&pfd, 1, timeoutms);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0)
+    throw rdr::SystemException("poll", errno);
+
+  return n;
+}
+
+static const char* sslError()
+{
+  unsigned long err = ERR_get_error();
+  return err ? ERR_reason_error_string(err) : "unknown error";
+}
+
+WebSocketInStream::WebSocketInStream(int fd_, SSL* ssl_, os::Mutex* sslMutex_)
+  : FdInStream(fd_), ssl(ssl_), sslMutex(sslMutex_), rawStart(0), rawEnd(0),
+    payloadLeft(0), maskPos(0), discard(false)
+{
+  raw = new rdr::U8[RAW_SIZE];
+}
+
+WebSocketInStream::~WebSocketInStream()
+{
+  delete [] raw;
+}
+
+bool WebSocketInStream::fillBuffer(size_t maxSize, bool wait)
+{
+  while (true) {
+    if (payloadLeft && rawEnd > rawStart) {
+      size_t i, n;
+      rdr::U8 m[4];
+      const rdr::U8* src;
+      rdr::U8* dst;
+
+      n = rawEnd - rawStart;
+      if (n > payloadLeft)
+        n = payloadLeft;
+
+      if (discard) {
+        rawStart += n;
+        payloadLeft -= n;
+        continue;
+      }
+
+      if (n > maxSize)
+        n = maxSize;
+
+      for (i = 0;i < 4;i++)
+        m[i] = mask[(maskPos + i) & 3];
+
+      src = raw + rawStart;
+      dst = (rdr::U8*)end;
+      for (i = 0;i < n;i++)
+        dst[i] = src[i] ^ m[i & 3];
+
+      maskPos = (maskPos + n) & 3;
+      rawStart += n;
+      payloadLeft -= n;
+      end += n;
+
+      return true;
+    }
+
+    if (!payloadLeft && readHeader())
+      continue;
+
+    if (!readRaw(wait))
+      return false;
+  }
+}
+
+//
+// readHeader() consumes the next frame header, if all of it has arrived.
+// Only binary data reaches the stream. Pings, pongs and text frames are
+// dropped, as the proxy always did, and a close frame ends the stream.
+//
+
+bool WebSocketInStream::readHeader()
+{
+  size_t avail, hdrLen;
+  const rdr::U8* p;
+  rdr::U64 len;
+  rdr::U8 opcode;
+  int i;
+
+  avail = rawEnd - rawStart;
+  if (avail < 2)
+    return false;
+
+  p = raw + rawStart;
+  opcode = p[0] & 0x0f;
+  len = p[1] & 0x7f;
+  hdrLen = 2;
+
+  if (len == 126) {
+    hdrLen = 4;
+    if (avail < hdrLen)
+      return false;
+    len = (p[2] << 8) | p[3];
+  } else if (len == 127) {
+    hdrLen = 10;
+    if (avail < hdrLen)
+      return false;
+    len = 0;
+    for (i = 2;i < 10;i++)
+      len = (len << 8) | p[i];
+  }
+
+  if (!(p[1] & 0x80))
+    throw rdr::Exception("Received unmasked websocket frame");
+
+  hdrLen += 4;
+  if (avail < hdrLen)
+    return false;
+
+  memcpy(mask, p + hdrLen - 4, 4);
+  maskPos = 0;
+
+  if (opcode == OPCODE_CLOSE)
+    throw rdr::EndOfStream();
+
+  discard = opcode != OPCODE_BINARY && opcode != OPCODE_CONTINUATION;
+  payloadLeft = len;
+  rawStart += hdrLen;
+
+  return true;
+}
+
+bool WebSocketInStream::readRaw(bool wait)
+{
+  ssize_t n;
+
+  // Whatever is left is part of a header, so this is cheap
+  if (rawStart) {
+    memmove(raw, raw + rawStart, rawEnd - rawStart);
+    rawEnd -= rawStart;
+    rawStart = 0;
+  }
+
+  bool wantWrite = false;
+
+  while (true) {
+    int pending = 0, err = SSL_ERROR_NONE;
+
+    // TLS may already hold data that poll() can't see
+    if (ssl && !wantWrite) {
+      os::AutoMutex a(sslMutex);
+      pending = SSL_pending(ssl);
+    }
+
+    if (!pending) {
+      if (!waitFd(wantWrite, wait))
+        return false;
+    }
+
+    if (ssl) {
+      {
+        os::AutoMutex a(sslMutex);
+        n = SSL_read(ssl, raw + rawEnd, RAW_SIZE - rawEnd);
+        if (n <= 0)
+          err = SSL_get_error(ssl, n);
+      }
+      if (n > 0)
+        break;
+
+      switch (err) {
+      case SSL_ERROR_WANT_READ:
+        wantWrite = false;
+        break;
+      case SSL_ERROR_WANT_WRITE:
+        wantWrite = true;
+        break;
+      case SSL_ERROR_ZERO_RETURN:
+        throw rdr::EndOfStream();
+      case SSL_ERROR_SYSCALL:
+        if (n == 0 || errno == 0)
+          throw rdr::EndOfStream();
+        throw rdr::SystemException("SSL_read", errno);
+      default:
+        throw rdr::Exception("SSL_read: %s", sslError());
+      }
+    } else {
+      do {
+        n = ::recv(fd, (char*)raw + rawEnd, RAW_SIZE - rawEnd, 0);
+      } while (n < 0 && errno == EINTR);
+
+      if (n > 0)
+        break;
+      if (n == 0)
+        throw rdr::EndOfStream();
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        throw rdr::SystemException("read", errno);
+    }
+
+    if (!wait)
+      return false;
+  }
+
+  rawEnd += n;
+
+  return true;
+}
+
+// Same timeout and callback rules as FdInStream
+bool WebSocketInStream::waitFd(bool write, bool wait)
+{
+  while (true) {
+    if (pollFd(fd, write, wait ? timeoutms : 0) > 0)
+      return true;
+
+    if (!wait)
+      return false;
+    if (!blockCallback)
+      throw rdr::TimedOut();
+
+    blockCallback->blockCallback();
+  }
+}
+
+WebSocketOutStream::WebSocketOutStream(int fd_, SSL* ssl_)
+  : FdOutStream(fd_), ssl(ssl_), sslMutex(NULL), ktls(false), wantRead(false),
+    headerLen(0), headerSent(0), frameLeft(0), staging(NULL), stagedLen(0)
+{
+  // With kTLS the kernel makes the records, so frames can be sent as on
+  // a plain socket. Anything OpenSSL itself writes later, such as alerts
+  // or key updates, also goes through the kernel, in order.
+#ifdef SSL_OP_ENABLE_KTLS
+  if (ssl && BIO_get_ktls_send(SSL_get_wbio(ssl)))
+    ktls = true;
+#endif
+
+  if (ssl)
+    sslMutex = new os::Mutex();
+
+  if (ssl && !ktls) {
+    // Every write is retried whole, so the staging copy stays simple
+    SSL_clear_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE);
+    staging = new rdr::U8[sizeof(header) + MAX_TLS_PAYLOAD];
+  }
+}
+
+WebSocketOutStream::~WebSocketOutStream()
+{
+  try {
+    while (bufferUsage())
+      flushBuffer(true);
+  } catch (rdr::Exception&) {
+  }
+
+  // Don't let FdOutStream send anything unframed
+  advance(bufferUsage());
+
+  delete [] staging;
+  if (ssl)
+    SSL_free(ssl);
+  delete sslMutex;
+}
+
+bool WebSocketOutStream::flushBuffer(bool wait)
+{
+  while (!writeFrame()) {
+    // Same timeout rules as FdOutStream
+    if (waitFd(!wantRead, (blocking || wait) ? timeoutms : 0))
+      continue;
+
+    if (!blocking && !wait)
+      return false;
+
+    throw rdr::TimedOut();
+  }
+
+  gettimeofday(&lastWrite, NULL);
+
+  return true;
+}
+
+//
+// writeFrame() sends as much of the current frame as the socket will take,
+// starting a new one from the pending data if needed. Payload goes
+// straight from the buffer and any kept vectors, so the stream only moves
+// on once it is sent.
+//
+
+bool WebSocketOutStream::writeFrame()
+{
+  struct iovec iov[MAX_IOV];
+  ssize_t n;
+  int count;
+
+  if (!frameLeft) {
+    size_t len;
+
+    len = bufferUsage();
+    if (staging && len > MAX_TLS_PAYLOAD)
+      len = MAX_TLS_PAYLOAD;
+
+    header[0] = 0x80 | OPCODE_BINARY;
+    if (len <= 125) {
+      header[1] = len;
+      headerLen = 2;
+    } else if (len <= 65535) {
+      header[1] = 126;
+      header[2] = len >> 8;
+      header[3] = len;
+      headerLen = 4;
+    } else {
+      int i;
+      header[1] = 127;
+      for (i = 0;i < 8;i++)
+        header[2 + i] = (rdr::U64)len >> (56 - i * 8);
+      headerLen = 10;
+    }
+
+    headerSent = 0;
+    frameLeft = len;
+    stagedLen = 0;
+  }
+
+  if (staging) {
+    if (!stagedLen) {
+      int i;
+
+      memcpy(staging, header, headerLen);
+      stagedLen = headerLen;
+
+      count = gather(iov, MAX_IOV, frameLeft);
+      for (i = 0;i < count;i++) {
+        memcpy(staging + stagedLen, iov[i].iov_base, iov[i].iov_len);
+        stagedLen += iov[i].iov_len;
+      }
+    }
+
+    int err = SSL_ERROR_NONE;
+
+    {
+      os::AutoMutex a(sslMutex);
+      n = SSL_write(ssl, staging, stagedLen);
+      if (n <= 0)
+        err = SSL_get_error(ssl, n);
+    }
+    if (n <= 0) {
+      switch (err) {
+      case SSL_ERROR_WANT_READ:
+        wantRead = true;
+        return false;
+      case SSL_ERROR_WANT_WRITE:
+        wantRead = false;
+        return false;
+      case SSL_ERROR_SYSCALL:
+        throw rdr::SystemException("SSL_write", errno);
+      default:
+        throw rdr::Exception("SSL_write: %s", sslError());
+      }
+    }
+
+    advance(frameLeft);
+    frameLeft = 0;
+    stagedLen = 0;
+
+    return true;
+  }
+
+  struct msghdr msg;
+
+  iov[0].iov_base = header + headerSent;
+  iov[0].iov_len = headerLen - headerSent;
+  count = 1 + gather(iov + 1, MAX_IOV - 1, frameLeft);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+
+  do {
+    n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return false;
+    throw rdr::SystemException("write", errno);
+  }
+
+  if ((size_t)n < headerLen - headerSent) {
+    headerSent += n;
+    return true;
+  }
+
+  n -= headerLen - headerSent;
+  headerSent = headerLen;
+
+  advance(n);
+  frameLeft -= n;
+
+  return true;
+}
+
+bool WebSocketOutStream::waitFd(bool write, int timeoutms)
+{
+  return pollFd(fd, write, timeoutms) > 0;
+}
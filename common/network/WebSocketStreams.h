@@ -0,0 +1,99 @@
+/* Copyright (C) 2021 Kasm
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// WebSocketInStream and WebSocketOutStream carry RFB directly in binary
+// websocket (RFC 6455) frames, optionally over TLS, on a client socket
+// whose HTTP upgrade and TLS handshake the websocket front end has
+// already done.
+//
+
+#ifndef __NETWORK_WEBSOCKET_STREAMS_H__
+#define __NETWORK_WEBSOCKET_STREAMS_H__
+
+#include <openssl/ssl.h>
+
+#include <os/Mutex.h>
+#include <rdr/FdInStream.h>
+#include <rdr/FdOutStream.h>
+
+namespace network {
+
+  class WebSocketInStream : public rdr::FdInStream {
+  public:
+    // The TLS session is shared with the output side, whose lock is
+    // taken around it as the two may be used from different threads
+    WebSocketInStream(int fd, SSL* ssl, os::Mutex* sslMutex);
+    virtual ~WebSocketInStream();
+
+  private:
+    virtual bool fillBuffer(size_t maxSize, bool wait);
+
+    bool readHeader();
+    bool readRaw(bool wait);
+    bool waitFd(bool write, bool wait);
+
+    SSL* ssl;
+    os::Mutex* sslMutex;
+
+    // Bytes as they came off the socket, still framed and masked
+    rdr::U8* raw;
+    size_t rawStart, rawEnd;
+
+    rdr::U64 payloadLeft;
+    rdr::U8 mask[4];
+    unsigned maskPos;
+    bool discard;
+  };
+
+  // Frees the TLS session when done, as the output side is the last to
+  // use it
+  class WebSocketOutStream : public rdr::FdOutStream {
+  public:
+    WebSocketOutStream(int fd, SSL* ssl);
+    virtual ~WebSocketOutStream();
+
+    // Whether the kernel encrypts what is sent (kTLS)
+    bool kernelTLS() const { return ktls; }
+
+    os::Mutex* getSSLMutex() { return sslMutex; }
+
+  private:
+    virtual bool flushBuffer(bool wait);
+
+    bool writeFrame();
+    bool waitFd(bool write, int timeoutms);
+
+    SSL* ssl;
+    os::Mutex* sslMutex;
+    bool ktls;
+    bool wantRead;
+
+    // The frame being sent, its payload is what is pending in the stream
+    rdr::U8 header[10];
+    size_t headerLen, headerSent;
+    size_t frameLeft;
+
+    // Userspace TLS sends header and payload as one record, from a copy
+    rdr::U8* staging;
+    size_t stagedLen;
+  };
+
+}
+
+#endif
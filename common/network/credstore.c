@@ -0,0 +1,263 @@
+/*
+ * In-memory copy of the kasmpasswd file, shared by the websocket threads
+ * and the main thread.
+ * Copyright (C) 2021 Kasm
+ * Licensed under LGPL version 3 (see docs/LICENSE.LGPL-3)
+ *
+ * Users are found through an open addressing hash table, so checking a
+ * login doesn't touch the disk. The main thread calls credstore_reload()
+ * when its inotify watch sees the file change. As that watch is only read
+ * while frames are being sent, a lookup also compares the file's stat
+ * with what was loaded, at most once a second.
+ *
+ * Changes made through the API are applied here and written out, after
+ * picking up any edit made behind our back first.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "credstore.h"
+
+#define CREDSTORE_RECHECK_SECS 1
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static char store_path[PATH_MAX];
+static struct kasmpasswd_t *store;
+static struct stat store_st;
+static time_t store_checked;
+
+// Entry index + 1, or 0 for a free slot
+static unsigned *slots;
+static unsigned slot_mask;
+
+static unsigned hash_user(const char user[]) {
+	uint32_t h = 2166136261u;
+
+	while (*user) {
+		h ^= (unsigned char) *user++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* All of the below are called with store_lock held */
+
+static void index_entries(void) {
+	unsigned i, h, size;
+
+	// Kept at most half full
+	for (size = 16; size < store->num * 2; size *= 2)
+		;
+
+	free(slots);
+	slots = calloc(size, sizeof(unsigned));
+	if (!slots)
+		abort();
+	slot_mask = size - 1;
+
+	for (i = 0; i < store->num; i++) {
+		h = hash_user(store->entries[i].user) & slot_mask;
+		while (slots[h])
+			h = (h + 1) & slot_mask;
+		slots[h] = i + 1;
+	}
+}
+
+static struct kasmpasswd_entry_t *find(const char user[]) {
+	unsigned h;
+
+	if (!store)
+		return NULL;
+
+	for (h = hash_user(user) & slot_mask; slots[h]; h = (h + 1) & slot_mask) {
+		if (!strcmp(store->entries[slots[h] - 1].user, user))
+			return &store->entries[slots[h] - 1];
+	}
+
+	return NULL;
+}
+
+static void free_store(void) {
+	if (!store)
+		return;
+
+	free(store->entries);
+	free(store);
+	store = NULL;
+}
+
+static void load(void) {
+	// Before reading, so a change during the read is noticed later
+	if (stat(store_path, &store_st))
+		memset(&store_st, 0, sizeof(store_st));
+
+	free_store();
+	store = readkasmpasswd(store_path);
+	index_entries();
+}
+
+static void recheck(int force) {
+	const time_t now = time(NULL);
+	struct stat st;
+
+	if (!force && now - store_checked < CREDSTORE_RECHECK_SECS)
+		return;
+	store_checked = now;
+
+	if (stat(store_path, &st))
+		memset(&st, 0, sizeof(st));
+
+	if (st.st_ino != store_st.st_ino || st.st_size != store_st.st_size ||
+	    st.st_mtime != store_st.st_mtime ||
+	    st.st_mtim.tv_nsec != store_st.st_mtim.tv_nsec)
+		load();
+}
+
+static void save(void) {
+	unsigned i, num;
+
+	// Removed users have an empty name, which the writer skips
+	writekasmpasswd(store_path, store);
+	if (stat(store_path, &store_st))
+		memset(&store_st, 0, sizeof(store_st));
+
+	for (i = num = 0; i < store->num; i++) {
+		if (store->entries[i].user[0])
+			store->entries[num++] = store->entries[i];
+	}
+	store->num = num;
+
+	index_entries();
+}
+
+void credstore_open(const char path[]) {
+	pthread_mutex_lock(&store_lock);
+
+	if (!store) {
+		strncpy(store_path, path, PATH_MAX - 1);
+		store_path[PATH_MAX - 1] = '\0';
+		store_checked = time(NULL);
+		load();
+	}
+
+	pthread_mutex_unlock(&store_lock);
+}
+
+void credstore_reload(void) {
+	pthread_mutex_lock(&store_lock);
+
+	if (store) {
+		store_checked = time(NULL);
+		load();
+	}
+
+	pthread_mutex_unlock(&store_lock);
+}
+
+unsigned credstore_count(void) {
+	unsigned num = 0;
+
+	pthread_mutex_lock(&store_lock);
+
+	if (store) {
+		recheck(0);
+		num = store->num;
+	}
+
+	pthread_mutex_unlock(&store_lock);
+
+	return num;
+}
+
+int credstore_lookup(const char user[], struct kasmpasswd_entry_t *entry) {
+	const struct kasmpasswd_entry_t *e = NULL;
+
+	pthread_mutex_lock(&store_lock);
+
+	if (store) {
+		recheck(0);
+		if ((e = find(user)))
+			*entry = *e;
+	}
+
+	pthread_mutex_unlock(&store_lock);
+
+	return e != NULL;
+}
+
+int credstore_add(const struct kasmpasswd_entry_t *entry) {
+	struct kasmpasswd_entry_t *entries;
+	int ret = 0;
+
+	pthread_mutex_lock(&store_lock);
+
+	if (store) {
+		recheck(1);
+
+		if (!find(entry->user)) {
+			entries = realloc(store->entries, (store->num + 1) *
+			                  sizeof(struct kasmpasswd_entry_t));
+			if (!entries)
+				abort();
+			store->entries = entries;
+			store->entries[store->num++] = *entry;
+
+			save();
+			ret = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&store_lock);
+
+	return ret;
+}
+
+int credstore_remove(const char user[]) {
+	struct kasmpasswd_entry_t *e;
+	int ret = 0;
+
+	pthread_mutex_lock(&store_lock);
+
+	if (store) {
+		recheck(1);
+
+		if ((e = find(user))) {
+			e->user[0] = '\0';
+			save();
+			ret = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&store_lock);
+
+	return ret;
+}
+
+int credstore_give_control(const char user[]) {
+	unsigned i;
+	int ret = 0;
+
+	pthread_mutex_lock(&store_lock);
+
+	if (store) {
+		recheck(1);
+
+		if (find(user)) {
+			for (i = 0; i < store->num; i++)
+				store->entries[i].write = !strcmp(store->entries[i].user, user);
+			save();
+			ret = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&store_lock);
+
+	return ret;
+}
@@ -0,0 +1,31 @@
+/*
+ * In-memory copy of the kasmpasswd file, shared by the websocket threads
+ * and the main thread.
+ * Copyright (C) 2021 Kasm
+ * Licensed under LGPL version 3 (see docs/LICENSE.LGPL-3)
+ */
+#ifndef CREDSTORE_H
+#define CREDSTORE_H
+
+#include "kasmpasswd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void credstore_open(const char path[]);
+void credstore_reload(void);
+
+unsigned credstore_count(void);
+int credstore_lookup(const char user[], struct kasmpasswd_entry_t *entry);
+
+/* These write the file too, and return 0 if the user isn't (or is) there */
+int credstore_add(const struct kasmpasswd_entry_t *entry);
+int credstore_remove(const char user[]);
+int credstore_give_control(const char user[]);
+
+#ifdef __cplusplus
+} // extern C
+#endif
+
+#endif
@@ -0,0 +1,497 @@
+/*
+ * In-memory cache of the files served by the built-in HTTP server.
+ * Copyright (C) 2021 Kasm
+ * Licensed under LGPL version 3 (see docs/LICENSE.LGPL-3)
+ *
+ * The whole -httpd directory is read once, and every file is kept in a
+ * single memory-backed file together with a gzip copy of it, plus the
+ * brotli copy if the web client build left a .br file next to it. The
+ * event loop can then sendfile() from there, and nothing touches the
+ * disk per request.
+ *
+ * inotify tells us when anything in the directory changes. The next
+ * request then builds a new cache, reusing what hasn't changed, while
+ * replies already under way keep the old one alive until they are done.
+ */
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include "websocket.h"
+#include "httpcache.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#define HTTP_CACHE_MAX_FILE     (8 * 1024 * 1024)   // larger files are read from disk
+#define HTTP_CACHE_MAX_TOTAL    (128 * 1024 * 1024)
+#define HTTP_CACHE_MAX_DEPTH    16
+#define HTTP_CACHE_MIN_GZIP     256                 // not worth it below this
+#define HTTP_CACHE_BUCKETS      1024
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                      IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+extern settings_t settings;
+
+typedef struct http_entry_t {
+    char *path;                 // as requested, e.g. "/app/ui.js"
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char etag[24];
+    off_t off[HTTP_ENCODINGS], len[HTTP_ENCODINGS];
+    struct http_entry_t *next;
+} http_entry_t;
+
+typedef struct {
+    int fd;
+    off_t size;
+    unsigned files;
+    unsigned refs;
+    http_entry_t *buckets[HTTP_CACHE_BUCKETS];
+} http_gen_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static http_gen_t *current;
+static int stale, building;
+static int inotify_fd = -1;
+static const char *root;
+
+static unsigned hash_path(const char *path) {
+    uint32_t h = 2166136261u;
+
+    while (*path) {
+        h ^= (unsigned char) *path++;
+        h *= 16777619u;
+    }
+
+    return h % HTTP_CACHE_BUCKETS;
+}
+
+static http_entry_t *lookup(http_gen_t *gen, const char *path) {
+    http_entry_t *e;
+
+    for (e = gen->buckets[hash_path(path)]; e; e = e->next) {
+        if (!strcmp(e->path, path))
+            return e;
+    }
+
+    return NULL;
+}
+
+/* Memory that can be handed to sendfile() */
+static int cache_fd(void) {
+    char tmpl[] = "/tmp/kasmvnc-httpd-XXXXXX";
+    int fd;
+
+#ifdef SYS_memfd_create
+    fd = syscall(SYS_memfd_create, "kasmvnc-httpd", MFD_CLOEXEC);
+    if (fd >= 0)
+        return fd;
+#endif
+
+    fd = mkostemp(tmpl, O_CLOEXEC);
+    if (fd >= 0)
+        unlink(tmpl);
+
+    return fd;
+}
+
+/* Adds data to the end of the cache, returns where it went or -1 */
+static off_t append(http_gen_t *gen, const void *data, size_t len) {
+    const off_t off = gen->size;
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = pwrite(gen->fd, (const char *) data + done, len - done,
+                     off + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+
+    gen->size += len;
+
+    return off;
+}
+
+/* Copies an unchanged variant over from the previous cache */
+static off_t copy_from(http_gen_t *gen, const http_gen_t *old, off_t from,
+                       off_t len) {
+    const off_t off = gen->size;
+    char buf[65536];
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = pread(old->fd, buf, len < (off_t) sizeof(buf) ? len :
+                                  (off_t) sizeof(buf), from);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0 || append(gen, buf, ret) < 0)
+            return -1;
+        from += ret;
+        len -= ret;
+    }
+
+    return off;
+}
+
+static unsigned char *read_file(const char *file, off_t size) {
+    unsigned char *data;
+    off_t done = 0;
+    ssize_t ret;
+    int fd;
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    if (! (data = malloc(size ? size : 1)) )
+        { fatal("malloc of cached file"); }
+
+    while (done < size) {
+        ret = read(fd, data + done, size - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        done += ret;
+    }
+
+    close(fd);
+
+    // Changed under us, inotify will have noticed
+    if (done != size) {
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+static unsigned char *gzip(const unsigned char *data, size_t len,
+                           size_t *outlen) {
+    unsigned char *out;
+    z_stream zs;
+    size_t bound;
+
+    memset(&zs, 0, sizeof(zs));
+    // 16 + 15 bits of window makes deflate write a gzip wrapper
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + 15, 9,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    bound = deflateBound(&zs, len);
+    if (! (out = malloc(bound)) )
+        { fatal("malloc of gzip buffer"); }
+
+    zs.next_in = (Bytef *) data;
+    zs.avail_in = len;
+    zs.next_out = out;
+    zs.avail_out = bound;
+
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        free(out);
+        out = NULL;
+    } else {
+        *outlen = zs.total_out;
+    }
+
+    deflateEnd(&zs);
+
+    return out;
+}
+
+/* Strong validator from the contents, so it holds across servers */
+static void make_etag(char *etag, const unsigned char *data, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 1099511628211ull;
+    }
+
+    sprintf(etag, "\"%016llx\"", (unsigned long long) h);
+}
+
+static int unchanged(const http_entry_t *e, const struct stat *st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino &&
+           e->size == st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec &&
+           e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void add_file(http_gen_t *gen, const http_gen_t *old, const char *path,
+                     const char *full, const struct stat *st) {
+    char brpath[PATH_MAX];
+    unsigned char *data, *gz;
+    const http_entry_t *prev;
+    struct stat brst;
+    http_entry_t *e;
+    size_t gzlen;
+    unsigned b;
+
+    // Anything not cached is still served, only from disk
+    if (st->st_size > HTTP_CACHE_MAX_FILE ||
+        gen->size + st->st_size > HTTP_CACHE_MAX_TOTAL)
+        return;
+
+    if (! (e = calloc(1, sizeof(http_entry_t))) )
+        { fatal("malloc of cache entry"); }
+    e->path = strdup(path);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+
+    prev = old ? lookup((http_gen_t *) old, path) : NULL;
+    if (prev && unchanged(prev, st)) {
+        strcpy(e->etag, prev->etag);
+        for (b = HTTP_IDENTITY; b <= HTTP_GZIP; b++) {
+            if (!prev->len[b])
+                continue;
+            e->off[b] = copy_from(gen, old, prev->off[b], prev->len[b]);
+            e->len[b] = prev->len[b];
+            if (e->off[b] < 0)
+                goto fail;
+        }
+    } else {
+        if (! (data = read_file(full, st->st_size)) )
+            goto fail;
+
+        make_etag(e->etag, data, st->st_size);
+        e->off[HTTP_IDENTITY] = append(gen, data, st->st_size);
+        e->len[HTTP_IDENTITY] = st->st_size;
+
+        // Images and archives are compressed already and hardly shrink
+        gz = NULL;
+        if (st->st_size >= HTTP_CACHE_MIN_GZIP &&
+            (gz = gzip(data, st->st_size, &gzlen)) &&
+            gzlen < (size_t) (st->st_size - st->st_size / 10)) {
+            e->off[HTTP_GZIP] = append(gen, gz, gzlen);
+            e->len[HTTP_GZIP] = gzlen;
+        }
+
+        free(gz);
+        free(data);
+
+        if (e->off[HTTP_IDENTITY] < 0 || e->off[HTTP_GZIP] < 0)
+            goto fail;
+    }
+
+    // Only a brotli file at least as new as the original will do
+    if (snprintf(brpath, sizeof(brpath), "%s.br", full) < (int) sizeof(brpath) &&
+        !stat(brpath, &brst) && S_ISREG(brst.st_mode) &&
+        brst.st_size > 0 && brst.st_size < st->st_size &&
+        brst.st_mtime >= st->st_mtime &&
+        (data = read_file(brpath, brst.st_size))) {
+        e->off[HTTP_BROTLI] = append(gen, data, brst.st_size);
+        e->len[HTTP_BROTLI] = brst.st_size;
+        free(data);
+
+        if (e->off[HTTP_BROTLI] < 0)
+            goto fail;
+    }
+
+    b = hash_path(path);
+    e->next = gen->buckets[b];
+    gen->buckets[b] = e;
+    gen->files++;
+
+    return;
+fail:
+    free(e->path);
+    free(e);
+}
+
+static void walk(http_gen_t *gen, const http_gen_t *old, const char *rel,
+                 unsigned depth) {
+    char dirpath[PATH_MAX], path[PATH_MAX], full[PATH_MAX];
+    struct stat st, lst;
+    struct dirent *de;
+    DIR *dir;
+
+    snprintf(dirpath, sizeof(dirpath), "%s%s", root, rel);
+
+    if (inotify_add_watch(inotify_fd, dirpath, WATCH_EVENTS) < 0)
+        wserr("Can't watch %s for changes: %s\n", dirpath, strerror(errno));
+
+    if (! (dir = opendir(dirpath)) )
+        return;
+
+    while ((de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", rel, de->d_name);
+        snprintf(full, sizeof(full), "%s%s", root, path);
+
+        if (lstat(full, &lst) || stat(full, &st))
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            // Linked directories could lead round in circles
+            if (!S_ISLNK(lst.st_mode) && depth < HTTP_CACHE_MAX_DEPTH)
+                walk(gen, old, path, depth + 1);
+        } else if (S_ISREG(st.st_mode)) {
+            add_file(gen, old, path, full, &st);
+        }
+    }
+
+    closedir(dir);
+}
+
+static void free_gen(http_gen_t *gen) {
+    http_entry_t *e, *next;
+    unsigned b;
+
+    for (b = 0; b < HTTP_CACHE_BUCKETS; b++) {
+        for (e = gen->buckets[b]; e; e = next) {
+            next = e->next;
+            free(e->path);
+            free(e);
+        }
+    }
+
+    close(gen->fd);
+    free(gen);
+}
+
+/* Called with cache_lock held */
+static void unref(http_gen_t *gen) {
+    if (!--gen->refs)
+        free_gen(gen);
+}
+
+static http_gen_t *build(const http_gen_t *old) {
+    http_gen_t *gen;
+
+    if (! (gen = calloc(1, sizeof(http_gen_t))) )
+        { fatal("malloc of http cache"); }
+
+    gen->fd = cache_fd();
+    if (gen->fd < 0) {
+        wserr("Unable to create http cache: %s\n", strerror(errno));
+        free(gen);
+        return NULL;
+    }
+
+    // One reference for being the current cache
+    gen->refs = 1;
+
+    walk(gen, old, "", 0);
+
+    handler_msg("cached %u files from %s, %llu bytes\n", gen->files, root,
+                (unsigned long long) gen->size);
+
+    return gen;
+}
+
+/*
+ * Loads the directory, returns a descriptor that becomes readable when
+ * something in it changes, or -1 if the files will be read from disk.
+ */
+int http_cache_init(const char *dir) {
+    pthread_mutex_lock(&cache_lock);
+    if (root) {
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+    root = dir;
+
+    // Without it changes would go unnoticed, so there is no cache
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        wserr("inotify: %s, not caching %s\n", strerror(errno), dir);
+        pthread_mutex_unlock(&cache_lock);
+        return -1;
+    }
+
+    current = build(NULL);
+    pthread_mutex_unlock(&cache_lock);
+
+    return inotify_fd;
+}
+
+/* Marks the cache as out of date, the next lookup rebuilds it */
+void http_cache_changed(void) {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (read(inotify_fd, buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock(&cache_lock);
+    stale = 1;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* Looks up a request path, returns 1 and a reference if it is cached */
+int http_cache_get(const char *path, http_hit_t *hit) {
+    http_gen_t *gen, *old;
+    http_entry_t *e;
+
+    pthread_mutex_lock(&cache_lock);
+
+    // Others keep using the old cache while one worker builds the new one
+    if (stale && !building) {
+        stale = 0;
+        building = 1;
+        old = current;
+        if (old)
+            old->refs++;
+        pthread_mutex_unlock(&cache_lock);
+
+        gen = build(old);
+
+        pthread_mutex_lock(&cache_lock);
+        building = 0;
+        if (current)
+            unref(current);
+        current = gen;
+        if (old)
+            unref(old);
+    }
+
+    gen = current;
+    if (!gen || ! (e = lookup(gen, path)) ) {
+        pthread_mutex_unlock(&cache_lock);
+        return 0;
+    }
+    gen->refs++;
+
+    pthread_mutex_unlock(&cache_lock);
+
+    hit->ref = gen;
+    hit->fd = gen->fd;
+    strcpy(hit->etag, e->etag);
+    memcpy(hit->off, e->off, sizeof(hit->off));
+    memcpy(hit->len, e->len, sizeof(hit->len));
+
+    return 1;
+}
+
+void http_cache_put(void *ref) {
+    pthread_mutex_lock(&cache_lock);
+    unref(ref);
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,33 @@
+/*
+ * In-memory cache of the files served by the built-in HTTP server.
+ * Copyright (C) 2021 Kasm
+ * Licensed under LGPL version 3 (see docs/LICENSE.LGPL-3)
+ */
+#ifndef HTTPCACHE_H
+#define HTTPCACHE_H
+
+#include <sys/types.h>
+
+enum {
+    HTTP_IDENTITY,
+    HTTP_GZIP,
+    HTTP_BROTLI,
+    HTTP_ENCODINGS
+};
+
+/* Where a cached file is, valid until given back with http_cache_put() */
+typedef struct {
+    void *ref;
+    int fd;
+    char etag[24];
+    /* Compressed variants have a zero length when there are none */
+    off_t off[HTTP_ENCODINGS], len[HTTP_ENCODINGS];
+} http_hit_t;
+
+int http_cache_init(const char *dir);
+void http_cache_changed(void);
+
+int http_cache_get(const char *path, http_hit_t *hit);
+void http_cache_put(void *ref);
+
+#endif
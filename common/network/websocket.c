@@ -21,17 +21,25 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>  // daemonizing
+#include <time.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
 #include <openssl/ssl.h>
 #include <openssl/bio.h> /* base64 encode/decode */
 #include <openssl/md5.h> /* md5 hash */
 #include <openssl/sha.h> /* sha1 hash */
 #include "websocket.h"
-#include "kasmpasswd.h"
+#include "credstore.h"
+#include "httpcache.h"
 
 /*
  * Global state
@@ -39,7 +47,6 @@
  *   Warning: not thread safe
  */
 int ssl_initialized = 0;
-int pipe_error = 0;
 settings_t settings;
 
 
@@ -177,15 +184,51 @@ ssize_t ws_send(ws_ctx_t *ctx, const void *buf, size_t len) {
         //handler_msg("SSL send\n");
         return SSL_write(ctx->ssl, buf, len);
     } else {
-        return send(ctx->sockfd, buf, len, 0);
+        return send(ctx->sockfd, buf, len, MSG_NOSIGNAL);
     }
 }
 
+/* Whether a failed ws_recv/ws_send only needs to be retried later */
+int ws_again(ws_ctx_t *ctx, ssize_t ret) {
+    if (ctx->ssl) {
+        const int err = SSL_get_error(ctx->ssl, ret);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+            ctx->ssl_want = err;
+            return 1;
+        }
+        return 0;
+    }
+    return ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+}
+
+/* Queues reply data, the event loop sends it once the request is handled */
+static void ws_reply(ws_ctx_t *ctx, const void *buf, size_t len) {
+    if (ctx->wbuf_len + len > ctx->wbuf_size) {
+        size_t size = ctx->wbuf_size ? ctx->wbuf_size : 4096;
+        while (size < ctx->wbuf_len + len)
+            size *= 2;
+        if (! (ctx->wbuf = realloc(ctx->wbuf, size)) )
+            { fatal("realloc of wbuf"); }
+        ctx->wbuf_size = size;
+    }
+    memcpy(ctx->wbuf + ctx->wbuf_len, buf, len);
+    ctx->wbuf_len += len;
+}
+
 ws_ctx_t *alloc_ws_ctx() {
     ws_ctx_t *ctx;
     if (! (ctx = calloc(sizeof(ws_ctx_t), 1)) )
         { fatal("malloc()"); }
 
+    ctx->headers = malloc(sizeof(headers_t));
+    ctx->ssl = NULL;
+    ctx->tsock = -1;
+    ctx->file_fd = -1;
+    return ctx;
+}
+
+/* Most connections never get this far, so the relay buffers come last */
+void alloc_proxy_bufs(ws_ctx_t *ctx) {
     if (! (ctx->cin_buf = malloc(BUFSIZE)) )
         { fatal("malloc of cin_buf"); }
     if (! (ctx->cout_buf = malloc(BUFSIZE)) )
@@ -194,11 +237,6 @@ ws_ctx_t *alloc_ws_ctx() {
         { fatal("malloc of tin_buf"); }
     if (! (ctx->tout_buf = malloc(BUFSIZE)) )
         { fatal("malloc of tout_buf"); }
-
-    ctx->headers = malloc(sizeof(headers_t));
-    ctx->ssl = NULL;
-    ctx->ssl_ctx = NULL;
-    return ctx;
 }
 
 void free_ws_ctx(ws_ctx_t *ctx) {
@@ -206,6 +244,8 @@ void free_ws_ctx(ws_ctx_t *ctx) {
     free(ctx->cout_buf);
     free(ctx->tin_buf);
     free(ctx->tout_buf);
+    free(ctx->wbuf);
+    free(ctx->headers);
     free(ctx);
 }
 
@@ -214,80 +254,195 @@ ws_ctx_t *ws_socket(ws_ctx_t *ctx, int socket) {
     return ctx;
 }
 
-ws_ctx_t *ws_socket_ssl(ws_ctx_t *ctx, int socket, char * certfile, char * keyfile) {
-    int ret;
-    char msg[1024];
-    char * use_keyfile;
-    ws_socket(ctx, socket);
+/*
+ * All TLS connections share one SSL_CTX, so the certificate is read once
+ * and resumed sessions can be found in its cache. The files are checked
+ * for changes at most once a second, and a new context is built when
+ * they change. Connections already using the old one keep it alive.
+ */
+#define SSL_RECHECK_SECS 1
+#define SSL_SESSION_CACHE_SIZE 4096
+
+static SSL_CTX *shared_ssl_ctx;
+static struct stat ssl_cert_st, ssl_key_st;
+static time_t ssl_checked;
+static unsigned char ssl_ticket_keys[80];
+
+static int ssl_file_changed(const char *file, const struct stat *old,
+                            struct stat *st) {
+    if (stat(file, st) != 0)
+        return 0; // Keep what we have while it's being replaced
+    return st->st_mtime != old->st_mtime || st->st_size != old->st_size ||
+           st->st_ino != old->st_ino;
+}
 
-    if (keyfile && (keyfile[0] != '\0')) {
-        // Separate key file
-        use_keyfile = keyfile;
-    } else {
-        // Combined key and cert file
-        use_keyfile = certfile;
+static SSL_CTX *ssl_ctx_load(const char *certfile, const char *keyfile) {
+    static const unsigned char sid_ctx[] = "kasmvnc";
+    SSL_CTX *ssl_ctx;
+
+    ssl_ctx = SSL_CTX_new(SSLv23_server_method());
+    if (ssl_ctx == NULL) {
+        ERR_print_errors_fp(stderr);
+        return NULL;
     }
 
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // Browsers often just drop the connection
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    // OpenSSL falls back to encrypting itself if the kernel can't
+    if (settings.ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+#else
+        wserr("Kernel TLS requested, but OpenSSL is too old for it\n");
+#endif
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(ssl_ctx, keyfile,
+                                    SSL_FILETYPE_PEM) <= 0) {
+        wserr("Unable to load private key file %s\n", keyfile);
+        SSL_CTX_free(ssl_ctx);
+        return NULL;
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(ssl_ctx, certfile) <= 0) {
+        wserr("Unable to load certificate file %s\n", certfile);
+        SSL_CTX_free(ssl_ctx);
+        return NULL;
+    }
+
+    if (!SSL_CTX_check_private_key(ssl_ctx)) {
+        wserr("Private key in %s does not match certificate %s\n",
+              keyfile, certfile);
+        SSL_CTX_free(ssl_ctx);
+        return NULL;
+    }
+
+//    if (SSL_CTX_set_cipher_list(ssl_ctx, "DEFAULT") != 1) {
+//        sprintf(msg, "Unable to set cipher\n");
+//        fatal(msg);
+//    }
+
+    // Resumption, both from the cache and from tickets. The ticket keys
+    // outlive the context, so tickets stay valid over a reload.
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(ssl_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_sess_set_cache_size(ssl_ctx, SSL_SESSION_CACHE_SIZE);
+    SSL_CTX_set_tlsext_ticket_keys(ssl_ctx, ssl_ticket_keys,
+                                   sizeof(ssl_ticket_keys));
+
+    return ssl_ctx;
+}
+
+/* Only called from the event loop thread */
+static SSL_CTX *ws_ssl_ctx(const char *certfile, const char *keyfile) {
+    struct stat cert_st, key_st;
+    SSL_CTX *ssl_ctx;
+    time_t now;
+
     // Initialize the library
     if (! ssl_initialized) {
         SSL_library_init();
         OpenSSL_add_all_algorithms();
         SSL_load_error_strings();
+        if (RAND_bytes(ssl_ticket_keys, sizeof(ssl_ticket_keys)) != 1)
+            fatal("Unable to generate session ticket keys");
         ssl_initialized = 1;
+    }
 
+    now = time(NULL);
+    if (shared_ssl_ctx && now - ssl_checked < SSL_RECHECK_SECS)
+        return shared_ssl_ctx;
+    ssl_checked = now;
+
+    memset(&cert_st, 0, sizeof(cert_st));
+    memset(&key_st, 0, sizeof(key_st));
+    if (shared_ssl_ctx &&
+        !ssl_file_changed(certfile, &ssl_cert_st, &cert_st) &&
+        !ssl_file_changed(keyfile, &ssl_key_st, &key_st))
+        return shared_ssl_ctx;
+
+    ssl_ctx = ssl_ctx_load(certfile, keyfile);
+
+    // Don't try a broken file again until it changes
+    stat(certfile, &ssl_cert_st);
+    stat(keyfile, &ssl_key_st);
+
+    if (!ssl_ctx) {
+        ERR_clear_error();
+        if (shared_ssl_ctx)
+            wserr("Keeping the previous certificate\n");
+        return shared_ssl_ctx;
     }
 
-    ctx->ssl_ctx = SSL_CTX_new(SSLv23_server_method());
-    if (ctx->ssl_ctx == NULL) {
-        ERR_print_errors_fp(stderr);
-        fatal("Failed to configure SSL context");
+    if (shared_ssl_ctx) {
+        wserr("Reloaded certificate %s\n", certfile);
+        SSL_CTX_free(shared_ssl_ctx);
     }
+    shared_ssl_ctx = ssl_ctx;
 
-    SSL_CTX_set_options(ctx->ssl_ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+    return shared_ssl_ctx;
+}
 
-    if (SSL_CTX_use_PrivateKey_file(ctx->ssl_ctx, use_keyfile,
-                                    SSL_FILETYPE_PEM) <= 0) {
-        sprintf(msg, "Unable to load private key file %s\n", use_keyfile);
-        fatal(msg);
-    }
+ws_ctx_t *ws_socket_ssl(ws_ctx_t *ctx, int socket, char * certfile, char * keyfile) {
+    SSL_CTX *ssl_ctx;
+    char * use_keyfile;
 
-    if (SSL_CTX_use_certificate_chain_file(ctx->ssl_ctx, certfile) <= 0) {
-        sprintf(msg, "Unable to load certificate file %s\n", certfile);
-        fatal(msg);
+    if (keyfile && (keyfile[0] != '\0')) {
+        // Separate key file
+        use_keyfile = keyfile;
+    } else {
+        // Combined key and cert file
+        use_keyfile = certfile;
     }
 
-//    if (SSL_CTX_set_cipher_list(ctx->ssl_ctx, "DEFAULT") != 1) {
-//        sprintf(msg, "Unable to set cipher\n");
-//        fatal(msg);
-//    }
+    ssl_ctx = ws_ssl_ctx(certfile, use_keyfile);
+    if (!ssl_ctx)
+        return NULL;
 
-    // Associate socket and ssl object
-    ctx->ssl = SSL_new(ctx->ssl_ctx);
-    SSL_set_fd(ctx->ssl, socket);
+    ws_socket(ctx, socket);
 
-    ret = SSL_accept(ctx->ssl);
-    if (ret < 0) {
-        ERR_print_errors_fp(stderr);
-        return NULL;
-    }
+    // Associate socket and ssl object, the event loop drives SSL_accept.
+    // The session holds its own reference to the context.
+    ctx->ssl = SSL_new(ssl_ctx);
+    SSL_set_fd(ctx->ssl, socket);
+    SSL_set_mode(ctx->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                           SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_set_accept_state(ctx->ssl);
 
     return ctx;
 }
 
+/* Lets go of the file a reply was sending from */
+static void ws_file_close(ws_ctx_t *ctx) {
+    if (ctx->file_ref) {
+        http_cache_put(ctx->file_ref);
+        ctx->file_ref = NULL;
+    } else if (ctx->file_fd >= 0) {
+        close(ctx->file_fd);
+    }
+    ctx->file_fd = -1;
+    ctx->file_off = ctx->file_left = 0;
+}
+
 void ws_socket_free(ws_ctx_t *ctx) {
     if (ctx->ssl) {
         SSL_free(ctx->ssl);
         ctx->ssl = NULL;
     }
-    if (ctx->ssl_ctx) {
-        SSL_CTX_free(ctx->ssl_ctx);
-        ctx->ssl_ctx = NULL;
-    }
     if (ctx->sockfd) {
         shutdown(ctx->sockfd, SHUT_RDWR);
         close(ctx->sockfd);
         ctx->sockfd = 0;
     }
+    if (ctx->tsock >= 0) {
+        shutdown(ctx->tsock, SHUT_RDWR);
+        close(ctx->tsock);
+        ctx->tsock = -1;
+    }
+    ws_file_close(ctx);
 }
 
 int ws_b64_ntop(const unsigned char const * src, size_t srclen, char * dst, size_t dstlen) {
@@ -783,7 +938,7 @@ static void dirlisting(ws_ctx_t *ws_ctx, const char fullpath[], const char path[
                      "Connection: close\r\n"
                      "Content-type: text/plain\r\n"
                      "\r\n", path);
-        ws_send(ws_ctx, buf, strlen(buf));
+        ws_reply(ws_ctx, buf, strlen(buf));
         return;
     }
 
@@ -796,7 +951,7 @@ static void dirlisting(ws_ctx_t *ws_ctx, const char fullpath[], const char path[
                  "Connection: close\r\n"
                  "Content-type: text/html\r\n"
                  "\r\n<html><title>Directory Listing</title><body><h2>%s</h2><hr><ul>", path);
-    ws_send(ws_ctx, buf, strlen(buf));
+    ws_reply(ws_ctx, buf, strlen(buf));
 
     struct dirent **names;
     const unsigned num = scandir(fullpath, &names, NULL, alphasort);
@@ -814,18 +969,142 @@ static void dirlisting(ws_ctx_t *ws_ctx, const char fullpath[], const char path[
 	        sprintf(buf, "<li><a href=\"%s\">%s</a></li>", enc,
 	                names[i]->d_name);
 
-        ws_send(ws_ctx, buf, strlen(buf));
+        ws_reply(ws_ctx, buf, strlen(buf));
     }
 
     sprintf(buf, "</ul></body></html>");
-    ws_send(ws_ctx, buf, strlen(buf));
+    ws_reply(ws_ctx, buf, strlen(buf));
+}
+
+/* Finds a request header, returns its value or NULL */
+static const char *find_header(const char *req, const char *name, unsigned *len) {
+    char pattern[64];
+    const char *val, *end;
+
+    snprintf(pattern, sizeof(pattern), "\r\n%s:", name);
+    val = strcasestr(req, pattern);
+    if (!val)
+        return NULL;
+
+    val += strlen(pattern);
+    while (*val == ' ' || *val == '\t')
+        val++;
+
+    end = strstr(val, "\r\n");
+    *len = end ? end - val : strlen(val);
+
+    return val;
+}
+
+/* Whether a list such as "gzip, deflate;q=0.5, br" has the token, q > 0 */
+static uint8_t has_token(const char *val, unsigned len, const char *token) {
+    const char *end = val + len, *item, *q;
+    const unsigned tlen = strlen(token);
+
+    while (val < end) {
+        while (val < end && (*val == ' ' || *val == ','))
+            val++;
+        item = val;
+        while (val < end && *val != ',')
+            val++;
+
+        if ((unsigned) (val - item) < tlen || strncasecmp(item, token, tlen))
+            continue;
+        q = item + tlen;
+        while (q < val && *q == ' ')
+            q++;
+        if (q == val)
+            return 1;
+        if (*q != ';')
+            continue;
+
+        for (; q + 2 <= val; q++) {
+            if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=')
+                return strtod(q + 2, NULL) > 0;
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Replies from the in-memory copy, the event loop sends the body */
+static void servecached(ws_ctx_t *ws_ctx, const char *req, const char *path,
+                        http_hit_t *hit, uint8_t keepalive) {
+    char buf[1024], etag[32];
+    const char *val, *encoding = NULL;
+    unsigned len, variant = HTTP_IDENTITY;
+    const char *conn = keepalive ? "keep-alive" : "close";
+
+    ws_ctx->keepalive = keepalive;
+
+    val = find_header(req, "Accept-Encoding", &len);
+    if (val && hit->len[HTTP_BROTLI] && has_token(val, len, "br")) {
+        variant = HTTP_BROTLI;
+        encoding = "br";
+    } else if (val && hit->len[HTTP_GZIP] && has_token(val, len, "gzip")) {
+        variant = HTTP_GZIP;
+        encoding = "gzip";
+    }
+
+    // Each encoding is a different representation, so has its own tag
+    len = strlen(hit->etag) - 1;
+    memcpy(etag, hit->etag, len);
+    sprintf(etag + len, "%s\"", variant == HTTP_BROTLI ? "-br" :
+                                 variant == HTTP_GZIP ? "-gz" : "");
+
+    val = find_header(req, "If-None-Match", &len);
+    if (val && ((len == 1 && val[0] == '*') ||
+                memmem(val, len, etag, strlen(etag)))) {
+        sprintf(buf, "HTTP/1.1 304 Not Modified\r\n"
+                     "Server: KasmVNC/4.0\r\n"
+                     "Connection: %s\r\n"
+                     "ETag: %s\r\n", conn, etag);
+        if (hit->len[HTTP_GZIP] || hit->len[HTTP_BROTLI])
+            strcat(buf, "Vary: Accept-Encoding\r\n");
+        strcat(buf, "\r\n");
+        ws_reply(ws_ctx, buf, strlen(buf));
+        http_cache_put(hit->ref);
+        return;
+    }
+
+    len = sprintf(buf, "HTTP/1.1 200 OK\r\n"
+                       "Server: KasmVNC/4.0\r\n"
+                       "Connection: %s\r\n"
+                       "Content-type: %s\r\n"
+                       "Content-length: %llu\r\n"
+                       "ETag: %s\r\n",
+                       conn, name2mime(path),
+                       (unsigned long long) hit->len[variant], etag);
+    if (hit->len[HTTP_GZIP] || hit->len[HTTP_BROTLI])
+        len += sprintf(buf + len, "Vary: Accept-Encoding\r\n");
+    if (encoding)
+        len += sprintf(buf + len, "Content-Encoding: %s\r\n", encoding);
+    len += sprintf(buf + len, "\r\n");
+    ws_reply(ws_ctx, buf, len);
+
+    ws_ctx->file_fd = hit->fd;
+    ws_ctx->file_ref = hit->ref;
+    ws_ctx->file_off = hit->off[variant];
+    ws_ctx->file_left = hit->len[variant];
 }
 
 static void servefile(ws_ctx_t *ws_ctx, const char *in) {
     char buf[4096], path[4096], fullpath[4096];
+    const char *req = in, *val;
+    uint8_t keepalive;
+    unsigned vlen;
+    http_hit_t hit;
 
     //fprintf(stderr, "http servefile input '%s'\n", in);
 
+    // HTTP/1.1 connections stay open unless the client says otherwise
+    val = strstr(in, "\r\n");
+    keepalive = val && val - in >= 8 && !strncmp(val - 8, "HTTP/1.1", 8);
+    val = find_header(in, "Connection", &vlen);
+    if (val && has_token(val, vlen, "close"))
+        keepalive = 0;
+
     if (strncmp(in, "GET ", 4)) {
         wserr("non-GET request, rejecting\n");
         goto nope;
@@ -853,6 +1132,12 @@ static void servefile(ws_ctx_t *ws_ctx, const char *in) {
     percent_decode(path, buf, 1);
 
     wserr("Requested file '%s'\n", buf);
+
+    if (http_cache_get(buf, &hit)) {
+        servecached(ws_ctx, req, path, &hit, keepalive);
+        return;
+    }
+
     sprintf(fullpath, "%s/%s", settings.httpdir, buf);
 
     DIR *dir = opendir(fullpath);
@@ -862,32 +1147,34 @@ static void servefile(ws_ctx_t *ws_ctx, const char *in) {
         return;
     }
 
-    FILE *f = fopen(fullpath, "r");
-    if (!f) {
+    const int fd = open(fullpath, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
         wserr("file not found or insufficient permissions\n");
+        if (fd >= 0)
+            close(fd);
         goto nope;
     }
 
-    fseek(f, 0, SEEK_END);
-    const unsigned filesize = ftell(f);
-    rewind(f);
+    const unsigned filesize = st.st_size;
 
     sprintf(buf, "HTTP/1.1 200 OK\r\n"
                  "Server: KasmVNC/4.0\r\n"
-                 "Connection: close\r\n"
+                 "Connection: %s\r\n"
                  "Content-type: %s\r\n"
                  "Content-length: %u\r\n"
                  "\r\n",
+                 keepalive ? "keep-alive" : "close",
                  name2mime(path), filesize);
-    ws_send(ws_ctx, buf, strlen(buf));
+    ws_reply(ws_ctx, buf, strlen(buf));
 
     //fprintf(stderr, "http servefile output '%s'\n", buf);
 
-    unsigned count;
-    while ((count = fread(buf, 1, 4096, f))) {
-        ws_send(ws_ctx, buf, count);
-    }
-    fclose(f);
+    // The event loop streams the body after the headers
+    ws_ctx->file_fd = fd;
+    ws_ctx->file_off = 0;
+    ws_ctx->file_left = filesize;
+    ws_ctx->keepalive = keepalive;
 
     return;
 nope:
@@ -897,7 +1184,30 @@ nope:
                  "Content-type: text/plain\r\n"
                  "\r\n"
                  "404");
-    ws_send(ws_ctx, buf, strlen(buf));
+    ws_reply(ws_ctx, buf, strlen(buf));
+}
+
+/* Live preview frames are parts of a multipart/x-mixed-replace reply */
+#define PREVIEW_BOUNDARY "kasmvncpreview"
+#define PREVIEW_HEADROOM 128 // room left for a part's headers
+
+/* Asks for the next frame's stats, and says how many clients to wait for */
+static uint8_t request_frame_stats(const char *client, unsigned *waitfor) {
+    if (!strcmp(client, "none")) {
+        *waitfor = 0;
+        return settings.requestFrameStatsNoneCb(settings.messager);
+    } else if (!strcmp(client, "auto")) {
+        *waitfor = settings.ownerConnectedCb(settings.messager);
+        if (!*waitfor)
+            return settings.requestFrameStatsNoneCb(settings.messager);
+        return settings.requestFrameStatsOwnerCb(settings.messager);
+    } else if (!strcmp(client, "all")) {
+        *waitfor = settings.numActiveUsersCb(settings.messager);
+        return settings.requestFrameStatsAllCb(settings.messager);
+    }
+
+    *waitfor = 1;
+    return settings.requestFrameStatsOneCb(settings.messager, client);
 }
 
 static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in) {
@@ -973,8 +1283,8 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in) {
                      "Content-type: text/plain\r\n"
                      "Content-length: %u\r\n"
                      "\r\n", len);
-            ws_send(ws_ctx, buf, strlen(buf));
-            ws_send(ws_ctx, staging, len);
+            ws_reply(ws_ctx, buf, strlen(buf));
+            ws_reply(ws_ctx, staging, len);
 
             wserr("Screenshot hadn't changed and dedup was requested, sent hash\n");
             ret = 1;
@@ -985,8 +1295,8 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in) {
                      "Content-type: image/jpeg\r\n"
                      "Content-length: %u\r\n"
                      "\r\n", len);
-            ws_send(ws_ctx, buf, strlen(buf));
-            ws_send(ws_ctx, staging, len);
+            ws_reply(ws_ctx, buf, strlen(buf));
+            ws_reply(ws_ctx, staging, len);
 
             wserr("Sent screenshot %u bytes\n", len);
             ret = 1;
@@ -1043,7 +1353,7 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in) {
                  "Content-length: 6\r\n"
                  "\r\n"
                  "200 OK");
-        ws_send(ws_ctx, buf, strlen(buf));
+        ws_reply(ws_ctx, buf, strlen(buf));
 
         ret = 1;
     } else entry("/api/remove_user") {
@@ -1071,7 +1381,7 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in) {
                  "Content-length: 6\r\n"
                  "\r\n"
                  "200 OK");
-        ws_send(ws_ctx, buf, strlen(buf));
+        ws_reply(ws_ctx, buf, strlen(buf));
 
         wserr("Passed remove_user request to main thread\n");
         ret = 1;
@@ -1100,7 +1410,7 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in) {
                  "Content-length: 6\r\n"
                  "\r\n"
                  "200 OK");
-        ws_send(ws_ctx, buf, strlen(buf));
+        ws_reply(ws_ctx, buf, strlen(buf));
 
         wserr("Passed give_control request to main thread\n");
         ret = 1;
@@ -1114,14 +1424,15 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in) {
                  "Content-type: text/plain\r\n"
                  "Content-length: %lu\r\n"
                  "\r\n", strlen(statbuf));
-        ws_send(ws_ctx, buf, strlen(buf));
-        ws_send(ws_ctx, statbuf, strlen(statbuf));
+        ws_reply(ws_ctx, buf, strlen(buf));
+        ws_reply(ws_ctx, statbuf, strlen(statbuf));
 
         wserr("Sent bottleneck stats to API caller\n");
         ret = 1;
     } else entry("/api/get_frame_stats") {
-        char statbuf[4096], decname[1024];
-        unsigned waitfor;
+        char decname[1024];
+        unsigned frames = 0;
+        uint8_t stream = 0;
 
         param = parse_get(args, "client", &len);
         if (len) {
@@ -1133,59 +1444,112 @@ static uint8_t ownerapi(ws_ctx_t *ws_ctx, const char *in) {
             goto nope;
         }
 
-        if (!decname[0])
+        // Kept for the re-requests of a stream, so it has to fit whole
+        if (!decname[0] || strlen(decname) >= sizeof(ws_ctx->stats_client))
             goto nope;
 
-        if (!strcmp(decname, "none")) {
-            waitfor = 0;
-            if (!settings.requestFrameStatsNoneCb(settings.messager))
-                goto nope;
-        } else if (!strcmp(decname, "auto")) {
-            waitfor = settings.ownerConnectedCb(settings.messager);
-            if (!waitfor) {
-                if (!settings.requestFrameStatsNoneCb(settings.messager))
-                    goto nope;
-            } else {
-                if (!settings.requestFrameStatsOwnerCb(settings.messager))
-                    goto nope;
-            }
-        } else if (!strcmp(decname, "all")) {
-            waitfor = settings.numActiveUsersCb(settings.messager);
-            if (!settings.requestFrameStatsAllCb(settings.messager))
-                goto nope;
-        } else {
-            waitfor = 1;
-            if (!settings.requestFrameStatsOneCb(settings.messager, decname))
-                goto nope;
+        param = parse_get(args, "stream", &len);
+        if (len && isalpha(param[0])) {
+            if (!strncmp(param, "true", len))
+                stream = 1;
         }
 
-        while (1) {
-            usleep(10 * 1000);
-            if (settings.serverFrameStatsReadyCb(settings.messager))
-                break;
+        param = parse_get(args, "frames", &len);
+        if (len && isdigit(param[0]))
+            frames = atoi(param);
+
+        if (!request_frame_stats(decname, &ws_ctx->stats_waitfor))
+            goto nope;
+
+        // The event loop replies once the main thread has the stats
+        strcpy(ws_ctx->stats_client, decname);
+        if (stream) {
+            ws_ctx->stats = STATS_STREAM;
+            ws_ctx->stats_left = frames;
+
+            sprintf(buf, "HTTP/1.1 200 OK\r\n"
+                     "Server: KasmVNC/4.0\r\n"
+                     "Connection: close\r\n"
+                     "Content-type: text/plain\r\n"
+                     "Transfer-Encoding: chunked\r\n"
+                     "\r\n");
+            ws_reply(ws_ctx, buf, strlen(buf));
+        } else {
+            ws_ctx->stats = STATS_ONCE;
         }
 
-        if (waitfor) {
-            unsigned waits;
-            for (waits = 0; waits < 20; waits++) { // wait up to 2s
-                if (settings.getClientFrameStatsNumCb(settings.messager) >= waitfor)
-                    break;
-                usleep(100 * 1000);
-            }
+        wserr("Passed frame stats request to main thread\n");
+        ret = 1;
+    } else entry("/api/get_preview") {
+        uint8_t q = 5, fps = 2;
+        uint16_t w = 320, h = 240;
+
+        param = parse_get(args, "width", &len);
+        if (len && isdigit(param[0]))
+            w = atoi(param);
+
+        param = parse_get(args, "height", &len);
+        if (len && isdigit(param[0]))
+            h = atoi(param);
+
+        param = parse_get(args, "quality", &len);
+        if (len && isdigit(param[0]))
+            q = atoi(param);
+
+        param = parse_get(args, "fps", &len);
+        if (len && isdigit(param[0]))
+            fps = atoi(param);
+
+        if (!w || !h || q > 9 || !fps || fps > 30)
+            goto nope;
+
+        // The event loop sends a frame whenever the screen has changed,
+        // at most fps times a second
+        ws_ctx->preview = 1;
+        ws_ctx->preview_w = w;
+        ws_ctx->preview_h = h;
+        ws_ctx->preview_q = q;
+        ws_ctx->preview_interval = 1000 / fps;
+        ws_ctx->preview_gen = 0;
+
+        sprintf(buf, "HTTP/1.1 200 OK\r\n"
+                 "Server: KasmVNC/4.0\r\n"
+                 "Connection: close\r\n"
+                 "Cache-Control: no-cache\r\n"
+                 "Content-type: multipart/x-mixed-replace; boundary=" PREVIEW_BOUNDARY "\r\n"
+                 "\r\n");
+        ws_reply(ws_ctx, buf, strlen(buf));
+
+        wserr("Streaming %ux%u preview at %u fps\n", w, h, fps);
+        ret = 1;
+    } else entry("/api/metrics") {
+        uint32_t room = 0, mlen = 64 * 1024;
+        char *metrics = NULL;
+
+        // Clients may come in between, so retry until it fits
+        while (mlen >= room) {
+            room = mlen + 1024;
+            if (! (metrics = realloc(metrics, room)) )
+                { fatal("realloc of metrics"); }
+            mlen = settings.metricsCb(settings.messager, metrics, room);
         }
 
-        settings.frameStatsCb(settings.messager, statbuf, 4096);
+        if (!mlen) {
+            free(metrics);
+            goto nope;
+        }
 
         sprintf(buf, "HTTP/1.1 200 OK\r\n"
                  "Server: KasmVNC/4.0\r\n"
                  "Connection: close\r\n"
-                 "Content-type: text/plain\r\n"
-                 "Content-length: %lu\r\n"
-                 "\r\n", strlen(statbuf));
-        ws_send(ws_ctx, buf, strlen(buf));
-        ws_send(ws_ctx, statbuf, strlen(statbuf));
+                 "Content-type: text/plain; version=0.0.4\r\n"
+                 "Content-length: %u\r\n"
+                 "\r\n", mlen);
+        ws_reply(ws_ctx, buf, strlen(buf));
+        ws_reply(ws_ctx, metrics, mlen);
+        free(metrics);
 
-        wserr("Sent frame stats to API caller\n");
+        wserr("Sent metrics to API caller\n");
         ret = 1;
     }
 
@@ -1199,78 +1563,23 @@ nope:
                  "Content-type: text/plain\r\n"
                  "\r\n"
                  "400 Bad Request");
-    ws_send(ws_ctx, buf, strlen(buf));
+    ws_reply(ws_ctx, buf, strlen(buf));
     return 1;
 }
 
-ws_ctx_t *do_handshake(int sock) {
-    char handshake[4096], response[4096], sha1[29], trailer[17];
-    char *scheme, *pre;
+/*
+ * Handles a complete request: checks credentials, then either queues an
+ * HTTP reply or the websocket handshake response. Runs on a worker, as
+ * the password file, API callbacks and file lookups may all block.
+ * Returns 1 if the connection should be proxied once the reply is sent.
+ */
+static int handle_request(ws_ctx_t *ws_ctx, char *handshake, const char *scheme) {
+    char response[4096], sha1[29], trailer[17];
+    const char *pre;
     headers_t *headers;
-    int len, i, offset;
-    ws_ctx_t * ws_ctx;
+    int len;
     char *response_protocol;
 
-    // Peek, but don't read the data
-    len = recv(sock, handshake, 1024, MSG_PEEK);
-    handshake[len] = 0;
-    if (len == 0) {
-        handler_msg("ignoring empty handshake\n");
-        return NULL;
-    } else if ((bcmp(handshake, "\x16", 1) == 0) ||
-               (bcmp(handshake, "\x80", 1) == 0)) {
-        // SSL
-        if (!settings.cert) {
-            handler_msg("SSL connection but no cert specified\n");
-            return NULL;
-        } else if (access(settings.cert, R_OK) != 0) {
-            handler_msg("SSL connection but '%s' not found\n",
-                        settings.cert);
-            return NULL;
-        }
-        ws_ctx = alloc_ws_ctx();
-        ws_socket_ssl(ws_ctx, sock, settings.cert, settings.key);
-        if (! ws_ctx) { return NULL; }
-        scheme = "wss";
-        handler_msg("using SSL socket\n");
-    } else if (settings.ssl_only) {
-        handler_msg("non-SSL connection disallowed\n");
-        return NULL;
-    } else {
-        ws_ctx = alloc_ws_ctx();
-        ws_socket(ws_ctx, sock);
-        if (! ws_ctx) { return NULL; }
-        scheme = "ws";
-        handler_msg("using plain (not SSL) socket\n");
-    }
-    offset = 0;
-    for (i = 0; i < 10; i++) {
-        /* (offset + 1): reserve one byte for the trailing '\0' */
-        if (0 > (len = ws_recv(ws_ctx, handshake + offset, sizeof(handshake) - (offset + 1)))) {
-            handler_emsg("Read error during handshake: %m\n");
-            free_ws_ctx(ws_ctx);
-            return NULL;
-        } else if (0 == len) {
-            handler_emsg("Client closed during handshake\n");
-            free_ws_ctx(ws_ctx);
-            return NULL;
-        }
-        offset += len;
-        handshake[offset] = 0;
-        if (strstr(handshake, "\r\n\r\n")) {
-            break;
-        } else if (sizeof(handshake) <= (size_t)(offset + 1)) {
-            handler_emsg("Oversized handshake\n");
-            free_ws_ctx(ws_ctx);
-            return NULL;
-        } else if (9 == i) {
-            handler_emsg("Incomplete handshake\n");
-            free_ws_ctx(ws_ctx);
-            return NULL;
-        }
-        usleep(10);
-    }
-
     unsigned char owner = 0;
     if (!settings.disablebasicauth) {
         const char *hdr = strstr(handshake, "Authorization: Basic ");
@@ -1279,17 +1588,15 @@ ws_ctx_t *do_handshake(int sock) {
             sprintf(response, "HTTP/1.1 401 Unauthorized\r\n"
                               "WWW-Authenticate: Basic realm=\"Websockify\"\r\n"
                               "\r\n");
-            ws_send(ws_ctx, response, strlen(response));
-            free_ws_ctx(ws_ctx);
-            return NULL;
+            ws_reply(ws_ctx, response, strlen(response));
+            return 0;
         }
 
         hdr += sizeof("Authorization: Basic ") - 1;
         const char *end = strchr(hdr, '\r');
         if (!end || end - hdr > 256) {
             handler_emsg("Client sent invalid BasicAuth, dropping connection\n");
-            free_ws_ctx(ws_ctx);
-            return NULL;
+            return 0;
         }
         len = end - hdr;
         char tmp[257];
@@ -1306,37 +1613,28 @@ ws_ctx_t *do_handshake(int sock) {
         if (settings.passwdfile) {
             if (resppw && *resppw && resppw - response < 32) {
                 char pwbuf[4096];
-                struct kasmpasswd_t *set = readkasmpasswd(settings.passwdfile);
-                if (!set->num) {
+                if (!credstore_count()) {
                     fprintf(stderr, " websocket %d: Error: BasicAuth configured to read password from file %s, but the file doesn't exist or has no valid users\n",
                             wsthread_handler_id,
                             settings.passwdfile);
                 } else {
-                    unsigned i;
+                    struct kasmpasswd_entry_t entry;
                     char inuser[32];
-                    unsigned char found = 0;
                     memcpy(inuser, response, resppw - response - 1);
                     inuser[resppw - response - 1] = '\0';
 
-                    for (i = 0; i < set->num; i++) {
-                        if (!strcmp(set->entries[i].user, inuser)) {
-                            found = 1;
-                            strcpy(ws_ctx->user, inuser);
-                            snprintf(authbuf, 4096, "%s:%s", set->entries[i].user,
-                                     set->entries[i].password);
-                            authbuf[4095] = '\0';
-
-                            if (set->entries[i].owner)
-                                owner = 1;
-                            break;
-                        }
-                    }
+                    if (credstore_lookup(inuser, &entry)) {
+                        strcpy(ws_ctx->user, inuser);
+                        snprintf(authbuf, 4096, "%s:%s", entry.user,
+                                 entry.password);
+                        authbuf[4095] = '\0';
 
-                    if (!found)
+                        if (entry.owner)
+                            owner = 1;
+                    } else {
                         handler_emsg("BasicAuth user %s not found\n", inuser);
+                    }
                 }
-                free(set->entries);
-                free(set);
 
                 struct crypt_data cdata;
                 cdata.initialized = 0;
@@ -1359,9 +1657,8 @@ ws_ctx_t *do_handshake(int sock) {
             handler_emsg("BasicAuth user/pw did not match\n");
             sprintf(response, "HTTP/1.1 401 Forbidden\r\n"
                               "\r\n");
-            ws_send(ws_ctx, response, strlen(response));
-            free_ws_ctx(ws_ctx);
-            return NULL;
+            ws_reply(ws_ctx, response, strlen(response));
+            return 0;
         }
         handler_emsg("BasicAuth matched\n");
     }
@@ -1383,7 +1680,7 @@ ws_ctx_t *do_handshake(int sock) {
                         "Content-type: text/plain\r\n"
                         "\r\n"
                         "401 Unauthorized");
-                ws_send(ws_ctx, response, strlen(response));
+                ws_reply(ws_ctx, response, strlen(response));
                 goto done;
             }
         }
@@ -1392,8 +1689,7 @@ ws_ctx_t *do_handshake(int sock) {
             servefile(ws_ctx, handshake);
 
 done:
-        free_ws_ctx(ws_ctx);
-        return NULL;
+        return 0;
     }
 
     headers = ws_ctx->headers;
@@ -1427,85 +1723,931 @@ done:
     }
 
     //handler_msg("response: %s\n", response);
-    ws_send(ws_ctx, response, strlen(response));
+    ws_reply(ws_ctx, response, strlen(response));
 
-    return ws_ctx;
+    return 1;
 }
 
-void proxy_handler(ws_ctx_t *ws_ctx);
-
 __thread unsigned wsthread_handler_id;
 
-void *subthread(void *ptr) {
-
-    const struct wspass_t * const pass = ptr;
+/*
+ * Connections for the VNC server, which picks them up from its main loop
+ * when woken through settings.handoff_fd
+ */
 
-    const int csock = pass->csock;
-    wsthread_handler_id = pass->id;
+typedef struct ws_handoff_t {
+    int fd;
+    SSL *ssl;
+    int framed;
+    char peer[128];
+    struct ws_handoff_t *next;
+} ws_handoff_t;
+
+static pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+static ws_handoff_t *handoff_head, *handoff_tail;
+
+void ws_handoff(int fd, SSL *ssl, int framed, const char *peer) {
+    ws_handoff_t *h;
+
+    if (! (h = calloc(1, sizeof(ws_handoff_t))) )
+        { fatal("malloc of handoff"); }
+    h->fd = fd;
+    h->ssl = ssl;
+    h->framed = framed;
+    snprintf(h->peer, sizeof(h->peer), "%s", peer);
+
+    pthread_mutex_lock(&handoff_lock);
+    if (handoff_tail)
+        handoff_tail->next = h;
+    else
+        handoff_head = h;
+    handoff_tail = h;
+    pthread_mutex_unlock(&handoff_lock);
+
+    if (write(settings.handoff_fd, "", 1) != 1)
+        wserr("handoff write: %s\n", strerror(errno));
+}
 
-    ws_ctx_t *ws_ctx;
+int ws_handoff_take(int *fd, SSL **ssl, int *framed, char *peer, size_t len) {
+    ws_handoff_t *h;
 
-    ws_ctx = do_handshake(csock);
-    if (ws_ctx == NULL) {
-        handler_msg("No connection after handshake\n");
-        goto out;   // Child process exits
+    pthread_mutex_lock(&handoff_lock);
+    h = handoff_head;
+    if (h) {
+        handoff_head = h->next;
+        if (!handoff_head)
+            handoff_tail = NULL;
     }
+    pthread_mutex_unlock(&handoff_lock);
+
+    if (!h)
+        return 0;
 
-    memcpy(ws_ctx->ip, pass->ip, sizeof(pass->ip));
+    *fd = h->fd;
+    *ssl = h->ssl;
+    *framed = h->framed;
+    snprintf(peer, len, "%s", h->peer);
+    free(h);
+
+    return 1;
+}
 
-    proxy_handler(ws_ctx);
-    if (pipe_error) {
-        handler_emsg("Closing due to SIGPIPE\n");
+/* Puts the next preview frame in the reply, if the screen has changed */
+static void preview_frame(ws_ctx_t *ctx) {
+    char head[PREVIEW_HEADROOM];
+    uint32_t len, room;
+    int headlen;
+
+    ctx->wbuf_len = ctx->wbuf_sent = 0;
+
+    // The JPEG goes after room for its part headers
+    while (1) {
+        room = ctx->wbuf_size > PREVIEW_HEADROOM + 2 ?
+               ctx->wbuf_size - PREVIEW_HEADROOM - 2 : 0;
+        len = settings.previewCb(settings.messager, ctx->preview_w,
+                                 ctx->preview_h, ctx->preview_q,
+                                 &ctx->preview_gen,
+                                 (uint8_t *) ctx->wbuf + PREVIEW_HEADROOM, room);
+        if (len <= room)
+            break;
+
+        if (! (ctx->wbuf = realloc(ctx->wbuf, PREVIEW_HEADROOM + len + 2)) )
+            { fatal("realloc of wbuf"); }
+        ctx->wbuf_size = PREVIEW_HEADROOM + len + 2;
     }
-out:
-    free((void *) pass);
 
-    if (ws_ctx) {
-        ws_socket_free(ws_ctx);
-        free_ws_ctx(ws_ctx);
-    } else {
-        shutdown(csock, SHUT_RDWR);
-        close(csock);
+    // Nothing new, or no CPU budget left for previews this second
+    if (!len)
+        return;
+
+    headlen = snprintf(head, sizeof(head), "--" PREVIEW_BOUNDARY "\r\n"
+                       "Content-type: image/jpeg\r\n"
+                       "Content-length: %u\r\n"
+                       "\r\n", len);
+
+    memmove(ctx->wbuf + headlen, ctx->wbuf + PREVIEW_HEADROOM, len);
+    memcpy(ctx->wbuf, head, headlen);
+    memcpy(ctx->wbuf + headlen + len, "\r\n", 2);
+    ctx->wbuf_len = headlen + len + 2;
+}
+
+/*
+ * Event loop
+ *
+ * A single thread owns every socket and moves each connection through
+ * the states below with non-blocking I/O. Request handling, which may
+ * block on the password file, API callbacks or the disk, runs on a small
+ * pool of workers. A connection is out of the loop's epoll set while a
+ * worker has it.
+ *
+ * Frame stats callers wait in the loop too, woken through the messager's
+ * eventfd when the main thread publishes stats. Live preview watchers
+ * wait for their next frame time, and go to a worker for the encode only
+ * if the screen has changed since their last frame.
+ */
+
+#define WS_WORKERS          4
+#define WS_MAX_EVENTS       256
+#define WS_REQUEST_TIMEOUT  30 // seconds from accept to a complete request
+#define WS_REPLY_TIMEOUT    30 // seconds without progress sending a reply
+#define WS_CLIENT_STATS_MS  2000 // how long clients get to report frame stats
+
+enum {
+    WS_DETECT,      // waiting for the first byte, TLS or plain
+    WS_TLS,         // TLS handshake
+    WS_REQUEST,     // reading the request headers
+    WS_WORKING,     // with a worker
+    WS_REPLY,       // sending the reply, then closing or proxying
+    WS_STATS,       // waiting for frame stats from the main thread
+    WS_PREVIEW,     // waiting to send the next live preview frame
+    WS_PROXY,       // relaying between the client and the VNC server
+    WS_CLOSED,      // waiting to be freed
+};
+
+typedef struct ws_conn_t ws_conn_t;
+
+typedef struct {
+    ws_conn_t *conn;
+    int fd;
+    uint32_t events;
+} ws_watch_t;
+
+struct ws_conn_t {
+    ws_ctx_t *ctx;
+    unsigned id;
+    int state;
+    int proxy;
+    time_t deadline;
+    const char *scheme;
+
+    char *req;
+    unsigned reqlen;
+
+    ws_watch_t client, target;
+
+    ws_conn_t *prev, *next;     // all connections, for timeouts
+    ws_conn_t *qnext;           // work or done queue
+
+    uint64_t stats_deadline;    // for the clients' frame stats, in ms
+    uint64_t preview_due;       // when the next preview frame may go, in ms
+    ws_conn_t *wnext;           // waiting for frame stats or a preview frame
+};
+
+static int epfd = -1, wakefd = -1, sparefd = -1;
+static ws_watch_t listen_watch, wake_watch, cache_watch, stats_watch;
+static ws_conn_t *conns, *dead, *stats_head, *preview_head;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static ws_conn_t *work_head, *work_tail, *done_head;
+
+static time_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Changes what a socket waits for, if that differs from before */
+static void watch(ws_watch_t *w, uint32_t events) {
+    struct epoll_event ev;
+
+    if (w->events == events)
+        return;
+
+    ev.events = events;
+    ev.data.ptr = w;
+    if (epoll_ctl(epfd, events ? (w->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD) :
+                  EPOLL_CTL_DEL, w->fd, &ev))
+        wserr("epoll_ctl: %s\n", strerror(errno));
+    w->events = events;
+}
+
+static void unlink_waiting(ws_conn_t **head, ws_conn_t *conn) {
+    ws_conn_t **p;
+
+    for (p = head; *p; p = &(*p)->wnext) {
+        if (*p == conn) {
+            *p = conn->wnext;
+            return;
+        }
     }
+}
+
+static void close_conn(ws_conn_t *conn) {
     handler_msg("handler exit\n");
 
+    if (conn->state == WS_STATS)
+        unlink_waiting(&stats_head, conn);
+    else if (conn->state == WS_PREVIEW)
+        unlink_waiting(&preview_head, conn);
+    // Otherwise no other caller could get frame stats again
+    if (conn->ctx->stats)
+        settings.cancelFrameStatsCb(settings.messager);
+
+    // Closing the sockets takes them out of the epoll set
+    ws_socket_free(conn->ctx);
+    conn->state = WS_CLOSED;
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+
+    // Events already returned by epoll_wait may still point here
+    conn->qnext = dead;
+    dead = conn;
+}
+
+static void free_dead(void) {
+    ws_conn_t *conn;
+
+    while ((conn = dead)) {
+        dead = conn->qnext;
+        free_ws_ctx(conn->ctx);
+        free(conn->req);
+        free(conn);
+    }
+}
+
+static void *worker(void *unused) {
+    ws_conn_t *conn;
+
+    while (1) {
+        pthread_mutex_lock(&queue_lock);
+        while (!work_head)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        conn = work_head;
+        work_head = conn->qnext;
+        if (!work_head)
+            work_tail = NULL;
+        pthread_mutex_unlock(&queue_lock);
+
+        wsthread_handler_id = conn->id;
+
+        if (conn->ctx->preview)
+            preview_frame(conn->ctx);
+        else
+            conn->proxy = handle_request(conn->ctx, conn->req, conn->scheme);
+
+        pthread_mutex_lock(&queue_lock);
+        conn->qnext = done_head;
+        done_head = conn;
+        pthread_mutex_unlock(&queue_lock);
+
+        const uint64_t one = 1;
+        if (write(wakefd, &one, sizeof(one)) < 0)
+            wserr("eventfd write: %s\n", strerror(errno));
+    }
+
     return NULL;
 }
 
-void *start_server(void *unused) {
-    int csock, pid;
-    struct sockaddr_in cli_addr;
-    socklen_t clilen;
+static void queue_work(ws_conn_t *conn) {
+    conn->state = WS_WORKING;
+    watch(&conn->client, 0);
+
+    pthread_mutex_lock(&queue_lock);
+    conn->qnext = NULL;
+    if (work_tail)
+        work_tail->qnext = conn;
+    else
+        work_head = conn;
+    work_tail = conn;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
 
-//    printf("Waiting for connections on %s:%d\n",
-//            settings.listen_host, settings.listen_port);
+/*
+ * Passes an upgraded connection on to the VNC server. Binary HyBi
+ * clients are framed by the server itself on their own socket, so they
+ * leave the loop here. Returns 1 if the loop should keep relaying.
+ */
+static int start_proxy(ws_conn_t *conn) {
+    ws_ctx_t *ctx = conn->ctx;
+    char peer[128];
+
+    if (ctx->hybi && ctx->opcode == OPCODE_BINARY) {
+        handler_msg("handing connection to VNC server\n");
+
+        watch(&conn->client, 0);
+        proxy_peer_name(ctx, peer, sizeof(peer));
+        ws_handoff(ctx->sockfd, ctx->ssl, 1, peer);
+
+        ctx->sockfd = 0;
+        ctx->ssl = NULL;
+        return 0;
+    }
+
+    if (proxy_connect(ctx))
+        return 0;
+
+    free(ctx->wbuf);
+    ctx->wbuf = NULL;
+    ctx->wbuf_len = ctx->wbuf_size = ctx->wbuf_sent = 0;
+
+    alloc_proxy_bufs(ctx);
+
+    conn->state = WS_PROXY;
+    conn->target.fd = ctx->tsock;
+
+    return 1;
+}
+
+/*
+ * Holds back partial segments while headers and body go out in separate
+ * writes. Otherwise a kept-alive client waits for its delayed ACK before
+ * it sees the end of the reply.
+ */
+static void cork(ws_ctx_t *ctx, int on) {
+    if (ctx->corked == on)
+        return;
+    if (setsockopt(ctx->sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)))
+        return;
+    ctx->corked = on;
+}
+
+/* Returns 1 once the reply and any file body are sent, -1 on errors */
+static int send_reply(ws_conn_t *conn) {
+    ws_ctx_t *ctx = conn->ctx;
+    ssize_t ret;
+
+    if (ctx->file_left > 0)
+        cork(ctx, 1);
 
     while (1) {
-        clilen = sizeof(cli_addr);
-        pipe_error = 0;
-        pid = 0;
-        do {
-            csock = accept(settings.listen_sock,
-                           (struct sockaddr *) &cli_addr,
-                           &clilen);
-        } while (csock == -1 && errno == EINTR);
+        if (ctx->wbuf_sent < ctx->wbuf_len) {
+            ret = ws_send(ctx, ctx->wbuf + ctx->wbuf_sent,
+                          ctx->wbuf_len - ctx->wbuf_sent);
+            if (ret <= 0)
+                return ws_again(ctx, ret) ? 0 : -1;
+            ctx->wbuf_sent += ret;
+            conn->deadline = now_sec() + WS_REPLY_TIMEOUT;
+            continue;
+        }
 
-        if (csock < 0) {
-            error("ERROR on accept");
+        if (ctx->file_fd >= 0 && ctx->file_left > 0) {
+#ifdef SSL_OP_ENABLE_KTLS
+            // The kernel encrypts, so the file needn't pass through here
+            if (ctx->ktls) {
+                ret = SSL_sendfile(ctx->ssl, ctx->file_fd, ctx->file_off,
+                                   ctx->file_left, 0);
+                if (ret <= 0)
+                    return ws_again(ctx, ret) ? 0 : -1;
+                ctx->file_off += ret;
+                ctx->file_left -= ret;
+                conn->deadline = now_sec() + WS_REPLY_TIMEOUT;
+                continue;
+            }
+#endif
+            // Plain connections let the kernel send straight from the file
+            if (!ctx->ssl) {
+                ret = sendfile(ctx->sockfd, ctx->file_fd, &ctx->file_off,
+                               ctx->file_left);
+                if (ret == 0) {
+                    wserr("file read error\n");
+                    return -1;
+                }
+                if (ret < 0)
+                    return ws_again(ctx, ret) ? 0 : -1;
+                ctx->file_left -= ret;
+                conn->deadline = now_sec() + WS_REPLY_TIMEOUT;
+                continue;
+            }
+            if (ctx->wbuf_size < BUFSIZE) {
+                if (! (ctx->wbuf = realloc(ctx->wbuf, BUFSIZE)) )
+                    { fatal("realloc of wbuf"); }
+                ctx->wbuf_size = BUFSIZE;
+            }
+            // Cached files share a descriptor, so no read()
+            ret = pread(ctx->file_fd, ctx->wbuf,
+                        ctx->file_left < ctx->wbuf_size ? ctx->file_left :
+                                                          ctx->wbuf_size,
+                        ctx->file_off);
+            if (ret <= 0) {
+                wserr("file read error\n");
+                return -1;
+            }
+            ctx->wbuf_len = ret;
+            ctx->wbuf_sent = 0;
+            ctx->file_off += ret;
+            ctx->file_left -= ret;
             continue;
         }
-        struct wspass_t *pass = calloc(1, sizeof(struct wspass_t));
-        inet_ntop(cli_addr.sin_family, &cli_addr.sin_addr, pass->ip, sizeof(pass->ip));
+
+        cork(ctx, 0);
+        return 1;
+    }
+}
+
+static void advance(ws_conn_t *conn);
+
+/* Waits for another request once a reply with a known length is sent */
+static void next_request(ws_conn_t *conn) {
+    ws_ctx_t *ctx = conn->ctx;
+
+    ws_file_close(ctx);
+    ctx->wbuf_len = ctx->wbuf_sent = 0;
+    ctx->keepalive = 0;
+
+    conn->reqlen = 0;
+    conn->state = WS_REQUEST;
+    conn->deadline = now_sec() + WS_REQUEST_TIMEOUT;
+    advance(conn);
+}
+
+/* Replies with the frame stats once the server's and the clients' are in */
+static void check_stats(ws_conn_t *conn) {
+    ws_ctx_t *ctx = conn->ctx;
+    char statbuf[4096], head[256];
+    size_t len;
+
+    if (!settings.serverFrameStatsReadyCb(settings.messager))
+        return;
+
+    // Clients report theirs once they have drawn the frame
+    if (ctx->stats_waitfor &&
+        settings.getClientFrameStatsNumCb(settings.messager) < ctx->stats_waitfor) {
+        if (!conn->stats_deadline)
+            conn->stats_deadline = now_ms() + WS_CLIENT_STATS_MS;
+        if (now_ms() < conn->stats_deadline)
+            return;
+    }
+
+    unlink_waiting(&stats_head, conn);
+
+    settings.frameStatsCb(settings.messager, statbuf, sizeof(statbuf));
+    len = strlen(statbuf);
+
+    if (ctx->stats == STATS_STREAM) {
+        sprintf(head, "%zx\r\n", len);
+        ws_reply(ctx, head, strlen(head));
+        ws_reply(ctx, statbuf, len);
+        ws_reply(ctx, "\r\n", 2);
+
+        // The next frame is asked for while this one's stats go out
+        if ((ctx->stats_left && !--ctx->stats_left) ||
+            !request_frame_stats(ctx->stats_client, &ctx->stats_waitfor)) {
+            ws_reply(ctx, "0\r\n\r\n", 5);
+            ctx->stats = 0;
+        }
+    } else {
+        sprintf(head, "HTTP/1.1 200 OK\r\n"
+                 "Server: KasmVNC/4.0\r\n"
+                 "Connection: close\r\n"
+                 "Content-type: text/plain\r\n"
+                 "Content-length: %zu\r\n"
+                 "\r\n", len);
+        ws_reply(ctx, head, strlen(head));
+        ws_reply(ctx, statbuf, len);
+        ctx->stats = 0;
+
+        wserr("Sent frame stats to API caller\n");
+    }
+
+    conn->state = WS_REPLY;
+    conn->deadline = now_sec() + WS_REPLY_TIMEOUT;
+    advance(conn);
+}
+
+/* Parks the connection until the main thread publishes frame stats */
+static void wait_stats(ws_conn_t *conn) {
+    ws_ctx_t *ctx = conn->ctx;
+
+    ctx->wbuf_len = ctx->wbuf_sent = 0;
+
+    conn->state = WS_STATS;
+    conn->stats_deadline = 0;
+    conn->wnext = stats_head;
+    stats_head = conn;
+
+    // Only a hangup is expected from the caller meanwhile
+    watch(&conn->client, EPOLLIN | EPOLLRDHUP);
+    check_stats(conn);
+}
+
+/* Parks a preview watcher until its next frame is due */
+static void wait_preview(ws_conn_t *conn) {
+    ws_ctx_t *ctx = conn->ctx;
+
+    ctx->wbuf_len = ctx->wbuf_sent = 0;
+
+    // The first frame goes straight away
+    conn->preview_due = now_ms() + (conn->preview_due ? ctx->preview_interval : 0);
+    conn->state = WS_PREVIEW;
+    conn->wnext = preview_head;
+    preview_head = conn;
+
+    watch(&conn->client, EPOLLIN | EPOLLRDHUP);
+}
+
+/* Runs the connection's state machine as far as it will go without blocking */
+static void advance(ws_conn_t *conn) {
+    ws_ctx_t *ctx = conn->ctx;
+    char peek;
+    int ret;
+
+    wsthread_handler_id = conn->id;
+
+    switch (conn->state) {
+    case WS_DETECT:
+        ret = recv(ctx->sockfd, &peek, 1, MSG_PEEK);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        if (ret <= 0) {
+            handler_msg("ignoring empty handshake\n");
+            goto close;
+        }
+
+        if (peek == '\x16' || peek == '\x80') {
+            if (!settings.cert) {
+                handler_msg("SSL connection but no cert specified\n");
+                goto close;
+            } else if (!ws_socket_ssl(ctx, ctx->sockfd,
+                                      (char *) settings.cert,
+                                      (char *) settings.key)) {
+                handler_msg("SSL connection but '%s' could not be loaded\n",
+                            settings.cert);
+                goto close;
+            }
+            conn->scheme = "wss";
+            conn->state = WS_TLS;
+            handler_msg("using SSL socket\n");
+        } else if (settings.ssl_only) {
+            handler_msg("non-SSL connection disallowed\n");
+            goto close;
+        } else {
+            conn->scheme = "ws";
+            conn->state = WS_REQUEST;
+            handler_msg("using plain (not SSL) socket\n");
+        }
+        advance(conn);
+        return;
+
+    case WS_TLS:
+        ret = SSL_accept(ctx->ssl);
+        if (ret <= 0) {
+            if (!ws_again(ctx, ret)) {
+                ERR_print_errors_fp(stderr);
+                goto close;
+            }
+            watch(&conn->client, ctx->ssl_want == SSL_ERROR_WANT_WRITE ?
+                                 EPOLLOUT : EPOLLIN);
+            return;
+        }
+#ifdef SSL_OP_ENABLE_KTLS
+        ctx->ktls = BIO_get_ktls_send(SSL_get_wbio(ctx->ssl));
+        if (settings.ktls)
+            handler_msg("kernel TLS %s\n", ctx->ktls ? "active" : "unavailable");
+#endif
+        conn->state = WS_REQUEST;
+        // The request may have arrived with the end of the handshake
+        advance(conn);
+        return;
+
+    case WS_REQUEST:
+        if (!conn->req && ! (conn->req = malloc(4096)) )
+            { fatal("malloc of request"); }
+
+        while (1) {
+            /* (reqlen + 1): reserve one byte for the trailing '\0' */
+            ret = ws_recv(ctx, conn->req + conn->reqlen, 4096 - (conn->reqlen + 1));
+            if (ret <= 0) {
+                if (ret < 0 && ws_again(ctx, ret)) {
+                    watch(&conn->client, ctx->ssl_want == SSL_ERROR_WANT_WRITE ?
+                                         EPOLLOUT : EPOLLIN);
+                    return;
+                }
+                if (ret == 0) {
+                    handler_emsg("Client closed during handshake\n");
+                } else {
+                    handler_emsg("Read error during handshake: %m\n");
+                }
+                goto close;
+            }
+            conn->reqlen += ret;
+            conn->req[conn->reqlen] = 0;
+            if (strstr(conn->req, "\r\n\r\n")) {
+                queue_work(conn);
+                return;
+            } else if (4096 <= conn->reqlen + 1) {
+                handler_emsg("Oversized handshake\n");
+                goto close;
+            }
+        }
+
+    case WS_WORKING:
+    case WS_CLOSED:
+        return;
+
+    case WS_REPLY:
+        ret = send_reply(conn);
+        if (ret < 0)
+            goto close;
+        if (ret == 0) {
+            watch(&conn->client, ctx->ssl_want == SSL_ERROR_WANT_READ ?
+                                 EPOLLIN : EPOLLOUT);
+            return;
+        }
+        if (ctx->stats) {
+            wait_stats(conn);
+            return;
+        }
+        if (ctx->preview) {
+            wait_preview(conn);
+            return;
+        }
+        if (!conn->proxy) {
+            if (ctx->keepalive) {
+                next_request(conn);
+                return;
+            }
+            handler_msg("No connection after handshake\n");
+            goto close;
+        }
+        if (!start_proxy(conn))
+            goto close;
+        advance(conn);
+        return;
+
+    case WS_STATS:
+    case WS_PREVIEW:
+        ret = recv(ctx->sockfd, &peek, 1, MSG_PEEK);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+        handler_msg("API caller went away\n");
+        goto close;
+
+    case WS_PROXY:
+        if (proxy_pump(ctx))
+            goto close;
+        watch(&conn->client, ctx->client_events);
+        watch(&conn->target, ctx->target_events);
+        return;
+    }
+
+close:
+    close_conn(conn);
+}
+
+static void accept_clients(void) {
+    struct sockaddr_storage cli_addr;
+    socklen_t clilen;
+    ws_conn_t *conn;
+    int csock;
+
+    while (1) {
+        clilen = sizeof(cli_addr);
+        csock = accept4(settings.listen_sock, (struct sockaddr *) &cli_addr,
+                        &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (csock < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                // Out of descriptors. Refuse the client rather than leave
+                // it queued, which would wake us up again straight away.
+                wserr("ERROR on accept: %s, dropping connection\n",
+                      strerror(errno));
+                if (sparefd >= 0) {
+                    close(sparefd);
+                    csock = accept(settings.listen_sock, NULL, NULL);
+                    if (csock >= 0)
+                        close(csock);
+                    sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                    continue;
+                }
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                error("ERROR on accept");
+            }
+            return;
+        }
+
+        if (! (conn = calloc(1, sizeof(ws_conn_t))) )
+            { fatal("malloc of connection"); }
+        conn->ctx = alloc_ws_ctx();
+        conn->ctx->sockfd = csock;
+
+        if (cli_addr.ss_family == AF_INET6)
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &cli_addr)->sin6_addr,
+                      conn->ctx->ip, sizeof(conn->ctx->ip));
+        else
+            inet_ntop(AF_INET, &((struct sockaddr_in *) &cli_addr)->sin_addr,
+                      conn->ctx->ip, sizeof(conn->ctx->ip));
+
         fprintf(stderr, " websocket %d: got client connection from %s\n",
                     settings.handler_id,
-                    pass->ip);
+                    conn->ctx->ip);
+
+        conn->id = settings.handler_id++;
+        conn->state = WS_DETECT;
+        conn->deadline = now_sec() + WS_REQUEST_TIMEOUT;
+        conn->client.conn = conn;
+        conn->client.fd = csock;
+        conn->target.conn = conn;
+        conn->target.fd = -1;
+
+        conn->next = conns;
+        if (conns)
+            conns->prev = conn;
+        conns = conn;
+
+        watch(&conn->client, EPOLLIN);
+    }
+}
+
+/* Takes back connections the workers are done with */
+static void collect_done(void) {
+    ws_conn_t *conn, *next;
+    uint64_t count;
+
+    if (read(wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        wserr("eventfd read: %s\n", strerror(errno));
+
+    pthread_mutex_lock(&queue_lock);
+    conn = done_head;
+    done_head = NULL;
+    pthread_mutex_unlock(&queue_lock);
+
+    for (; conn; conn = next) {
+        next = conn->qnext;
 
-        pthread_t tid;
-        pass->id = settings.handler_id;
-        pass->csock = csock;
-        pthread_create(&tid, NULL, subthread, pass);
+        free(conn->req);
+        conn->req = NULL;
+
+        conn->state = WS_REPLY;
+        conn->deadline = now_sec() + WS_REPLY_TIMEOUT;
+        advance(conn);
+    }
+}
+
+static void expire_conns(void) {
+    const time_t now = now_sec();
+    ws_conn_t *conn, *next;
+
+    for (conn = conns; conn; conn = next) {
+        next = conn->next;
+
+        if (conn->state == WS_WORKING || conn->state == WS_PROXY ||
+            conn->state == WS_STATS || conn->state == WS_PREVIEW)
+            continue;
+        if (conn->deadline > now)
+            continue;
+
+        wsthread_handler_id = conn->id;
+        handler_emsg("timed out %s\n", conn->state == WS_REPLY ?
+                     "sending reply" : "waiting for request");
+        close_conn(conn);
+    }
+}
+
+/*
+ * Checks the connections waiting for frame stats, all of them when the
+ * main thread published some, otherwise those whose clients ran out of
+ * time
+ */
+static void poll_stats(int published) {
+    const uint64_t now = now_ms();
+    ws_conn_t *conn, *next;
+    uint64_t count;
+
+    if (published && read(settings.frame_stats_fd, &count, sizeof(count)) < 0 &&
+        errno != EAGAIN)
+        wserr("eventfd read: %s\n", strerror(errno));
+
+    for (conn = stats_head; conn; conn = next) {
+        next = conn->wnext;
+
+        if (published || (conn->stats_deadline && conn->stats_deadline <= now)) {
+            wsthread_handler_id = conn->id;
+            check_stats(conn);
+        }
+    }
+}
+
+/* Hands the preview watchers whose frame is due to the workers */
+static void poll_previews(void) {
+    const uint64_t now = now_ms();
+    const uint64_t gen = settings.screenGenCb(settings.messager);
+    ws_conn_t *conn, *next;
+
+    for (conn = preview_head; conn; conn = next) {
+        next = conn->wnext;
+
+        if (conn->preview_due > now)
+            continue;
+
+        // Unchanged, look again after another interval
+        if (conn->ctx->preview_gen == gen) {
+            conn->preview_due = now + conn->ctx->preview_interval;
+            continue;
+        }
+
+        unlink_waiting(&preview_head, conn);
+        queue_work(conn);
+    }
+}
+
+/* How long the loop may sleep before a frame stats or preview deadline */
+static int wait_timeout(void) {
+    const uint64_t now = now_ms();
+    ws_conn_t *conn;
+    int timeout = 1000;
+
+    for (conn = stats_head; conn; conn = conn->wnext) {
+        if (!conn->stats_deadline)
+            continue;
+        if (conn->stats_deadline <= now)
+            return 0;
+        if (conn->stats_deadline - now < (uint64_t) timeout)
+            timeout = conn->stats_deadline - now;
+    }
+
+    for (conn = preview_head; conn; conn = conn->wnext) {
+        if (conn->preview_due <= now)
+            return 0;
+        if (conn->preview_due - now < (uint64_t) timeout)
+            timeout = conn->preview_due - now;
+    }
+
+    return timeout;
+}
+
+void *start_server(void *unused) {
+    struct epoll_event events[WS_MAX_EVENTS];
+    time_t last_expire = now_sec();
+    pthread_t tid;
+    int i, n;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd < 0 || wakefd < 0)
+        fatal("websocket event loop setup");
+
+    // Held back so a client can still be refused when out of descriptors
+    sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    fcntl(settings.listen_sock, F_SETFL,
+          fcntl(settings.listen_sock, F_GETFL) | O_NONBLOCK);
+
+    listen_watch.fd = settings.listen_sock;
+    watch(&listen_watch, EPOLLIN);
+    wake_watch.fd = wakefd;
+    watch(&wake_watch, EPOLLIN);
+
+    if (settings.httpdir && settings.httpdir[0]) {
+        cache_watch.fd = http_cache_init(settings.httpdir);
+        if (cache_watch.fd >= 0)
+            watch(&cache_watch, EPOLLIN);
+    }
+
+    if (settings.frame_stats_fd >= 0) {
+        stats_watch.fd = settings.frame_stats_fd;
+        watch(&stats_watch, EPOLLIN);
+    }
+
+    for (i = 0; i < WS_WORKERS; i++)
+        pthread_create(&tid, NULL, worker, NULL);
+
+    while (1) {
+        n = epoll_wait(epfd, events, WS_MAX_EVENTS, wait_timeout());
+        if (n < 0 && errno != EINTR) {
+            error("ERROR on epoll_wait");
+            continue;
+        }
+
+        for (i = 0; i < n; i++) {
+            ws_watch_t *w = events[i].data.ptr;
+
+            if (w == &listen_watch)
+                accept_clients();
+            else if (w == &wake_watch)
+                collect_done();
+            else if (w == &cache_watch)
+                http_cache_changed();
+            else if (w == &stats_watch)
+                poll_stats(1);
+            else
+                advance(w->conn);
+        }
+
+        if (stats_head)
+            poll_stats(0);
+        if (preview_head)
+            poll_previews();
+
+        if (now_sec() != last_expire) {
+            expire_conns();
+            last_expire = now_sec();
+        }
 
-        settings.handler_id += 1;
+        free_dead();
     }
     handler_msg("websockify exit\n");
 
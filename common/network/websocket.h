@@ -1,5 +1,7 @@
+#include <netinet/in.h>
 #include <openssl/ssl.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #define BUFSIZE 65536
 #define DBUFSIZE (BUFSIZE * 3) / 4 - 20
@@ -30,6 +32,9 @@ Sec-WebSocket-Protocol: %s\r\n\
 #define OPCODE_TEXT    0x01
 #define OPCODE_BINARY  0x02
 
+#define STATS_ONCE     1
+#define STATS_STREAM   2
+
 typedef struct {
     char path[1024+1];
     char host[1024+1];
@@ -44,7 +49,6 @@ typedef struct {
 
 typedef struct {
     int        sockfd;
-    SSL_CTX   *ssl_ctx;
     SSL       *ssl;
     int        hixie;
     int        hybi;
@@ -57,23 +61,47 @@ typedef struct {
 
     char      user[32];
     char      ip[64];
-} ws_ctx_t;
 
-struct wspass_t {
-    int csock;
-    unsigned id;
-    char ip[64];
-};
+    /* Reply being sent before the connection closes or starts proxying */
+    char      *wbuf;
+    size_t     wbuf_len, wbuf_size, wbuf_sent;
+    int        file_fd;
+    off_t      file_off, file_left;
+    void      *file_ref;    /* set when file_fd belongs to the http cache */
+    int        keepalive;
+    int        corked;
+    int        ktls;
+
+    /* Frame stats the reply waits for, see get_frame_stats in ownerapi() */
+    int        stats;
+    unsigned   stats_waitfor, stats_left;
+    char       stats_client[128];
+
+    /* Live preview the connection streams, see get_preview in ownerapi() */
+    int        preview;
+    uint16_t   preview_w, preview_h;
+    uint8_t    preview_q;
+    unsigned   preview_interval;    /* ms */
+    uint64_t   preview_gen;
+
+    /* Proxy state, see websockify.c */
+    int        tsock;
+    unsigned   tout_start, tout_end, cout_start, cout_end, tin_end;
+    int        ssl_want;
+    uint32_t   client_events, target_events;
+} ws_ctx_t;
 
 typedef struct {
     int verbose;
     int listen_sock;
+    int handoff_fd;
     unsigned int handler_id;
     const char *cert;
     const char *key;
     uint8_t disablebasicauth;
     const char *passwdfile;
     int ssl_only;
+    int ktls;
     const char *httpdir;
 
     void *messager;
@@ -96,6 +124,13 @@ typedef struct {
     uint8_t (*numActiveUsersCb)(void *messager);
     uint8_t (*getClientFrameStatsNumCb)(void *messager);
     uint8_t (*serverFrameStatsReadyCb)(void *messager);
+    void (*cancelFrameStatsCb)(void *messager);
+
+    uint64_t (*screenGenCb)(void *messager);
+    uint32_t (*previewCb)(void *messager, uint16_t w, uint16_t h, const uint8_t q,
+                          uint64_t *gen, uint8_t *buf, uint32_t len);
+    uint32_t (*metricsCb)(void *messager, char *buf, uint32_t len);
+    int frame_stats_fd;
 } settings_t;
 
 #ifdef __cplusplus
@@ -108,6 +143,15 @@ ssize_t ws_recv(ws_ctx_t *ctx, void *buf, size_t len);
 
 ssize_t ws_send(ws_ctx_t *ctx, const void *buf, size_t len);
 
+int ws_again(ws_ctx_t *ctx, ssize_t ret);
+
+void proxy_peer_name(ws_ctx_t *ws_ctx, char *buf, size_t len);
+int proxy_connect(ws_ctx_t *ws_ctx);
+int proxy_pump(ws_ctx_t *ws_ctx);
+
+void ws_handoff(int fd, SSL *ssl, int framed, const char *peer);
+int ws_handoff_take(int *fd, SSL **ssl, int *framed, char *peer, size_t len);
+
 /* base64.c declarations */
 //int b64_ntop(u_char const *src, size_t srclength, char *target, size_t targsize);
 //int b64_pton(char const *src, u_char *target, size_t targsize);
@@ -130,6 +174,7 @@ extern __thread unsigned wsthread_handler_id;
 #define handler_emsg(...) gen_handler_msg(stderr, __VA_ARGS__);
 
 void traffic(const char * token);
+void fatal(char *msg);
 
 int encode_hixie(u_char const *src, size_t srclength,
                  char *target, size_t targsize);
@@ -13,10 +13,9 @@
 #include <getopt.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -35,232 +34,194 @@ char USAGE[] = "Usage: [options] " \
                "  --ssl-only         disallow non-encrypted connections";
 */
 
-extern int pipe_error;
 extern settings_t settings;
 
-static void do_proxy(ws_ctx_t *ws_ctx, int target) {
-    fd_set rlist, wlist, elist;
-    struct timeval tv;
-    int maxfd, client = ws_ctx->sockfd;
-    unsigned int opcode, left, ret;
-    unsigned int tout_start, tout_end, cout_start, cout_end;
-    unsigned int tin_end;
+/*
+ * Moves as much data as possible in both directions without blocking,
+ * then records which events each socket needs to wait for. Returns -1
+ * when the connection should be closed.
+ */
+int proxy_pump(ws_ctx_t *ws_ctx) {
+    int target = ws_ctx->tsock;
+    unsigned int opcode, left;
+    int progress, enclen;
     ssize_t len, bytes;
 
-    tout_start = tout_end = cout_start = cout_end =
-    tin_end = 0;
-    maxfd = client > target ? client+1 : target+1;
-
-    while (1) {
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
-
-        FD_ZERO(&rlist);
-        FD_ZERO(&wlist);
-        FD_ZERO(&elist);
-
-        FD_SET(client, &elist);
-        FD_SET(target, &elist);
-
-        if (tout_end == tout_start) {
-            // Nothing queued for target, so read from client
-            FD_SET(client, &rlist);
-        } else {
-            // Data queued for target, so write to it
-            FD_SET(target, &wlist);
-        }
-        if (cout_end == cout_start) {
-            // Nothing queued for client, so read from target
-            FD_SET(target, &rlist);
-        } else {
-            // Data queued for client, so write to it
-            FD_SET(client, &wlist);
-        }
-
-        do {
-            ret = select(maxfd, &rlist, &wlist, &elist, &tv);
-        } while (ret == -1 && errno == EINTR);
-        if (pipe_error) { break; }
+    do {
+        progress = 0;
+        ws_ctx->ssl_want = 0;
 
-        if (FD_ISSET(target, &elist)) {
-            handler_emsg("target exception\n");
-            break;
-        }
-        if (FD_ISSET(client, &elist)) {
-            handler_emsg("client exception\n");
-            break;
-        }
-
-        if (ret == -1) {
-            handler_emsg("select(): %s\n", strerror(errno));
-            break;
-        } else if (ret == 0) {
-            //handler_emsg("select timeout\n");
-            continue;
-        }
-
-        if (FD_ISSET(target, &wlist)) {
-            len = tout_end-tout_start;
-            bytes = send(target, ws_ctx->tout_buf + tout_start, len, 0);
-            if (pipe_error) { break; }
+        if (ws_ctx->tout_end > ws_ctx->tout_start) {
+            len = ws_ctx->tout_end - ws_ctx->tout_start;
+            bytes = send(target, ws_ctx->tout_buf + ws_ctx->tout_start, len,
+                         MSG_NOSIGNAL);
             if (bytes < 0) {
-                handler_emsg("target connection error: %s\n",
-                             strerror(errno));
-                break;
-            }
-            tout_start += bytes;
-            if (tout_start >= tout_end) {
-                tout_start = tout_end = 0;
-                traffic(">");
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    handler_emsg("target connection error: %s\n",
+                                 strerror(errno));
+                    return -1;
+                }
             } else {
-                traffic(">.");
+                ws_ctx->tout_start += bytes;
+                if (ws_ctx->tout_start >= ws_ctx->tout_end) {
+                    ws_ctx->tout_start = ws_ctx->tout_end = 0;
+                    traffic(">");
+                } else {
+                    traffic(">.");
+                }
+                progress = 1;
             }
         }
 
-        if (FD_ISSET(client, &wlist)) {
-            len = cout_end-cout_start;
-            bytes = ws_send(ws_ctx, ws_ctx->cout_buf + cout_start, len);
-            if (pipe_error) { break; }
-            if (len < 3) {
-                handler_emsg("len: %d, bytes: %d: %d\n",
-                             (int) len, (int) bytes,
-                             (int) *(ws_ctx->cout_buf + cout_start));
-            }
-            cout_start += bytes;
-            if (cout_start >= cout_end) {
-                cout_start = cout_end = 0;
-                traffic("<");
+        if (ws_ctx->cout_end > ws_ctx->cout_start) {
+            len = ws_ctx->cout_end - ws_ctx->cout_start;
+            bytes = ws_send(ws_ctx, ws_ctx->cout_buf + ws_ctx->cout_start, len);
+            if (bytes <= 0) {
+                if (!ws_again(ws_ctx, bytes)) {
+                    handler_emsg("client connection error\n");
+                    return -1;
+                }
             } else {
-                traffic("<.");
+                ws_ctx->cout_start += bytes;
+                if (ws_ctx->cout_start >= ws_ctx->cout_end) {
+                    ws_ctx->cout_start = ws_ctx->cout_end = 0;
+                    traffic("<");
+                } else {
+                    traffic("<.");
+                }
+                progress = 1;
             }
         }
 
-        if (FD_ISSET(target, &rlist)) {
-            bytes = recv(target, ws_ctx->cin_buf, DBUFSIZE , 0);
-            if (pipe_error) { break; }
-            if (bytes <= 0) {
+        if (ws_ctx->cout_end == ws_ctx->cout_start) {
+            bytes = recv(target, ws_ctx->cin_buf, DBUFSIZE, 0);
+            if (bytes == 0) {
                 handler_emsg("target closed connection\n");
-                break;
-            }
-            cout_start = 0;
-            if (ws_ctx->hybi) {
-                cout_end = encode_hybi(ws_ctx->cin_buf, bytes,
-                                   ws_ctx->cout_buf, BUFSIZE, ws_ctx->opcode);
+                return -1;
+            } else if (bytes < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    handler_emsg("target connection error: %s\n",
+                                 strerror(errno));
+                    return -1;
+                }
             } else {
-                cout_end = encode_hixie(ws_ctx->cin_buf, bytes,
-                                    ws_ctx->cout_buf, BUFSIZE);
-            }
-            /*
-            printf("encoded: ");
-            for (i=0; i< cout_end; i++) {
-                printf("%u,", (unsigned char) *(ws_ctx->cout_buf+i));
-            }
-            printf("\n");
-            */
-            if (cout_end < 0) {
-                handler_emsg("encoding error\n");
-                break;
+                ws_ctx->cout_start = 0;
+                if (ws_ctx->hybi) {
+                    enclen = encode_hybi(ws_ctx->cin_buf, bytes,
+                                         ws_ctx->cout_buf, BUFSIZE, ws_ctx->opcode);
+                } else {
+                    enclen = encode_hixie(ws_ctx->cin_buf, bytes,
+                                          ws_ctx->cout_buf, BUFSIZE);
+                }
+                if (enclen < 0) {
+                    handler_emsg("encoding error\n");
+                    return -1;
+                }
+                ws_ctx->cout_end = enclen;
+                traffic("{");
+                progress = 1;
             }
-            traffic("{");
         }
 
-        if (FD_ISSET(client, &rlist)) {
-            bytes = ws_recv(ws_ctx, ws_ctx->tin_buf + tin_end, BUFSIZE-1-tin_end);
-            if (pipe_error) { break; }
+        if (ws_ctx->tout_end == ws_ctx->tout_start) {
+            bytes = ws_recv(ws_ctx, ws_ctx->tin_buf + ws_ctx->tin_end,
+                            BUFSIZE-1-ws_ctx->tin_end);
             if (bytes <= 0) {
-                handler_emsg("client closed connection\n");
-                break;
-            }
-            tin_end += bytes;
-            /*
-            printf("before decode: ");
-            for (i=0; i< bytes; i++) {
-                printf("%u,", (unsigned char) *(ws_ctx->tin_buf+i));
-            }
-            printf("\n");
-            */
-            if (ws_ctx->hybi) {
-                len = decode_hybi(ws_ctx->tin_buf,
-                                  tin_end,
-                                  ws_ctx->tout_buf, BUFSIZE-1,
-                                  &opcode, &left);
+                if (bytes == 0 || !ws_again(ws_ctx, bytes)) {
+                    handler_emsg("client closed connection\n");
+                    return -1;
+                }
             } else {
-                len = decode_hixie(ws_ctx->tin_buf,
-                                   tin_end,
-                                   ws_ctx->tout_buf, BUFSIZE-1,
-                                   &opcode, &left);
-            }
+                ws_ctx->tin_end += bytes;
+                opcode = 0;
+                if (ws_ctx->hybi) {
+                    len = decode_hybi(ws_ctx->tin_buf,
+                                      ws_ctx->tin_end,
+                                      ws_ctx->tout_buf, BUFSIZE-1,
+                                      &opcode, &left);
+                } else {
+                    len = decode_hixie(ws_ctx->tin_buf,
+                                       ws_ctx->tin_end,
+                                       ws_ctx->tout_buf, BUFSIZE-1,
+                                       &opcode, &left);
+                }
 
-            if (opcode == 8) {
-                handler_msg("client sent orderly close frame\n");
-                break;
-            }
+                if (opcode == 8) {
+                    handler_msg("client sent orderly close frame\n");
+                    return -1;
+                }
 
-            /*
-            printf("decoded: ");
-            for (i=0; i< len; i++) {
-                printf("%u,", (unsigned char) *(ws_ctx->tout_buf+i));
-            }
-            printf("\n");
-            */
-            if (len < 0) {
-                handler_emsg("decoding error\n");
-                break;
-            }
-            if (left) {
-                const unsigned tin_start = tin_end - left;
-                //handler_emsg("partial frame from client, %u left, start %u end %u, lens %lu %lu\n",
-                //             left, tin_start, tin_end, bytes, len);
-                memmove(ws_ctx->tin_buf, ws_ctx->tin_buf + tin_start, left);
-                tin_end = left;
-            } else {
-                //handler_emsg("handled %lu/%lu bytes\n", bytes, len);
-                tin_end = 0;
-            }
+                if (len < 0) {
+                    handler_emsg("decoding error\n");
+                    return -1;
+                }
+                if (left) {
+                    const unsigned tin_start = ws_ctx->tin_end - left;
+                    memmove(ws_ctx->tin_buf, ws_ctx->tin_buf + tin_start, left);
+                    ws_ctx->tin_end = left;
+                } else {
+                    ws_ctx->tin_end = 0;
+                }
 
-            traffic("}");
-            tout_start = 0;
-            tout_end = len;
+                traffic("}");
+                ws_ctx->tout_start = 0;
+                ws_ctx->tout_end = len;
+                progress = 1;
+            }
         }
-    }
-}
+    } while (progress);
 
-void proxy_handler(ws_ctx_t *ws_ctx) {
+    // Read from one side only while there is room to pass it on
+    ws_ctx->client_events = 0;
+    ws_ctx->target_events = 0;
 
-    char sockname[32];
-    sprintf(sockname, ".KasmVNCSock%u", getpid());
+    if (ws_ctx->tout_end == ws_ctx->tout_start ||
+        ws_ctx->ssl_want == SSL_ERROR_WANT_READ)
+        ws_ctx->client_events |= EPOLLIN;
+    if (ws_ctx->cout_end > ws_ctx->cout_start ||
+        ws_ctx->ssl_want == SSL_ERROR_WANT_WRITE)
+        ws_ctx->client_events |= EPOLLOUT;
 
-    struct sockaddr_un addr;
-    addr.sun_family = AF_UNIX;
-    strcpy(addr.sun_path, sockname);
-    addr.sun_path[0] = '\0';
+    if (ws_ctx->cout_end == ws_ctx->cout_start)
+        ws_ctx->target_events |= EPOLLIN;
+    if (ws_ctx->tout_end > ws_ctx->tout_start)
+        ws_ctx->target_events |= EPOLLOUT;
 
+    return 0;
+}
+
+/* How the VNC server knows who this is, "user@ip_sec.usec" */
+void proxy_peer_name(ws_ctx_t *ws_ctx, char *buf, size_t len) {
     struct timeval tv;
     gettimeofday(&tv, NULL);
 
-    struct sockaddr_un myaddr;
-    myaddr.sun_family = AF_UNIX;
-    sprintf(myaddr.sun_path, ".%s@%s_%lu.%lu", ws_ctx->user, ws_ctx->ip,
-            tv.tv_sec, tv.tv_usec);
-    myaddr.sun_path[0] = '\0';
-
-    int tsock = socket(AF_UNIX, SOCK_STREAM, 0);
-    bind(tsock, (struct sockaddr *) &myaddr, sizeof(struct sockaddr_un));
-
-    handler_msg("connecting to VNC target\n");
+    snprintf(buf, len, "%s@%s_%lu.%lu", ws_ctx->user, ws_ctx->ip,
+             tv.tv_sec, tv.tv_usec);
+}
 
-    if (connect(tsock, (struct sockaddr *) &addr,
-        sizeof(sa_family_t) + strlen(sockname)) < 0) {
+/*
+ * Hands the VNC server one end of a socket pair, and keeps the other to
+ * relay to, for clients that can't be framed in-process.
+ */
+int proxy_connect(ws_ctx_t *ws_ctx) {
+    char peer[128];
+    int sv[2];
 
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
         handler_emsg("Could not connect to target: %s\n",
                      strerror(errno));
-        return;
+        return -1;
     }
 
-    do_proxy(ws_ctx, tsock);
+    handler_msg("connecting to VNC target\n");
+
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    ws_ctx->tsock = sv[0];
+
+    proxy_peer_name(ws_ctx, peer, sizeof(peer));
+    ws_handoff(sv[1], NULL, 0, peer);
 
-    shutdown(tsock, SHUT_RDWR);
-    close(tsock);
+    return 0;
 }
 
 #if 0
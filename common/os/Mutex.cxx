@@ -19,6 +19,7 @@
 #ifdef WIN32
 #include <windows.h>
 #else
+#include <errno.h>
 #include <pthread.h>
 #endif
 
@@ -28,16 +29,23 @@
 
 using namespace os;
 
-Mutex::Mutex()
+Mutex::Mutex(bool recursive)
 {
 #ifdef WIN32
+  // Critical sections are always recursive
   systemMutex = new CRITICAL_SECTION;
   InitializeCriticalSection((CRITICAL_SECTION*)systemMutex);
 #else
+  pthread_mutexattr_t attr;
   int ret;
 
+  pthread_mutexattr_init(&attr);
+  if (recursive)
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
   systemMutex = new pthread_mutex_t;
-  ret = pthread_mutex_init((pthread_mutex_t*)systemMutex, NULL);
+  ret = pthread_mutex_init((pthread_mutex_t*)systemMutex, &attr);
+  pthread_mutexattr_destroy(&attr);
   if (ret != 0)
     throw rdr::SystemException("Failed to create mutex", ret);
 #endif
@@ -67,6 +75,23 @@ void Mutex::lock()
 #endif
 }
 
+bool Mutex::tryLock()
+{
+#ifdef WIN32
+  return TryEnterCriticalSection((CRITICAL_SECTION*)systemMutex);
+#else
+  int ret;
+
+  ret = pthread_mutex_trylock((pthread_mutex_t*)systemMutex);
+  if (ret == EBUSY)
+    return false;
+  if (ret != 0)
+    throw rdr::SystemException("Failed to lock mutex", ret);
+
+  return true;
+#endif
+}
+
 void Mutex::unlock()
 {
 #ifdef WIN32
@@ -24,10 +24,12 @@ namespace os {
 
   class Mutex {
   public:
-    Mutex();
+    Mutex(bool recursive=false);
     ~Mutex();
 
     void lock();
+    // Returns false instead of waiting if another thread holds the mutex
+    bool tryLock();
     void unlock();
 
   private:
@@ -22,19 +22,31 @@
 #include <config.h>
 #endif
 
+#include <string.h>
+
 #include <rdr/BufferedOutStream.h>
 #include <rdr/Exception.h>
+#include <rfb/util.h>
 
 
 using namespace rdr;
 
 static const size_t DEFAULT_BUF_SIZE = 16384;
 
+// Enough for a whole update, so that writing one to a slow reader doesn't
+// have to wait for it
+static const size_t MAX_BUF_SIZE = 32 * 1024 * 1024;
+
+// Smaller vectors are cheaper to copy than to keep track of
+static const size_t MIN_BLOCK_SIZE = 8192;
+
 BufferedOutStream::BufferedOutStream()
-  : bufSize(DEFAULT_BUF_SIZE), offset(0)
+  : bufSize(DEFAULT_BUF_SIZE), offset(0), peakUsage(0),
+    blockUsage(0), bufSent(0)
 {
   ptr = start = sentUpTo = new U8[bufSize];
   end = start + bufSize;
+  gettimeofday(&lastSizeCheck, NULL);
 }
 
 BufferedOutStream::~BufferedOutStream()
@@ -45,17 +57,17 @@ BufferedOutStream::~BufferedOutStream()
 
 size_t BufferedOutStream::length()
 {
-  return offset + ptr - sentUpTo;
+  return offset + bufferUsage();
 }
 
 size_t BufferedOutStream::bufferUsage()
 {
-  return ptr - sentUpTo;
+  return ptr - sentUpTo + blockUsage;
 }
 
 void BufferedOutStream::flush()
 {
-  while (sentUpTo < ptr) {
+  while (bufferUsage()) {
     size_t len;
 
     len = bufferUsage();
@@ -67,20 +79,47 @@ void BufferedOutStream::flush()
   }
 
   // Managed to flush everything?
-  if (sentUpTo == ptr)
-    ptr = sentUpTo = start;
+  if (bufferUsage())
+    return;
+
+  ptr = sentUpTo = start;
+
+  // Shrink back if the large buffer hasn't been needed lately
+  if (bufSize > DEFAULT_BUF_SIZE && rfb::msSince(&lastSizeCheck) > 5000) {
+    size_t newSize;
+
+    newSize = DEFAULT_BUF_SIZE;
+    while (newSize < peakUsage)
+      newSize *= 2;
+
+    if (newSize < bufSize) {
+      delete [] start;
+      bufSize = newSize;
+      ptr = start = sentUpTo = new U8[bufSize];
+      end = start + bufSize;
+    }
+
+    peakUsage = 0;
+    gettimeofday(&lastSizeCheck, NULL);
+  }
 }
 
 void BufferedOutStream::overrun(size_t needed)
 {
-  if (needed > bufSize)
+  size_t totalNeeded;
+
+  if (needed > MAX_BUF_SIZE)
     throw Exception("BufferedOutStream overrun: "
                     "requested size of %lu bytes exceeds maximum of %lu bytes",
-                    (long unsigned)needed, (long unsigned)bufSize);
+                    (long unsigned)needed, (long unsigned)MAX_BUF_SIZE);
 
   // First try to get rid of the data we have
   flush();
 
+  totalNeeded = ptr - sentUpTo + needed;
+  if (peakUsage < totalNeeded)
+    peakUsage = totalNeeded;
+
   // Still not enough space?
   while (needed > avail()) {
     // Can we shuffle things around?
@@ -90,6 +129,27 @@ void BufferedOutStream::overrun(size_t needed)
       memmove(start, sentUpTo, ptr - sentUpTo);
       ptr = start + (ptr - sentUpTo);
       sentUpTo = start;
+    } else if (bufSize < MAX_BUF_SIZE) {
+      size_t newSize;
+      U8* newBuffer;
+
+      // Make room rather than wait for the other end to read it
+      newSize = bufSize * 2;
+      while (newSize < MAX_BUF_SIZE && newSize < totalNeeded)
+        newSize *= 2;
+      if (newSize > MAX_BUF_SIZE)
+        newSize = MAX_BUF_SIZE;
+
+      newBuffer = new U8[newSize];
+      memcpy(newBuffer, sentUpTo, ptr - sentUpTo);
+      delete [] start;
+
+      ptr = newBuffer + (ptr - sentUpTo);
+      start = sentUpTo = newBuffer;
+      end = start + newSize;
+      bufSize = newSize;
+
+      gettimeofday(&lastSizeCheck, NULL);
     } else {
       size_t len;
 
@@ -106,3 +166,109 @@ void BufferedOutStream::overrun(size_t needed)
     }
   }
 }
+
+void BufferedOutStream::writeOwned(std::vector<U8>& data)
+{
+  if (data.size() < MIN_BLOCK_SIZE) {
+    OutStream::writeOwned(data);
+    return;
+  }
+
+  blocks.push_back(Block());
+
+  Block& block = blocks.back();
+  block.pos = bufSent + (ptr - sentUpTo);
+  block.sent = 0;
+  block.data.swap(data);
+
+  blockUsage += block.data.size();
+}
+
+int BufferedOutStream::gather(struct iovec* iov, int maxiov, size_t maxBytes)
+{
+  std::list<Block>::iterator block;
+  size_t pos;
+  U8* buf;
+  int count;
+
+  block = blocks.begin();
+  pos = bufSent;
+  buf = sentUpTo;
+  count = 0;
+
+  while (count < maxiov && maxBytes > 0) {
+    size_t len;
+
+    if (block != blocks.end() && block->pos == pos) {
+      len = block->data.size() - block->sent;
+      iov[count].iov_base = &block->data[block->sent];
+      block++;
+    } else {
+      if (block != blocks.end())
+        len = block->pos - pos;
+      else
+        len = ptr - buf;
+      if (len == 0)
+        break;
+
+      iov[count].iov_base = buf;
+      buf += len;
+      pos += len;
+    }
+
+    if (len > maxBytes)
+      len = maxBytes;
+    iov[count].iov_len = len;
+
+    maxBytes -= len;
+    count++;
+  }
+
+  return count;
+}
+
+void BufferedOutStream::advance(size_t n)
+{
+  while (n > 0) {
+    size_t len;
+
+    if (!blocks.empty() && blocks.front().pos == bufSent) {
+      Block& block = blocks.front();
+
+      len = block.data.size() - block.sent;
+      if (len > n)
+        len = n;
+
+      block.sent += len;
+      blockUsage -= len;
+
+      if (block.sent == block.data.size()) {
+        releaseBlock(block.data);
+        blocks.pop_front();
+      }
+    } else {
+      if (!blocks.empty())
+        len = blocks.front().pos - bufSent;
+      else
+        len = ptr - sentUpTo;
+      if (len > n)
+        len = n;
+
+      if (len == 0)
+        throw Exception("BufferedOutStream: sent more than was written");
+
+      sentUpTo += len;
+      bufSent += len;
+    }
+
+    n -= len;
+  }
+}
+
+size_t BufferedOutStream::blockPending()
+{
+  if (blocks.empty() || blocks.front().pos != bufSent)
+    return 0;
+
+  return blocks.front().data.size() - blocks.front().sent;
+}
@@ -24,8 +24,23 @@
 #ifndef __RDR_BUFFEREDOUTSTREAM_H__
 #define __RDR_BUFFEREDOUTSTREAM_H__
 
+#include <sys/time.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+#include <list>
+#include <vector>
+
 #include <rdr/OutStream.h>
 
+#ifdef _WIN32
+struct iovec {
+  void* iov_base;
+  size_t iov_len;
+};
+#endif
+
 namespace rdr {
 
   class BufferedOutStream : public OutStream {
@@ -36,6 +51,10 @@ namespace rdr {
     virtual size_t length();
     virtual void flush();
 
+    // Large vectors are kept as they are, and sent from where they are in
+    // between the buffered data
+    virtual void writeOwned(std::vector<U8>& data);
+
     size_t bufferUsage();
 
   private:
@@ -48,11 +67,43 @@ namespace rdr {
 
     virtual void overrun(size_t needed);
 
+  protected:
+    // gather() describes the data to send next, in order, using at most
+    // maxiov entries and maxBytes bytes. Returns the number of entries.
+    int gather(struct iovec* iov, int maxiov, size_t maxBytes);
+
+    // advance() moves past data that has been sent
+    void advance(size_t n);
+
+    // blockPending() returns what is left of a kept vector if it is next
+    // to be sent, or zero if buffered data comes first
+    size_t blockPending();
+
+    // releaseBlock() gets each kept vector once all of it has been sent.
+    // It is freed on return, unless it is swapped for an empty one.
+    virtual void releaseBlock(std::vector<U8>& data) {}
+
   private:
     size_t bufSize;
     size_t offset;
     U8* start;
 
+    // The buffer grows when the other end is slow to read, and shrinks
+    // again once the extra room hasn't been needed for a while
+    size_t peakUsage;
+    struct timeval lastSizeCheck;
+
+    // Kept vectors, each going in before the buffered byte at pos. Buffer
+    // positions count every byte that has been through the buffer.
+    struct Block {
+      size_t pos;
+      size_t sent;
+      std::vector<U8> data;
+    };
+    std::list<Block> blocks;
+    size_t blockUsage;
+    size_t bufSent;
+
   protected:
     U8* sentUpTo;
 
@@ -42,6 +42,7 @@
 #endif
 
 #include <rdr/FdInStream.h>
+#include <rdr/FdOutStream.h>
 #include <rdr/Exception.h>
 
 using namespace rdr;
@@ -51,12 +52,12 @@ enum { DEFAULT_BUF_SIZE = 8192 };
 FdInStream::FdInStream(int fd_, int timeoutms_,
                        bool closeWhenDone_)
   : fd(fd_), closeWhenDone(closeWhenDone_),
-    timeoutms(timeoutms_), blockCallback(0)
+    timeoutms(timeoutms_), blockCallback(0), zeroCopyStream(0)
 {
 }
 
 FdInStream::FdInStream(int fd_, FdInStreamBlockCallback* blockCallback_)
-  : fd(fd_), timeoutms(0), blockCallback(blockCallback_)
+  : fd(fd_), timeoutms(0), blockCallback(blockCallback_), zeroCopyStream(0)
 {
 }
 
@@ -76,6 +77,11 @@ void FdInStream::setBlockCallback(FdInStreamBlockCallback* blockCallback_)
   timeoutms = 0;
 }
 
+void FdInStream::setZeroCopyStream(FdOutStream* os)
+{
+  zeroCopyStream = os;
+}
+
 
 bool FdInStream::fillBuffer(size_t maxSize, bool wait)
 {
@@ -123,7 +129,29 @@ size_t FdInStream::readWithTimeoutOrCallback(void* buf, size_t len, bool wait)
       n = select(fd+1, &fds, 0, 0, tvp);
     } while (n < 0 && errno == EINTR);
 
-    if (n > 0) break;
+    if (n > 0) {
+      int flags = 0;
+
+#ifdef MSG_DONTWAIT
+      // select() also reports zero-copy completions waiting on the error
+      // queue, so there may be nothing to read after all
+      if (zeroCopyStream)
+        flags = MSG_DONTWAIT;
+#endif
+
+      do {
+        n = ::recv(fd, (char*)buf, len, flags);
+      } while (n < 0 && errno == EINTR);
+
+      if (n < 0 && zeroCopyStream &&
+          (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        zeroCopyStream->readCompletions();
+        if (!wait) return 0;
+        continue;
+      }
+
+      break;
+    }
     if (n < 0) throw SystemException("select",errno);
     if (!wait) return 0;
     if (!blockCallback) throw TimedOut();
@@ -131,10 +159,6 @@ size_t FdInStream::readWithTimeoutOrCallback(void* buf, size_t len, bool wait)
     blockCallback->blockCallback();
   }
 
-  do {
-    n = ::recv(fd, (char*)buf, len, 0);
-  } while (n < 0 && errno == EINTR);
-
   if (n < 0) throw SystemException("read",errno);
   if (n == 0) throw EndOfStream();
 
@@ -27,6 +27,8 @@
 
 namespace rdr {
 
+  class FdOutStream;
+
   class FdInStreamBlockCallback {
   public:
     virtual void blockCallback() = 0;
@@ -45,16 +47,24 @@ namespace rdr {
     void setBlockCallback(FdInStreamBlockCallback* blockCallback);
     int getFd() { return fd; }
 
+    // The stream that sends on the same socket with zero-copy, and so
+    // needs to hear when the socket was only readable for its sake
+    void setZeroCopyStream(FdOutStream* os);
+
   private:
     virtual bool fillBuffer(size_t maxSize, bool wait);
 
     size_t readWithTimeoutOrCallback(void* buf, size_t len, bool wait=true);
 
+  protected:
     int fd;
     bool closeWhenDone;
     int timeoutms;
     FdInStreamBlockCallback* blockCallback;
 
+  private:
+    FdOutStream* zeroCopyStream;
+
     size_t offset;
     U8* start;
   };
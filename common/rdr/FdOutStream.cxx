@@ -39,11 +39,22 @@
 #include <netinet/tcp.h>
 #endif
 
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY
+#endif
+
 /* Old systems have select() in sys/time.h */
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
 
+#include <os/Mutex.h>
+
 #include <rdr/FdOutStream.h>
 #include <rdr/Exception.h>
 #include <rfb/util.h>
@@ -51,8 +62,16 @@
 
 using namespace rdr;
 
+// Enough to cover sending as many pieces as gather() tends to find
+static const int MAX_IOV = 64;
+
+// The kernel's advice is that smaller sends are faster to copy
+static const size_t MIN_ZEROCOPY_SIZE = 65536;
+
 FdOutStream::FdOutStream(int fd_, bool blocking_, int timeoutms_)
-  : fd(fd_), blocking(blocking_), timeoutms(timeoutms_)
+  : fd(fd_), blocking(blocking_), timeoutms(timeoutms_),
+    zeroCopyMutex(new os::Mutex()), zeroCopy(false),
+    frontPinned(false), frontSeq(0), nextSeq(0), doneSeq(0)
 {
   gettimeofday(&lastWrite, NULL);
 }
@@ -60,10 +79,15 @@ FdOutStream::FdOutStream(int fd_, bool blocking_, int timeoutms_)
 FdOutStream::~FdOutStream()
 {
   try {
-    while (sentUpTo != ptr)
+    while (bufferUsage())
       flushBuffer(true);
   } catch (Exception&) {
   }
+
+  // Anything still pinned is only on its way to a closing socket, and
+  // the kernel holds on to the pages themselves
+
+  delete zeroCopyMutex;
 }
 
 void FdOutStream::setTimeout(int timeoutms_) {
@@ -79,11 +103,104 @@ unsigned FdOutStream::getIdleTime()
   return rfb::msSince(&lastWrite);
 }
 
+void FdOutStream::flush()
+{
+  BufferedOutStream::flush();
+
+  readCompletions();
+}
+
+bool FdOutStream::enableZeroCopy()
+{
+#ifdef HAVE_ZEROCOPY
+  int one = 1;
+
+  os::AutoMutex a(zeroCopyMutex);
+  if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+    zeroCopy = true;
+#endif
+
+  return zeroCopy;
+}
+
+void FdOutStream::readCompletions()
+{
+#ifdef HAVE_ZEROCOPY
+  os::AutoMutex a(zeroCopyMutex);
+
+  while (nextSeq != doneSeq) {
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    char control[128];
+    int n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    do {
+      n = recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+      break;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      struct sock_extended_err* err;
+      U32 seq;
+
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+          !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+        continue;
+
+      err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      // The kernel had to copy after all (e.g. loopback), so pinning
+      // only costs us
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        zeroCopy = false;
+
+      for (seq = err->ee_info; seq != err->ee_data + 1; seq++)
+        completed(seq);
+    }
+  }
+
+  while (!pinned.empty() && (S32)(pinned.front().seq - doneSeq) < 0)
+    pinned.pop_front();
+#endif
+}
+
+void FdOutStream::completed(U32 seq)
+{
+  if (seq != doneSeq) {
+    doneEarly.insert(seq);
+    return;
+  }
+
+  doneSeq++;
+  while (doneEarly.erase(doneSeq))
+    doneSeq++;
+}
+
+void FdOutStream::releaseBlock(std::vector<U8>& data)
+{
+  os::AutoMutex a(zeroCopyMutex);
+
+  if (!frontPinned)
+    return;
+
+  pinned.push_back(Pinned());
+  pinned.back().seq = frontSeq;
+  pinned.back().data.swap(data);
+
+  frontPinned = false;
+}
+
 bool FdOutStream::flushBuffer(bool wait)
 {
-  size_t n = writeWithTimeout((const void*) sentUpTo,
-                              ptr - sentUpTo,
-                              (blocking || wait)? timeoutms : 0);
+  size_t n = writeWithTimeout((blocking || wait)? timeoutms : 0);
 
   // Timeout?
   if (n == 0) {
@@ -94,25 +211,28 @@ bool FdOutStream::flushBuffer(bool wait)
     throw TimedOut();
   }
 
-  sentUpTo += n;
-
   return true;
 }
 
 //
-// writeWithTimeout() writes up to the given length in bytes from the given
-// buffer to the file descriptor.  If there is a timeout set and that timeout
-// expires, it throws a TimedOut exception.  Otherwise it returns the number of
-// bytes written.  It never attempts to send() unless select() indicates that
-// the fd is writable - this means it can be used on an fd which has been set
+// writeWithTimeout() writes as much of the pending data as it can to the
+// file descriptor.  If there is a timeout set and that timeout expires, it
+// throws a TimedOut exception.  Otherwise it returns the number of bytes
+// written.  It never attempts to send() unless select() indicates that the fd
+// is writable - this means it can be used on an fd which has been set
 // non-blocking.  It also has to cope with the annoying possibility of both
 // select() and send() returning EINTR.
 //
+// The buffer and any kept vectors go out together with sendmsg(). A large
+// vector is sent on its own with MSG_ZEROCOPY if that is enabled.
+//
 
-size_t FdOutStream::writeWithTimeout(const void* data, size_t length, int timeoutms)
+size_t FdOutStream::writeWithTimeout(int timeoutms)
 {
-  int n;
+  struct iovec iov[MAX_IOV];
+  int n, count;
 
+again:
   do {
     fd_set fds;
     struct timeval tv;
@@ -136,20 +256,86 @@ size_t FdOutStream::writeWithTimeout(const void* data, size_t length, int timeou
   if (n == 0)
     return 0;
 
+#ifdef _WIN32
+  gather(iov, 1, (size_t)-1);
+
   do {
-    // select only guarantees that you can write SO_SNDLOWAT without
-    // blocking, which is normally 1. Use MSG_DONTWAIT to avoid
-    // blocking, when possible.
+    n = ::send(fd, (const char*)iov[0].iov_base, iov[0].iov_len, 0);
+  } while (n < 0 && (errno == EINTR));
+#else
+  struct msghdr msg;
+  int flags;
+  bool pin;
+
+  // select only guarantees that you can write SO_SNDLOWAT without
+  // blocking, which is normally 1. Use MSG_DONTWAIT to avoid
+  // blocking, when possible.
 #ifndef MSG_DONTWAIT
-    n = ::send(fd, (const char*)data, length, 0);
+  flags = 0;
 #else
-    n = ::send(fd, (const char*)data, length, MSG_DONTWAIT);
+  flags = MSG_DONTWAIT;
+#endif
+
+  pin = false;
+#ifdef HAVE_ZEROCOPY
+  // The reading thread may reap completions meanwhile, so the send and
+  // its sequence number have to be one step for it
+  zeroCopyMutex->lock();
+
+  if (zeroCopy && blockPending() >= MIN_ZEROCOPY_SIZE) {
+    flags |= MSG_ZEROCOPY;
+    pin = true;
+  }
+#endif
+
+  count = gather(iov, pin ? 1 : MAX_IOV, (size_t)-1);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+
+  while (true) {
+    n = sendmsg(fd, &msg, flags);
+    if (n >= 0)
+      break;
+
+    if (errno == EINTR)
+      continue;
+
+#ifdef HAVE_ZEROCOPY
+    // Out of memory for tracking it, so copy this time
+    if (pin && errno == ENOBUFS) {
+      flags &= ~MSG_ZEROCOPY;
+      pin = false;
+      continue;
+    }
+#endif
+
+    break;
+  }
+
+  if (pin && n > 0) {
+    frontPinned = true;
+    frontSeq = nextSeq++;
+  }
+
+#ifdef HAVE_ZEROCOPY
+  bool pending = nextSeq != doneSeq;
+  zeroCopyMutex->unlock();
+
+  // Pending completions also make select() say the socket is writable
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && pending) {
+    readCompletions();
+    goto again;
+  }
+#endif
 #endif
-  } while (n < 0 && (errno == EINTR));
 
   if (n < 0)
     throw SystemException("write", errno);
 
+  advance(n);
+
   gettimeofday(&lastWrite, NULL);
 
   return n;
@@ -26,8 +26,13 @@
 
 #include <sys/time.h>
 
+#include <list>
+#include <set>
+
 #include <rdr/BufferedOutStream.h>
 
+namespace os { class Mutex; }
+
 namespace rdr {
 
   class FdOutStream : public BufferedOutStream {
@@ -43,13 +48,47 @@ namespace rdr {
 
     unsigned getIdleTime();
 
+    virtual void flush();
+
+    // enableZeroCopy() lets large kept vectors be sent with MSG_ZEROCOPY,
+    // if the socket supports it. The kernel then reports when it is done
+    // with them on the socket's error queue, which makes the socket look
+    // readable, so whoever reads the socket has to call readCompletions()
+    // when there turns out to be nothing to read. That may be another
+    // thread than the one writing.
+    bool enableZeroCopy();
+    void readCompletions();
+
   private:
     virtual bool flushBuffer(bool wait);
-    size_t writeWithTimeout(const void* data, size_t length, int timeoutms);
+    size_t writeWithTimeout(int timeoutms);
+
+    virtual void releaseBlock(std::vector<U8>& data);
+    void completed(U32 seq);
+
+  protected:
     int fd;
     bool blocking;
     int timeoutms;
     struct timeval lastWrite;
+
+  private:
+    // Guards everything below, which readCompletions() also changes
+    os::Mutex* zeroCopyMutex;
+
+    bool zeroCopy;
+
+    // Zero-copy sends are numbered by the kernel, and their memory has to
+    // stay untouched until it says it is done with them
+    struct Pinned {
+      U32 seq;
+      std::vector<U8> data;
+    };
+    std::list<Pinned> pinned;
+    bool frontPinned;
+    U32 frontSeq;
+    U32 nextSeq, doneSeq;
+    std::set<U32> doneEarly;
   };
 
 }
@@ -27,6 +27,7 @@
 #include <rdr/types.h>
 #include <rdr/InStream.h>
 #include <string.h> // for memcpy
+#include <vector>
 
 namespace rdr {
 
@@ -96,6 +97,15 @@ namespace rdr {
       }
     }
 
+    // writeOwned() writes all of data, but may keep the vector itself for
+    // sending rather than copying its contents. data is left empty.
+
+    virtual void writeOwned(std::vector<U8>& data) {
+      if (!data.empty())
+        writeBytes(&data[0], data.size());
+      data.clear();
+    }
+
     // copyBytes() efficiently transfers data between streams
 
     void copyBytes(InStream* is, size_t length) {
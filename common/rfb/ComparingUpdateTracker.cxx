@@ -20,13 +20,17 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <vector>
 #include <zlib.h>
 #include <rdr/types.h>
 #include <rfb/Exception.h>
 #include <rfb/LogWriter.h>
+#include <rfb/Metrics.h>
 #include <rfb/ServerCore.h>
 #include <rfb/ComparingUpdateTracker.h>
+#include <rfb/TaskPool.h>
+#include <rfb/util.h>
 
 #include <rfb/adler32.h>
 #include <rfb/xxhash.h>
@@ -62,6 +66,7 @@ static uint32_t pow2shift(const uint32_t in) {
 #define SCROLLBLOCK_SIZE 64
 #define NUM_TOTALS (1024 * 256)
 #define MAX_CHECKS 8
+#define MAX_OFFSETS 4
 
 class scrollHasher_t {
 protected:
@@ -87,22 +92,52 @@ protected:
 		uint32_t hash, idx;
 	};
 
+	struct offset_t {
+		int_fast16_t x, y;
+	};
+
 	uint_fast32_t w, h, d, lineBytes, blockBytes;
 	hashdata_t *hashtable;
 	uint_fast32_t hashw, hashAnd, hashShift;
-	mutable int_fast16_t lastOffX, lastOffY;
+	// The offsets of recent good matches, most recent first. Panes that
+	// scroll by different amounts in the same frame each get their own.
+	mutable offset_t offsets[MAX_OFFSETS];
+	mutable uint_fast32_t numOffsets;
 
 	const uint8_t *olddata;
 	uint32_t *totals, *starts, *idxtable, *curs;
 public:
 	scrollHasher_t(): w(0), h(0), d(0), lineBytes(0), blockBytes(0), hashtable(NULL),
 				hashw(0), hashAnd(0), hashShift(0),
-				lastOffX(0), lastOffY(0),
+				numOffsets(0),
 				olddata(NULL), totals(NULL), starts(NULL), idxtable(NULL) {
 
 		assert(sizeof(hashdata_t) == sizeof(uint32_t));
 	}
 
+	void rememberOffset(const int_fast16_t x, const int_fast16_t y) const {
+
+		uint_fast32_t i;
+
+		for (i = 0; i < numOffsets; i++) {
+			if (offsets[i].x == x && offsets[i].y == y)
+				break;
+		}
+
+		// Drop the oldest one if it is new and there is no room
+		if (i == numOffsets) {
+			if (numOffsets < MAX_OFFSETS)
+				numOffsets++;
+			i = numOffsets - 1;
+		}
+
+		for (; i > 0; i--)
+			offsets[i] = offsets[i - 1];
+
+		offsets[0].x = x;
+		offsets[0].y = y;
+	}
+
 	virtual ~scrollHasher_t() {
 		free(totals);
 		free(starts);
@@ -112,8 +147,52 @@ public:
 		free((void *) olddata);
 	}
 
-	virtual void calcHashes(const uint8_t *ptr,
-			const uint32_t w_, const uint32_t h_, const uint32_t d_) = 0;
+	// Hashes all of ptr, a copy of the old framebuffer
+	void calcHashes(const uint8_t *ptr,
+			const uint32_t w_, const uint32_t h_, const uint32_t d_) {
+
+		resize(w_, h_, d_);
+
+		// We need to make a copy, since the comparer incrementally updates its copy
+		memcpy((uint8_t *) olddata, ptr, w * h * d);
+
+		hashArea(0, 0, w, h);
+		buildIndex();
+
+		numOffsets = 0;
+	}
+
+	// Rehashes only the rects of ptr that changed since the last call,
+	// which must have been for a framebuffer of the same size
+	void updateHashes(const uint8_t *ptr, const std::vector<Rect> &rects) {
+
+		std::vector<Rect>::const_iterator r;
+
+		for (r = rects.begin(); r != rects.end(); r++) {
+			const uint_fast32_t offset = r->tl.y * lineBytes + r->tl.x * d;
+			const uint_fast32_t bytes = r->width() * d;
+
+			for (int_fast32_t y = 0; y < r->height(); y++)
+				memcpy((uint8_t *) olddata + offset + y * lineBytes,
+					ptr + offset + y * lineBytes, bytes);
+		}
+
+		for (r = rects.begin(); r != rects.end(); r++)
+			hashArea(r->tl.x, r->tl.y, r->br.x, r->br.y);
+
+		buildIndex();
+
+		numOffsets = 0;
+	}
+
+	virtual void resize(const uint32_t w_, const uint32_t h_, const uint32_t d_) = 0;
+
+	// Hashes every position whose block overlaps the area
+	virtual void hashArea(const uint_fast32_t x0, const uint_fast32_t y0,
+				const uint_fast32_t x1, const uint_fast32_t y1) = 0;
+
+	// Sorts all positions by hash, for the lookups
+	virtual void buildIndex() = 0;
 
 	virtual void invalidate(const uint_fast32_t x, uint_fast32_t y, uint_fast32_t h) = 0;
 
@@ -128,6 +207,14 @@ public:
 				uint_fast32_t *outx,
 				uint_fast32_t *outy,
 				uint_fast32_t *outlines) const = 0;
+
+	// Finds where a line of a block, from any position, was in the old
+	// framebuffer. Only a single match counts.
+	virtual bool findLine(const uint8_t * const ptr,
+				uint_fast32_t *outx,
+				uint_fast32_t *outy) const {
+		return false;
+	}
 };
 
 class scrollHasher_vert_t: public scrollHasher_t {
@@ -139,8 +226,7 @@ public:
 		curs = (uint32_t *) malloc(sizeof(uint32_t) * NUM_TOTALS);
 	}
 
-	void calcHashes(const uint8_t *ptr,
-			const uint32_t w_, const uint32_t h_, const uint32_t d_) {
+	void resize(const uint32_t w_, const uint32_t h_, const uint32_t d_) {
 
 		if (w != w_ || h != h_) {
 			// Reallocate
@@ -161,30 +247,43 @@ public:
 
 			olddata = (const uint8_t *) realloc((void *) olddata, w * h * d);
 		}
+	}
 
-		// We need to make a copy, since the comparer incrementally updates its copy
-		memcpy((uint8_t *) olddata, ptr, w * h * d);
+	void hashArea(const uint_fast32_t x0, const uint_fast32_t y0,
+			const uint_fast32_t x1, const uint_fast32_t y1) {
 
-		//memset(hashtable, 0, hashw * h * sizeof(uint32_t));
-		//memset(idxtable, 0, w * h * sizeof(uint32_t));
-		memset(totals, 0, NUM_TOTALS * sizeof(uint32_t));
-		//memset(starts, 0, NUM_TOTALS * sizeof(uint32_t));
-		//memset(curs, 0, NUM_TOTALS * sizeof(uint32_t));
+		// Only whole blocks are hashed
+		const uint_fast32_t firstCol = x0 / SCROLLBLOCK_SIZE;
+		uint_fast32_t lastCol = (x1 + SCROLLBLOCK_SIZE - 1) / SCROLLBLOCK_SIZE;
+		if (lastCol > w / SCROLLBLOCK_SIZE)
+			lastCol = w / SCROLLBLOCK_SIZE;
 
-		for (uint_fast32_t y = 0; y < h; y++) {
+		for (uint_fast32_t y = y0; y < y1; y++) {
 			const uint8_t *inptr0 = olddata;
-			inptr0 += y * lineBytes;
-			for (uint_fast32_t x = 0; x < w; x += SCROLLBLOCK_SIZE) {
-				if (w - x < SCROLLBLOCK_SIZE)
-					break;
-
-				const uint_fast32_t idx = (y << hashShift) + x / SCROLLBLOCK_SIZE;
+			inptr0 += y * lineBytes + firstCol * blockBytes;
+			for (uint_fast32_t col = firstCol; col < lastCol; col++) {
+				const uint_fast32_t idx = (y << hashShift) + col;
 				hashtable[idx].hash = XXH64(inptr0, blockBytes, 0);
-				totals[hashtable[idx].hash % NUM_TOTALS]++;
 
 				inptr0 += blockBytes;
 			}
 		}
+	}
+
+	void buildIndex() {
+
+		const uint_fast32_t cols = w / SCROLLBLOCK_SIZE;
+
+		//memset(idxtable, 0, w * h * sizeof(uint32_t));
+		memset(totals, 0, NUM_TOTALS * sizeof(uint32_t));
+		//memset(starts, 0, NUM_TOTALS * sizeof(uint32_t));
+		//memset(curs, 0, NUM_TOTALS * sizeof(uint32_t));
+
+		for (uint_fast32_t y = 0; y < h; y++) {
+			const hashdata_t *src = &hashtable[y << hashShift];
+			for (uint_fast32_t col = 0; col < cols; col++)
+				totals[src[col].hash % NUM_TOTALS]++;
+		}
 
 		// calculate number of unique 21-bit hashes
 		/*uint_fast32_t uniqHashes = 0;
@@ -207,12 +306,8 @@ public:
 		const hashdata_t *src = hashtable;
 		for (uint_fast32_t y = 0; y < h; y++) {
 			uint_fast32_t ybase = (y << hashShift);
-			for (uint_fast32_t x = 0; x < w; x += SCROLLBLOCK_SIZE, ybase++) {
-
-				if (w - x < SCROLLBLOCK_SIZE)
-					break;
-
-				const uint_fast32_t val = src[x / SCROLLBLOCK_SIZE].hash;
+			for (uint_fast32_t col = 0; col < cols; col++, ybase++) {
+				const uint_fast32_t val = src[col].hash;
 				const uint_fast32_t smallIdx = val % NUM_TOTALS;
 
 				const uint_fast32_t newpos = curs[smallIdx]++;
@@ -222,8 +317,6 @@ public:
 			}
 			src += hashw;
 		}
-
-		lastOffX = lastOffY = 0;
 	}
 
 	void invalidate(const uint_fast32_t x, uint_fast32_t y, uint_fast32_t h) {
@@ -258,24 +351,25 @@ public:
 		//printf("target hash %lx, it has %u matches\n",
 		//	starthash, totals[smallIdx]);
 
-		// First, try the last good offset. If this was a scroll,
+		// First, try the recent good offsets. If this was a scroll,
 		// and we have a good offset, it should match almost everything
-		const uint_fast16_t tryX = inx + lastOffX;
-		const uint_fast16_t tryY = iny + lastOffY;
-		if ((lastOffX || lastOffY) &&
-			tryX < w - (SCROLLBLOCK_SIZE - 1) &&
-			tryY < h - maxLines) {
+		for (uint_fast32_t o = 0; o < numOffsets; o++) {
+			const uint_fast16_t tryX = inx + offsets[o].x;
+			const uint_fast16_t tryY = iny + offsets[o].y;
+			if (tryX >= w - (SCROLLBLOCK_SIZE - 1) ||
+				tryY >= h - maxLines)
+				continue;
 
 			//printf("Trying good offset %ld,%ld for in %lu,%lu, try %lu,%lu\n",
-			//	lastOffX, lastOffY, inx, iny, tryX, tryY);
+			//	offsets[o].x, offsets[o].y, inx, iny, tryX, tryY);
 
 			curidx = (tryY << hashShift) + tryX / SCROLLBLOCK_SIZE;
 			curhash = hashtable[curidx].hash;
 			if (curhash == starthash &&
 				memcmp(ptr, &olddata[tryY * lineBytes + tryX * d], blockBytes) == 0) {
 
-				matches[0].hash = curhash;
-				matches[0].idx = curidx;
+				matches[found].hash = curhash;
+				matches[found].idx = curidx;
 				found++;
 			} /*else printf("Nope, hashes %u %lx %lx, mem %u, maxlines %lu\n",
 				curhash == starthash, curhash, starthash,
@@ -348,10 +442,8 @@ public:
 
 		// Was it a good match? If so, store for later
 		if (*outx == inx && bestmatches >= maxLines / 2 &&
-			totals[smallIdx] < 4 && *outy != iny) {
-			lastOffX = 0;
-			lastOffY = *outy - iny;
-		}
+			totals[smallIdx] < 4 && *outy != iny)
+			rememberOffset(0, *outy - iny);
 	}
 
 	void findBlock(const uint8_t * const ptr,
@@ -413,6 +505,40 @@ public:
 		*outx = tmpx;
 		*outy = tmpy - lowest;
 	}
+
+	bool findLine(const uint8_t * const ptr,
+			uint_fast32_t *outx,
+			uint_fast32_t *outy) const {
+
+		const uint_fast32_t linehash = (uint32_t) XXH64(ptr, blockBytes, 0);
+		const uint_fast32_t smallIdx = linehash % NUM_TOTALS;
+		uint_fast32_t i, found = 0;
+
+		// Too common to tell where it came from
+		if (!totals[smallIdx] || totals[smallIdx] > MAX_CHECKS)
+			return false;
+
+		for (i = starts[smallIdx]; i < starts[smallIdx] + totals[smallIdx]; i++) {
+			const uint_fast32_t curidx = idxtable[i];
+
+			if (hashtable[curidx].hash != linehash)
+				continue;
+
+			const uint_fast32_t oldy = curidx >> hashShift;
+			const uint_fast32_t oldx = curidx & hashAnd;
+
+			if (memcmp(ptr, &olddata[oldy * lineBytes + oldx * blockBytes], blockBytes))
+				continue;
+
+			if (found++)
+				return false;
+
+			*outx = oldx * SCROLLBLOCK_SIZE;
+			*outy = oldy;
+		}
+
+		return found == 1;
+	}
 };
 
 #undef NUM_TOTALS
@@ -427,8 +553,7 @@ public:
 		curs = (uint32_t *) malloc(sizeof(uint32_t) * NUM_TOTALS);
 	}
 
-	void calcHashes(const uint8_t *ptr,
-			const uint32_t w_, const uint32_t h_, const uint32_t d_) {
+	void resize(const uint32_t w_, const uint32_t h_, const uint32_t d_) {
 
 		if (w != w_ || h != h_) {
 			// Reallocate
@@ -449,24 +574,27 @@ public:
 
 			olddata = (const uint8_t *) realloc((void *) olddata, w * h * d);
 		}
+	}
 
-		// We need to make a copy, since the comparer incrementally updates its copy
-		memcpy((uint8_t *) olddata, ptr, w * h * d);
+	void hashArea(const uint_fast32_t x0, const uint_fast32_t y0,
+			const uint_fast32_t x1, const uint_fast32_t y1) {
 
-		Adler32 rolling(blockBytes);
+		// Every block starting up to a block width left of the area
+		// covers some of it
+		const uint_fast32_t startx = x0 > (SCROLLBLOCK_SIZE - 1) ?
+					x0 - (SCROLLBLOCK_SIZE - 1) : 0;
+		uint_fast32_t endx = x1;
+		if (endx > w - (SCROLLBLOCK_SIZE - 1))
+			endx = w - (SCROLLBLOCK_SIZE - 1);
 
-		//memset(hashtable, 0, hashw * h * sizeof(uint32_t));
-		//memset(idxtable, 0, w * h * sizeof(uint32_t));
-		memset(totals, 0, NUM_TOTALS * sizeof(uint32_t));
-		//memset(starts, 0, NUM_TOTALS * sizeof(uint32_t));
-		//memset(curs, 0, NUM_TOTALS * sizeof(uint32_t));
+		Adler32 rolling(blockBytes);
 
 		const uint8_t *prevptr = NULL;
-		for (uint_fast32_t y = 0; y < h; y++) {
+		for (uint_fast32_t y = y0; y < y1; y++) {
 			const uint8_t *inptr0 = olddata;
-			inptr0 += y * lineBytes;
-			for (uint_fast32_t x = 0; x < w - (SCROLLBLOCK_SIZE - 1); x++) {
-				if (!x) {
+			inptr0 += y * lineBytes + startx * d;
+			for (uint_fast32_t x = startx; x < endx; x++) {
+				if (x == startx) {
 					rolling.reset();
 					uint_fast32_t g;
 					for (g = 0; g < SCROLLBLOCK_SIZE; g++) {
@@ -482,12 +610,27 @@ public:
 				}
 				const uint_fast32_t idx = (y << hashShift) + x;
 				hashtable[idx].hash = rolling.hash;
-				totals[rolling.hash % NUM_TOTALS]++;
 
 				prevptr = inptr0;
 				inptr0 += d;
 			}
 		}
+	}
+
+	void buildIndex() {
+
+		const uint_fast32_t positions = w - (SCROLLBLOCK_SIZE - 1);
+
+		//memset(idxtable, 0, w * h * sizeof(uint32_t));
+		memset(totals, 0, NUM_TOTALS * sizeof(uint32_t));
+		//memset(starts, 0, NUM_TOTALS * sizeof(uint32_t));
+		//memset(curs, 0, NUM_TOTALS * sizeof(uint32_t));
+
+		for (uint_fast32_t y = 0; y < h; y++) {
+			const hashdata_t *src = &hashtable[y << hashShift];
+			for (uint_fast32_t x = 0; x < positions; x++)
+				totals[src[x].hash % NUM_TOTALS]++;
+		}
 
 		// calculate number of unique 21-bit hashes
 		/*uint_fast32_t uniqHashes = 0;
@@ -510,7 +653,7 @@ public:
 		const hashdata_t *src = hashtable;
 		for (uint_fast32_t y = 0; y < h; y++) {
 			uint_fast32_t ybase = (y << hashShift);
-			for (uint_fast32_t x = 0; x < w - (SCROLLBLOCK_SIZE - 1); x++, ybase++) {
+			for (uint_fast32_t x = 0; x < positions; x++, ybase++) {
 				const uint_fast32_t val = src[x].hash;
 				const uint_fast32_t smallIdx = val % NUM_TOTALS;
 
@@ -521,8 +664,6 @@ public:
 			}
 			src += hashw;
 		}
-
-		lastOffX = lastOffY = 0;
 	}
 
 	void invalidate(const uint_fast32_t x, uint_fast32_t y, uint_fast32_t h) {
@@ -564,24 +705,25 @@ public:
 		//printf("target hash %lx, it has %u matches\n",
 		//	starthash, totals[smallIdx]);
 
-		// First, try the last good offset. If this was a scroll,
+		// First, try the recent good offsets. If this was a scroll,
 		// and we have a good offset, it should match almost everything
-		const uint_fast16_t tryX = inx + lastOffX;
-		const uint_fast16_t tryY = iny + lastOffY;
-		if ((lastOffX || lastOffY) &&
-			tryX < w - (SCROLLBLOCK_SIZE - 1) &&
-			tryY < h - maxLines) {
+		for (uint_fast32_t o = 0; o < numOffsets; o++) {
+			const uint_fast16_t tryX = inx + offsets[o].x;
+			const uint_fast16_t tryY = iny + offsets[o].y;
+			if (tryX >= w - (SCROLLBLOCK_SIZE - 1) ||
+				tryY >= h - maxLines)
+				continue;
 
 			//printf("Trying good offset %ld,%ld for in %lu,%lu, try %lu,%lu\n",
-			//	lastOffX, lastOffY, inx, iny, tryX, tryY);
+			//	offsets[o].x, offsets[o].y, inx, iny, tryX, tryY);
 
 			curidx = (tryY << hashShift) + tryX;
 			curhash = hashtable[curidx].hash;
 			if (curhash == starthash &&
 				memcmp(ptr, &olddata[tryY * lineBytes + tryX * d], blockBytes) == 0) {
 
-				matches[0].hash = curhash;
-				matches[0].idx = curidx;
+				matches[found].hash = curhash;
+				matches[found].idx = curidx;
 				found++;
 			} /*else printf("Nope, hashes %u %lx %lx, mem %u, maxlines %lu\n",
 				curhash == starthash, curhash, starthash,
@@ -654,10 +796,8 @@ public:
 
 		// Was it a good match? If so, store for later
 		if (bestmatches >= maxLines / 2 &&
-			totals[smallIdx] < 4) {
-			lastOffX = *outx - inx;
-			lastOffY = *outy - iny;
-		}
+			totals[smallIdx] < 4 && (*outx != inx || *outy != iny))
+			rememberOffset(*outx - inx, *outy - iny);
 	}
 
 	void findBlock(const uint8_t * const ptr,
@@ -672,10 +812,15 @@ public:
 
 ComparingUpdateTracker::ComparingUpdateTracker(PixelBuffer* buffer)
   : fb(buffer), oldFb(fb->getPF(), 0, 0), firstCompare(true),
-    enabled(true), detectScroll(false), totalPixels(0), missedPixels(0),
-    scrollHasher(NULL)
+    enabled(true), detectScroll(false), hashOnly(Server::compareHashes),
+    hashWidth(0), hashHeight(0), totalPixels(0), missedPixels(0),
+    scrollHasher(NULL), scrollHashesValid(false)
 {
     changed.assign_union(fb->getRect());
+    // No scroll detection without the old pixels
+    if (hashOnly)
+      return;
+
     if (Server::detectHorizontal)
       scrollHasher = new scrollHasher_bothDir_t;
     else
@@ -700,6 +845,13 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
   if (!enabled)
     return false;
 
+  if (firstCompare && hashOnly) {
+    initHashes();
+    firstCompare = false;
+
+    return false;
+  }
+
   if (firstCompare) {
     // NB: We leave the change region untouched on this iteration,
     // since in effect the entire framebuffer has changed.
@@ -713,13 +865,21 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
     }
 
     firstCompare = false;
+    scrollHashesValid = false;
 
     return false;
   }
 
+  if (scrollHasher)
+    scrollDirty.assign_union(copied);
+
   copied.get_rects(&rects, copy_delta.x<=0, copy_delta.y<=0);
-  for (i = rects.begin(); i != rects.end(); i++)
-    oldFb.copyRect(*i, copy_delta);
+  for (i = rects.begin(); i != rects.end(); i++) {
+    if (hashOnly)
+      invalidateHashes(*i);
+    else
+      oldFb.copyRect(*i, copy_delta);
+  }
 
   changed.get_rects(&rects);
 
@@ -731,31 +891,55 @@ bool ComparingUpdateTracker::compare(bool skipScrollDetection, const Region &ski
       atLeast64 = true;
     changedArea += i->area();
   }
-  if (atLeast64 && Server::detectScrolling && !skipScrollDetection &&
+  if (atLeast64 && !hashOnly && Server::detectScrolling && !skipScrollDetection &&
       (changedArea * 100) / (fb->width() * fb->height()) > (unsigned) Server::scrollDetectLimit) {
     detectScroll = true;
     Rect pos(0, 0, oldFb.width(), oldFb.height());
     int unused;
-    scrollHasher->calcHashes(oldFb.getBuffer(pos, &unused), oldFb.width(), oldFb.height(),
-    				oldFb.getPF().bpp / 8);
+    if (!scrollHashesValid) {
+      scrollHasher->calcHashes(oldFb.getBuffer(pos, &unused), oldFb.width(), oldFb.height(),
+      				oldFb.getPF().bpp / 8);
+      scrollHashesValid = true;
+    } else {
+      // Only rehash what changed since the last time
+      std::vector<Rect> dirty;
+      scrollDirty.intersect(pos).get_rects(&dirty);
+      scrollHasher->updateHashes(oldFb.getBuffer(pos, &unused), dirty);
+    }
+    scrollDirty.clear();
     // Invalidating lossy areas is not needed, the lossy region tracking tracks copies too
   }
 
   copyPassRects.clear();
+  movedBlocks.clear();
+
+  // The horizontal hasher finds 2D offsets by itself
+  if (detectScroll && Server::detectMotion && !Server::detectHorizontal)
+    findMotion(rects, skipCursorArea);
 
   Region newChanged;
-  for (i = rects.begin(); i != rects.end(); i++)
-    compareRect(*i, &newChanged, skipCursorArea);
+  if (hashOnly)
+    compareHashes(rects, &newChanged, skipCursorArea);
+  else
+    compareRects(rects, &newChanged, skipCursorArea);
+
+  // Anything compared may have been copied to oldFb, or had its scroll
+  // hashes invalidated
+  if (scrollHasher)
+    scrollDirty.assign_union(changed);
 
+  unsigned changedarea = 0;
   changed.get_rects(&rects);
   for (i = rects.begin(); i != rects.end(); i++)
-    totalPixels += i->area();
+    changedarea += i->area();
+  totalPixels += changedarea;
   newChanged.get_rects(&rects);
   unsigned newchangedarea = 0;
   for (i = rects.begin(); i != rects.end(); i++) {
     missedPixels += i->area();
     newchangedarea += i->area();
   }
+  Metrics::compared(changedarea, newchangedarea);
 
   changedPerc = newchangedarea * 100 / fb->area();
 
@@ -780,6 +964,62 @@ void ComparingUpdateTracker::disable()
   firstCompare = true;
 }
 
+// How far back a finished copy rect is matched against earlier ones with
+// the same offset. Each pane scrolling on its own in the same band of
+// the screen adds one rect per block row in between.
+#define MERGE_LOOKBACK 16
+
+// Tries to merge the last copy rect into one right above it, or with
+// -DetectMotion also below it, with the same offset and width. The copies
+// are done in order and a rect's source may only be overwritten after it
+// was read, so no rect in between may read from where the last one
+// writes to.
+static void mergeLast(std::vector<CopyPassRect> &copyPassRects) {
+
+  if (copyPassRects.size() < 2)
+    return;
+
+  const CopyPassRect &cur = copyPassRects.back();
+  const size_t last = copyPassRects.size() - 1;
+  const size_t first = last > MERGE_LOOKBACK ? last - MERGE_LOOKBACK : 0;
+
+  for (size_t i = last; i-- > first;) {
+    CopyPassRect &prev = copyPassRects[i];
+
+    if (prev.rect.tl.x != cur.rect.tl.x ||
+        prev.rect.br.x != cur.rect.br.x ||
+        prev.src_x != cur.src_x)
+      continue;
+
+    const bool above = prev.rect.br.y == cur.rect.tl.y &&
+                       prev.src_y + prev.rect.height() == cur.src_y;
+    // Only motion sends copies bottom up
+    const bool below = Server::detectMotion &&
+                       cur.rect.br.y == prev.rect.tl.y &&
+                       cur.src_y + cur.rect.height() == prev.src_y;
+
+    if (above || below) {
+      for (size_t j = i + 1; j < last; j++) {
+        const CopyPassRect &mid = copyPassRects[j];
+        const Rect src(mid.src_x, mid.src_y,
+                       mid.src_x + mid.rect.width(),
+                       mid.src_y + mid.rect.height());
+        if (cur.rect.overlaps(src))
+          return;
+      }
+
+      if (above) {
+        prev.rect.br.y = cur.rect.br.y;
+      } else {
+        prev.rect.tl.y = cur.rect.tl.y;
+        prev.src_y = cur.src_y;
+      }
+      copyPassRects.pop_back();
+      return;
+    }
+  }
+}
+
 static void tryMerge(std::vector<CopyPassRect> &copyPassRects,
                      const int y, const int blockLeft,
                      const int blockRight, const uint_fast32_t outlines,
@@ -797,22 +1037,9 @@ static void tryMerge(std::vector<CopyPassRect> &copyPassRects,
 
     //merged++;
   } else {
-    // Before adding this new rect as a non-mergeable one, try to vertically merge the
-    // previous two
-    if (copyPassRects.size() > 1) {
-      CopyPassRect &prev = *(copyPassRects.end() - 2);
-      const CopyPassRect &cur = copyPassRects.back();
-
-      if (prev.rect.br.y == cur.rect.tl.y &&
-          prev.rect.tl.x == cur.rect.tl.x &&
-          prev.rect.br.x == cur.rect.br.x &&
-          prev.src_x == cur.src_x &&
-          prev.src_y + prev.rect.height() == cur.src_y) {
-
-        prev.rect.br.y += cur.rect.height();
-        copyPassRects.pop_back();
-      }
-    }
+    // Before adding this new rect as a non-mergeable one, the previous
+    // one is finished and may be merged vertically
+    mergeLast(copyPassRects);
 
     const CopyPassRect cp = {Rect(blockLeft, y, blockRight, y + outlines),
                             (unsigned) outx, (unsigned) outy};
@@ -820,46 +1047,134 @@ static void tryMerge(std::vector<CopyPassRect> &copyPassRects,
  }
 }
 
-void ComparingUpdateTracker::compareRect(const Rect& inr, Region* newChanged,
-                                         const Region &skipCursorArea)
+// The comparison is split into strips of one block row each, which are
+// compared in parallel. A strip covers all rects of one band of the
+// region, so no two strips touch the same pixels. Changed blocks that
+// need a scroll search are only noted there, and searched for in strip
+// order afterwards, as the scroll hasher carries state from one match to
+// the next.
+
+struct ComparingUpdateTracker::ScrollBlock {
+  Rect rect;
+  int firstChanged;
+};
+
+struct ComparingUpdateTracker::Strip {
+  std::vector<Rect>::const_iterator first, last;
+  int blockTop;
+
+  Region changed;
+  std::vector<ScrollBlock> scrollBlocks;
+};
+
+struct ComparingUpdateTracker::StripJob {
+  ComparingUpdateTracker *tracker;
+  std::vector<Strip> *strips;
+  const Region *skipCursorArea;
+};
+
+void ComparingUpdateTracker::prepareRects(const std::vector<Rect>& in,
+                                          std::vector<Rect>* out) const
 {
-    Rect r = inr;
+  std::vector<Rect>::const_iterator i;
+
+  out->reserve(in.size());
+  for (i = in.begin(); i != in.end(); i++) {
+    Rect r = *i;
     if (detectScroll && !Server::detectHorizontal)
       r.tl.x &= ~(BLOCK_SIZE - 1);
 
-  if (!r.enclosed_by(fb->getRect())) {
-    Rect safe;
-    // Crop the rect and try again
-    safe = r.intersect(fb->getRect());
-    if (!safe.is_empty())
-      compareRect(safe, newChanged, skipCursorArea);
-    return;
+    r = r.intersect(fb->getRect());
+    if (!r.is_empty())
+      out->push_back(r);
+  }
+}
+
+void ComparingUpdateTracker::compareRects(const std::vector<Rect>& inrects,
+                                          Region* newChanged,
+                                          const Region &skipCursorArea)
+{
+  std::vector<Rect> rects;
+  std::vector<Rect>::const_iterator i, band;
+  std::vector<Strip> strips;
+  std::vector<Strip>::iterator strip;
+  std::vector<ScrollBlock>::const_iterator sb;
+  std::vector<Rect> changedBlocks;
+
+  prepareRects(inrects, &rects);
+
+  // Rects come in bands of the same height, left to right
+  for (band = rects.begin(); band != rects.end(); band = i) {
+    for (i = band; i != rects.end(); i++) {
+      if (i->tl.y != band->tl.y || i->br.y != band->br.y)
+        break;
+    }
+
+    for (int blockTop = band->tl.y; blockTop < band->br.y; blockTop += BLOCK_SIZE) {
+      Strip s;
+      s.first = band;
+      s.last = i;
+      s.blockTop = blockTop;
+      strips.push_back(s);
+    }
+  }
+
+  struct StripJob job;
+  job.tracker = this;
+  job.strips = &strips;
+  job.skipCursorArea = &skipCursorArea;
+
+  TaskPool::get()->parallelFor(strips.size(), compareStripTask, &job);
+
+  for (strip = strips.begin(); strip != strips.end(); strip++) {
+    newChanged->assign_union(strip->changed);
+
+    for (sb = strip->scrollBlocks.begin(); sb != strip->scrollBlocks.end(); sb++)
+      findScroll(*sb, &changedBlocks);
   }
 
-  int bytesPerPixel = fb->getPF().bpp/8;
-  int oldStride;
-  rdr::U8* oldData = oldFb.getBufferRW(r, &oldStride);
-  int oldStrideBytes = oldStride * bytesPerPixel;
+  mergeLast(copyPassRects);
 
+  if (!changedBlocks.empty()) {
+    Region temp;
+    temp.setOrderedRects(changedBlocks);
+    newChanged->assign_union(temp);
+  }
+}
+
+void ComparingUpdateTracker::compareStripTask(unsigned index, void *data)
+{
+  const struct StripJob * const job = (const struct StripJob *) data;
+
+  job->tracker->compareStrip(&(*job->strips)[index], *job->skipCursorArea);
+}
+
+void ComparingUpdateTracker::compareStrip(Strip *strip,
+                                          const Region &skipCursorArea)
+{
+  std::vector<Rect>::const_iterator r;
   std::vector<Rect> changedBlocks;
 
-  for (int blockTop = r.tl.y; blockTop < r.br.y; blockTop += BLOCK_SIZE)
-  {
-    // Get a strip of the source buffer
-    Rect pos(r.tl.x, blockTop, r.br.x, __rfbmin(r.br.y, blockTop+BLOCK_SIZE));
-    int fbStride;
-    const rdr::U8* newBlockPtr = fb->getBuffer(pos, &fbStride);
-    int newStrideBytes = fbStride * bytesPerPixel;
+  const int bytesPerPixel = fb->getPF().bpp/8;
+  const int blockTop = strip->blockTop;
 
-    rdr::U8* oldBlockPtr = oldData;
-    int blockBottom = __rfbmin(blockTop+BLOCK_SIZE, r.br.y);
+  for (r = strip->first; r != strip->last; r++) {
+    const int blockBottom = __rfbmin(blockTop+BLOCK_SIZE, r->br.y);
 
-    for (int blockLeft = r.tl.x; blockLeft < r.br.x; blockLeft += BLOCK_SIZE)
+    // Get a strip of both buffers
+    Rect pos(r->tl.x, blockTop, r->br.x, blockBottom);
+    int oldStride, fbStride;
+    rdr::U8* oldBlockPtr = oldFb.getBufferRW(pos, &oldStride);
+    const rdr::U8* newBlockPtr = fb->getBuffer(pos, &fbStride);
+    const int oldStrideBytes = oldStride * bytesPerPixel;
+    const int newStrideBytes = fbStride * bytesPerPixel;
+
+    for (int blockLeft = r->tl.x; blockLeft < r->br.x; blockLeft += BLOCK_SIZE)
     {
       const rdr::U8* newPtr = newBlockPtr;
       rdr::U8* oldPtr = oldBlockPtr;
 
-      int blockRight = __rfbmin(blockLeft+BLOCK_SIZE, r.br.x);
+      int blockRight = __rfbmin(blockLeft+BLOCK_SIZE, r->br.x);
       int blockWidthInBytes = (blockRight-blockLeft) * bytesPerPixel;
       bool changed = false;
       int y;
@@ -870,14 +1185,12 @@ void ComparingUpdateTracker::compareRect(const Rect& inr, Region* newChanged,
         {
           // A block has changed - copy the remainder to the oldFb
           changed = true;
-          const rdr::U8* savedPtr = newPtr;
           for (int y2 = y; y2 < blockBottom; y2++)
           {
             memcpy(oldPtr, newPtr, blockWidthInBytes);
             newPtr += newStrideBytes;
             oldPtr += oldStrideBytes;
           }
-          newPtr = savedPtr;
           break;
         }
 
@@ -885,85 +1198,456 @@ void ComparingUpdateTracker::compareRect(const Rect& inr, Region* newChanged,
         oldPtr += oldStrideBytes;
       }
 
-      if (!changed || (changed && !detectScroll) ||
+      const Rect block(blockLeft, blockTop, blockRight, blockBottom);
+
+      if (changed && !movedBlocks.empty() &&
+          movedBlocks.count(std::make_pair(blockLeft, blockTop))) {
+        // Sent as a copy already
+      } else if (!changed || (changed && !detectScroll) ||
           (skipCursorArea.numRects() &&
-           !skipCursorArea.intersect(Rect(blockLeft, blockTop, blockRight, blockBottom)).is_empty())) {
+           !skipCursorArea.intersect(block).is_empty())) {
         if (changed || skipCursorArea.numRects())
-          changedBlocks.push_back(Rect(blockLeft, blockTop,
-                                       blockRight, blockBottom));
+          changedBlocks.push_back(block);
+      } else if (blockRight - blockLeft < SCROLLBLOCK_SIZE) {
+        // Block too small, put it out outright as changed
+        changedBlocks.push_back(block);
+      } else {
+        const ScrollBlock sb = { block, y };
+        strip->scrollBlocks.push_back(sb);
+      }
+
+      oldBlockPtr += blockWidthInBytes;
+      newBlockPtr += blockWidthInBytes;
+    }
+
+    oldFb.commitBufferRW(pos);
+  }
+
+  if (!changedBlocks.empty())
+    strip->changed.setOrderedRects(changedBlocks);
+}
+
+void ComparingUpdateTracker::findScroll(const ScrollBlock &sb,
+                                        std::vector<Rect> *changedBlocks)
+{
+  const int bytesPerPixel = fb->getPF().bpp/8;
+  const int blockLeft = sb.rect.tl.x, blockRight = sb.rect.br.x;
+  const int blockTop = sb.rect.tl.y, blockBottom = sb.rect.br.y;
+  int fbStride, y;
+
+  const rdr::U8* newBlockPtr = fb->getBuffer(sb.rect, &fbStride);
+  const int newStrideBytes = fbStride * bytesPerPixel;
+
+  y = sb.firstChanged;
+  const rdr::U8* newPtr = newBlockPtr + (y - blockTop) * newStrideBytes;
+
+  uint_fast32_t outx, outy, outlines;
+
+  // First, try to find a full block
+  outlines = 0;
+  if (blockBottom - blockTop == SCROLLBLOCK_SIZE)
+    scrollHasher->findBlock(newBlockPtr, blockLeft, blockTop, &outx, &outy,
+                           &outlines);
+
+  if (outlines == SCROLLBLOCK_SIZE) {
+    // Perfect match!
+    // success += outlines;
+    tryMerge(copyPassRects, blockTop, blockLeft, blockRight, outlines, outx, outy);
+
+    scrollHasher->invalidate(blockLeft, blockTop, outlines);
+    return;
+  }
+
+  for (; y < blockBottom; y += outlines)
+  {
+    // We have the first changed line. Find the best match, if any
+    scrollHasher->findBestMatch(newPtr, blockBottom - y, blockLeft, y,
+                                &outx, &outy, &outlines);
+
+    if (!outlines) {
+      // Heuristic, if a line did not match, probably
+      // the next few won't either
+      changedBlocks->push_back(Rect(blockLeft, y,
+                                    blockRight, __rfbmin(y + 4, blockBottom)));
+      y += 4;
+      newPtr += newStrideBytes * 4;
+      // unfound += 4;
+      continue;
+    }
+    // success += outlines;
+
+    // Try to merge it with the last rect
+    tryMerge(copyPassRects, y, blockLeft, blockRight, outlines, outx, outy);
+
+    scrollHasher->invalidate(blockLeft, y, outlines);
+
+    newPtr += newStrideBytes * outlines;
+  }
+}
 
-        oldBlockPtr += blockWidthInBytes;
-        newBlockPtr += blockWidthInBytes;
+// Windows dragged on a composited desktop, and other things that move in
+// 2D, only show up as damage. For each large changed rect, one line per
+// block row is looked up at every x among the aligned line hashes of the
+// scroll hasher, and every unique hit votes for an offset. The blocks
+// compareStrip() will look at are then checked against oldFb with the
+// strongest offsets, and those that match are sent as copies.
+
+#define MOTION_MIN_SIZE 128
+#define MOTION_SAMPLE_LINES 8
+#define MOTION_MIN_VOTES 8
+#define MAX_MOTIONS 2
+
+struct ComparingUpdateTracker::Motion {
+  int dx, dy;
+  unsigned votes;
+
+  // Most votes first
+  bool operator<(const Motion& other) const { return votes > other.votes; }
+};
+
+void ComparingUpdateTracker::findMotion(const std::vector<Rect>& inrects,
+                                        const Region &skipCursorArea)
+{
+  std::vector<Rect> rects;
+  std::vector<Rect>::const_iterator i;
+  std::vector<Motion> motions;
+  Region moved;
+
+  prepareRects(inrects, &rects);
+
+  for (i = rects.begin(); i != rects.end(); i++) {
+    if (i->width() >= MOTION_MIN_SIZE && i->height() >= MOTION_MIN_SIZE)
+      sampleMotion(*i, &motions);
+  }
+
+  std::sort(motions.begin(), motions.end());
+
+  for (size_t m = 0; m < motions.size() && m < MAX_MOTIONS; m++) {
+    if (motions[m].votes < MOTION_MIN_VOTES)
+      break;
+    verifyMotion(rects, motions[m], skipCursorArea, &moved);
+  }
+}
+
+void ComparingUpdateTracker::sampleMotion(const Rect& r,
+                                          std::vector<Motion>* motions) const
+{
+  const int bytesPerPixel = fb->getPF().bpp/8;
+  const int step = __rfbmax(BLOCK_SIZE, r.height() / MOTION_SAMPLE_LINES);
+  std::vector<Motion>::iterator m;
+
+  for (int y = r.tl.y + step / 2; y < r.br.y; y += step) {
+    int stride;
+    const rdr::U8* ptr = fb->getBuffer(Rect(r.tl.x, y, r.br.x, y + 1), &stride);
+
+    for (int x = r.tl.x; x + SCROLLBLOCK_SIZE <= r.br.x; x++, ptr += bytesPerPixel) {
+      uint_fast32_t oldx, oldy;
+
+      if (!scrollHasher->findLine(ptr, &oldx, &oldy))
         continue;
+
+      // Where it came from, relative to where it is now
+      const int dx = (int) oldx - x;
+      const int dy = (int) oldy - y;
+      if (!dx && !dy)
+        continue;
+
+      for (m = motions->begin(); m != motions->end(); m++) {
+        if (m->dx == dx && m->dy == dy)
+          break;
       }
 
-      uint_fast32_t outx, outy, outlines;
-      if (blockRight - blockLeft < SCROLLBLOCK_SIZE) {
-        // Block too small, put it out outright as changed
-        changedBlocks.push_back(Rect(blockLeft, blockTop,
-                                     blockRight, blockBottom));
+      if (m != motions->end()) {
+        m->votes++;
       } else {
-        // First, try to find a full block
-        outlines = 0;
-        if (blockBottom - blockTop == SCROLLBLOCK_SIZE)
-          scrollHasher->findBlock(newBlockPtr, blockLeft, blockTop, &outx, &outy,
-                                 &outlines);
+        const Motion motion = { dx, dy, 1 };
+        motions->push_back(motion);
+      }
+    }
+  }
+}
+
+// Copies are done in order, so the blocks of one motion are sent against
+// its direction like memmove() does, so that none is overwritten before
+// it is read
+struct MotionOrder {
+  MotionOrder(int dx_, int dy_) : dx(dx_), dy(dy_) {}
+
+  bool operator()(const Rect& a, const Rect& b) const {
+    if (a.tl.y != b.tl.y)
+      return dy > 0 ? a.tl.y < b.tl.y : a.tl.y > b.tl.y;
+    return dx > 0 ? a.tl.x < b.tl.x : a.tl.x > b.tl.x;
+  }
+
+  int dx, dy;
+};
+
+void ComparingUpdateTracker::verifyMotion(const std::vector<Rect>& rects,
+                                          const Motion& m,
+                                          const Region &skipCursorArea,
+                                          Region* moved)
+{
+  std::vector<Rect>::const_iterator r, b;
+  std::vector<Rect> blocks;
 
-        if (outlines == SCROLLBLOCK_SIZE) {
-          // Perfect match!
-          // success += outlines;
-          tryMerge(copyPassRects, blockTop, blockLeft, blockRight, outlines, outx, outy);
+  const Point delta(m.dx, m.dy);
 
-          scrollHasher->invalidate(blockLeft, blockTop, outlines);
+  // The same blocks as compareStrip()
+  for (r = rects.begin(); r != rects.end(); r++) {
+    for (int blockTop = r->tl.y; blockTop < r->br.y; blockTop += BLOCK_SIZE) {
+      for (int blockLeft = r->tl.x; blockLeft < r->br.x; blockLeft += BLOCK_SIZE) {
+        const Rect block(blockLeft, blockTop,
+                         __rfbmin(blockLeft + BLOCK_SIZE, r->br.x),
+                         __rfbmin(blockTop + BLOCK_SIZE, r->br.y));
+        const Rect src = block.translate(delta);
 
-          oldBlockPtr += blockWidthInBytes;
-          newBlockPtr += blockWidthInBytes;
+        if (movedBlocks.count(std::make_pair(blockLeft, blockTop)))
+          continue;
+        if (skipCursorArea.numRects() &&
+            !skipCursorArea.intersect(block).is_empty())
+          continue;
+        if (!src.enclosed_by(fb->getRect()))
+          continue;
+        // Already overwritten by the copies of an earlier motion
+        if (!moved->intersect(src).is_empty())
           continue;
-        }
 
-        for (; y < blockBottom; y += outlines)
-        {
-          // We have the first changed line. Find the best match, if any
-          scrollHasher->findBestMatch(newPtr, blockBottom - y, blockLeft, y,
-                                      &outx, &outy, &outlines);
-
-          if (!outlines) {
-            // Heuristic, if a line did not match, probably
-            // the next few won't either
-            changedBlocks.push_back(Rect(blockLeft, y,
-                                         blockRight, __rfbmin(y + 4, blockBottom)));
-            y += 4;
-            newPtr += newStrideBytes * 4;
-            // unfound += 4;
-            continue;
-          }
-          // success += outlines;
+        if (blockMoved(block, m))
+          blocks.push_back(block);
+      }
+    }
+  }
+
+  if (blocks.empty())
+    return;
 
-          // Try to merge it with the last rect
-          tryMerge(copyPassRects, y, blockLeft, blockRight, outlines, outx, outy);
+  std::sort(blocks.begin(), blocks.end(), MotionOrder(m.dx, m.dy));
 
-          scrollHasher->invalidate(blockLeft, y, outlines);
+  const size_t first = copyPassRects.size();
 
-          newPtr += newStrideBytes * outlines;
+  for (b = blocks.begin(); b != blocks.end(); b++) {
+    movedBlocks.insert(std::make_pair(b->tl.x, b->tl.y));
+    moved->assign_union(*b);
+
+    // The client's old pixels here are gone once the copy is done
+    scrollHasher->invalidate(b->tl.x, b->tl.y, b->height());
+
+    if (copyPassRects.size() > first) {
+      CopyPassRect &prev = copyPassRects.back();
+
+      if (prev.rect.tl.y == b->tl.y && prev.rect.br.y == b->br.y) {
+        if (prev.rect.br.x == b->tl.x) {
+          prev.rect.br.x = b->br.x;
+          continue;
+        }
+        if (prev.rect.tl.x == b->br.x) {
+          prev.rect.tl.x = b->tl.x;
+          prev.src_x = b->tl.x + m.dx;
+          continue;
         }
       }
+    }
 
-      oldBlockPtr += blockWidthInBytes;
-      newBlockPtr += blockWidthInBytes;
+    mergeLast(copyPassRects);
+
+    const CopyPassRect cp = { *b, (unsigned) (b->tl.x + m.dx),
+                              (unsigned) (b->tl.y + m.dy) };
+    copyPassRects.push_back(cp);
+  }
+
+  mergeLast(copyPassRects);
+}
+
+bool ComparingUpdateTracker::blockMoved(const Rect& block, const Motion& m) const
+{
+  const int bytesPerPixel = fb->getPF().bpp/8;
+  const int lineBytes = block.width() * bytesPerPixel;
+  int newStride, oldStride;
+  bool changed = false;
+
+  const rdr::U8* newPtr = fb->getBuffer(block, &newStride);
+  const rdr::U8* oldPtr = oldFb.getBuffer(block, &oldStride);
+  const rdr::U8* srcPtr = oldFb.getBuffer(block.translate(Point(m.dx, m.dy)),
+                                          &oldStride);
+
+  for (int y = block.tl.y; y < block.br.y; y++) {
+    if (memcmp(newPtr, srcPtr, lineBytes))
+      return false;
+    if (!changed && memcmp(newPtr, oldPtr, lineBytes))
+      changed = true;
+
+    newPtr += newStride * bytesPerPixel;
+    oldPtr += oldStride * bytesPerPixel;
+    srcPtr += oldStride * bytesPerPixel;
+  }
+
+  // Nothing to send for a block that did not change
+  return changed;
+}
+
+// In hash-only mode there is no copy of the old framebuffer. Instead there
+// is a 64-bit hash of each block on a fixed BLOCK_SIZE grid, and a changed
+// rect only counts where the hash of the block under it has changed. A
+// hash of 0 means unknown and never matches, e.g. for blocks that were
+// copied to. On a collision the change is missed until the block changes
+// again; with XXH64 that is far less likely than a bit error on the wire.
+
+enum {
+  blockUntouched,
+  blockDamaged,
+  blockChanged,
+};
+
+struct ComparingUpdateTracker::HashJob {
+  ComparingUpdateTracker *tracker;
+  const std::vector<int> *rows;
+};
+
+void ComparingUpdateTracker::initHashes()
+{
+  std::vector<int> rows;
+  char a[1024], b[1024];
+
+  hashWidth = (fb->width() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  hashHeight = (fb->height() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  blockHashes.assign(hashWidth * hashHeight, 0);
+  blockState.assign(hashWidth * hashHeight, blockDamaged);
+
+  for (int row = 0; row < hashHeight; row++)
+    rows.push_back(row);
+  hashRows(rows);
+
+  iecPrefix(blockHashes.size() * sizeof(rdr::U64), "B", a, sizeof(a), 3);
+  iecPrefix((long long) fb->area() * (fb->getPF().bpp/8), "B", b, sizeof(b), 3);
+  vlog.info("Comparing by block hashes, using %s instead of %s for a copy of "
+            "the framebuffer", a, b);
+}
+
+void ComparingUpdateTracker::invalidateHashes(const Rect& inr)
+{
+  const Rect r = inr.intersect(fb->getRect());
+
+  if (r.is_empty() || blockHashes.empty())
+    return;
+
+  for (int row = r.tl.y / BLOCK_SIZE; row <= (r.br.y - 1) / BLOCK_SIZE; row++) {
+    for (int col = r.tl.x / BLOCK_SIZE; col <= (r.br.x - 1) / BLOCK_SIZE; col++)
+      blockHashes[row * hashWidth + col] = 0;
+  }
+}
+
+void ComparingUpdateTracker::compareHashes(const std::vector<Rect>& inrects,
+                                           Region* newChanged,
+                                           const Region &skipCursorArea)
+{
+  std::vector<Rect> rects;
+  std::vector<Rect>::const_iterator i;
+  std::vector<int> rows;
+  std::vector<bool> rowDamaged(hashHeight, false);
+  std::vector<Rect> changedBlocks;
+  int row, col;
+
+  blockState.assign(hashWidth * hashHeight, blockUntouched);
+
+  for (i = inrects.begin(); i != inrects.end(); i++) {
+    const Rect r = i->intersect(fb->getRect());
+    if (r.is_empty())
+      continue;
+
+    for (row = r.tl.y / BLOCK_SIZE; row <= (r.br.y - 1) / BLOCK_SIZE; row++) {
+      for (col = r.tl.x / BLOCK_SIZE; col <= (r.br.x - 1) / BLOCK_SIZE; col++)
+        blockState[row * hashWidth + col] = blockDamaged;
+      rowDamaged[row] = true;
     }
 
-    oldData += oldStrideBytes * BLOCK_SIZE;
+    rects.push_back(r);
   }
 
-  oldFb.commitBufferRW(r);
+  for (row = 0; row < hashHeight; row++) {
+    if (rowDamaged[row])
+      rows.push_back(row);
+  }
 
-  if (!changedBlocks.empty()) {
-    Region temp;
-    temp.setOrderedRects(changedBlocks);
-    newChanged->assign_union(temp);
+  hashRows(rows);
+
+  // Only the damaged part of a changed block is reported
+  for (i = rects.begin(); i != rects.end(); i++) {
+    changedBlocks.clear();
+
+    for (row = i->tl.y / BLOCK_SIZE; row <= (i->br.y - 1) / BLOCK_SIZE; row++) {
+      for (col = i->tl.x / BLOCK_SIZE; col <= (i->br.x - 1) / BLOCK_SIZE; col++) {
+        if (blockState[row * hashWidth + col] != blockChanged &&
+            !skipCursorArea.numRects())
+          continue;
+
+        const Rect block(col * BLOCK_SIZE, row * BLOCK_SIZE,
+                         (col + 1) * BLOCK_SIZE, (row + 1) * BLOCK_SIZE);
+        changedBlocks.push_back(block.intersect(*i));
+      }
+    }
+
+    if (!changedBlocks.empty()) {
+      Region temp;
+      temp.setOrderedRects(changedBlocks);
+      newChanged->assign_union(temp);
+    }
+  }
+}
+
+void ComparingUpdateTracker::hashRows(const std::vector<int>& rows)
+{
+  struct HashJob job;
+
+  job.tracker = this;
+  job.rows = &rows;
+
+  TaskPool::get()->parallelFor(rows.size(), hashRowTask, &job);
+}
+
+void ComparingUpdateTracker::hashRowTask(unsigned index, void *data)
+{
+  const struct HashJob * const job = (const struct HashJob *) data;
+  ComparingUpdateTracker * const self = job->tracker;
+  const int row = (*job->rows)[index];
+
+  for (int col = 0; col < self->hashWidth; col++) {
+    const int idx = row * self->hashWidth + col;
+
+    if (self->blockState[idx] == blockUntouched)
+      continue;
+
+    const rdr::U64 hash = self->hashBlock(col, row);
+    if (hash != self->blockHashes[idx]) {
+      self->blockHashes[idx] = hash;
+      self->blockState[idx] = blockChanged;
+    }
   }
 }
 
+rdr::U64 ComparingUpdateTracker::hashBlock(int col, int row) const
+{
+  const Rect block = Rect(col * BLOCK_SIZE, row * BLOCK_SIZE,
+                          (col + 1) * BLOCK_SIZE,
+                          (row + 1) * BLOCK_SIZE).intersect(fb->getRect());
+  const int lineBytes = block.width() * (fb->getPF().bpp/8);
+  int stride;
+  rdr::U64 hash;
+
+  const rdr::U8* ptr = fb->getBuffer(block, &stride);
+  const int strideBytes = stride * (fb->getPF().bpp/8);
+
+  // Each line is hashed with the hash so far as its seed
+  hash = 0;
+  for (int y = block.tl.y; y < block.br.y; y++) {
+    hash = XXH64(ptr, lineBytes, hash);
+    ptr += strideBytes;
+  }
+
+  // 0 is reserved for unknown blocks
+  return hash ? hash : 1;
+}
+
 void ComparingUpdateTracker::logStats()
 {
   double ratio;
@@ -19,6 +19,9 @@
 #ifndef __RFB_COMPARINGUPDATETRACKER_H__
 #define __RFB_COMPARINGUPDATETRACKER_H__
 
+#include <set>
+#include <utility>
+
 #include <rfb/UpdateTracker.h>
 
 class scrollHasher_t;
@@ -45,22 +48,66 @@ namespace rfb {
 
     void logStats();
 
+    // setFramebuffer() points the comparison at another copy of the same
+    // screen, e.g. a newer snapshot of it
+    void setFramebuffer(PixelBuffer* buffer) { fb = buffer; }
+
     virtual void getUpdateInfo(UpdateInfo* info, const Region& cliprgn);
     virtual void clear();
 
     rdr::U8 changedPerc;
 
   private:
-    void compareRect(const Rect& r, Region* newchanged, const Region &skipCursorArea);
+    struct ScrollBlock;
+    struct Strip;
+    struct StripJob;
+
+    void prepareRects(const std::vector<Rect>& in, std::vector<Rect>* out) const;
+    void compareRects(const std::vector<Rect>& rects, Region* newchanged,
+                      const Region &skipCursorArea);
+    static void compareStripTask(unsigned index, void *data);
+    void compareStrip(Strip *strip, const Region &skipCursorArea);
+    void findScroll(const ScrollBlock &sb, std::vector<Rect> *changedBlocks);
+
+    struct Motion;
+
+    void findMotion(const std::vector<Rect>& rects,
+                    const Region &skipCursorArea);
+    void sampleMotion(const Rect& r, std::vector<Motion>* motions) const;
+    void verifyMotion(const std::vector<Rect>& rects, const Motion& m,
+                      const Region &skipCursorArea, Region* moved);
+    bool blockMoved(const Rect& block, const Motion& m) const;
+
+    // Hash-only mode, keeps a hash per block instead of oldFb
+    struct HashJob;
+
+    void initHashes();
+    void invalidateHashes(const Rect& r);
+    void compareHashes(const std::vector<Rect>& rects, Region* newchanged,
+                       const Region &skipCursorArea);
+    void hashRows(const std::vector<int>& rows);
+    static void hashRowTask(unsigned index, void *data);
+    rdr::U64 hashBlock(int col, int row) const;
+
     PixelBuffer* fb;
     ManagedPixelBuffer oldFb;
     bool firstCompare;
     bool enabled;
     bool detectScroll;
 
+    bool hashOnly;
+    int hashWidth, hashHeight;
+    std::vector<rdr::U64> blockHashes;
+    std::vector<rdr::U8> blockState;
+
     rdr::U32 totalPixels, missedPixels;
     scrollHasher_t *scrollHasher;
+    // Where oldFb changed since the scroll hashes were last updated
+    Region scrollDirty;
+    bool scrollHashesValid;
     std::vector<CopyPassRect> copyPassRects;
+    // Blocks already sent as moved, by their top left corner
+    std::set<std::pair<int, int> > movedBlocks;
   };
 
 }
@@ -303,6 +303,11 @@ unsigned Congestion::getPingTime() const
   return safeBaseRTT;
 }
 
+unsigned Congestion::getCongestionWindow() const
+{
+  return congWindow;
+}
+
 void Congestion::debugTrace(const char* filename, int fd)
 {
 #ifdef CONGESTION_TRACE
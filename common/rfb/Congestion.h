@@ -53,6 +53,10 @@ namespace rfb {
 
     unsigned getPingTime() const;
 
+    // getCongestionWindow() returns how many bytes may currently be in
+    // flight.
+    unsigned getCongestionWindow() const;
+
     // debugTrace() writes the current congestion window, as well as the
     // congestion window of the underlying TCP layer, to the specified
     // file
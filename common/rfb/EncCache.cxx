@@ -18,55 +18,91 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
  * USA.
  */
+#include <os/Mutex.h>
 #include <rfb/EncCache.h>
+#include <rfb/ServerCore.h>
 
 using namespace rfb;
 
-EncCache::EncCache() {
-  enabled = false;
+EncCache::EncCache(): bytes(0), evictions(0) {
+  mutex = new os::Mutex();
 }
 
 EncCache::~EncCache() {
+  delete mutex;
+}
+
+bool EncCache::enabled() const {
+  return rfb::Server::encCacheSize > 0;
 }
 
 void EncCache::clear() {
-  std::map<EncId, const void *>::iterator it;
-  for (it = cache.begin(); it != cache.end(); it++)
-    free((void *) it->second);
+  os::AutoMutex a(mutex);
 
   cache.clear();
+  lru.clear();
+  bytes = 0;
+}
+
+void EncCache::evict(size_t limit) {
+  while (bytes > limit && !lru.empty()) {
+    const EncEntry &e = lru.back();
+
+    bytes -= e.data.size();
+    cache.erase(e.id);
+    lru.pop_back();
+    evictions++;
+  }
 }
 
-void EncCache::add(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-                   uint32_t len, const void *data) {
+void EncCache::add(uint64_t hash, uint8_t type, uint8_t quality,
+                   const std::vector<uint8_t> &data) {
+
+  const size_t limit = (size_t) rfb::Server::encCacheSize * 1024 * 1024;
+  if (data.size() > limit)
+    return;
 
   EncId id;
 
+  id.hash = hash;
   id.type = type;
-  id.x = x;
-  id.y = y;
-  id.w = w;
-  id.h = h;
-  id.len = len;
+  id.quality = quality;
 
-  cache[id] = data;
+  os::AutoMutex a(mutex);
+
+  // Another thread may have compressed the same content meanwhile
+  if (cache.find(id) != cache.end())
+    return;
+
+  evict(limit - data.size());
+
+  EncEntry e;
+  e.id = id;
+  lru.push_front(e);
+  lru.front().data = data;
+
+  cache[id] = lru.begin();
+  bytes += data.size();
 }
 
-const void *EncCache::get(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-                          uint32_t &len) const {
+bool EncCache::get(uint64_t hash, uint8_t type, uint8_t quality,
+                   std::vector<uint8_t> &data) {
 
   EncId id;
 
+  id.hash = hash;
   id.type = type;
-  id.x = x;
-  id.y = y;
-  id.w = w;
-  id.h = h;
+  id.quality = quality;
+
+  os::AutoMutex a(mutex);
 
-  std::map<EncId, const void *>::const_iterator it = cache.find(id);
+  std::map<EncId, std::list<EncEntry>::iterator>::iterator it = cache.find(id);
   if (it == cache.end())
-    return NULL;
+    return false;
+
+  // Move to the front, without copying the data
+  lru.splice(lru.begin(), lru, it->second);
 
-  len = it->first.len;
-  return it->second;
+  data = it->second->data;
+  return true;
 }
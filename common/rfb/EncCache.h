@@ -21,26 +21,36 @@
 #ifndef __RFB_ENCCACHE_H__
 #define __RFB_ENCCACHE_H__
 
+#include <list>
 #include <map>
+#include <vector>
 
 #include <rdr/types.h>
 
 #include <stdint.h>
 #include <stdlib.h>
 
+namespace os { class Mutex; }
+
 namespace rfb {
 
+  // Compressed rects are keyed by a hash of their pixels (which includes
+  // the pixel format and dimensions), the encoder and the quality they
+  // were compressed at. Position plays no part, so identical content
+  // reappearing anywhere on screen, in any later frame or for any client,
+  // can reuse the compressed bytes.
+
   struct EncId {
+    uint64_t hash;
     uint8_t type;
-    uint16_t x, y, w, h;
-    uint32_t len;
+    uint8_t quality;
 
     bool operator <(const EncId &other) const {
-      return type < other.type ||
-             x < other.x ||
-             y < other.y ||
-             w < other.w ||
-             h < other.h;
+      if (hash != other.hash)
+        return hash < other.hash;
+      if (type != other.type)
+        return type < other.type;
+      return quality < other.quality;
     }
   };
 
@@ -49,16 +59,33 @@ namespace rfb {
     EncCache();
     ~EncCache();
 
+    bool enabled() const;
+
     void clear();
-    void add(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-             uint32_t len, const void *data);
-    const void *get(uint8_t type, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-                    uint32_t &len) const;
+    void add(uint64_t hash, uint8_t type, uint8_t quality,
+             const std::vector<uint8_t> &data);
+    bool get(uint64_t hash, uint8_t type, uint8_t quality,
+             std::vector<uint8_t> &data);
 
-    bool enabled;
+    unsigned long long getEvictions() const { return evictions; }
+    size_t getBytes() const { return bytes; }
 
   protected:
-    std::map<EncId, const void *> cache;
+    void evict(size_t limit);
+
+    struct EncEntry {
+      EncId id;
+      std::vector<uint8_t> data;
+    };
+
+    // Most recently used first
+    std::list<EncEntry> lru;
+    std::map<EncId, std::list<EncEntry>::iterator> cache;
+
+    size_t bytes;
+    unsigned long long evictions;
+
+    os::Mutex *mutex;
   };
 }
 
@@ -19,21 +19,25 @@
  * USA.
  */
 
-#include <omp.h>
 #include <stdlib.h>
 
+#include <os/Mutex.h>
+
 #include <rfb/cpuid.h>
 #include <rfb/EncCache.h>
 #include <rfb/EncodeManager.h>
 #include <rfb/Encoder.h>
 #include <rfb/Palette.h>
+#include <rfb/pixelrun.h>
 #include <rfb/scale_sse2.h>
 #include <rfb/SConnection.h>
 #include <rfb/ServerCore.h>
 #include <rfb/SMsgWriter.h>
+#include <rfb/TaskPool.h>
 #include <rfb/UpdateTracker.h>
 #include <rfb/LogWriter.h>
 #include <rfb/Exception.h>
+#include <rfb/Metrics.h>
 
 #include <rfb/RawEncoder.h>
 #include <rfb/RREEncoder.h>
@@ -43,6 +47,9 @@
 #include <rfb/TightJPEGEncoder.h>
 #include <rfb/TightWEBPEncoder.h>
 
+#define XXH_STATIC_LINKING_ONLY
+#include <rfb/xxhash.h>
+
 using namespace rfb;
 
 static LogWriter vlog("EncodeManager");
@@ -95,6 +102,25 @@ struct QualityInfo {
   unsigned score;
 };
 
+// Everything the rect tasks of one writeRects() call share
+struct RectJob {
+  EncodeManager *manager;
+  const PixelBuffer *pb, *scaledpb;
+  const struct timeval *start;
+  const std::vector<Rect> *subrects, *scaledrects;
+  std::vector<uint8_t> *encoderTypes, *isWebp, *fromCache;
+  std::vector<Palette> *palettes;
+  std::vector<std::vector<uint8_t> > *compresseds;
+  std::vector<uint32_t> *ms;
+  std::vector<uint64_t> *hashes;
+
+  // Rects are written in the order they finish, by one thread at a time
+  os::Mutex *mutex;
+  std::vector<unsigned> finished;
+  unsigned nwritten;
+  bool writing;
+};
+
 };
 
 static const char *encoderClassName(EncoderClass klass)
@@ -143,6 +169,22 @@ static const char *encoderTypeName(EncoderType type)
   return "Unknown Encoder Type";
 }
 
+// The same as the per connection stats, added up over all of them
+struct EncoderTotals {
+  volatile uint64_t rects, pixels, bytes;
+};
+
+static EncoderTotals totals[encoderClassMax][encoderTypeMax], copyTotals;
+static volatile uint64_t totalCacheHits, totalCacheMisses;
+
+static void addTotals(EncoderTotals *t, unsigned rects,
+                      unsigned long long pixels, unsigned long long bytes)
+{
+  __sync_add_and_fetch(&t->rects, rects);
+  __sync_add_and_fetch(&t->pixels, pixels);
+  __sync_add_and_fetch(&t->bytes, bytes);
+}
+
 static void updateMaxVideoRes(uint16_t *x, uint16_t *y) {
   sscanf(Server::maxVideoResolution, "%hux%hu", x, y);
   *x &= ~1;
@@ -159,7 +201,7 @@ EncodeManager::EncodeManager(SConnection* conn_, EncCache *encCache_) : conn(con
   dynamicQualityMin(-1), dynamicQualityOff(-1),
   areaCur(0), videoDetected(false), videoTimer(this),
   maxEncodingTime(0), framesSinceEncPrint(0),
-  encCache(encCache_)
+  encCache(encCache_), cacheHits(0), cacheMisses(0)
 {
   StatsVector::iterator iter;
 
@@ -287,6 +329,23 @@ void EncodeManager::logStats()
     }
   }
 
+  if (cacheHits || cacheMisses) {
+    vlog.info("  %s:", "EncCache");
+
+    siPrefix(cacheHits, "hits", a, sizeof(a));
+    siPrefix(cacheMisses, "misses", b, sizeof(b));
+    vlog.info("    %s, %s", a, b);
+    siPrefix(encCache->getEvictions(), "evictions", a, sizeof(a));
+    iecPrefix(encCache->getBytes(), "B", b, sizeof(b));
+    vlog.info("    %s, %s cached (shared)", a, b);
+  }
+
+  TaskPool *pool = TaskPool::get();
+  vlog.info("  %s: %u threads", "TaskPool", pool->getThreadCount());
+  siPrefix(pool->getTaskCount(), "tasks", a, sizeof(a));
+  siPrefix(pool->getStealCount(), "steals", b, sizeof(b));
+  vlog.info("    %s, %s (shared), %u queued", a, b, pool->getQueueDepth());
+
   ratio = (double)equivalent / bytes;
 
   siPrefix(rects, "rects", a, sizeof(a));
@@ -296,6 +355,47 @@ void EncodeManager::logStats()
   vlog.info("         %s (1:%g ratio)", a, ratio);
 }
 
+void EncodeManager::writeMetrics(FILE *f)
+{
+  size_t i, j;
+
+  #define encoder_counter(metric, help, field) \
+    fprintf(f, "# HELP " metric " " help "\n"); \
+    fprintf(f, "# TYPE " metric " counter\n"); \
+    if (copyTotals.rects) \
+      fprintf(f, metric "{encoder=\"CopyRect\",type=\"Copies\"} %llu\n", \
+              (unsigned long long) copyTotals.field); \
+    for (i = 0; i < encoderClassMax; i++) { \
+      for (j = 0; j < encoderTypeMax; j++) { \
+        if (!totals[i][j].rects) \
+          continue; \
+        fprintf(f, metric "{encoder=\"%s\",type=\"%s\"} %llu\n", \
+                encoderClassName((EncoderClass)i), \
+                encoderTypeName((EncoderType)j), \
+                (unsigned long long) totals[i][j].field); \
+      } \
+    }
+
+  // Only the combinations that were used
+  encoder_counter("kasmvnc_encoder_rects_total", "Rects sent", rects);
+  encoder_counter("kasmvnc_encoder_pixels_total", "Pixels sent", pixels);
+  encoder_counter("kasmvnc_encoder_bytes_total", "Bytes sent, encoded", bytes);
+
+  #undef encoder_counter
+
+  fprintf(f, "# HELP kasmvnc_encoder_cache_hits_total Rects whose encoding "
+             "was found in the shared cache\n");
+  fprintf(f, "# TYPE kasmvnc_encoder_cache_hits_total counter\n");
+  fprintf(f, "kasmvnc_encoder_cache_hits_total %llu\n",
+          (unsigned long long) totalCacheHits);
+
+  fprintf(f, "# HELP kasmvnc_encoder_cache_misses_total Cacheable rects "
+             "that had to be encoded\n");
+  fprintf(f, "# TYPE kasmvnc_encoder_cache_misses_total counter\n");
+  fprintf(f, "kasmvnc_encoder_cache_misses_total %llu\n",
+          (unsigned long long) totalCacheMisses);
+}
+
 bool EncodeManager::supported(int encoding)
 {
   switch (encoding) {
@@ -389,10 +489,21 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
     if (conn->cp.supportsLastRect)
       nRects = 0xFFFF;
     else {
+      std::vector<Rect> rects;
+
+      // The count goes out first, and video mode sends the whole screen
+      // instead of what changed, so it has to be decided before counting
+      changed.get_rects(&rects);
+      updateVideoStats(rects, pb);
+
       nRects = copied.numRects();
       nRects += copypassed.size();
-      nRects += computeNumRects(changed);
-      nRects += computeNumRects(cursorRegion);
+      if (videoDetected)
+        nRects += computeNumRects(pb->getRect());
+      else {
+        nRects += computeNumRects(changed);
+        nRects += computeNumRects(cursorRegion);
+      }
     }
 
     conn->writer()->writeFramebufferUpdateStart(nRects);
@@ -408,7 +519,7 @@ void EncodeManager::doUpdate(bool allowLossy, const Region& changed_,
       writeSolidRects(&changed, pb);
 
     writeRects(changed, pb,
-               &start, true);
+               &start, conn->cp.supportsLastRect);
     if (!videoDetected) // In case detection happened between the calls
       writeRects(cursorRegion, renderedCursor);
 
@@ -611,21 +722,26 @@ int EncodeManager::computeNumRects(const Region& changed)
   return numRects;
 }
 
+// klass overrides the active encoder for rects that were compressed
+// beforehand, as the active one may change while they are being written
 Encoder *EncodeManager::startRect(const Rect& rect, int type, const bool trackQuality,
-                                  const uint8_t isWebp)
+                                  const int klass_)
 {
   Encoder *encoder;
   int klass, equiv;
 
   activeType = type;
   klass = activeEncoders[activeType];
-  if (isWebp)
-    klass = encoderTightWEBP;
+  if (klass_ >= 0)
+    klass = klass_;
+  activeClass = klass;
 
   beforeLength = conn->getOutStream()->length();
 
   stats[klass][activeType].rects++;
   stats[klass][activeType].pixels += rect.area();
+  __sync_add_and_fetch(&totals[klass][activeType].rects, 1);
+  __sync_add_and_fetch(&totals[klass][activeType].pixels, rect.area());
   equiv = 12 + rect.area() * (conn->cp.pf().bpp/8);
   stats[klass][activeType].equivalent += equiv;
 
@@ -648,19 +764,16 @@ Encoder *EncodeManager::startRect(const Rect& rect, int type, const bool trackQu
   return encoder;
 }
 
-void EncodeManager::endRect(const uint8_t isWebp)
+void EncodeManager::endRect()
 {
-  int klass;
   int length;
 
   conn->writer()->endRect();
 
   length = conn->getOutStream()->length() - beforeLength;
 
-  klass = activeEncoders[activeType];
-  if (isWebp)
-    klass = encoderTightWEBP;
-  stats[klass][activeType].bytes += length;
+  stats[activeClass][activeType].bytes += length;
+  __sync_add_and_fetch(&totals[activeClass][activeType].bytes, length);
 }
 
 void EncodeManager::writeCopyPassRects(const std::vector<CopyPassRect>& copypassed)
@@ -669,6 +782,7 @@ void EncodeManager::writeCopyPassRects(const std::vector<CopyPassRect>& copypass
 
   Region lossyCopy;
 
+  const EncoderStats before = copyStats;
   beforeLength = conn->getOutStream()->length();
 
   for (rect = copypassed.begin(); rect != copypassed.end(); ++rect) {
@@ -690,6 +804,9 @@ void EncodeManager::writeCopyPassRects(const std::vector<CopyPassRect>& copypass
   }
 
   copyStats.bytes += conn->getOutStream()->length() - beforeLength;
+
+  addTotals(&copyTotals, copyStats.rects - before.rects,
+            copyStats.pixels - before.pixels, copyStats.bytes - before.bytes);
 }
 
 void EncodeManager::writeCopyRects(const Region& copied, const Point& delta)
@@ -699,6 +816,7 @@ void EncodeManager::writeCopyRects(const Region& copied, const Point& delta)
 
   Region lossyCopy;
 
+  const EncoderStats before = copyStats;
   beforeLength = conn->getOutStream()->length();
 
   copied.get_rects(&rects, delta.x <= 0, delta.y <= 0);
@@ -716,6 +834,9 @@ void EncodeManager::writeCopyRects(const Region& copied, const Point& delta)
 
   copyStats.bytes += conn->getOutStream()->length() - beforeLength;
 
+  addTotals(&copyTotals, copyStats.rects - before.rects,
+            copyStats.pixels - before.pixels, copyStats.bytes - before.bytes);
+
   lossyCopy = lossyRegion;
   lossyCopy.translate(delta);
   lossyCopy.assign_intersect(copied);
@@ -831,12 +952,11 @@ void EncodeManager::findSolidRect(const Rect& rect, Region *changed,
 
 void EncodeManager::checkWebpFallback(const struct timeval *start) {
     // Have we taken too long for the frame? If so, drop from WEBP to JPEG
-    if (start && activeEncoders[encoderFullColour] == encoderTightWEBP && !webpTookTooLong) {
+    if (start && activeEncoders[encoderFullColour] == encoderTightWEBP && !webpFallback()) {
         unsigned us;
         us = msSince(start) * 1024;
         if (us > webpFallbackUs)
-            #pragma omp atomic
-            webpTookTooLong |= true;
+            __sync_bool_compare_and_swap(&webpTookTooLong, 0, 1);
     }
 }
 
@@ -897,53 +1017,68 @@ void EncodeManager::updateVideoStats(const std::vector<Rect> &rects, const Pixel
   }
 }
 
-PixelBuffer *rfb::nearestScale(const PixelBuffer *pb, const uint16_t w, const uint16_t h,
-                                 const float diff)
+// Scaling is done in bands of output rows on the task pool
+static const unsigned ScaleBandRows = 32;
+
+struct ScaleJob {
+  const rdr::U8 *oldpx;
+  rdr::U8 *newpx;
+  int oldstride, newstride;
+  uint16_t w, h, bpp;
+  float diff;
+};
+
+static void scaleBands(struct ScaleJob *job, TaskPool::TaskFunc func)
 {
-  ManagedPixelBuffer *newpb = new ManagedPixelBuffer(pb->getPF(), w, h);
+  TaskPool::get()->parallelFor((job->h + ScaleBandRows - 1) / ScaleBandRows,
+                               func, job);
+}
+
+static void nearestScaleBand(unsigned band, void *data)
+{
+  const struct ScaleJob * const job = (const struct ScaleJob *) data;
   uint16_t x, y;
-  int oldstride, newstride;
-  const rdr::U8 *oldpxorig = pb->getBuffer(pb->getRect(), &oldstride);
   const rdr::U8 *oldpx;
-  rdr::U8 *newpx = newpb->getBufferRW(newpb->getRect(), &newstride);
-  const uint16_t bpp = pb->getPF().bpp / 8;
-  const float rowstep = 1 / diff;
+  const uint16_t bpp = job->bpp;
+  const float rowstep = 1 / job->diff;
+
+  const uint16_t starty = band * ScaleBandRows;
+  const uint16_t endy = __rfbmin(starty + ScaleBandRows, job->h);
+  rdr::U8 *newpx = job->newpx + job->newstride * bpp * starty;
 
-  for (y = 0; y < h; y++) {
+  for (y = starty; y < endy; y++) {
     const uint16_t ny = rowstep * y;
-    oldpx = oldpxorig + oldstride * bpp * ny;
-    for (x = 0; x < w; x++) {
-      const uint16_t newx = x / diff;
+    oldpx = job->oldpx + job->oldstride * bpp * ny;
+    for (x = 0; x < job->w; x++) {
+      const uint16_t newx = x / job->diff;
       memcpy(&newpx[x * bpp], &oldpx[newx * bpp], bpp);
     }
-    newpx += newstride * bpp;
+    newpx += job->newstride * bpp;
   }
-
-  return newpb;
 }
 
-PixelBuffer *rfb::bilinearScale(const PixelBuffer *pb, const uint16_t w, const uint16_t h,
-                                 const float diff)
+static void bilinearScaleBand(unsigned band, void *data)
 {
-  ManagedPixelBuffer *newpb = new ManagedPixelBuffer(pb->getPF(), w, h);
+  const struct ScaleJob * const job = (const struct ScaleJob *) data;
   uint16_t x, y;
-  int oldstride, newstride;
-  const rdr::U8 *oldpx = pb->getBuffer(pb->getRect(), &oldstride);
-  rdr::U8 *newpx = newpb->getBufferRW(newpb->getRect(), &newstride);
-  const uint16_t bpp = pb->getPF().bpp / 8;
-  const float invdiff = 1 / diff;
+  const uint16_t bpp = job->bpp;
+  const float invdiff = 1 / job->diff;
+
+  const uint16_t starty = band * ScaleBandRows;
+  const uint16_t endy = __rfbmin(starty + ScaleBandRows, job->h);
+  rdr::U8 *newpx = job->newpx + job->newstride * bpp * starty;
 
-  for (y = 0; y < h; y++) {
+  for (y = starty; y < endy; y++) {
     const float ny = y * invdiff;
     const uint16_t lowy = ny;
     const uint16_t highy = lowy + 1;
     const uint16_t bot = (ny - lowy) * 256;
     const uint16_t top = 256 - bot;
 
-    const rdr::U8 *lowyptr = oldpx + oldstride * bpp * lowy;
-    const rdr::U8 *highyptr = oldpx + oldstride * bpp * highy;
+    const rdr::U8 *lowyptr = job->oldpx + job->oldstride * bpp * lowy;
+    const rdr::U8 *highyptr = job->oldpx + job->oldstride * bpp * highy;
 
-    for (x = 0; x < w; x++) {
+    for (x = 0; x < job->w; x++) {
       const float nx = x * invdiff;
       const uint16_t lowx = nx;
       const uint16_t highx = lowx + 1;
@@ -964,27 +1099,71 @@ PixelBuffer *rfb::bilinearScale(const PixelBuffer *pb, const uint16_t w, const u
         newpx[x * bpp + i] = (val * top + val2 * bot) >> 8;
       }
     }
-    newpx += newstride * bpp;
+    newpx += job->newstride * bpp;
   }
+}
+
+static void sse2HalveBand(unsigned band, void *data)
+{
+  const struct ScaleJob * const job = (const struct ScaleJob *) data;
+
+  const uint16_t starty = band * ScaleBandRows;
+  const uint16_t endy = __rfbmin(starty + ScaleBandRows, job->h);
+
+  SSE2_halve(job->oldpx + job->oldstride * starty * 2 * 4, job->w, endy - starty,
+             job->newpx + job->newstride * starty * 4,
+             job->oldstride, job->newstride);
+}
+
+static void sse2ScaleBand(unsigned band, void *data)
+{
+  const struct ScaleJob * const job = (const struct ScaleJob *) data;
+
+  const uint16_t starty = band * ScaleBandRows;
+  const uint16_t endy = __rfbmin(starty + ScaleBandRows, job->h);
+
+  SSE2_scale(job->oldpx, job->w, endy, job->newpx,
+             job->oldstride, job->newstride, job->diff, starty);
+}
+
+static ManagedPixelBuffer *scaleWith(const PixelBuffer *pb, const uint16_t w,
+                                     const uint16_t h, const float diff,
+                                     TaskPool::TaskFunc func)
+{
+  ManagedPixelBuffer *newpb = new ManagedPixelBuffer(pb->getPF(), w, h);
+  struct ScaleJob job;
+
+  job.oldpx = pb->getBuffer(pb->getRect(), &job.oldstride);
+  job.newpx = newpb->getBufferRW(newpb->getRect(), &job.newstride);
+  job.w = w;
+  job.h = h;
+  job.bpp = pb->getPF().bpp / 8;
+  job.diff = diff;
+
+  scaleBands(&job, func);
 
   return newpb;
 }
 
+PixelBuffer *rfb::nearestScale(const PixelBuffer *pb, const uint16_t w, const uint16_t h,
+                                 const float diff)
+{
+  return scaleWith(pb, w, h, diff, nearestScaleBand);
+}
+
+PixelBuffer *rfb::bilinearScale(const PixelBuffer *pb, const uint16_t w, const uint16_t h,
+                                 const float diff)
+{
+  return scaleWith(pb, w, h, diff, bilinearScaleBand);
+}
+
 PixelBuffer *rfb::progressiveBilinearScale(const PixelBuffer *pb,
                                  const uint16_t tgtw, const uint16_t tgth,
                                  const float tgtdiff)
 {
   if (supportsSSE2()) {
-    if (tgtdiff >= 0.5f) {
-      ManagedPixelBuffer *newpb = new ManagedPixelBuffer(pb->getPF(), tgtw, tgth);
-
-      int oldstride, newstride;
-      const rdr::U8 *oldpx = pb->getBuffer(pb->getRect(), &oldstride);
-      rdr::U8 *newpx = newpb->getBufferRW(newpb->getRect(), &newstride);
-
-      SSE2_scale(oldpx, tgtw, tgth, newpx, oldstride, newstride, tgtdiff);
-      return newpb;
-    }
+    if (tgtdiff >= 0.5f)
+      return scaleWith(pb, tgtw, tgth, tgtdiff, sse2ScaleBand);
 
     PixelBuffer *newpb;
     uint16_t neww, newh, oldw, oldh;
@@ -996,14 +1175,7 @@ PixelBuffer *rfb::progressiveBilinearScale(const PixelBuffer *pb,
       neww = oldw / 2;
       newh = oldh / 2;
 
-      newpb = new ManagedPixelBuffer(pb->getPF(), neww, newh);
-
-      int oldstride, newstride;
-      const rdr::U8 *oldpx = pb->getBuffer(pb->getRect(), &oldstride);
-      rdr::U8 *newpx = ((ManagedPixelBuffer *) newpb)->getBufferRW(newpb->getRect(),
-                                                                   &newstride);
-
-      SSE2_halve(oldpx, neww, newh, newpx, oldstride, newstride);
+      newpb = scaleWith(pb, neww, newh, 0.5f, sse2HalveBand);
 
       if (del)
         delete pb;
@@ -1017,14 +1189,7 @@ PixelBuffer *rfb::progressiveBilinearScale(const PixelBuffer *pb,
       oldw = pb->getRect().width();
       oldh = pb->getRect().height();
 
-      newpb = new ManagedPixelBuffer(pb->getPF(), tgtw, tgth);
-
-      int oldstride, newstride;
-      const rdr::U8 *oldpx = pb->getBuffer(pb->getRect(), &oldstride);
-      rdr::U8 *newpx = ((ManagedPixelBuffer *) newpb)->getBufferRW(newpb->getRect(),
-                                                                   &newstride);
-
-      SSE2_scale(oldpx, tgtw, tgth, newpx, oldstride, newstride, tgtw / (float) oldw);
+      newpb = scaleWith(pb, tgtw, tgth, tgtw / (float) oldw, sse2ScaleBand);
       if (del)
         delete pb;
     }
@@ -1077,12 +1242,10 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
   std::vector<Palette> palettes;
   std::vector<std::vector<uint8_t> > compresseds;
   std::vector<uint32_t> ms;
+  std::vector<uint64_t> hashes;
   uint32_t i;
 
-  if (rfb::Server::rectThreads > 0)
-    omp_set_num_threads(rfb::Server::rectThreads);
-
-  webpTookTooLong = false;
+  webpTookTooLong = 0;
   changed.get_rects(&rects);
 
   // Update stats
@@ -1138,6 +1301,7 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
   encoderTypes.resize(subrects.size());
   isWebp.resize(subrects.size());
   fromCache.resize(subrects.size());
+  hashes.resize(subrects.size());
   palettes.resize(subrects.size());
   compresseds.resize(subrects.size());
   scaledrects.resize(subrects.size());
@@ -1197,26 +1361,35 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
     }
   }
   scalingTime = msSince(&scalestart);
-
-  #pragma omp parallel for schedule(dynamic, 1)
-  for (i = 0; i < subrects.size(); ++i) {
-    encoderTypes[i] = getEncoderType(subrects[i], pb, &palettes[i], compresseds[i],
-                                     &isWebp[i], &fromCache[i],
-                                     scaledpb, scaledrects[i], ms[i]);
-    checkWebpFallback(start);
-  }
-
-  for (i = 0; i < subrects.size(); ++i) {
-    if (encoderTypes[i] == encoderFullColour) {
-      if (isWebp[i])
-        webpstats.ms += ms[i];
-      else
-        jpegstats.ms += ms[i];
-    }
-  }
+  if (scaledpb)
+    Metrics::scalingTime.observe(scalingTime);
+
+  struct RectJob job;
+  job.manager = this;
+  job.pb = pb;
+  job.scaledpb = scaledpb;
+  job.start = start;
+  job.subrects = &subrects;
+  job.scaledrects = &scaledrects;
+  job.encoderTypes = &encoderTypes;
+  job.isWebp = &isWebp;
+  job.fromCache = &fromCache;
+  job.palettes = &palettes;
+  job.compresseds = &compresseds;
+  job.ms = &ms;
+  job.hashes = &hashes;
+
+  os::Mutex mutex;
+  job.mutex = &mutex;
+  job.finished.reserve(subrects.size());
+  job.nwritten = 0;
+  job.writing = false;
+
+  TaskPool::get()->parallelFor(subrects.size(), encodeRectTask, &job);
 
   if (start) {
     encodingTime = msSince(start);
+    Metrics::encodingTime.observe(encodingTime);
 
     if (vlog.getLevel() >= vlog.LEVEL_DEBUG) {
       framesSinceEncPrint++;
@@ -1233,28 +1406,85 @@ void EncodeManager::writeRects(const Region& changed, const PixelBuffer* pb,
     }
   }
 
-  if (webpTookTooLong)
+  if (webpFallback())
     activeEncoders[encoderFullColour] = encoderTightJPEG;
 
-  for (i = 0; i < subrects.size(); ++i) {
-    if (encCache->enabled && compresseds[i].size() && !fromCache[i]) {
-      void *tmp = malloc(compresseds[i].size());
-      memcpy(tmp, &compresseds[i][0], compresseds[i].size());
-      encCache->add(isWebp[i] ? encoderTightWEBP : encoderTightJPEG,
-                    subrects[i].tl.x, subrects[i].tl.y, subrects[i].width(), subrects[i].height(),
-                    compresseds[i].size(), tmp);
-    }
+  if (scaledpb)
+    delete scaledpb;
+}
 
-    writeSubRect(subrects[i], pb, encoderTypes[i], palettes[i], compresseds[i], isWebp[i]);
+void EncodeManager::encodeRectTask(unsigned i, void *data)
+{
+  struct RectJob * const job = (struct RectJob *) data;
+  EncodeManager * const self = job->manager;
+
+  (*job->encoderTypes)[i] =
+    self->getEncoderType((*job->subrects)[i], job->pb, &(*job->palettes)[i],
+                         (*job->compresseds)[i], &(*job->isWebp)[i],
+                         &(*job->fromCache)[i], (*job->hashes)[i],
+                         job->scaledpb, (*job->scaledrects)[i], (*job->ms)[i]);
+  self->checkWebpFallback(job->start);
+
+  job->mutex->lock();
+  job->finished.push_back(i);
+  if (job->writing) {
+    // Whoever is writing picks this one up as well
+    job->mutex->unlock();
+    return;
   }
+  job->writing = true;
+  job->mutex->unlock();
 
-  if (scaledpb)
-    delete scaledpb;
+  self->writeFinishedRects(job);
+}
+
+// writeFinishedRects() sends the rects that are done so far, while the
+// others are still being compressed. The rect count was sent up front,
+// or LastRect is used, so the order does not matter to the client.
+
+void EncodeManager::writeFinishedRects(struct RectJob *job)
+{
+  unsigned i;
+
+  job->mutex->lock();
+  while (job->nwritten < job->finished.size()) {
+    i = job->finished[job->nwritten++];
+    job->mutex->unlock();
+
+    const Rect &rect = (*job->subrects)[i];
+    std::vector<uint8_t> &compressed = (*job->compresseds)[i];
+
+    if ((*job->encoderTypes)[i] == encoderFullColour) {
+      if ((*job->isWebp)[i])
+        webpstats.ms += (*job->ms)[i];
+      else
+        jpegstats.ms += (*job->ms)[i];
+    }
+
+    if ((*job->fromCache)[i]) {
+      cacheHits++;
+      __sync_add_and_fetch(&totalCacheHits, 1);
+    } else if ((*job->hashes)[i] && compressed.size()) {
+      // Only JPEG and WEBP results are kept, the other rects aren't misses
+      cacheMisses++;
+      __sync_add_and_fetch(&totalCacheMisses, 1);
+      encCache->add((*job->hashes)[i],
+                    (*job->isWebp)[i] ? encoderTightWEBP : encoderTightJPEG,
+                    cacheQuality(rect), compressed);
+    }
+
+    writeSubRect(rect, job->pb, (*job->encoderTypes)[i], (*job->palettes)[i],
+                 compressed, (*job->isWebp)[i]);
+
+    job->mutex->lock();
+  }
+  job->writing = false;
+  job->mutex->unlock();
 }
 
 uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
                                       Palette *pal, std::vector<uint8_t> &compressed,
-                                      uint8_t *isWebp, uint8_t *fromCache,
+                                      uint8_t *isWebp, uint8_t *fromCache, uint64_t &hash,
                                       const PixelBuffer *scaledpb, const Rect& scaledrect,
                                       uint32_t &ms) const
 {
@@ -1266,6 +1496,31 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
   bool useRLE;
   EncoderType type;
 
+  *isWebp = 0;
+  *fromCache = 0;
+  hash = 0;
+  ms = 0;
+
+  // Content we have already compressed doesn't need analysing again
+  if (encCache->enabled() &&
+      (activeEncoders[encoderFullColour] == encoderTightWEBP ||
+       activeEncoders[encoderFullColour] == encoderTightJPEG)) {
+    const uint8_t cachedType =
+      activeEncoders[encoderFullColour] == encoderTightWEBP && !webpFallback() ?
+      encoderTightWEBP : encoderTightJPEG;
+
+    if (scaledpb)
+      hash = hashRect(scaledrect, scaledpb);
+    else
+      hash = hashRect(rect, pb);
+
+    if (encCache->get(hash, cachedType, cacheQuality(rect), compressed)) {
+      *isWebp = cachedType == encoderTightWEBP;
+      *fromCache = 1;
+      return encoderFullColour;
+    }
+  }
+
   encoder = encoders[activeEncoders[encoderIndexedRLE]];
   if (maxColours > encoder->maxPaletteSize)
     maxColours = encoder->maxPaletteSize;
@@ -1307,23 +1562,11 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
   if (scaledpb)
     type = encoderFullColour;
 
-  *isWebp = 0;
-  *fromCache = 0;
-  ms = 0;
   if (type == encoderFullColour) {
-    uint32_t len;
-    const void *data;
     struct timeval start;
     gettimeofday(&start, NULL);
 
-    if (encCache->enabled &&
-        (data = encCache->get(activeEncoders[encoderFullColour],
-                              rect.tl.x, rect.tl.y, rect.width(), rect.height(),
-                              len))) {
-      compressed.resize(len);
-      memcpy(&compressed[0], data, len);
-      *fromCache = 1;
-    } else if (activeEncoders[encoderFullColour] == encoderTightWEBP && !webpTookTooLong) {
+    if (activeEncoders[encoderFullColour] == encoderTightWEBP && !webpFallback()) {
       if (scaledpb) {
         delete ppb;
         ppb = preparePixelBuffer(scaledrect, scaledpb,
@@ -1339,7 +1582,7 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
                                                                       compressed,
                                                                       videoDetected);
       *isWebp = 1;
-    } else if (activeEncoders[encoderFullColour] == encoderTightJPEG || webpTookTooLong) {
+    } else if (activeEncoders[encoderFullColour] == encoderTightJPEG || webpFallback()) {
       if (scaledpb) {
         delete ppb;
         ppb = preparePixelBuffer(scaledrect, scaledpb,
@@ -1364,15 +1607,54 @@ uint8_t EncodeManager::getEncoderType(const Rect& rect, const PixelBuffer *pb,
   return type;
 }
 
+uint64_t EncodeManager::hashRect(const Rect& rect, const PixelBuffer *pb) const
+{
+  XXH64_state_t state;
+  char pfstr[256];
+  const rdr::U8 *buffer;
+  int stride, y;
+
+  const int bytesPerPixel = pb->getPF().bpp / 8;
+  const uint16_t dims[2] = { (uint16_t) rect.width(), (uint16_t) rect.height() };
+
+  // The same bytes mean different pixels in a different format or shape
+  pb->getPF().print(pfstr, sizeof(pfstr));
+
+  XXH64_reset(&state, 0);
+  XXH64_update(&state, pfstr, strlen(pfstr));
+  XXH64_update(&state, dims, sizeof(dims));
+
+  buffer = pb->getBuffer(rect, &stride);
+  for (y = 0; y < rect.height(); y++)
+    XXH64_update(&state, buffer + y * stride * bytesPerPixel,
+                 rect.width() * bytesPerPixel);
+
+  return XXH64_digest(&state);
+}
+
+uint8_t EncodeManager::cacheQuality(const Rect& rect) const
+{
+  // Video mode uses its own quality setting
+  if (videoDetected)
+    return 0xff;
+
+  const unsigned q = scaledQuality(rect);
+  return q < 0xfe ? q : 0xfe;
+}
+
 void EncodeManager::writeSubRect(const Rect& rect, const PixelBuffer *pb,
                                  const uint8_t type, const Palette &pal,
-                                 const std::vector<uint8_t> &compressed,
+                                 std::vector<uint8_t> &compressed,
                                  const uint8_t isWebp)
 {
   PixelBuffer *ppb;
   Encoder *encoder;
 
-  encoder = startRect(rect, type, compressed.size() == 0, isWebp);
+  if (compressed.size())
+    encoder = startRect(rect, type, false,
+                        isWebp ? encoderTightWEBP : encoderTightJPEG);
+  else
+    encoder = startRect(rect, type);
 
   if (compressed.size()) {
     if (isWebp) {
@@ -1395,7 +1677,7 @@ void EncodeManager::writeSubRect(const Rect& rect, const PixelBuffer *pb,
     delete ppb;
   }
 
-  endRect(isWebp);
+  endRect();
 }
 
 bool EncodeManager::checkSolidTile(const Rect& r, const rdr::U8* colourValue,
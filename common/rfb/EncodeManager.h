@@ -32,6 +32,7 @@
 #include <rfb/util.h>
 
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/time.h>
 
 namespace rfb {
@@ -46,6 +47,7 @@ namespace rfb {
 
   struct RectInfo;
   struct QualityInfo;
+  struct RectJob;
 
   class EncodeManager: public Timer::Callback {
   public:
@@ -54,6 +56,9 @@ namespace rfb {
 
     void logStats();
 
+    // The stats of all connections so far, for Metrics
+    static void writeMetrics(FILE *f);
+
     // Hack to let ConnParams calculate the client's preferred encoding
     static bool supported(int encoding);
 
@@ -100,8 +105,8 @@ namespace rfb {
     int computeNumRects(const Region& changed);
 
     Encoder *startRect(const Rect& rect, int type, const bool trackQuality = true,
-                       const uint8_t isWebp = 0);
-    void endRect(const uint8_t isWebp = 0);
+                       const int klass = -1);
+    void endRect();
 
     void writeCopyRects(const Region& copied, const Point& delta);
     void writeCopyPassRects(const std::vector<CopyPassRect>& copypassed);
@@ -111,17 +116,24 @@ namespace rfb {
                     const struct timeval *start = NULL,
                     const bool mainScreen = false);
     void checkWebpFallback(const struct timeval *start);
+    bool webpFallback() const {
+      return __sync_add_and_fetch(&webpTookTooLong, 0);
+    }
     void updateVideoStats(const std::vector<Rect> &rects, const PixelBuffer* pb);
 
     void writeSubRect(const Rect& rect, const PixelBuffer *pb, const uint8_t type,
-                      const Palette& pal, const std::vector<uint8_t> &compressed,
+                      const Palette& pal, std::vector<uint8_t> &compressed,
                       const uint8_t isWebp);
 
     uint8_t getEncoderType(const Rect& rect, const PixelBuffer *pb, Palette *pal,
                            std::vector<uint8_t> &compressed, uint8_t *isWebp,
-                           uint8_t *fromCache,
+                           uint8_t *fromCache, uint64_t &hash,
                            const PixelBuffer *scaledpb, const Rect& scaledrect,
                            uint32_t &ms) const;
+    uint64_t hashRect(const Rect& rect, const PixelBuffer *pb) const;
+    uint8_t cacheQuality(const Rect& rect) const;
+    void writeFinishedRects(struct RectJob *job);
+    static void encodeRectTask(unsigned index, void *data);
     virtual bool handleTimeout(Timer* t);
 
     bool checkSolidTile(const Rect& r, const rdr::U8* colourValue,
@@ -191,17 +203,20 @@ namespace rfb {
     unsigned updates;
     EncoderStats copyStats;
     StatsVector stats;
-    int activeType;
+    int activeType, activeClass;
     int beforeLength;
     size_t curMaxUpdateSize;
     unsigned webpFallbackUs;
     unsigned webpBenchResult;
-    bool webpTookTooLong;
+    // Set by any encoding task while the others read it, so only
+    // accessed with __sync builtins
+    mutable unsigned webpTookTooLong;
     unsigned encodingTime;
     unsigned maxEncodingTime, framesSinceEncPrint;
     unsigned scalingTime;
 
     EncCache *encCache;
+    unsigned long long cacheHits, cacheMisses;
 
     class OffsetPixelBuffer : public FullFramePixelBuffer {
     public:
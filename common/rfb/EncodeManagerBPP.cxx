@@ -23,28 +23,44 @@
 
 #define UBPP CONCAT2E(U,BPP)
 
+#define PIXELRUN CONCAT2E(pixelRun,BPP)
+
+// How many pixels from buffer on equal colour, at most len. 32 bpp is
+// what servers run at, so only that has vector versions.
+static inline int PIXELRUN(const rdr::UBPP* buffer, int len,
+                           rdr::UBPP colour)
+{
+#if BPP == 32
+  return pixelRun(buffer, len, colour);
+#else
+  int i;
+
+  for (i = 0; i < len; i++) {
+    if (buffer[i] != colour)
+      return i;
+  }
+
+  return len;
+#endif
+}
+
 inline bool EncodeManager::checkSolidTile(const Rect& r,
                                           rdr::UBPP colourValue,
                                           const PixelBuffer *pb)
 {
   int w, h;
   const rdr::UBPP* buffer;
-  int stride, pad;
+  int stride;
 
   w = r.width();
   h = r.height();
 
   buffer = (const rdr::UBPP*)pb->getBuffer(r, &stride);
-  pad = stride - w;
 
   while (h--) {
-    int w_ = w;
-    while (w_--) {
-      if (*buffer != colourValue)
-        return false;
-      buffer++;
-    }
-    buffer += pad;
+    if (PIXELRUN(buffer, w, colourValue) != w)
+      return false;
+    buffer += stride;
   }
 
   return true;
@@ -54,38 +70,43 @@ inline bool EncodeManager::analyseRect(int width, int height,
                                        const rdr::UBPP* buffer, int stride,
                                        struct RectInfo *info, int maxColours) const
 {
-  int pad;
-
   rdr::UBPP colour;
   int count;
 
   info->rleRuns = 0;
   info->palette->clear();
 
-  pad = stride - width;
-
   // For efficiency, we only update the palette on changes in colour
   colour = buffer[0];
   count = 0;
   while (height--) {
-    int w_ = width;
-    while (w_--) {
-      if (*buffer != colour) {
-        if (!info->palette->insert(colour, count))
-          return false;
-        if (info->palette->size() > maxColours)
-          return false;
-
-        // FIXME: This doesn't account for switching lines
-        info->rleRuns++;
-
-        colour = *buffer;
-        count = 0;
-      }
-      buffer++;
-      count++;
+    int x = 0;
+    while (x < width) {
+      int run;
+
+      // Runs of a single pixel, as in dithering, aren't worth a search
+      if (buffer[x] == colour && x + 1 < width && buffer[x + 1] != colour)
+        run = 1;
+      else
+        run = PIXELRUN(buffer + x, width - x, colour);
+
+      x += run;
+      count += run;
+      if (x == width)
+        break;
+
+      if (!info->palette->insert(colour, count))
+        return false;
+      if (info->palette->size() > maxColours)
+        return false;
+
+      // FIXME: This doesn't account for switching lines
+      info->rleRuns++;
+
+      colour = buffer[x];
+      count = 0;
     }
-    buffer += pad;
+    buffer += stride;
   }
 
   // Make sure the final pixels also get counted
@@ -96,3 +117,5 @@ inline bool EncodeManager::analyseRect(int width, int height,
 
   return true;
 }
+
+#undef PIXELRUN
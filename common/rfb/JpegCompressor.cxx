@@ -111,7 +111,8 @@ JpegTermDestination(j_compress_ptr cinfo)
   jc->setptr(dest->pub.next_output_byte);
 }
 
-JpegCompressor::JpegCompressor(int bufferLen) : MemOutStream(bufferLen)
+JpegCompressor::JpegCompressor(int bufferLen) : MemOutStream(bufferLen),
+  rgbBuf(NULL), rgbBufSize(0), rowPointers(NULL), rowPointersSize(0)
 {
   cinfo = new jpeg_compress_struct;
 
@@ -149,6 +150,9 @@ JpegCompressor::~JpegCompressor(void)
   delete dest;
 
   delete cinfo;
+
+  delete [] rgbBuf;
+  delete [] rowPointers;
 }
 
 void JpegCompressor::compress(const rdr::U8 *buf, int stride, const Rect& r,
@@ -158,14 +162,10 @@ void JpegCompressor::compress(const rdr::U8 *buf, int stride, const Rect& r,
   int h = r.height();
   int pixelsize;
   rdr::U8 *srcBuf = NULL;
-  bool srcBufIsTemp = false;
-  JSAMPROW *rowPointer = NULL;
 
   if(setjmp(err->jmpBuffer)) {
     // this will execute if libjpeg has an error
     jpeg_abort_compress(cinfo);
-    if (srcBufIsTemp && srcBuf) delete[] srcBuf;
-    if (rowPointer) delete[] rowPointer;
     throw rdr::Exception("%s", err->lastError);
   }
 
@@ -196,8 +196,12 @@ void JpegCompressor::compress(const rdr::U8 *buf, int stride, const Rect& r,
     stride = w;
 
   if (cinfo->in_color_space == JCS_RGB) {
-    srcBuf = new rdr::U8[w * h * pixelsize];
-    srcBufIsTemp = true;
+    if (rgbBufSize < w * h * pixelsize) {
+      delete [] rgbBuf;
+      rgbBufSize = w * h * pixelsize;
+      rgbBuf = new rdr::U8[rgbBufSize];
+    }
+    srcBuf = rgbBuf;
     pf.rgbFromBuffer(srcBuf, (const rdr::U8 *)buf, w, stride, h);
     stride = w;
   }
@@ -233,7 +237,13 @@ void JpegCompressor::compress(const rdr::U8 *buf, int stride, const Rect& r,
     cinfo->comp_info[0].v_samp_factor = 1;
   }
 
-  rowPointer = new JSAMPROW[h];
+  if (rowPointersSize < h) {
+    delete [] rowPointers;
+    rowPointersSize = h;
+    rowPointers = new rdr::U8*[rowPointersSize];
+  }
+
+  JSAMPROW *rowPointer = (JSAMPROW *) rowPointers;
   for (int dy = 0; dy < h; dy++)
     rowPointer[dy] = (JSAMPROW)(&srcBuf[dy * stride * pixelsize]);
 
@@ -243,9 +253,6 @@ void JpegCompressor::compress(const rdr::U8 *buf, int stride, const Rect& r,
       cinfo->image_height - cinfo->next_scanline);
 
   jpeg_finish_compress(cinfo);
-
-  if (srcBufIsTemp) delete[] srcBuf;
-  delete[] rowPointer;
 }
 
 void JpegCompressor::writeBytes(const void* data, int length)
@@ -19,7 +19,9 @@
 
 //
 // JpegCompressor compresses RGB input into a JPEG image and stores it in
-// an underlying MemOutStream
+// an underlying MemOutStream. The libjpeg state and the conversion
+// buffers are kept between calls, so one instance can be reused for
+// many images.
 //
 
 #ifndef __RFB_JPEGCOMPRESSOR_H__
@@ -54,6 +56,11 @@ namespace rfb {
     struct JPEG_ERROR_MGR *err;
     struct JPEG_DEST_MGR *dest;
 
+    rdr::U8 *rgbBuf;
+    int rgbBufSize;
+    rdr::U8 **rowPointers;
+    int rowPointersSize;
+
   };
 
 } // end of namespace rfb
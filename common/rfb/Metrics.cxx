@@ -0,0 +1,235 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <rfb/EncodeManager.h>
+#include <rfb/Metrics.h>
+
+using namespace rfb;
+
+// 16 and 33 ms are a frame at 60 and 30 fps
+const unsigned Histogram::bounds[numBounds] = {
+  1, 2, 5, 10, 16, 33, 50, 100, 250, 500, 1000
+};
+
+Histogram Metrics::frameTime, Metrics::analysisTime;
+Histogram Metrics::encodingTime, Metrics::scalingTime;
+
+volatile uint64_t Metrics::frames, Metrics::dropped[DropReasonMax];
+volatile uint64_t Metrics::comparedPixels, Metrics::changedPixels;
+Metrics::Client Metrics::clients[maxClients];
+
+static const char *dropReasonName[Metrics::DropReasonMax] = {
+  "congestion",
+  "pacing",
+};
+
+void Histogram::observe(unsigned ms)
+{
+  unsigned i;
+
+  for (i = 0; i < numBounds; i++) {
+    if (ms <= bounds[i])
+      break;
+  }
+
+  __sync_add_and_fetch(&buckets[i], 1);
+  __sync_add_and_fetch(&sum, ms);
+}
+
+void Histogram::write(FILE *f, const char *name, const char *help) const
+{
+  uint64_t count = 0;
+  unsigned i;
+
+  fprintf(f, "# HELP %s %s\n", name, help);
+  fprintf(f, "# TYPE %s histogram\n", name);
+
+  // The count is what the buckets added up to, so that it matches them
+  // even if an observation lands meanwhile
+  for (i = 0; i < numBounds; i++) {
+    count += buckets[i];
+    fprintf(f, "%s_bucket{le=\"%u\"} %" PRIu64 "\n", name, bounds[i], count);
+  }
+  count += buckets[numBounds];
+  fprintf(f, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, count);
+
+  fprintf(f, "%s_sum %" PRIu64 "\n", name, sum);
+  fprintf(f, "%s_count %" PRIu64 "\n", name, count);
+}
+
+int Metrics::addClient(const char *name)
+{
+  int i;
+
+  for (i = 0; i < maxClients; i++) {
+    if (__sync_bool_compare_and_swap(&clients[i].used, 0, 1))
+      break;
+  }
+  if (i == maxClients)
+    return -1;
+
+  Client &c = clients[i];
+
+  __sync_add_and_fetch(&c.seq, 1);
+  strncpy(c.name, name, sizeof(c.name) - 1);
+  c.name[sizeof(c.name) - 1] = '\0';
+  c.bandwidth = 0;
+  c.congWindow = 0;
+  c.rtt = (unsigned) -1;
+  __sync_add_and_fetch(&c.seq, 1);
+
+  return i;
+}
+
+void Metrics::removeClient(int slot)
+{
+  if (slot < 0)
+    return;
+
+  Client &c = clients[slot];
+
+  __sync_add_and_fetch(&c.seq, 1);
+  c.used = 0;
+  __sync_add_and_fetch(&c.seq, 1);
+}
+
+void Metrics::updateClient(int slot, uint64_t bandwidth,
+                           unsigned congWindow, unsigned rtt)
+{
+  if (slot < 0)
+    return;
+
+  Client &c = clients[slot];
+
+  c.bandwidth = bandwidth;
+  c.congWindow = congWindow;
+  c.rtt = rtt;
+}
+
+static void writeLabel(FILE *f, const char *s)
+{
+  for (; *s; s++) {
+    if (*s == '\\' || *s == '"')
+      fputc('\\', f);
+    if (*s == '\n')
+      fputs("\\n", f);
+    else
+      fputc(*s, f);
+  }
+}
+
+void Metrics::writeClients(FILE *f)
+{
+  struct {
+    char name[128];
+    uint64_t bandwidth;
+    unsigned congWindow, rtt;
+  } seen[maxClients];
+  unsigned num = 0, seq, i;
+  // The RTT until it has been measured
+  const unsigned unknown = (unsigned) -1;
+
+  // Names are only copied while they stay the same, values are taken as
+  // they are at the time
+  for (i = 0; i < maxClients; i++) {
+    Client &c = clients[i];
+
+    seq = __sync_add_and_fetch(&c.seq, 0);
+    if ((seq & 1) || !c.used)
+      continue;
+
+    memcpy(seen[num].name, c.name, sizeof(c.name));
+    seen[num].bandwidth = c.bandwidth;
+    seen[num].congWindow = c.congWindow;
+    seen[num].rtt = c.rtt;
+
+    if (__sync_add_and_fetch(&c.seq, 0) != seq)
+      continue;
+
+    seen[num].name[sizeof(seen[num].name) - 1] = '\0';
+    num++;
+  }
+
+  #define client_gauge(metric, help, field, fmt) \
+    fprintf(f, "# HELP " metric " " help "\n"); \
+    fprintf(f, "# TYPE " metric " gauge\n"); \
+    for (i = 0; i < num; i++) { \
+      if (seen[i].field == unknown) \
+        continue; \
+      fprintf(f, metric "{client=\""); \
+      writeLabel(f, seen[i].name); \
+      fprintf(f, "\"} %" fmt "\n", seen[i].field); \
+    }
+
+  client_gauge("kasmvnc_client_bandwidth_bytes",
+               "Estimated bandwidth to the client, in bytes per second",
+               bandwidth, PRIu64);
+  client_gauge("kasmvnc_client_congestion_window_bytes",
+               "Congestion window of the client's link",
+               congWindow, "u");
+  client_gauge("kasmvnc_client_rtt_milliseconds",
+               "Round trip time to the client, without queueing",
+               rtt, "u");
+
+  #undef client_gauge
+}
+
+void Metrics::write(FILE *f)
+{
+  unsigned i;
+
+  fprintf(f, "# HELP kasmvnc_frames_total Frames the server has started "
+             "comparing and sending out\n");
+  fprintf(f, "# TYPE kasmvnc_frames_total counter\n");
+  fprintf(f, "kasmvnc_frames_total %" PRIu64 "\n", frames);
+
+  fprintf(f, "# HELP kasmvnc_dropped_frames_total Frames a client skipped "
+             "as its link was busy\n");
+  fprintf(f, "# TYPE kasmvnc_dropped_frames_total counter\n");
+  for (i = 0; i < DropReasonMax; i++)
+    fprintf(f, "kasmvnc_dropped_frames_total{reason=\"%s\"} %" PRIu64 "\n",
+            dropReasonName[i], dropped[i]);
+
+  fprintf(f, "# HELP kasmvnc_compared_pixels_total Pixels reported damaged "
+             "and compared against the previous frame\n");
+  fprintf(f, "# TYPE kasmvnc_compared_pixels_total counter\n");
+  fprintf(f, "kasmvnc_compared_pixels_total %" PRIu64 "\n", comparedPixels);
+
+  fprintf(f, "# HELP kasmvnc_changed_pixels_total Compared pixels that had "
+             "actually changed\n");
+  fprintf(f, "# TYPE kasmvnc_changed_pixels_total counter\n");
+  fprintf(f, "kasmvnc_changed_pixels_total %" PRIu64 "\n", changedPixels);
+
+  frameTime.write(f, "kasmvnc_frame_milliseconds",
+                  "Time to compare, encode and send a frame to all clients");
+  analysisTime.write(f, "kasmvnc_analysis_milliseconds",
+                     "Time to compare a frame and detect scrolling");
+  encodingTime.write(f, "kasmvnc_encoding_milliseconds",
+                     "Time to encode an update for one client");
+  scalingTime.write(f, "kasmvnc_scaling_milliseconds",
+                    "Time to scale an update for one client");
+
+  EncodeManager::writeMetrics(f);
+
+  writeClients(f);
+}
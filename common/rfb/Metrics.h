@@ -0,0 +1,116 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// Metrics holds the process-wide counters of the encoding pipeline, as
+// served in the Prometheus text format by /api/metrics.
+//
+// Everything is updated with atomic adds and plain stores, so the
+// encoding threads never wait for a scrape, and a scrape never waits for
+// them. A scrape may see one frame's updates half applied, which only
+// matters within that frame.
+//
+
+#ifndef __RFB_METRICS_H__
+#define __RFB_METRICS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+namespace rfb {
+
+  // Durations in ms, in fixed buckets
+  class Histogram {
+  public:
+    void observe(unsigned ms);
+    void write(FILE *f, const char *name, const char *help) const;
+
+    static const unsigned numBounds = 11;
+
+  private:
+    static const unsigned bounds[numBounds];
+
+    // The last one is +Inf
+    volatile uint64_t buckets[numBounds + 1];
+    volatile uint64_t sum;
+  };
+
+  class Metrics {
+  public:
+    static void frameStarted() {
+      __sync_add_and_fetch(&frames, 1);
+    }
+
+    static void frameDone(unsigned ms) {
+      frameTime.observe(ms);
+    }
+
+    enum DropReason {
+      DropCongestion,
+      DropPacing,
+      DropReasonMax
+    };
+
+    // An update is retried on timers and socket events too, so this only
+    // counts once per frame. last is kept by the client for that.
+    static void frameDropped(DropReason why, uint64_t &last) {
+      if (last == frames)
+        return;
+      last = frames;
+      __sync_add_and_fetch(&dropped[why], 1);
+    }
+
+    static void compared(unsigned in, unsigned out) {
+      __sync_add_and_fetch(&comparedPixels, in);
+      __sync_add_and_fetch(&changedPixels, out);
+    }
+
+    // A client's link as its congestion control sees it, with an RTT of
+    // (unsigned) -1 until one is known. Clients past maxClients aren't
+    // reported on, addClient() returns -1 for them.
+    static int addClient(const char *name);
+    static void removeClient(int slot);
+    static void updateClient(int slot, uint64_t bandwidth,
+                             unsigned congWindow, unsigned rtt);
+
+    static void write(FILE *f);
+
+    static Histogram frameTime, analysisTime, encodingTime, scalingTime;
+
+    static const int maxClients = 64;
+
+  private:
+    struct Client {
+      volatile int used;
+      // Odd while the name is being changed
+      volatile unsigned seq;
+      char name[128];
+      volatile uint64_t bandwidth;
+      volatile unsigned congWindow, rtt;
+    };
+
+    static void writeClients(FILE *f);
+
+    static volatile uint64_t frames, dropped[DropReasonMax];
+    static volatile uint64_t comparedPixels, changedPixels;
+    static Client clients[maxClients];
+  };
+
+}
+
+#endif
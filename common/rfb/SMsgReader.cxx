@@ -102,6 +102,37 @@ void SMsgReader::readMsg()
   }
 }
 
+bool SMsgReader::readInputMsg()
+{
+  size_t len;
+
+  if (!is->checkNoWait(1))
+    return false;
+
+  switch (is->getptr()[0]) {
+  case msgTypeKeyEvent:
+    len = 8;
+    break;
+  case msgTypePointerEvent:
+    len = 10;
+    break;
+  case msgTypeQEMUClientMessage:
+    if (!is->checkNoWait(2) || is->getptr()[1] != qemuExtendedKeyEvent)
+      return false;
+    len = 12;
+    break;
+  default:
+    return false;
+  }
+
+  if (!is->checkNoWait(len))
+    return false;
+
+  readMsg();
+
+  return true;
+}
+
 void SMsgReader::readSetPixelFormat()
 {
   is->skip(3);
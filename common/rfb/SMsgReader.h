@@ -39,6 +39,11 @@ namespace rfb {
     // readMsg() reads a message, calling the handler as appropriate.
     void readMsg();
 
+    // readInputMsg() reads the next message only if it is a key or pointer
+    // event that has already arrived in full, and returns whether it did.
+    // It never waits, and leaves any other message alone.
+    bool readInputMsg();
+
     rdr::InStream* getInStream() { return is; }
 
   protected:
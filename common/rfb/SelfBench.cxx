@@ -16,14 +16,20 @@
  * USA.
  */
 
+#include <rdr/MemOutStream.h>
 #include <rfb/ComparingUpdateTracker.h>
+#include <rfb/EncCache.h>
 #include <rfb/EncodeManager.h>
+#include <rfb/encodings.h>
 #include <rfb/LogWriter.h>
 #include <rfb/SConnection.h>
+#include <rfb/SMsgWriter.h>
 #include <rfb/ServerCore.h>
 #include <rfb/PixelBuffer.h>
+#include <rfb/TaskPool.h>
 #include <rfb/TightJPEGEncoder.h>
 #include <rfb/TightWEBPEncoder.h>
+#include <rfb/UpdateTracker.h>
 #include <rfb/util.h>
 #include <sys/time.h>
 #include <stdint.h>
@@ -39,6 +45,257 @@ static const PixelFormat pfRGBX(32, 24, false, true, 255, 255, 255, 0, 8, 16);
 #define W 1600
 #define H 1200
 
+#define MAXCLIENTS 8
+
+// A client that throws away everything sent to it
+class BenchConn : public SConnection {
+public:
+	BenchConn(EncCache *cache) : manager(this, cache) {
+		static const rdr::S32 encodings[] = {
+			encodingTight, pseudoEncodingLastRect,
+			pseudoEncodingQualityLevel0 + 8
+		};
+
+		setStreams(NULL, &out);
+		setWriter(new SMsgWriter(&cp, &out));
+
+		cp.setPF(pfRGBX);
+		setEncodings(sizeof(encodings) / sizeof(encodings[0]), encodings);
+	}
+
+	void writeUpdate(const UpdateInfo &ui, const PixelBuffer *pb) {
+		out.clear();
+		manager.writeUpdate(ui, pb, NULL);
+	}
+
+	virtual void setAccessRights(AccessRights ar) {}
+	virtual void setDesktopSize(int fb_width, int fb_height,
+				    const ScreenSet& layout) {}
+	virtual void sendStats(const bool toClient = true) {}
+	virtual void handleFrameStats(rdr::U32 all, rdr::U32 render) {}
+	virtual bool canChangeKasmSettings() const { return false; }
+
+private:
+	rdr::MemOutStream out;
+	EncodeManager manager;
+};
+
+struct BenchJob {
+	BenchConn **conns;
+	const UpdateInfo *ui;
+	const PixelBuffer *pb;
+};
+
+static void benchClientTask(unsigned c, void *data) {
+	const struct BenchJob * const job = (const struct BenchJob *) data;
+
+	job->conns[c]->writeUpdate(*job->ui, job->pb);
+}
+
+static void benchClients(ManagedPixelBuffer *frames[2], const bool parallel) {
+
+	struct timeval start;
+	unsigned n, i, runs;
+	int c;
+	EncCache cache;
+	BenchConn *conns[MAXCLIENTS];
+	UpdateInfo ui;
+
+	ui.changed = frames[0]->getRect();
+
+	for (c = 0; c < MAXCLIENTS; c++)
+		conns[c] = new BenchConn(&cache);
+
+	for (n = 1; n <= MAXCLIENTS; n *= 2) {
+		struct BenchJob job;
+		job.conns = conns;
+		job.ui = &ui;
+
+		gettimeofday(&start, NULL);
+		runs = RUNS / 8;
+		for (i = 0; i < runs; i++) {
+			job.pb = frames[i % 2];
+
+			if (parallel) {
+				TaskPool::get()->parallelFor(n, benchClientTask, &job);
+			} else {
+				for (c = 0; c < (int) n; c++)
+					benchClientTask(c, &job);
+			}
+		}
+		vlog.info("%s encoding for %u clients took %u ms per frame (%u runs)",
+			  parallel ? "Parallel" : "Serial", n, msSince(&start) / runs, runs);
+	}
+
+	for (c = 0; c < MAXCLIENTS; c++)
+		delete conns[c];
+}
+
+// Browser, editor or chat panes scrolling on an otherwise still 4K
+// screen, each by a different amount
+#define SCROLL_W 3840
+#define SCROLL_H 2160
+#define MAXPANES 3
+
+static const struct {
+	Rect rect;
+	int step;
+} scrollPanes[MAXPANES] = {
+	{ Rect(1280, 384, 2432, 1536), 24 },
+	{ Rect(2560, 384, 3456, 1536), 40 },
+	{ Rect(256, 1024, 1152, 1792), 16 },
+};
+
+static void scrollPane(rdr::U8 * const screenptr, const int stride,
+		       const Rect &pane, const int step) {
+
+	rdr::U8 *ptr = screenptr + (pane.tl.y * stride + pane.tl.x) * 4;
+	int x, y;
+
+	for (y = 0; y < pane.height() - step; y++) {
+		memcpy(ptr, ptr + step * stride * 4, pane.width() * 4);
+		ptr += stride * 4;
+	}
+	for (; y < pane.height(); y++) {
+		for (x = 0; x < pane.width() * 4; x++)
+			ptr[x] = rand();
+		ptr += stride * 4;
+	}
+}
+
+static void benchScroll(const bool horizontal, const unsigned npanes) {
+
+	struct timeval start;
+	unsigned i, p, runs, copyRects;
+	uint64_t copied, area;
+	int stride;
+	UpdateInfo ui;
+	Region cursorReg;
+
+	ManagedPixelBuffer screen(pfRGBX, SCROLL_W, SCROLL_H);
+	rdr::U8 * const screenptr = screen.getBufferRW(screen.getRect(), &stride);
+
+	for (i = 0; i < SCROLL_W * SCROLL_H * 4; i++)
+		screenptr[i] = rand();
+
+	const int scrollDetectLimit = Server::scrollDetectLimit;
+
+	Server::detectScrolling.setParam(true);
+	Server::detectHorizontal.setParam(horizontal);
+	Server::scrollDetectLimit.setParam(0);
+
+	ComparingUpdateTracker comparer(&screen);
+	comparer.compare(false, cursorReg);
+	comparer.clear();
+
+	copied = copyRects = area = 0;
+
+	gettimeofday(&start, NULL);
+	runs = horizontal ? RUNS / 4 : RUNS;
+	for (i = 0; i < runs; i++) {
+		for (p = 0; p < npanes; p++) {
+			scrollPane(screenptr, stride, scrollPanes[p].rect,
+				   scrollPanes[p].step);
+			comparer.add_changed(scrollPanes[p].rect);
+			area += scrollPanes[p].rect.area();
+		}
+
+		comparer.compare(false, cursorReg);
+
+		comparer.getUpdateInfo(&ui, screen.getRect());
+		for (std::vector<CopyPassRect>::const_iterator c = ui.copypassed.begin();
+		     c != ui.copypassed.end(); c++)
+			copied += c->rect.area();
+		copyRects += ui.copypassed.size();
+		comparer.clear();
+	}
+	vlog.info("%u pane scroll on 4K w/ %s scroll detection took %u ms (%u runs), "
+		  "%u%% found as %u copies per frame", npanes,
+		  horizontal ? "horizontal" : "vertical",
+		  msSince(&start), runs, (unsigned) (copied * 100 / area), copyRects / runs);
+
+	Server::scrollDetectLimit.setParam(scrollDetectLimit);
+	Server::detectHorizontal.setParam(false);
+	Server::detectScrolling.setParam(false);
+}
+
+// A window dragged across a 4K screen, which X only reports as damage
+#define DRAG_DX 29
+#define DRAG_DY 13
+
+static void benchDrag() {
+
+	struct timeval start;
+	unsigned i, runs, copyRects;
+	uint64_t copied, area;
+	int stride, y;
+	Rect window(512, 256, 1536, 1024);
+	UpdateInfo ui;
+	Region cursorReg;
+
+	ManagedPixelBuffer screen(pfRGBX, SCROLL_W, SCROLL_H);
+	rdr::U8 * const screenptr = screen.getBufferRW(screen.getRect(), &stride);
+	std::vector<rdr::U8> pixels(window.area() * 4);
+	std::vector<rdr::U8> behind(SCROLL_W * SCROLL_H * 4);
+
+	for (i = 0; i < SCROLL_W * SCROLL_H * 4; i++) {
+		screenptr[i] = rand();
+		behind[i] = rand();
+	}
+
+	const int scrollDetectLimit = Server::scrollDetectLimit;
+
+	Server::detectScrolling.setParam(true);
+	Server::scrollDetectLimit.setParam(0);
+
+	ComparingUpdateTracker comparer(&screen);
+	comparer.compare(false, cursorReg);
+	comparer.clear();
+
+	copied = area = 0;
+	copyRects = 0;
+
+	gettimeofday(&start, NULL);
+	runs = RUNS;
+	for (i = 0; i < runs; i++) {
+		const Rect moved = window.translate(Point(DRAG_DX, DRAG_DY));
+		const int lineBytes = window.width() * 4;
+
+		for (y = 0; y < window.height(); y++)
+			memcpy(&pixels[y * lineBytes],
+			       screenptr + ((window.tl.y + y) * stride + window.tl.x) * 4,
+			       lineBytes);
+
+		// What was behind it
+		for (y = window.tl.y; y < window.br.y; y++)
+			memcpy(screenptr + (y * stride + window.tl.x) * 4,
+			       &behind[(y * SCROLL_W + window.tl.x) * 4], lineBytes);
+
+		for (y = 0; y < moved.height(); y++)
+			memcpy(screenptr + ((moved.tl.y + y) * stride + moved.tl.x) * 4,
+			       &pixels[y * lineBytes], lineBytes);
+
+		comparer.add_changed(Region(window).union_(moved));
+		comparer.compare(false, cursorReg);
+		area += moved.area();
+		window = moved;
+
+		comparer.getUpdateInfo(&ui, screen.getRect());
+		for (std::vector<CopyPassRect>::const_iterator c = ui.copypassed.begin();
+		     c != ui.copypassed.end(); c++)
+			copied += c->rect.area();
+		copyRects += ui.copypassed.size();
+		comparer.clear();
+	}
+	vlog.info("Window drag on 4K w/ %s took %u ms (%u runs), "
+		  "%u%% found as %u copies per frame",
+		  Server::detectMotion ? "motion detection" : "scroll detection only",
+		  msSince(&start), runs, (unsigned) (copied * 100 / area), copyRects / runs);
+
+	Server::scrollDetectLimit.setParam(scrollDetectLimit);
+	Server::detectScrolling.setParam(false);
+}
+
 void SelfBench() {
 
 	unsigned i, runs;
@@ -193,5 +450,46 @@ void SelfBench() {
 	}
 	vlog.info("Analysis w/ horizontal scroll detection took %u ms (%u runs) (incl. memcpy overhead)", msSince(&start), runs);
 
+	Server::detectScrolling.setParam(false);
+	Server::detectHorizontal.setParam(false);
+	Server::compareHashes.setParam(true);
+	delete comparer;
+	comparer = new ComparingUpdateTracker(&screen);
+
+	gettimeofday(&start, NULL);
+	runs = RUNS;
+	for (i = 0; i < runs; i++) {
+		memcpy(screenptr, i % 2 ? f1orig : f2orig, W * H * 4);
+		comparer->compare(true, cursorReg);
+	}
+	vlog.info("Analysis w/ block hashes took %u ms (%u runs) (incl. memcpy overhead)", msSince(&start), runs);
+
+	Server::compareHashes.setParam(false);
+	delete comparer;
+
+	for (i = 1; i <= MAXPANES; i++) {
+		benchScroll(false, i);
+		benchScroll(true, i);
+	}
+
+	const bool detectMotion = Server::detectMotion;
+	Server::detectMotion.setParam(false);
+	benchDrag();
+	Server::detectMotion.setParam(true);
+	benchDrag();
+	Server::detectMotion.setParam(detectMotion);
+
+	// Frame time against the number of clients. The encoded rect cache
+	// is disabled, as it would let all but the first client skip encoding.
+	ManagedPixelBuffer *frames[2] = { &f1, &f2 };
+	const int cacheSize = Server::encCacheSize;
+
+	Server::encCacheSize.setParam(0);
+
+	benchClients(frames, false);
+	benchClients(frames, true);
+
+	Server::encCacheSize.setParam(cacheSize);
+
 	exit(0);
 }
@@ -56,6 +56,11 @@ rfb::IntParameter rfb::Server::frameRate
 ("FrameRate",
  "The maximum number of updates per second sent to each client",
  60);
+rfb::IntParameter rfb::Server::inputFrameDelay
+("InputFrameDelay",
+ "Send the screen changes that follow a key press or mouse click after this many "
+ "milliseconds, instead of waiting for the next frame. -1 to disable",
+ 2, -1, 1000);
 rfb::BoolParameter rfb::Server::protocol3_3
 ("Protocol3.3",
  "Always use protocol version 3.3 for backwards compatibility with "
@@ -109,6 +114,21 @@ rfb::BoolParameter rfb::Server::detectHorizontal
 ("DetectHorizontal",
  "With -DetectScrolling enabled, try to detect horizontal scrolls too, not just vertical.",
  false);
+rfb::BoolParameter rfb::Server::detectMotion
+("DetectMotion",
+ "With -DetectScrolling enabled, try to detect moved windows and other 2D motion too. "
+ "Costs extra CPU time on large changed areas.",
+ false);
+rfb::BoolParameter rfb::Server::compareHashes
+("CompareHashes",
+ "Compare the framebuffer by a hash per 64x64 block instead of a full copy of it. "
+ "Uses much less memory, but disables scroll detection.",
+ false);
+rfb::BoolParameter rfb::Server::updateThread
+("UpdateThread",
+ "Compare and encode framebuffer updates on a separate thread, so that the main "
+ "loop only copies changed areas of the screen.",
+ false);
 rfb::BoolParameter rfb::Server::ignoreClientSettingsKasm
 ("IgnoreClientSettingsKasm",
  "Ignore the additional client settings exposed in Kasm.",
@@ -135,8 +155,17 @@ rfb::IntParameter rfb::Server::scrollDetectLimit
  25, 0, 100);
 rfb::IntParameter rfb::Server::rectThreads
 ("RectThreads",
- "Use this many threads to compress rects in parallel. Default 0 (auto), 1 = off",
+ "Use this many threads for encoding, shared by all clients. Default 0 (auto), 1 = off",
+ 0, 0, 64);
+rfb::IntParameter rfb::Server::clientThreads
+("ClientThreads",
+ "Encode updates for up to this many clients at once on the encoding threads. Default 0 (all), 1 = off",
  0, 0, 64);
+rfb::IntParameter rfb::Server::encCacheSize
+("EncCacheSize",
+ "Keep this many megabytes of compressed rects for reuse across frames and clients, "
+ "0 to disable. Default 64",
+ 64, 0, 4096);
 rfb::IntParameter rfb::Server::jpegVideoQuality
 ("JpegVideoQuality",
  "The JPEG quality to use when in video mode",
@@ -39,11 +39,14 @@ namespace rfb {
     static IntParameter clientWaitTimeMillis;
     static IntParameter compareFB;
     static IntParameter frameRate;
+    static IntParameter inputFrameDelay;
     static IntParameter dynamicQualityMin;
     static IntParameter dynamicQualityMax;
     static IntParameter treatLossless;
     static IntParameter scrollDetectLimit;
     static IntParameter rectThreads;
+    static IntParameter clientThreads;
+    static IntParameter encCacheSize;
     static IntParameter DLP_ClipSendMax;
     static IntParameter DLP_ClipAcceptMax;
     static IntParameter DLP_ClipDelay;
@@ -74,6 +77,9 @@ namespace rfb {
     static BoolParameter queryConnect;
     static BoolParameter detectScrolling;
     static BoolParameter detectHorizontal;
+    static BoolParameter detectMotion;
+    static BoolParameter compareHashes;
+    static BoolParameter updateThread;
     static BoolParameter ignoreClientSettingsKasm;
     static BoolParameter selfBench;
     static PresetParameter preferBandwidth;
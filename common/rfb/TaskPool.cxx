@@ -0,0 +1,296 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <exception>
+#include <string>
+
+#include <pthread.h>
+
+#include <os/Mutex.h>
+#include <os/Thread.h>
+#include <rdr/Exception.h>
+#include <rfb/LogWriter.h>
+#include <rfb/ServerCore.h>
+#include <rfb/TaskPool.h>
+
+using namespace rfb;
+
+static LogWriter vlog("TaskPool");
+
+// Which pool and queue the current thread works for, if any
+static __thread const TaskPool *currentPool = NULL;
+static __thread int currentIndex = -1;
+
+struct TaskPool::Group {
+  TaskFunc func;
+  void *data;
+  volatile unsigned remaining;
+  std::string error;
+};
+
+class TaskPool::Worker : public os::Thread {
+public:
+  Worker(TaskPool *pool_, int index_) : pool(pool_), index(index_) {}
+
+protected:
+  virtual void worker() { pool->workerLoop(index); }
+
+private:
+  TaskPool *pool;
+  int index;
+};
+
+TaskPool::TaskPool(unsigned threads) : nextQueue(0), stopping(false),
+  queued(0), tasks(0), steals(0)
+{
+  unsigned i;
+
+  mutex = new os::Mutex();
+  cond = new os::Condition(mutex);
+
+  // The thread calling parallelFor() is one of the threads
+  if (threads < 1)
+    threads = 1;
+
+  for (i = 0; i < threads; i++) {
+    Queue *q = new Queue;
+    q->mutex = new os::Mutex();
+    queues.push_back(q);
+  }
+
+  for (i = 0; i < threads - 1; i++) {
+    workers.push_back(new Worker(this, i));
+    workers.back()->start();
+  }
+}
+
+TaskPool::~TaskPool()
+{
+  std::vector<Worker*>::iterator iter;
+  std::vector<Queue*>::iterator qiter;
+
+  mutex->lock();
+  stopping = true;
+  cond->broadcast();
+  mutex->unlock();
+
+  for (iter = workers.begin(); iter != workers.end(); iter++) {
+    (*iter)->wait();
+    delete *iter;
+  }
+
+  for (qiter = queues.begin(); qiter != queues.end(); qiter++) {
+    delete (*qiter)->mutex;
+    delete *qiter;
+  }
+
+  delete cond;
+  delete mutex;
+}
+
+static TaskPool *sharedPool = NULL;
+static pthread_once_t sharedPoolOnce = PTHREAD_ONCE_INIT;
+
+static void createSharedPool()
+{
+  unsigned threads = rfb::Server::rectThreads;
+  if (!threads)
+    threads = os::Thread::getSystemCPUCount();
+
+  sharedPool = new TaskPool(threads);
+  vlog.info("Using %u threads for encoding", sharedPool->getThreadCount());
+}
+
+TaskPool *TaskPool::get()
+{
+  // The update thread and SelfBench may be the first to get here
+  pthread_once(&sharedPoolOnce, createSharedPool);
+
+  return sharedPool;
+}
+
+void TaskPool::parallelFor(unsigned count, TaskFunc func, void *data)
+{
+  Group group;
+  unsigned i, start, end;
+  int self;
+
+  // Nothing to share
+  if (workers.empty() || count <= 1) {
+    for (i = 0; i < count; i++)
+      func(i, data);
+    return;
+  }
+
+  group.func = func;
+  group.data = data;
+  group.remaining = count;
+
+  self = currentQueue();
+
+  if (self < (int) workers.size()) {
+    // Nested work goes to our own deque, for the idle ones to steal
+    Queue * const q = queues[self];
+
+    // Counted under the lock, before anyone can take them
+    q->mutex->lock();
+    __sync_add_and_fetch(&queued, count);
+    for (i = 0; i < count; i++) {
+      const Task t = { &group, i };
+      q->tasks.push_back(t);
+    }
+    q->mutex->unlock();
+  } else {
+    // Spread it over the workers, starting where the last call ended
+    const unsigned n = workers.size();
+    const unsigned first = __sync_fetch_and_add(&nextQueue, 1);
+
+    for (i = 0; i < n; i++) {
+      start = count * i / n;
+      end = count * (i + 1) / n;
+      if (start == end)
+        continue;
+
+      Queue * const q = queues[(first + i) % n];
+
+      q->mutex->lock();
+      __sync_add_and_fetch(&queued, end - start);
+      for (; start < end; start++) {
+        const Task t = { &group, start };
+        q->tasks.push_back(t);
+      }
+      q->mutex->unlock();
+    }
+  }
+
+  mutex->lock();
+  cond->broadcast();
+  mutex->unlock();
+
+  // Help out until our tasks are done, whoever ends up running them
+  while (group.remaining) {
+    if (runTask(self))
+      continue;
+
+    mutex->lock();
+    while (group.remaining && !queued)
+      cond->wait();
+    mutex->unlock();
+  }
+
+  if (!group.error.empty())
+    throw rdr::Exception("%s", group.error.c_str());
+}
+
+int TaskPool::currentQueue() const
+{
+  if (currentPool == this)
+    return currentIndex;
+
+  return workers.size();
+}
+
+// Only the first one is passed on to parallelFor()'s caller
+void TaskPool::setError(Group *group, const char *error)
+{
+  mutex->lock();
+  if (group->error.empty())
+    group->error = error;
+  mutex->unlock();
+}
+
+bool TaskPool::runTask(int self)
+{
+  Task task;
+  bool found, stolen;
+  unsigned i;
+
+  const unsigned n = queues.size();
+
+  found = stolen = false;
+
+  Queue * const own = queues[self];
+  own->mutex->lock();
+  if (!own->tasks.empty()) {
+    task = own->tasks.back();
+    own->tasks.pop_back();
+    found = true;
+  }
+  own->mutex->unlock();
+
+  for (i = 1; !found && i < n; i++) {
+    Queue * const q = queues[(self + i) % n];
+
+    q->mutex->lock();
+    if (!q->tasks.empty()) {
+      task = q->tasks.front();
+      q->tasks.pop_front();
+      found = stolen = true;
+    }
+    q->mutex->unlock();
+  }
+
+  if (!found)
+    return false;
+
+  __sync_sub_and_fetch(&queued, 1);
+  __sync_add_and_fetch(&tasks, 1);
+  if (stolen)
+    __sync_add_and_fetch(&steals, 1);
+
+  Group * const group = task.group;
+
+  try {
+    group->func(task.index, group->data);
+  } catch (rdr::Exception &e) {
+    setError(group, e.str());
+  } catch (std::exception &e) {
+    setError(group, e.what());
+  } catch (...) {
+    setError(group, "Unknown exception");
+  }
+
+  // The group may be gone as soon as this reaches zero
+  if (__sync_sub_and_fetch(&group->remaining, 1) == 0) {
+    mutex->lock();
+    cond->broadcast();
+    mutex->unlock();
+  }
+
+  return true;
+}
+
+void TaskPool::workerLoop(int self)
+{
+  currentPool = this;
+  currentIndex = self;
+
+  while (true) {
+    if (runTask(self))
+      continue;
+
+    mutex->lock();
+    while (!stopping && !queued)
+      cond->wait();
+    if (stopping) {
+      mutex->unlock();
+      return;
+    }
+    mutex->unlock();
+  }
+}
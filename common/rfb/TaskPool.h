@@ -0,0 +1,100 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// TaskPool is the process-wide set of threads used for encoding work.
+//
+// Each worker has its own task deque. New tasks go to the back of the
+// submitting worker's deque and are taken from there, and idle workers
+// steal from the front of the others. Tasks may submit tasks of their
+// own (e.g. the rects of one client's update), so the number of threads
+// stays bounded however the work nests.
+//
+
+#ifndef __RFB_TASKPOOL_H__
+#define __RFB_TASKPOOL_H__
+
+#include <deque>
+#include <vector>
+
+#include <stdint.h>
+
+namespace os {
+  class Mutex;
+  class Condition;
+}
+
+namespace rfb {
+
+  class TaskPool {
+  public:
+    typedef void (*TaskFunc)(unsigned index, void *data);
+
+    TaskPool(unsigned threads);
+    ~TaskPool();
+
+    // Runs func for each index below count and returns once all of them
+    // have finished. The calling thread runs tasks as well meanwhile.
+    void parallelFor(unsigned count, TaskFunc func, void *data);
+
+    unsigned getThreadCount() const { return workers.size() + 1; }
+    unsigned getQueueDepth() const { return queued; }
+    uint64_t getTaskCount() const { return tasks; }
+    uint64_t getStealCount() const { return steals; }
+
+    // The shared pool, sized by the RectThreads parameter
+    static TaskPool *get();
+
+  private:
+    struct Group;
+
+    struct Task {
+      Group *group;
+      unsigned index;
+    };
+
+    struct Queue {
+      os::Mutex *mutex;
+      std::deque<Task> tasks;
+    };
+
+    class Worker;
+    friend class Worker;
+
+    int currentQueue() const;
+    void setError(Group *group, const char *error);
+    bool runTask(int self);
+    void workerLoop(int self);
+
+    std::vector<Worker*> workers;
+
+    // One per worker, the last one for threads outside the pool
+    std::vector<Queue*> queues;
+    unsigned nextQueue;
+
+    os::Mutex *mutex;
+    os::Condition *cond;
+    bool stopping;
+
+    volatile unsigned queued;
+    volatile uint64_t tasks, steals;
+  };
+
+}
+
+#endif
@@ -107,12 +107,20 @@ bool TightJPEGEncoder::treatLossless()
   return qualityLevel >= rfb::Server::treatLossless;
 }
 
+// compressOnly() is called from the encoding threads. Each of them gets
+// one compressor, kept for the life of the thread, so that the libjpeg
+// setup and the buffers are not redone for every rect.
+static __thread JpegCompressor *threadCompressor = NULL;
+
 void TightJPEGEncoder::compressOnly(const PixelBuffer* pb, const uint8_t qualityIn,
                                     std::vector<uint8_t> &out, const bool lowVideoQuality) const
 {
   const rdr::U8* buffer;
   int stride;
-  JpegCompressor jc;
+
+  if (!threadCompressor)
+    threadCompressor = new JpegCompressor();
+  JpegCompressor &jc = *threadCompressor;
 
   int quality, subsampling;
 
@@ -143,7 +151,7 @@ void TightJPEGEncoder::compressOnly(const PixelBuffer* pb, const uint8_t quality
   memcpy(&out[0], jc.data(), jc.length());
 }
 
-void TightJPEGEncoder::writeOnly(const std::vector<uint8_t> &out) const
+void TightJPEGEncoder::writeOnly(std::vector<uint8_t> &out) const
 {
   rdr::OutStream* os;
 
@@ -152,7 +160,8 @@ void TightJPEGEncoder::writeOnly(const std::vector<uint8_t> &out) const
   os->writeU8(tightJpeg << 4);
 
   writeCompact(out.size(), os);
-  os->writeBytes(&out[0], out.size());
+  // Large images are sent from out rather than copied
+  os->writeOwned(out);
 }
 
 void TightJPEGEncoder::writeRect(const PixelBuffer* pb, const Palette& palette)
@@ -42,7 +42,7 @@ namespace rfb {
     virtual void writeRect(const PixelBuffer* pb, const Palette& palette);
     virtual void compressOnly(const PixelBuffer* pb, const uint8_t quality,
                               std::vector<uint8_t> &out, const bool lowVideoQuality) const;
-    virtual void writeOnly(const std::vector<uint8_t> &out) const;
+    virtual void writeOnly(std::vector<uint8_t> &out) const;
     virtual void writeSolidRect(int width, int height,
                                 const PixelFormat& pf,
                                 const rdr::U8* colour);
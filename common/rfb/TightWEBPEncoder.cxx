@@ -117,6 +117,15 @@ bool TightWEBPEncoder::treatLossless()
   return qualityLevel >= rfb::Server::treatLossless;
 }
 
+// Output and RGB conversion buffers of compressOnly(), one set per
+// encoding thread, reused for every rect that thread compresses
+struct TightWEBPContext {
+  WebPMemoryWriter wrt;
+  std::vector<rdr::U8> rgb;
+};
+
+static __thread TightWEBPContext *threadContext = NULL;
+
 void TightWEBPEncoder::compressOnly(const PixelBuffer* pb, const uint8_t qualityIn,
                                     std::vector<uint8_t> &out, const bool lowVideoQuality) const
 {
@@ -125,7 +134,15 @@ void TightWEBPEncoder::compressOnly(const PixelBuffer* pb, const uint8_t quality
   uint8_t quality, method;
   WebPConfig cfg;
   WebPPicture pic;
-  WebPMemoryWriter wrt;
+
+  if (!threadContext) {
+    threadContext = new TightWEBPContext;
+    WebPMemoryWriterInit(&threadContext->wrt);
+  }
+
+  // Start over, but keep the memory of the last rect
+  WebPMemoryWriter &wrt = threadContext->wrt;
+  wrt.size = 0;
 
   buffer = pb->getBuffer(pb->getRect(), &stride);
 
@@ -160,15 +177,14 @@ void TightWEBPEncoder::compressOnly(const PixelBuffer* pb, const uint8_t quality
   } else if (pfBGRX.equal(pb->getPF())) {
     WebPPictureImportBGRX(&pic, buffer, stride * 4);
   } else {
-    rdr::U8* tmpbuf = new rdr::U8[pic.width * pic.height * 3];
-    pb->getPF().rgbFromBuffer(tmpbuf, (const rdr::U8 *) buffer, pic.width, stride, pic.height);
+    std::vector<rdr::U8> &tmpbuf = threadContext->rgb;
+    tmpbuf.resize(pic.width * pic.height * 3);
+    pb->getPF().rgbFromBuffer(&tmpbuf[0], (const rdr::U8 *) buffer, pic.width, stride, pic.height);
     stride = pic.width * 3;
 
-    WebPPictureImportRGB(&pic, tmpbuf, stride);
-    delete [] tmpbuf;
+    WebPPictureImportRGB(&pic, &tmpbuf[0], stride);
   }
 
-  WebPMemoryWriterInit(&wrt);
   pic.writer = WebPMemoryWrite;
   pic.custom_ptr = &wrt;
 
@@ -181,10 +197,9 @@ void TightWEBPEncoder::compressOnly(const PixelBuffer* pb, const uint8_t quality
   memcpy(&out[0], wrt.mem, wrt.size);
 
   WebPPictureFree(&pic);
-  WebPMemoryWriterClear(&wrt);
 }
 
-void TightWEBPEncoder::writeOnly(const std::vector<uint8_t> &out) const
+void TightWEBPEncoder::writeOnly(std::vector<uint8_t> &out) const
 {
   rdr::OutStream* os;
 
@@ -193,7 +208,8 @@ void TightWEBPEncoder::writeOnly(const std::vector<uint8_t> &out) const
   os->writeU8(tightWebp << 4);
 
   writeCompact(out.size(), os);
-  os->writeBytes(&out[0], out.size());
+  // Large images are sent from out rather than copied
+  os->writeOwned(out);
 }
 
 void TightWEBPEncoder::writeRect(const PixelBuffer* pb, const Palette& palette)
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <sys/time.h>
 
+#include <os/Mutex.h>
 #include <rfb/Timer.h>
 #include <rfb/util.h>
 #include <rfb/LogWriter.h>
@@ -53,11 +54,19 @@ inline static int diffTimeMillis(timeval later, timeval earlier) {
 
 std::list<Timer*> Timer::pending;
 
+// Timers may be started and stopped from the encoding threads, while the
+// main loop is running the callbacks. The callbacks themselves are run
+// without the lock.
+static os::Mutex pendingMutex;
+
 int Timer::checkTimeouts() {
   timeval start;
 
-  if (pending.empty())
+  pendingMutex.lock();
+  if (pending.empty()) {
+    pendingMutex.unlock();
     return 0;
+  }
 
   gettimeofday(&start, 0);
   while (pending.front()->isBefore(start)) {
@@ -66,6 +75,7 @@ int Timer::checkTimeouts() {
 
     timer = pending.front();
     pending.pop_front();
+    pendingMutex.unlock();
 
     gettimeofday(&before, 0);
     if (timer->cb->handleTimeout(timer)) {
@@ -83,17 +93,24 @@ int Timer::checkTimeouts() {
           timer->dueTime = now;
       }
 
+      pendingMutex.lock();
       insertTimer(timer);
-    } else if (pending.empty()) {
-      return 0;
+    } else {
+      pendingMutex.lock();
+      if (pending.empty()) {
+        pendingMutex.unlock();
+        return 0;
+      }
     }
   }
+  pendingMutex.unlock();
   return getNextTimeout();
 }
 
 int Timer::getNextTimeout() {
   timeval now;
   gettimeofday(&now, 0);
+  os::AutoMutex a(&pendingMutex);
   int toWait = __rfbmax(1, pending.front()->getRemainingMs());
   if (toWait > pending.front()->timeoutMs) {
     if (toWait - pending.front()->timeoutMs < 1000) {
@@ -128,15 +145,18 @@ void Timer::start(int timeoutMs_) {
   if (timeoutMs <= 0)
     timeoutMs = 1;
   dueTime = addMillis(now, timeoutMs);
+  os::AutoMutex a(&pendingMutex);
   insertTimer(this);
 }
 
 void Timer::stop() {
+  os::AutoMutex a(&pendingMutex);
   pending.remove(this);
 }
 
 bool Timer::isStarted() {
   std::list<Timer*>::iterator i;
+  os::AutoMutex a(&pendingMutex);
   for (i=pending.begin(); i!=pending.end(); i++) {
     if (*i == this)
       return true;
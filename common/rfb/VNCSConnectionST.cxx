@@ -24,8 +24,10 @@
 #include <rfb/Encoder.h>
 #include <rfb/KeyRemapper.h>
 #include <rfb/LogWriter.h>
+#include <rfb/Metrics.h>
 #include <rfb/Security.h>
 #include <rfb/ServerCore.h>
+#include <rfb/SMsgReader.h>
 #include <rfb/SMsgWriter.h>
 #include <rfb/VNCServerST.h>
 #include <rfb/VNCSConnectionST.h>
@@ -41,7 +43,7 @@
 #include <stdint.h>
 #include <wordexp.h>
 
-#include "kasmpasswd.h"
+#include <network/credstore.h>
 
 using namespace rfb;
 
@@ -58,17 +60,26 @@ VNCSConnectionST::VNCSConnectionST(VNCServerST* server_, network::Socket *s,
     pendingSyncFence(false), syncFence(false), fenceFlags(0),
     fenceDataLen(0), fenceData(NULL), congestionTimer(this),
     losslessTimer(this), kbdLogTimer(this), binclipTimer(this),
+    pacingTimer(this),
     server(server_), updates(false),
     updateRenderedCursor(false), removeRenderedCursor(false),
     continuousUpdates(false), encodeManager(this, &server_->encCache),
     needsPermCheck(false), pointerEventTime(0),
-    clientHasCursor(false),
+    clientHasCursor(false), drainState(DRAIN_NONE), drainTime(0),
+    lastButtonMask(0), inputWaiting(false), earlyInput(false),
+    earlyInputWaiting(false), earlyPointerMoved(false), earlyKbdLog(false),
+    earlyPointerTime(0),
+    inputLatencyCount(0), inputLatencyMax(0), inputLatencyTotal(0),
+    inputsSinceLatencyPrint(0), maxRecentInputLatency(0),
     accessRights(AccessDefault), startTime(time(0)), frameTracking(false)
 {
   setStreams(&sock->inStream(), &sock->outStream());
   peerEndpoint.buf = sock->getPeerEndpoint();
   VNCServerST::connectionsLog.write(1,"accepted: %s", peerEndpoint.buf);
 
+  metricsSlot = Metrics::addClient(peerEndpoint.buf);
+  lastDroppedFrame = 0;
+
   memset(bstats_total, 0, sizeof(bstats_total));
   gettimeofday(&connStart, NULL);
 
@@ -113,6 +124,12 @@ VNCSConnectionST::~VNCSConnectionST()
                                     peerEndpoint.buf,
                                     (closeReason.buf) ? closeReason.buf : "");
 
+  if (inputLatencyCount)
+    vlog.info("Input to update latency for %s: %u inputs, average %u ms, max %u ms",
+              peerEndpoint.buf, inputLatencyCount,
+              (unsigned) (inputLatencyTotal / inputLatencyCount),
+              inputLatencyMax);
+
   // Release any keys the client still had pressed
   while (!pressedKeys.empty()) {
     rdr::U32 keysym, keycode;
@@ -134,6 +151,8 @@ VNCSConnectionST::~VNCSConnectionST()
 
   delete [] fenceData;
 
+  Metrics::removeClient(metricsSlot);
+
   if (server->apimessager) {
     server->apimessager->mainUpdateUserInfo(checkOwnerConn(), server->clients.size());
     server->apimessager->mainClearBottleneckStats(peerEndpoint.buf);
@@ -188,6 +207,13 @@ void VNCSConnectionST::close(const char* reason)
 void VNCSConnectionST::processMessages()
 {
   if (state() == RFBSTATE_CLOSING) return;
+
+  catchUpEarlyInput();
+  if (earlyError.buf) {
+    close(earlyError.buf);
+    return;
+  }
+
   try {
     // - Now set appropriate socket timeouts and process data
     setSocketTimeouts();
@@ -228,6 +254,67 @@ void VNCSConnectionST::processMessages()
   }
 }
 
+bool VNCSConnectionST::processInputMessages()
+{
+  bool done;
+
+  if (state() != RFBSTATE_NORMAL || earlyError.buf)
+    return false;
+
+  // A fence reply has to follow the next message, which is left for
+  // processMessages() to send
+  if (pendingSyncFence)
+    return false;
+
+  earlyInput = true;
+
+  try {
+    while (reader()->readInputMsg())
+      ;
+    done = !getInStream()->checkNoWait(1);
+  } catch (rdr::EndOfStream&) {
+    earlyError.buf = strDup("Clean disconnection");
+    done = false;
+  } catch (rdr::Exception &e) {
+    // Closing sends to the client, that has to wait
+    earlyError.buf = strDup(e.str());
+    done = false;
+  }
+
+  earlyInput = false;
+
+  return done;
+}
+
+// catchUpEarlyInput() hands over what processInputMessages() kept aside,
+// now that the update thread isn't using it
+
+void VNCSConnectionST::catchUpEarlyInput()
+{
+  if (earlyPointerTime) {
+    pointerEventTime = earlyPointerTime;
+    earlyPointerTime = 0;
+  }
+
+  if (earlyPointerMoved) {
+    pointerEventPos = earlyPointerPos;
+    earlyPointerMoved = false;
+  }
+
+  if (earlyInputWaiting) {
+    if (!inputWaiting) {
+      inputTime = earlyInputTime;
+      inputWaiting = true;
+    }
+    earlyInputWaiting = false;
+  }
+
+  if (earlyKbdLog) {
+    kbdLogTimer.start(60 * 1000);
+    earlyKbdLog = false;
+  }
+}
+
 void VNCSConnectionST::flushSocket()
 {
   if (state() == RFBSTATE_CLOSING) return;
@@ -705,12 +792,22 @@ void VNCSConnectionST::setPixelFormat(const PixelFormat& pf)
 
 void VNCSConnectionST::pointerEvent(const Point& pos, int buttonMask, const bool skipClick, const bool skipRelease, int scrollX, int scrollY)
 {
-  pointerEventTime = lastEventTime = time(0);
+  lastEventTime = time(0);
   server->lastUserInputTime = lastEventTime;
+  // The update thread checks where the pointer is for the cursor
+  if (earlyInput)
+    earlyPointerTime = lastEventTime;
+  else
+    pointerEventTime = lastEventTime;
   if (!(accessRights & AccessPtrEvents)) return;
   if (!rfb::Server::acceptPointerEvents) return;
   if (!server->pointerClient || server->pointerClient == this) {
-    pointerEventPos = pos;
+    if (earlyInput) {
+      earlyPointerPos = pos;
+      earlyPointerMoved = true;
+    } else {
+      pointerEventPos = pos;
+    }
     if (buttonMask)
       server->pointerClient = this;
     else
@@ -731,7 +828,12 @@ void VNCSConnectionST::pointerEvent(const Point& pos, int buttonMask, const bool
       }
     }
 
-    server->desktop->pointerEvent(pointerEventPos, buttonMask, skipclick, skiprelease, scrollX, scrollY);
+    // Plain motion doesn't count, the cursor is sent separately
+    if (buttonMask != lastButtonMask || scrollX || scrollY)
+      inputEvent();
+    lastButtonMask = buttonMask;
+
+    server->desktop->pointerEvent(pos, buttonMask, skipclick, skiprelease, scrollX, scrollY);
   }
 }
 
@@ -773,10 +875,15 @@ void VNCSConnectionST::keyEvent(rdr::U32 keysym, rdr::U32 keycode, bool down) {
   }
 
   gettimeofday(&lastKeyEvent, NULL);
+  inputEvent();
 
   if (down) {
     keylog(keysym, sock->getPeerAddress());
-    kbdLogTimer.start(60 * 1000);
+    // Timers are shared with the update thread
+    if (earlyInput)
+      earlyKbdLog = true;
+    else
+      kbdLogTimer.start(60 * 1000);
     vlog.debug("Key pressed: 0x%x / 0x%x", keysym, keycode);
   } else {
     vlog.debug("Key released: 0x%x / 0x%x", keysym, keycode);
@@ -1078,7 +1185,8 @@ bool VNCSConnectionST::handleTimeout(Timer* t)
 {
   try {
     if ((t == &congestionTimer) ||
-        (t == &losslessTimer))
+        (t == &losslessTimer) ||
+        (t == &pacingTimer))
       writeFramebufferUpdate();
     else if (t == &kbdLogTimer)
       flushKeylog(sock->getPeerAddress());
@@ -1114,19 +1222,12 @@ bool VNCSConnectionST::getPerms(bool &write, bool &owner) const
     return true;
   }
   if (user[0]) {
-    struct kasmpasswd_t *set = readkasmpasswd(kasmpasswdpath);
-    unsigned i;
-    for (i = 0; i < set->num; i++) {
-      if (!strcmp(set->entries[i].user, user)) {
-        write = set->entries[i].write;
-        owner = set->entries[i].owner;
-        found = true;
-        break;
-      }
+    struct kasmpasswd_entry_t entry;
+    if (credstore_lookup(user, &entry)) {
+      write = entry.write;
+      owner = entry.owner;
+      found = true;
     }
-
-    free(set->entries);
-    free(set);
   }
 
   return found;
@@ -1160,15 +1261,23 @@ bool VNCSConnectionST::isCongested()
   // Stuff still waiting in the send buffer?
   sock->outStream().flush();
   congestion.debugTrace("congestion-trace.csv", sock->getFd());
-  if (sock->outStream().bufferUsage() > 0)
+  if (sock->outStream().bufferUsage() > 0) {
+    measureDrain(true);
     return true;
+  }
 
-  if (!cp.supportsFence)
+  if (!cp.supportsFence) {
+    measureDrain(false);
     return false;
+  }
 
   congestion.updatePosition(sock->outStream().length());
-  if (!congestion.isCongested())
+  if (!congestion.isCongested()) {
+    measureDrain(false);
     return false;
+  }
+
+  measureDrain(true);
 
   eta = congestion.getUncongestedETA();
   if (eta >= 0)
@@ -1185,6 +1294,54 @@ bool VNCSConnectionST::isCongested()
   return true;
 }
 
+// frameInterval() returns how often this client should get a frame. That
+// is every 1000/FrameRate ms, unless its updates have recently taken longer
+// than that to get through the link. Such clients are paced to what their
+// link can take, rather than being encoded for on every frame.
+
+unsigned VNCSConnectionST::frameInterval()
+{
+  const unsigned interval = 1000 / rfb::Server::frameRate;
+
+  if (drainTime < interval)
+    return interval;
+
+  // Still a frame a second, however slow the link
+  if (drainTime > 1000)
+    return 1000;
+
+  return drainTime;
+}
+
+// measureDrain() is called with the result of every congestion check. The
+// time until the link is free again after an update is only measured if
+// it was found busy in between, otherwise the link kept up with it.
+
+void VNCSConnectionST::measureDrain(bool congested)
+{
+  const unsigned interval = 1000 / rfb::Server::frameRate;
+  unsigned sample;
+
+  if (drainState == DRAIN_NONE)
+    return;
+
+  if (congested) {
+    drainState = DRAIN_CONGESTED;
+    return;
+  }
+
+  if (drainState == DRAIN_CONGESTED)
+    sample = msSince(&lastRealUpdate);
+  else
+    sample = interval;
+  drainState = DRAIN_NONE;
+
+  if (!drainTime)
+    drainTime = sample;
+  else
+    drainTime = (drainTime * 3 + sample) / 4;
+}
+
 
 void VNCSConnectionST::writeFramebufferUpdate()
 {
@@ -1210,8 +1367,11 @@ void VNCSConnectionST::writeFramebufferUpdate()
 
   // Check that we actually have some space on the link and retry in a
   // bit if things are congested.
-  if (isCongested())
+  if (isCongested()) {
+    if (!updates.is_empty())
+      Metrics::frameDropped(Metrics::DropCongestion, lastDroppedFrame);
     return;
+  }
 
   // Check for permission changes?
   if (needsPermCheck) {
@@ -1248,6 +1408,9 @@ void VNCSConnectionST::writeFramebufferUpdate()
   sock->cork(false);
 
   congestion.updatePosition(sock->outStream().length());
+  Metrics::updateClient(metricsSlot, congestion.getBandwidth(),
+                        congestion.getCongestionWindow(),
+                        congestion.getPingTime());
 
   struct timeval now;
   gettimeofday(&now, NULL);
@@ -1273,6 +1436,7 @@ void VNCSConnectionST::writeDataUpdate()
   bool needNewUpdateInfo;
   const RenderedCursor *cursor;
   size_t maxUpdateSize;
+  unsigned interval;
 
   updates.enable_copyrect(cp.useCopyRect);
 
@@ -1391,6 +1555,20 @@ void VNCSConnectionST::writeDataUpdate()
       msSince(&lastRealUpdate) < losslessThreshold))
     return;
 
+  // A client on a slow link waits for its own next frame. The changes keep
+  // collecting in the tracker meanwhile, so only the latest pixels of the
+  // screen are encoded for it.
+  interval = frameInterval();
+  if (!ui.is_empty() && interval > 1000 / (unsigned) rfb::Server::frameRate) {
+    const unsigned elapsed = msSince(&lastRealUpdate);
+    if (elapsed < interval) {
+      if (!pacingTimer.isStarted())
+        pacingTimer.start(interval - elapsed);
+      Metrics::frameDropped(Metrics::DropPacing, lastDroppedFrame);
+      return;
+    }
+  }
+
   writeRTTPing();
 
   // FIXME: If continuous updates aren't used then the client might
@@ -1399,12 +1577,14 @@ void VNCSConnectionST::writeDataUpdate()
 
   // FIXME: Bandwidth estimation without congestion control
   maxUpdateSize = congestion.getBandwidth() *
-                  server->msToNextUpdate() / 1000;
+                  __rfbmax((unsigned) server->msToNextUpdate(), interval) / 1000;
 
   if (!ui.is_empty()) {
     encodeManager.writeUpdate(ui, server->getPixelBuffer(), cursor, maxUpdateSize);
     copypassed.clear();
     gettimeofday(&lastRealUpdate, NULL);
+    drainState = DRAIN_SENT;
+    countInputLatency();
     losslessTimer.start(losslessThreshold);
 
     const unsigned ms = encodeManager.getEncodingTime();
@@ -1468,6 +1648,63 @@ void VNCSConnectionST::screenLayoutChange(rdr::U16 reason)
                                      cp.screenLayout);
 }
 
+// inputEvent() is called for client input that is likely to change the
+// screen. The server sends the result early, and we time how long it
+// takes to get to the client.
+
+void VNCSConnectionST::inputEvent()
+{
+  server->inputReceived();
+
+  // The update thread times it, so that waits
+  if (earlyInput) {
+    if (!earlyInputWaiting) {
+      gettimeofday(&earlyInputTime, NULL);
+      earlyInputWaiting = true;
+    }
+    return;
+  }
+
+  if (inputWaiting)
+    return;
+
+  gettimeofday(&inputTime, NULL);
+  inputWaiting = true;
+}
+
+void VNCSConnectionST::countInputLatency()
+{
+  unsigned latency;
+
+  if (!inputWaiting)
+    return;
+  inputWaiting = false;
+
+  // Input that didn't change anything would be counted against whatever
+  // changed next
+  latency = msSince(&inputTime);
+  if (latency >= 1000)
+    return;
+
+  inputLatencyCount++;
+  inputLatencyTotal += latency;
+  if (inputLatencyMax < latency)
+    inputLatencyMax = latency;
+
+  if (vlog.getLevel() >= vlog.LEVEL_DEBUG) {
+    inputsSinceLatencyPrint++;
+    if (maxRecentInputLatency < latency)
+      maxRecentInputLatency = latency;
+
+    if (inputsSinceLatencyPrint >= 60) {
+      vlog.debug("Max input to update latency during the last %u inputs: %u ms",
+                 inputsSinceLatencyPrint, maxRecentInputLatency);
+      inputsSinceLatencyPrint = 0;
+      maxRecentInputLatency = 0;
+    }
+  }
+}
+
 static const unsigned recentSecs = 10;
 
 static void pruneStatList(std::list<struct timeval> &list, const struct timeval &now) {
@@ -1513,16 +1750,19 @@ void VNCSConnectionST::sendStats(const bool toClient) {
 
   #define ten(x) (10 - x * 10.0f)
 
-  sprintf(buf, "[ %.1f, %.1f, %.1f, %.1f ]",
+  sprintf(buf, "[ %.1f, %.1f, %.1f, %.1f",
                ten(cpu_recent), ten(cpu_total),
                ten(net_recent), ten(net_total));
 
   #undef ten
 
   if (toClient) {
+    strcat(buf, " ]");
     vlog.info("Sending client stats:\n%s\n", buf);
     writer()->writeStats(buf, strlen(buf));
   } else if (server->apimessager) {
+    // The API also says whether the kernel encrypts for this client
+    sprintf(buf + strlen(buf), ", %u ]", sock->isKernelTLS());
     server->apimessager->mainUpdateBottleneckStats(peerEndpoint.buf, buf);
   }
 }
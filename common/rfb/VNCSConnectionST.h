@@ -64,6 +64,13 @@ namespace rfb {
     // Socket if an error occurs, via the close() call.
     void processMessages();
 
+    // processInputMessages() is used instead while the update thread is
+    // sending a frame. It only reads the key and pointer events that have
+    // already arrived, which go to the desktop without touching anything
+    // the frame needs. Returns false if it stopped at anything else, for
+    // processMessages() to carry on with once the frame is done.
+    bool processInputMessages();
+
     // flushSocket() pushes any unwritten data on to the network.
     void flushSocket();
 
@@ -120,22 +127,29 @@ namespace rfb {
     void add_changed(const Region& region) { updates.add_changed(region); }
     void add_changed_all() { updates.add_changed(server->pb->getRect()); }
     void add_copied(const Region& dest, const Point& delta) {
+      // Pending copypassed rects go out after any copies, so a newer copy
+      // would be done on the client before an older one
+      if (copypassed.size()) {
+        add_changed(dest);
+        return;
+      }
+
       updates.add_copied(dest, delta);
     }
-    void add_copypassed(const std::vector<CopyPassRect> &in) {
-      // If we're adding to a non-empty list, it means something
-      // changed, and we have to convert the new list into changes.
+    void add_copypassed(const std::vector<CopyPassRect> &in, bool copypass) {
+      // If anything from an earlier frame is still unsent, it means something
+      // changed, and we have to convert the new list into changes. The
+      // caller checks can_copypass() before adding the frame's copies.
       //
       // The new change might be a scroll, and just adding would break
-      // the order!
+      // the order! Copypassed rects go out before the changed ones, so they
+      // would copy pixels the client hasn't got yet.
       // (copies 1f, changes 1f, copies 2f, changes 2f -> copies, changes)
       //
-      // However, it shouldn't happen, as we changed the caller to save
-      // cpu on those frames. No point calculating scroll copies that wouldn't
-      // be used. It should only happen if there's multiple clients, and one is
-      // slow.
+      // This happens when one of several clients is slow, or while a client
+      // is congested or paced.
 
-      if (copypassed.size()) {
+      if (!copypass) {
         Region everything;
         for (std::vector<CopyPassRect>::const_iterator it = in.begin();
              it != in.end(); it++) {
@@ -148,8 +162,10 @@ namespace rfb {
       copypassed = in;
     }
 
-    bool has_copypassed() const {
-      return copypassed.size() != 0;
+    // can_copypass() is false if new copypassed rects would only be
+    // converted into changes
+    bool can_copypass() const {
+      return copypassed.empty() && updates.is_empty();
     }
 
     const char* getPeerEndpoint() const {return peerEndpoint.buf;}
@@ -247,6 +263,9 @@ namespace rfb {
 
     bool isShiftPressed();
 
+    void inputEvent();
+    void countInputLatency();
+
     bool getPerms(bool &write, bool &owner) const;
 
     bool checkOwnerConn() const;
@@ -254,6 +273,8 @@ namespace rfb {
     // Congestion control
     void writeRTTPing();
     bool isCongested();
+    unsigned frameInterval();
+    void measureDrain(bool congested);
 
     // writeFramebufferUpdate() attempts to write a framebuffer update to the
     // client.
@@ -270,6 +291,7 @@ namespace rfb {
     void setDesktopName(const char *name);
     void setLEDState(unsigned int state);
     void setSocketTimeouts();
+    void catchUpEarlyInput();
 
     network::Socket* sock;
     CharArray peerEndpoint;
@@ -283,10 +305,14 @@ namespace rfb {
     char *fenceData;
 
     Congestion congestion;
+    // Where its link is reported in Metrics, -1 if it isn't
+    int metricsSlot;
+    uint64_t lastDroppedFrame;
     Timer congestionTimer;
     Timer losslessTimer;
     Timer kbdLogTimer;
     Timer binclipTimer;
+    Timer pacingTimer;
 
     VNCServerST* server;
     SimpleUpdateTracker updates;
@@ -320,9 +346,31 @@ namespace rfb {
     Point pointerEventPos;
     bool clientHasCursor;
     struct timeval lastRealUpdate;
+
+    // Frame pacing, from how long the recent updates took to get through
+    enum { DRAIN_NONE, DRAIN_SENT, DRAIN_CONGESTED } drainState;
+    unsigned drainTime;
     struct timeval lastClipboardOp;
     struct timeval lastKeyEvent;
 
+    // Input to update latency, from the first input after an update to
+    // the next update
+    int lastButtonMask;
+    bool inputWaiting;
+    struct timeval inputTime;
+
+    // What processInputMessages() would have changed under the update
+    // thread, kept aside until processMessages()
+    bool earlyInput;
+    bool earlyInputWaiting, earlyPointerMoved, earlyKbdLog;
+    struct timeval earlyInputTime;
+    Point earlyPointerPos;
+    time_t earlyPointerTime;
+    CharArray earlyError;
+    unsigned inputLatencyCount, inputLatencyMax;
+    rdr::U64 inputLatencyTotal;
+    unsigned inputsSinceLatencyPrint, maxRecentInputLatency;
+
     AccessRights accessRights;
 
     CharArray closeReason;
@@ -48,17 +48,42 @@
 // otherwise blacklisted connections might be "forgotten".
 
 
+// Note about the update thread:
+//
+// With -UpdateThread, frames are compared and encoded on a thread of its
+// own instead of the main loop. The main loop still collects the changes
+// to the framebuffer, and once per frame copies them into the back of two
+// snapshots of it. The update thread then swaps the snapshots and sends
+// the front one. The clients only ever read the front snapshot, so it
+// does not change under them while the X server keeps drawing.
+//
+// Everything else is still done by the main loop, with the server lock
+// (serverMutex) held by whichever thread is working on the server or its
+// clients. The main loop never waits for a frame to be sent, apart from
+// when the framebuffer is resized. Key and pointer events are read from
+// the clients and passed to the desktop without the lock, as they don't
+// touch anything the frame needs. Anything else is queued, and done once
+// the main loop next gets the lock, at the latest a frame later from
+// checkTimeouts().
+
+
 #include <assert.h>
 #include <stdlib.h>
 
 #include <network/GetAPI.h>
+#include <network/credstore.h>
+
+#include <os/Mutex.h>
+#include <os/Thread.h>
 
 #include <rfb/cpuid.h>
 #include <rfb/ComparingUpdateTracker.h>
 #include <rfb/KeyRemapper.h>
 #include <rfb/ListConnInfo.h>
+#include <rfb/Metrics.h>
 #include <rfb/Security.h>
 #include <rfb/ServerCore.h>
+#include <rfb/TaskPool.h>
 #include <rfb/VNCServerST.h>
 #include <rfb/VNCSConnectionST.h>
 #include <rfb/util.h>
@@ -85,6 +110,26 @@ void SelfBench();
 
 static char kasmpasswdpath[4096];
 
+// Releases the server lock taken by lockForEvents() on the way out
+class EventLock {
+public:
+  EventLock(os::Mutex* mutex_) : mutex(mutex_) {}
+  ~EventLock() { mutex->unlock(); }
+private:
+  os::Mutex* mutex;
+};
+
+class VNCServerST::UpdateThread : public os::Thread {
+public:
+  UpdateThread(VNCServerST *server_) : server(server_) {}
+
+protected:
+  virtual void worker() { server->updateLoop(); }
+
+private:
+  VNCServerST *server;
+};
+
 // -=- Constructors/Destructor
 
 static void mixedPercentages() {
@@ -131,7 +176,11 @@ VNCServerST::VNCServerST(const char* name_, SDesktop* desktop_)
     renderedCursorInvalid(false),
     queryConnectionHandler(0), keyRemapper(&KeyRemapper::defInstance),
     lastConnectionTime(0), disableclients(false),
-    frameTimer(this), apimessager(NULL), trackingFrameStats(0)
+    frameTimer(this), inputDamagePending(false),
+    updateThread(NULL), frameClockRunning(false),
+    frameMutex(NULL), frameCond(NULL), frontSnapshot(0),
+    snapshotReady(false), snapshotsValid(false), stopping(false),
+    inotifyfd(-1), apimessager(NULL), trackingFrameStats(0)
 {
   lastUserInputTime = lastDisconnectTime = time(0);
   slog.debug("creating single-threaded server %s", name.buf);
@@ -204,6 +253,9 @@ VNCServerST::VNCServerST(const char* name_, SDesktop* desktop_)
   kasmpasswdpath[4095] = '\0';
   wordfree(&wexp);
 
+  if (kasmpasswdpath[0])
+    credstore_open(kasmpasswdpath);
+
   if (kasmpasswdpath[0] && access(kasmpasswdpath, R_OK) == 0) {
     // Set up a watch on the password file
     inotifyfd = inotify_init();
@@ -219,6 +271,16 @@ VNCServerST::VNCServerST(const char* name_, SDesktop* desktop_)
 
   trackingClient[0] = 0;
 
+  serverMutex = new os::Mutex(true);
+  snapshots[0] = snapshots[1] = NULL;
+
+  if (Server::updateThread) {
+    frameMutex = new os::Mutex();
+    frameCond = new os::Condition(frameMutex);
+    updateThread = new UpdateThread(this);
+    updateThread->start();
+  }
+
   if (Server::selfBench)
     SelfBench();
 }
@@ -227,6 +289,22 @@ VNCServerST::~VNCServerST()
 {
   slog.debug("shutting down server %s", name.buf);
 
+  if (updateThread) {
+    frameMutex->lock();
+    stopping = true;
+    frameCond->signal();
+    frameMutex->unlock();
+
+    updateThread->wait();
+    delete updateThread;
+    updateThread = NULL;
+
+    delete snapshots[0];
+    delete snapshots[1];
+    delete frameCond;
+    delete frameMutex;
+  }
+
   // Close any active clients, with appropriate logging & cleanup
   closeClients("Server shutdown");
 
@@ -247,6 +325,7 @@ VNCServerST::~VNCServerST()
   delete comparer;
 
   delete cursor;
+  delete serverMutex;
 }
 
 
@@ -254,30 +333,28 @@ VNCServerST::~VNCServerST()
 
 void VNCServerST::addSocket(network::Socket* sock, bool outgoing)
 {
-  // - Check the connection isn't black-marked
-  // *** do this in getSecurity instead?
-  CharArray address(sock->getPeerAddress());
-  if (blHosts->isBlackmarked(address.buf)) {
-    connectionsLog.error("blacklisted: %s", address.buf);
-    try {
-      SConnection::writeConnFailedFromScratch("Too many security failures",
-                                              &sock->outStream());
-    } catch (rdr::Exception&) {
-    }
-    sock->shutdown();
-    closingSockets.push_back(sock);
-    return;
-  }
-
-  if (clients.empty()) {
-    lastConnectionTime = time(0);
-  }
-
-  VNCSConnectionST* client = new VNCSConnectionST(this, sock, outgoing);
-  client->init();
+  QueuedEvent* ev = new QueuedEvent(QueuedEvent::AddSocket);
+  ev->sock = sock;
+  ev->flag = outgoing;
+  queueEvent(ev);
 }
 
 void VNCServerST::removeSocket(network::Socket* sock) {
+  std::list<QueuedEvent*>::iterator ei, ei_next;
+
+  lockForEvents(true);
+  EventLock a(serverMutex);
+
+  // - Forget about anything left for it
+  stalledSockets.erase(sock);
+  for (ei = queuedEvents.begin(); ei != queuedEvents.end(); ei = ei_next) {
+    ei_next = ei; ei_next++;
+    if ((*ei)->sock == sock && (*ei)->type != QueuedEvent::CloseClients) {
+      delete *ei;
+      queuedEvents.erase(ei);
+    }
+  }
+
   // - If the socket has resources allocated to it, delete them
   std::list<VNCSConnectionST*>::iterator ci;
   for (ci = clients.begin(); ci != clients.end(); ci++) {
@@ -307,8 +384,30 @@ void VNCServerST::removeSocket(network::Socket* sock) {
 
 void VNCServerST::processSocketReadEvent(network::Socket* sock)
 {
-  // - Find the appropriate VNCSConnectionST and process the event
   std::list<VNCSConnectionST*>::iterator ci;
+
+  if (!lockForEvents()) {
+    StalledSocket& stalled = stalledSockets[sock];
+
+    // The client list only changes on the main loop, so it can be
+    // searched without the lock
+    stalled.read = true;
+    for (ci = clients.begin(); ci != clients.end(); ci++) {
+      if ((*ci)->getSock() == sock) {
+        if (!(*ci)->processInputMessages())
+          stalled.readStopped = true;
+        return;
+      }
+    }
+
+    // Not added yet
+    stalled.readStopped = true;
+    return;
+  }
+
+  EventLock a(serverMutex);
+
+  // - Find the appropriate VNCSConnectionST and process the event
   for (ci = clients.begin(); ci != clients.end(); ci++) {
     if ((*ci)->getSock() == sock) {
       (*ci)->processMessages();
@@ -320,6 +419,14 @@ void VNCServerST::processSocketReadEvent(network::Socket* sock)
 
 void VNCServerST::processSocketWriteEvent(network::Socket* sock)
 {
+  // The update thread is sending to it anyway
+  if (!lockForEvents()) {
+    stalledSockets[sock].write = true;
+    return;
+  }
+
+  EventLock a(serverMutex);
+
   // - Find the appropriate VNCSConnectionST and process the event
   std::list<VNCSConnectionST*>::iterator ci;
   for (ci = clients.begin(); ci != clients.end(); ci++) {
@@ -331,7 +438,48 @@ void VNCServerST::processSocketWriteEvent(network::Socket* sock)
   throw rdr::Exception("invalid Socket in VNCServerST");
 }
 
+void VNCServerST::getStalled(network::Socket* sock, bool* read, bool* write)
+{
+  std::map<network::Socket*, StalledSocket>::const_iterator i;
+
+  *read = *write = false;
+
+  i = stalledSockets.find(sock);
+  if (i == stalledSockets.end())
+    return;
+
+  *read = i->second.readStopped;
+  *write = i->second.write;
+}
+
 int VNCServerST::checkTimeouts()
+{
+  int timeout = 0;
+
+  // Don't wait for the update thread to finish a frame, it is enough to
+  // come back for the rest a frame later
+  if (lockForEvents()) {
+    try {
+      soonestTimeout(&timeout, checkServerTimeouts());
+    } catch (...) {
+      serverMutex->unlock();
+      throw;
+    }
+
+    serverMutex->unlock();
+  } else {
+    soonestTimeout(&timeout, 1000/rfb::Server::frameRate);
+  }
+
+  // Only now, or the update thread might already be busy with it when
+  // the lock is tried above
+  if (updateThread)
+    soonestTimeout(&timeout, snapshotFrame());
+
+  return timeout;
+}
+
+int VNCServerST::checkServerTimeouts()
 {
   int timeout = 0;
   std::list<VNCSConnectionST*>::iterator ci, ci_next;
@@ -418,6 +566,9 @@ int VNCServerST::checkTimeouts()
 
 void VNCServerST::blockUpdates()
 {
+  lockForEvents(true);
+  EventLock a(serverMutex);
+
   blockCounter++;
 
   stopFrameClock();
@@ -425,19 +576,30 @@ void VNCServerST::blockUpdates()
 
 void VNCServerST::unblockUpdates()
 {
+  lockForEvents(true);
+  EventLock a(serverMutex);
+
   assert(blockCounter > 0);
 
   blockCounter--;
 
   // Restart the frame clock if we have updates
   if (blockCounter == 0) {
-    if (!comparer->is_empty())
+    if (updateThread) {
+      frameMutex->lock();
+      if (!damage.is_empty())
+        startFrameClock();
+      frameMutex->unlock();
+    } else if (!comparer->is_empty())
       startFrameClock();
   }
 }
 
 void VNCServerST::setPixelBuffer(PixelBuffer* pb_, const ScreenSet& layout)
 {
+  lockForEvents(true);
+  EventLock a(serverMutex);
+
   if (comparer)
     comparer->logStats();
 
@@ -445,6 +607,9 @@ void VNCServerST::setPixelBuffer(PixelBuffer* pb_, const ScreenSet& layout)
   delete comparer;
   comparer = 0;
 
+  if (updateThread)
+    resetSnapshots();
+
   screenLayout = layout;
 
   if (!pb) {
@@ -504,6 +669,9 @@ void VNCServerST::setPixelBuffer(PixelBuffer* pb_)
 
 void VNCServerST::setScreenLayout(const ScreenSet& layout)
 {
+  lockForEvents(true);
+  EventLock a(serverMutex);
+
   if (!pb)
     throw Exception("setScreenLayout: new screen layout without a PixelBuffer");
   if (!layout.validate(pb->width(), pb->height()))
@@ -520,32 +688,25 @@ void VNCServerST::setScreenLayout(const ScreenSet& layout)
 
 void VNCServerST::announceClipboard(bool available)
 {
-  std::list<VNCSConnectionST*>::iterator ci, ci_next;
-
-  if (available)
-    clipboardClient = NULL;
-
-  clipboardRequestors.clear();
-
-  for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
-    ci_next = ci; ci_next++;
-    (*ci)->announceClipboard(available);
-  }
+  QueuedEvent* ev = new QueuedEvent(QueuedEvent::AnnounceClipboard);
+  ev->flag = available;
+  queueEvent(ev);
 }
 
 void VNCServerST::sendBinaryClipboardData(const char* mime, const unsigned char *data,
                                           const unsigned len)
 {
-  std::list<VNCSConnectionST*>::iterator ci, ci_next;
-  for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
-    ci_next = ci; ci_next++;
-    (*ci)->sendBinaryClipboardDataOrClose(mime, data, len);
-  }
+  QueuedEvent* ev = new QueuedEvent(QueuedEvent::SendBinaryClipboard);
+  ev->text.buf = strDup(mime);
+  ev->data.assign(data, data + len);
+  queueEvent(ev);
 }
 
 void VNCServerST::getBinaryClipboardData(const char* mime, const unsigned char **data,
                                          unsigned *len)
 {
+  // Only the main loop changes the clipboard, so this doesn't have to
+  // wait for a frame
   if (!clipboardClient)
     return;
   clipboardClient->getBinaryClipboardData(mime, data, len);
@@ -553,101 +714,97 @@ void VNCServerST::getBinaryClipboardData(const char* mime, const unsigned char *
 
 void VNCServerST::clearBinaryClipboardData()
 {
-  std::list<VNCSConnectionST*>::iterator ci, ci_next;
-  for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
-    ci_next = ci; ci_next++;
-    (*ci)->clearBinaryClipboardData();
-  }
+  queueEvent(new QueuedEvent(QueuedEvent::ClearBinaryClipboard));
 }
 
 void VNCServerST::bell()
 {
-  std::list<VNCSConnectionST*>::iterator ci, ci_next;
-  for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
-    ci_next = ci; ci_next++;
-    (*ci)->bellOrClose();
-  }
+  queueEvent(new QueuedEvent(QueuedEvent::Bell));
 }
 
 void VNCServerST::setName(const char* name_)
 {
-  name.replaceBuf(strDup(name_));
-  std::list<VNCSConnectionST*>::iterator ci, ci_next;
-  for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
-    ci_next = ci; ci_next++;
-    (*ci)->setDesktopNameOrClose(name_);
-  }
+  QueuedEvent* ev = new QueuedEvent(QueuedEvent::SetName);
+  ev->text.buf = strDup(name_);
+  queueEvent(ev);
 }
 
 void VNCServerST::add_changed(const Region& region)
 {
+  if (updateThread) {
+    // Called for every drawing request, so this only waits for the
+    // update thread to pick up a snapshot, never for a whole frame
+    if (pb == NULL)
+      return;
+
+    snapshotStale[0].assign_union(region);
+    snapshotStale[1].assign_union(region);
+
+    frameMutex->lock();
+    damage.add_changed(region);
+    frameMutex->unlock();
+
+    startFrameClock();
+    flushInputDamage();
+    return;
+  }
+
   if (comparer == NULL)
     return;
 
   comparer->add_changed(region);
   startFrameClock();
+  flushInputDamage();
 }
 
 void VNCServerST::add_copied(const Region& dest, const Point& delta)
 {
+  if (updateThread) {
+    if (pb == NULL)
+      return;
+
+    snapshotStale[0].assign_union(dest);
+    snapshotStale[1].assign_union(dest);
+
+    frameMutex->lock();
+    damage.add_copied(dest, delta);
+    frameMutex->unlock();
+
+    startFrameClock();
+    flushInputDamage();
+    return;
+  }
+
   if (comparer == NULL)
     return;
 
   comparer->add_copied(dest, delta);
   startFrameClock();
+  flushInputDamage();
 }
 
 void VNCServerST::setCursor(int width, int height, const Point& newHotspot,
                             const rdr::U8* data, const bool resizing)
 {
-  delete cursor;
-  cursor = new Cursor(width, height, newHotspot, data);
-  cursor->crop();
-
-  renderedCursorInvalid = true;
-
-  // If an app has an animated cursor on the resized edge, X internals
-  // will call for it to be rendered. Unlucky for us, the VNC screen
-  // is currently pointing to freed memory, and a cursor change
-  // would want to send a screen update. So, don't do that.
-  if (resizing)
-    return;
-
-  std::list<VNCSConnectionST*>::iterator ci, ci_next;
-  for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
-    ci_next = ci; ci_next++;
-    (*ci)->renderedCursorChange();
-    (*ci)->setCursorOrClose();
-  }
+  QueuedEvent* ev = new QueuedEvent(QueuedEvent::SetCursor);
+  ev->cursor = new Cursor(width, height, newHotspot, data);
+  ev->flag = resizing;
+  queueEvent(ev);
 }
 
 void VNCServerST::setCursorPos(const Point& pos, bool warped)
 {
-  if (!cursorPos.equals(pos)) {
-    cursorPos = pos;
-    renderedCursorInvalid = true;
-    std::list<VNCSConnectionST*>::iterator ci;
-    for (ci = clients.begin(); ci != clients.end(); ci++) {
-      (*ci)->renderedCursorChange();
-      if (warped)
-        (*ci)->cursorPositionChange();
-    }
-  }
+  QueuedEvent* ev = new QueuedEvent(QueuedEvent::SetCursorPos);
+  ev->pos = pos;
+  ev->flag = warped;
+  queueEvent(ev);
 }
 
 void VNCServerST::setLEDState(unsigned int state)
 {
-  std::list<VNCSConnectionST*>::iterator ci, ci_next;
-
-  if (state == ledState)
-    return;
-
-  ledState = state;
-
-  for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
-    ci_next = ci; ci_next++;
-    (*ci)->setLEDStateOrClose(state);
-  }
+  QueuedEvent* ev = new QueuedEvent(QueuedEvent::SetLEDState);
+  ev->value = state;
+  queueEvent(ev);
 }
 
 // Other public methods
@@ -655,27 +812,26 @@ void VNCServerST::setLEDState(unsigned int state)
 void VNCServerST::approveConnection(network::Socket* sock, bool accept,
                                     const char* reason)
 {
-  std::list<VNCSConnectionST*>::iterator ci;
-  for (ci = clients.begin(); ci != clients.end(); ci++) {
-    if ((*ci)->getSock() == sock) {
-      (*ci)->approveConnectionOrClose(accept, reason);
-      return;
-    }
-  }
+  QueuedEvent* ev = new QueuedEvent(QueuedEvent::ApproveConnection);
+  ev->sock = sock;
+  ev->flag = accept;
+  ev->text.buf = reason ? strDup(reason) : NULL;
+  queueEvent(ev);
 }
 
 void VNCServerST::closeClients(const char* reason, network::Socket* except)
 {
-  std::list<VNCSConnectionST*>::iterator i, next_i;
-  for (i=clients.begin(); i!=clients.end(); i=next_i) {
-    next_i = i; next_i++;
-    if ((*i)->getSock() != except)
-      (*i)->close(reason);
-  }
+  QueuedEvent* ev = new QueuedEvent(QueuedEvent::CloseClients);
+  ev->sock = except;
+  ev->text.buf = strDup(reason);
+  queueEvent(ev);
 }
 
 void VNCServerST::getSockets(std::list<network::Socket*>* sockets)
 {
+  // Only the main loop adds and removes clients, so this doesn't have to
+  // wait for a frame. Sockets still to be added are included, for their
+  // events to be found.
   sockets->clear();
   std::list<VNCSConnectionST*>::iterator ci;
   for (ci = clients.begin(); ci != clients.end(); ci++) {
@@ -685,9 +841,16 @@ void VNCServerST::getSockets(std::list<network::Socket*>* sockets)
   for (si = closingSockets.begin(); si != closingSockets.end(); si++) {
     sockets->push_back(*si);
   }
+  std::list<QueuedEvent*>::iterator ei;
+  for (ei = queuedEvents.begin(); ei != queuedEvents.end(); ei++) {
+    if ((*ei)->type == QueuedEvent::AddSocket)
+      sockets->push_back((*ei)->sock);
+  }
 }
 
 SConnection* VNCServerST::getSConnection(network::Socket* sock) {
+  os::AutoMutex a(serverMutex);
+
   std::list<VNCSConnectionST*>::iterator ci;
   for (ci = clients.begin(); ci != clients.end(); ci++) {
     if ((*ci)->getSock() == sock)
@@ -729,7 +892,12 @@ void VNCServerST::startDesktop()
     desktopStarted = true;
     // The tracker might have accumulated changes whilst we were
     // stopped, so flush those out
-    if (!comparer->is_empty())
+    if (updateThread) {
+      frameMutex->lock();
+      if (!damage.is_empty())
+        startFrameClock();
+      frameMutex->unlock();
+    } else if (!comparer->is_empty())
       writeUpdate();
   }
 }
@@ -764,7 +932,7 @@ inline bool VNCServerST::needRenderedCursor()
 
 void VNCServerST::startFrameClock()
 {
-  if (frameTimer.isStarted())
+  if (frameTimer.isStarted() || frameClockRunning)
     return;
   if (blockCounter > 0)
     return;
@@ -774,12 +942,67 @@ void VNCServerST::startFrameClock()
   // The first iteration will be just half a frame as we get a very
   // unstable update rate if we happen to be perfectly in sync with
   // the application's update rate
+  if (updateThread) {
+    // Timer callbacks run with the server lock held, which the update
+    // thread keeps for a whole frame. The next snapshot should not wait
+    // for that, so snapshotFrame() keeps this clock instead
+    gettimeofday(&frameClockStart, NULL);
+    frameClockDelay = 1000/rfb::Server::frameRate/2;
+    frameClockRunning = true;
+    return;
+  }
+
   frameTimer.start(1000/rfb::Server::frameRate/2);
 }
 
 void VNCServerST::stopFrameClock()
 {
   frameTimer.stop();
+  frameClockRunning = false;
+}
+
+// inputReceived() is called by the clients for input that usually changes
+// the screen, such as key presses and mouse clicks. The user is waiting
+// for the result, so the next damage is sent early rather than at the
+// next frame tick. Input that changed nothing within a frame interval is
+// forgotten, so unrelated damage later on isn't hurried.
+
+void VNCServerST::inputReceived()
+{
+  if (rfb::Server::inputFrameDelay < 0)
+    return;
+
+  inputDamagePending = true;
+  gettimeofday(&inputDamageTime, NULL);
+}
+
+void VNCServerST::flushInputDamage()
+{
+  const int delay = rfb::Server::inputFrameDelay;
+
+  if (!inputDamagePending)
+    return;
+  inputDamagePending = false;
+
+  if (msSince(&inputDamageTime) > 1000 / (unsigned) rfb::Server::frameRate)
+    return;
+
+  // Only bring the next frame forward, the ones after it follow at the
+  // usual rate again
+  if (updateThread) {
+    if (!frameClockRunning)
+      return;
+    if (frameClockDelay - (int) msSince(&frameClockStart) > delay) {
+      gettimeofday(&frameClockStart, NULL);
+      frameClockDelay = delay;
+    }
+    return;
+  }
+
+  if (!frameTimer.isStarted())
+    return;
+  if (frameTimer.getRemainingMs() > delay)
+    frameTimer.start(delay);
 }
 
 int VNCServerST::msToNextUpdate()
@@ -787,6 +1010,11 @@ int VNCServerST::msToNextUpdate()
   // FIXME: If the application is updating slower than frameRate then
   //        we could allow the clients more time here
 
+  // The update thread sends a frame as soon as it gets it, the next one
+  // is a full interval away
+  if (updateThread)
+    return 1000/rfb::Server::frameRate;
+
   if (!frameTimer.isStarted())
     return 1000/rfb::Server::frameRate/2;
   else
@@ -805,47 +1033,19 @@ static void checkAPIMessages(network::GetAPIMessager *apimessager,
     slog.info("Main thread processing user API request %u/%u", i + 1, num);
 
     const network::GetAPIMessager::action_data &act = apimessager->actionQueue[i];
-    struct kasmpasswd_t *set = NULL;
-    unsigned s;
-    bool found;
 
     switch (act.action) {
       case network::GetAPIMessager::USER_REMOVE:
-        set = readkasmpasswd(kasmpasswdpath);
-        found = false;
-        for (s = 0; s < set->num; s++) {
-          if (!strcmp(set->entries[s].user, act.data.user)) {
-            set->entries[s].user[0] = '\0';
-            found = true;
-            break;
-          }
-        }
-
-        if (found) {
-          writekasmpasswd(kasmpasswdpath, set);
+        if (credstore_remove(act.data.user))
           slog.info("User %s removed", act.data.user);
-        } else {
+        else
           slog.error("Tried to remove nonexistent user %s", act.data.user);
-        }
       break;
       case network::GetAPIMessager::USER_GIVE_CONTROL:
-        set = readkasmpasswd(kasmpasswdpath);
-        found = false;
-        for (s = 0; s < set->num; s++) {
-          if (!strcmp(set->entries[s].user, act.data.user)) {
-            set->entries[s].write = 1;
-            found = true;
-          } else {
-            set->entries[s].write = 0;
-          }
-        }
-
-        if (found) {
-          writekasmpasswd(kasmpasswdpath, set);
+        if (credstore_give_control(act.data.user))
           slog.info("User %s given control", act.data.user);
-        } else {
+        else
           slog.error("Tried to give control to nonexistent user %s", act.data.user);
-        }
       break;
 
       case network::GetAPIMessager::WANT_FRAME_STATS_SERVERONLY:
@@ -862,11 +1062,6 @@ static void checkAPIMessages(network::GetAPIMessager *apimessager,
         memcpy(trackingClient, act.data.password, 128);
       break;
     }
-
-    if (set) {
-      free(set->entries);
-      free(set);
-    }
   }
 
   apimessager->actionQueue.clear();
@@ -905,7 +1100,7 @@ void VNCServerST::translateDLPRegion(rdr::U16 &x1, rdr::U16 &y1, rdr::U16 &x2, r
   //slog.info("DLP_Region vals %u,%u %u,%u", x1, y1, x2, y2);
 }
 
-void VNCServerST::blackOut()
+void VNCServerST::blackOut(const PixelBuffer *src)
 {
   // Compute the region, since the resolution may have changed
   rdr::U16 x1, y1, x2, y2;
@@ -917,11 +1112,11 @@ void VNCServerST::blackOut()
   blackedpb = new ManagedPixelBuffer(pb->getPF(), pb->getRect().width(), pb->getRect().height());
 
   int stride;
-  const rdr::U8 *src = pb->getBuffer(pb->getRect(), &stride);
+  const rdr::U8 *srcData = src->getBuffer(pb->getRect(), &stride);
   rdr::U8 *data = blackedpb->getBufferRW(pb->getRect(), &stride);
   stride *= 4;
 
-  memcpy(data, src, stride * pb->getRect().height());
+  memcpy(data, srcData, stride * pb->getRect().height());
 
   rdr::U16 y;
   const rdr::U16 w = pb->getRect().width();
@@ -959,10 +1154,11 @@ void VNCServerST::writeUpdate()
 
   struct timeval start;
   gettimeofday(&start, NULL);
+  Metrics::frameStarted();
 
   if (DLPRegion.enabled) {
     comparer->enable_copyrect(false);
-    blackOut();
+    blackOut(framePb());
   }
 
   comparer->getUpdateInfo(&ui, pb->getRect());
@@ -979,7 +1175,9 @@ void VNCServerST::writeUpdate()
     cursorReg = clippedCursorRect;
   }
 
-  pb->grabRegion(toCheck);
+  // The snapshots were grabbed when they were taken
+  if (!updateThread)
+    pb->grabRegion(toCheck);
 
   if (getComparerState())
     comparer->enable();
@@ -989,17 +1187,15 @@ void VNCServerST::writeUpdate()
   struct timeval beforeAnalysis;
   gettimeofday(&beforeAnalysis, NULL);
 
-  // Skip scroll detection if the client is slow, and didn't get the previous one yet
-  if (comparer->compare(clients.size() == 1 && (*clients.begin())->has_copypassed(),
+  // Skip scroll detection if the client is slow, and didn't get the previous update yet
+  if (comparer->compare(clients.size() == 1 && !(*clients.begin())->can_copypass(),
                         cursorReg))
     comparer->getUpdateInfo(&ui, pb->getRect());
 
   comparer->clear();
 
   const unsigned analysisMs = msSince(&beforeAnalysis);
-
-  encCache.clear();
-  encCache.enabled = clients.size() > 1;
+  Metrics::analysisTime.observe(analysisMs);
 
   // Check if the password file was updated
   bool permcheck = false;
@@ -1018,16 +1214,25 @@ void VNCServerST::writeUpdate()
 
       permcheck = true;
 
-      ret -= sizeof(struct inotify_event) - ev->len;
-      pos += sizeof(struct inotify_event) - ev->len;
+      ret -= sizeof(struct inotify_event) + ev->len;
+      pos += sizeof(struct inotify_event) + ev->len;
     }
+
+    if (permcheck)
+      credstore_reload();
   }
 
   unsigned shottime = 0;
   if (apimessager) {
     struct timeval shotstart;
     gettimeofday(&shotstart, NULL);
-    apimessager->mainUpdateScreen(pb);
+    // Scrolled and moved areas are only in copypassed after the compare
+    Region damage = ui.changed.union_(ui.copied);
+    std::vector<CopyPassRect>::const_iterator cp;
+    for (cp = ui.copypassed.begin(); cp != ui.copypassed.end(); ++cp)
+      damage.assign_union(cp->rect);
+
+    apimessager->mainUpdateScreen(framePb(), damage);
     shottime = msSince(&shotstart);
 
     trackingFrameStats = 0;
@@ -1040,6 +1245,9 @@ void VNCServerST::writeUpdate()
   memset(&jpegstats, 0, sizeof(EncodeManager::codecstats_t));
   memset(&webpstats, 0, sizeof(EncodeManager::codecstats_t));
 
+  std::vector<VNCSConnectionST*> toUpdate;
+  toUpdate.reserve(clients.size());
+
   for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
     ci_next = ci; ci_next++;
 
@@ -1059,10 +1267,21 @@ void VNCServerST::writeUpdate()
         trackingFrameStats = network::GetAPIMessager::WANT_FRAME_STATS_SERVERONLY;
     }
 
+    // Copypassed rects are found after the copies of the same frame, and
+    // are sent after them, so only what is left from earlier frames counts
+    const bool copypass = (*ci)->can_copypass();
+
     (*ci)->add_copied(ui.copied, ui.copy_delta);
-    (*ci)->add_copypassed(ui.copypassed);
+    (*ci)->add_copypassed(ui.copypassed, copypass);
     (*ci)->add_changed(ui.changed);
-    (*ci)->writeFramebufferUpdateOrClose();
+
+    toUpdate.push_back(*ci);
+  }
+
+  writeClientUpdates(toUpdate);
+
+  for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
+    ci_next = ci; ci_next++;
 
     if (apimessager) {
       (*ci)->sendStats(false);
@@ -1082,6 +1301,8 @@ void VNCServerST::writeUpdate()
     }
   }
 
+  Metrics::frameDone(msSince(&start));
+
   if (trackingFrameStats) {
     if (enctime) {
       const unsigned totalMs = msSince(&start);
@@ -1111,6 +1332,427 @@ void VNCServerST::writeUpdate()
   }
 }
 
+// writeClientUpdates() sends the pending updates to the given clients. With
+// several clients, they are encoded as tasks on the shared encoding pool,
+// which also runs the rect tasks of each update. Each connection is still
+// only written to from one thread at a time.
+
+struct ClientUpdateJob {
+  const std::vector<VNCSConnectionST*> *clients;
+  unsigned lanes;
+};
+
+static void writeClientUpdateTask(unsigned lane, void *data)
+{
+  const struct ClientUpdateJob * const job = (const struct ClientUpdateJob *) data;
+  unsigned i;
+
+  for (i = lane; i < job->clients->size(); i += job->lanes)
+    (*job->clients)[i]->writeFramebufferUpdateOrClose();
+}
+
+void VNCServerST::writeClientUpdates(const std::vector<VNCSConnectionST*> &toUpdate)
+{
+  const unsigned nclients = toUpdate.size();
+  unsigned lanes, i;
+
+  lanes = rfb::Server::clientThreads;
+  if (!lanes || lanes > nclients)
+    lanes = nclients;
+
+  if (lanes <= 1) {
+    for (i = 0; i < nclients; i++)
+      toUpdate[i]->writeFramebufferUpdateOrClose();
+    return;
+  }
+
+  // The rendered cursor is created on demand, do it before the clients
+  // share it
+  if (needRenderedCursor())
+    getRenderedCursor();
+
+  struct ClientUpdateJob job;
+  job.clients = &toUpdate;
+  job.lanes = lanes;
+
+  TaskPool::get()->parallelFor(lanes, writeClientUpdateTask, &job);
+}
+
+void VNCServerST::lock()
+{
+  serverMutex->lock();
+}
+
+bool VNCServerST::tryLock()
+{
+  return serverMutex->tryLock();
+}
+
+void VNCServerST::unlock()
+{
+  serverMutex->unlock();
+}
+
+// lockForEvents() takes the server lock for something coming from the main
+// loop. With -UpdateThread it returns false rather than wait for a frame
+// being sent, unless told to. Once it has the lock, it first does what was
+// left meanwhile, so that it is done in order.
+
+bool VNCServerST::lockForEvents(bool wait)
+{
+  std::list<VNCSConnectionST*>::iterator ci;
+
+  if (!updateThread || wait)
+    serverMutex->lock();
+  else if (!serverMutex->tryLock())
+    return false;
+
+  try {
+    // Taken off first, as these may come back here
+    while (!queuedEvents.empty()) {
+      QueuedEvent* ev = queuedEvents.front();
+      queuedEvents.pop_front();
+      try {
+        handleEvent(ev);
+      } catch (...) {
+        delete ev;
+        throw;
+      }
+      delete ev;
+    }
+
+    while (!stalledSockets.empty()) {
+      network::Socket* sock = stalledSockets.begin()->first;
+      StalledSocket stalled = stalledSockets.begin()->second;
+      stalledSockets.erase(stalledSockets.begin());
+
+      for (ci = clients.begin(); ci != clients.end(); ci++) {
+        if ((*ci)->getSock() == sock) {
+          if (stalled.read)
+            (*ci)->processMessages();
+          if (stalled.write)
+            (*ci)->flushSocket();
+          break;
+        }
+      }
+    }
+  } catch (...) {
+    serverMutex->unlock();
+    throw;
+  }
+
+  return true;
+}
+
+void VNCServerST::queueEvent(QueuedEvent* ev)
+{
+  queuedEvents.push_back(ev);
+
+  if (lockForEvents())
+    serverMutex->unlock();
+}
+
+void VNCServerST::handleEvent(QueuedEvent* ev)
+{
+  std::list<VNCSConnectionST*>::iterator ci, ci_next;
+
+  switch (ev->type) {
+  case QueuedEvent::AddSocket:
+    {
+      network::Socket* sock = ev->sock;
+
+      // - Check the connection isn't black-marked
+      // *** do this in getSecurity instead?
+      CharArray address(sock->getPeerAddress());
+      if (blHosts->isBlackmarked(address.buf)) {
+        connectionsLog.error("blacklisted: %s", address.buf);
+        try {
+          SConnection::writeConnFailedFromScratch("Too many security failures",
+                                                  &sock->outStream());
+        } catch (rdr::Exception&) {
+        }
+        sock->shutdown();
+        closingSockets.push_back(sock);
+        break;
+      }
+
+      if (clients.empty()) {
+        lastConnectionTime = time(0);
+      }
+
+      VNCSConnectionST* client = new VNCSConnectionST(this, sock, ev->flag);
+      client->init();
+    }
+    break;
+
+  case QueuedEvent::ApproveConnection:
+    for (ci = clients.begin(); ci != clients.end(); ci++) {
+      if ((*ci)->getSock() == ev->sock) {
+        (*ci)->approveConnectionOrClose(ev->flag, ev->text.buf);
+        break;
+      }
+    }
+    break;
+
+  case QueuedEvent::CloseClients:
+    for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
+      ci_next = ci; ci_next++;
+      if ((*ci)->getSock() != ev->sock)
+        (*ci)->close(ev->text.buf);
+    }
+    break;
+
+  case QueuedEvent::SetName:
+    name.replaceBuf(strDup(ev->text.buf));
+    for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
+      ci_next = ci; ci_next++;
+      (*ci)->setDesktopNameOrClose(name.buf);
+    }
+    break;
+
+  case QueuedEvent::SetCursor:
+    delete cursor;
+    cursor = ev->cursor;
+    ev->cursor = NULL;
+    cursor->crop();
+
+    renderedCursorInvalid = true;
+
+    // If an app has an animated cursor on the resized edge, X internals
+    // will call for it to be rendered. Unlucky for us, the VNC screen
+    // is currently pointing to freed memory, and a cursor change
+    // would want to send a screen update. So, don't do that.
+    if (ev->flag)
+      break;
+
+    for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
+      ci_next = ci; ci_next++;
+      (*ci)->renderedCursorChange();
+      (*ci)->setCursorOrClose();
+    }
+    break;
+
+  case QueuedEvent::SetCursorPos:
+    if (cursorPos.equals(ev->pos))
+      break;
+
+    cursorPos = ev->pos;
+    renderedCursorInvalid = true;
+    for (ci = clients.begin(); ci != clients.end(); ci++) {
+      (*ci)->renderedCursorChange();
+      if (ev->flag)
+        (*ci)->cursorPositionChange();
+    }
+    break;
+
+  case QueuedEvent::SetLEDState:
+    if (ev->value == ledState)
+      break;
+
+    ledState = ev->value;
+
+    for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
+      ci_next = ci; ci_next++;
+      (*ci)->setLEDStateOrClose(ledState);
+    }
+    break;
+
+  case QueuedEvent::Bell:
+    for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
+      ci_next = ci; ci_next++;
+      (*ci)->bellOrClose();
+    }
+    break;
+
+  case QueuedEvent::AnnounceClipboard:
+    if (ev->flag)
+      clipboardClient = NULL;
+
+    clipboardRequestors.clear();
+
+    for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
+      ci_next = ci; ci_next++;
+      (*ci)->announceClipboard(ev->flag);
+    }
+    break;
+
+  case QueuedEvent::SendBinaryClipboard:
+    for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
+      ci_next = ci; ci_next++;
+      (*ci)->sendBinaryClipboardDataOrClose(ev->text.buf,
+                                            ev->data.empty() ? NULL : &ev->data[0],
+                                            ev->data.size());
+    }
+    break;
+
+  case QueuedEvent::ClearBinaryClipboard:
+    for (ci = clients.begin(); ci != clients.end(); ci = ci_next) {
+      ci_next = ci; ci_next++;
+      (*ci)->clearBinaryClipboardData();
+    }
+    break;
+  }
+}
+
+// snapshotFrame() runs on the main loop with -UpdateThread, in place of
+// the frame timer. Once per frame it copies what changed into the back
+// snapshot and hands it to the update thread, unless that is still busy
+// with the previous one. Returns the milliseconds until it should be
+// called again, or 0 once nothing is changing.
+
+int VNCServerST::snapshotFrame()
+{
+  UpdateInfo ui;
+  SimpleUpdateTracker frame;
+  Region stale;
+  std::vector<Rect> rects;
+  std::vector<Rect>::const_iterator i;
+  ManagedPixelBuffer *back;
+  int backIndex, elapsed;
+
+  if (!frameClockRunning)
+    return 0;
+
+  elapsed = msSince(&frameClockStart);
+  if (elapsed < frameClockDelay)
+    return frameClockDelay - elapsed;
+
+  gettimeofday(&frameClockStart, NULL);
+  frameClockDelay = 1000/rfb::Server::frameRate;
+
+  frameMutex->lock();
+
+  // We keep running until we go a full interval without any updates
+  if (damage.is_empty()) {
+    frameMutex->unlock();
+    frameClockRunning = false;
+    return 0;
+  }
+
+  // Still busy with the last one, this frame goes with the next
+  if (snapshotReady) {
+    frameMutex->unlock();
+    return frameClockDelay;
+  }
+
+  damage.copyTo(&frame);
+  damage.clear();
+
+  backIndex = 1 - frontSnapshot;
+  back = snapshots[backIndex];
+
+  frameMutex->unlock();
+
+  // The update thread only touches the back snapshot once it is ready,
+  // so it can be filled without the lock
+  frame.getUpdateInfo(&ui, pb->getRect());
+  pb->grabRegion(ui.changed.union_(ui.copied));
+
+  stale = snapshotStale[backIndex];
+  snapshotStale[backIndex].clear();
+
+  stale.get_rects(&rects);
+  for (i = rects.begin(); i != rects.end(); ++i) {
+    const rdr::U8 *data;
+    int stride;
+
+    data = pb->getBuffer(*i, &stride);
+    back->imageRect(*i, data, stride);
+  }
+
+  frameMutex->lock();
+  frame.copyTo(&snapshotDamage);
+  snapshotReady = true;
+  frameCond->signal();
+  frameMutex->unlock();
+
+  return frameClockDelay;
+}
+
+// resetSnapshots() makes new snapshots for a new framebuffer. They are
+// filled by the following frames, until then the whole screen is pending
+// so that the clients don't read them.
+
+void VNCServerST::resetSnapshots()
+{
+  os::AutoMutex a(frameMutex);
+  int i;
+
+  snapshotReady = false;
+  snapshotsValid = false;
+  snapshotDamage.clear();
+  damage.clear();
+
+  for (i = 0; i < 2; i++) {
+    delete snapshots[i];
+    snapshots[i] = NULL;
+    snapshotStale[i].clear();
+  }
+
+  if (!pb)
+    return;
+
+  for (i = 0; i < 2; i++) {
+    snapshots[i] = new ManagedPixelBuffer(pb->getPF(), pb->width(), pb->height());
+    snapshotStale[i] = pb->getRect();
+  }
+}
+
+void VNCServerST::updateLoop()
+{
+  while (true) {
+    frameMutex->lock();
+    while (!snapshotReady && !stopping)
+      frameCond->wait();
+    const bool stop = stopping;
+    frameMutex->unlock();
+
+    if (stop)
+      return;
+
+    try {
+      os::AutoMutex a(serverMutex);
+      writeSnapshot();
+    } catch (rdr::Exception& e) {
+      slog.error("Update thread: %s", e.str());
+    }
+  }
+}
+
+// writeSnapshot() makes the snapshot the main loop just took the front
+// one, and sends the changes in it to the clients like writeUpdate() does
+// for the framebuffer itself. Called with the server lock held.
+
+void VNCServerST::writeSnapshot()
+{
+  frameMutex->lock();
+
+  // A new framebuffer may have replaced it meanwhile
+  if (!snapshotReady) {
+    frameMutex->unlock();
+    return;
+  }
+
+  frontSnapshot = 1 - frontSnapshot;
+  snapshotReady = false;
+  // The first one after a reset has everything
+  snapshotsValid = true;
+
+  if (comparer)
+    snapshotDamage.copyTo(comparer);
+  snapshotDamage.clear();
+
+  frameMutex->unlock();
+
+  if (!comparer || !desktopStarted || blockCounter > 0)
+    return;
+
+  comparer->setFramebuffer(snapshots[frontSnapshot]);
+
+  if (!comparer->is_empty())
+    writeUpdate();
+}
+
 // checkUpdate() is called by clients to see if it is safe to read from
 // the framebuffer at this time.
 
@@ -1122,6 +1764,15 @@ Region VNCServerST::getPendingRegion()
   if (blockCounter > 0)
     return pb->getRect();
 
+  // The clients read the front snapshot, which doesn't change until all
+  // of its changes have been handed out. Nothing is pending then, once
+  // there is one.
+  if (updateThread) {
+    if (!snapshotsValid)
+      return pb->getRect();
+    return Region();
+  }
+
   // Block client from updating if there are pending updates
   if (comparer->is_empty())
     return Region();
@@ -1134,7 +1785,7 @@ Region VNCServerST::getPendingRegion()
 const RenderedCursor* VNCServerST::getRenderedCursor()
 {
   if (renderedCursorInvalid) {
-    renderedCursor.update(pb, cursor, cursorPos);
+    renderedCursor.update(framePb(), cursor, cursorPos);
     renderedCursorInvalid = false;
   }
 
@@ -1143,6 +1794,8 @@ const RenderedCursor* VNCServerST::getRenderedCursor()
 
 void VNCServerST::getConnInfo(ListConnInfo * listConn)
 {
+  os::AutoMutex a(serverMutex);
+
   listConn->Clear();
   listConn->setDisable(getDisable());
   if (clients.empty())
@@ -1155,6 +1808,8 @@ void VNCServerST::getConnInfo(ListConnInfo * listConn)
 
 void VNCServerST::setConnStatus(ListConnInfo* listConn)
 {
+  os::AutoMutex a(serverMutex);
+
   setDisable(listConn->getDisable());
   if (listConn->Empty() || clients.empty()) return;
   for (listConn->iBegin(); !listConn->iEnd(); listConn->iNext()) {
@@ -25,6 +25,9 @@
 #define __RFB_VNCSERVERST_H__
 
 #include <sys/time.h>
+#include <list>
+#include <map>
+#include <vector>
 
 #include <rfb/EncCache.h>
 #include <rfb/SDesktop.h>
@@ -35,6 +38,12 @@
 #include <rfb/Timer.h>
 #include <network/Socket.h>
 #include <rfb/ScreenSet.h>
+#include <rfb/UpdateTracker.h>
+
+namespace os {
+  class Mutex;
+  class Condition;
+}
 
 namespace rfb {
 
@@ -81,6 +90,13 @@ namespace rfb {
     //   Flush pending data from the Socket on to the network.
     virtual void processSocketWriteEvent(network::Socket* sock);
 
+    // With -UpdateThread, the two above don't wait for a frame being
+    // sent. Key and pointer events are read straight away, and the rest
+    // is left until the main loop next gets the server lock. This says
+    // whether the socket should stop being watched for reading or writing
+    // until then, as that would only wake the main loop up again.
+    void getStalled(network::Socket* sock, bool* read, bool* write);
+
     // checkTimeouts
     //   Returns the number of milliseconds left until the next idle timeout
     //   expires.  If any have already expired, the corresponding connections
@@ -95,7 +111,7 @@ namespace rfb {
     virtual void setPixelBuffer(PixelBuffer* pb, const ScreenSet& layout);
     virtual void setPixelBuffer(PixelBuffer* pb);
     virtual void setScreenLayout(const ScreenSet& layout);
-    virtual PixelBuffer* getPixelBuffer() const { if (DLPRegion.enabled && blackedpb) return blackedpb; else return pb; }
+    virtual PixelBuffer* getPixelBuffer() const { if (DLPRegion.enabled && blackedpb) return blackedpb; else return framePb(); }
     virtual void announceClipboard(bool available);
     virtual void clearBinaryClipboardData();
     virtual void sendBinaryClipboardData(const char* mime, const unsigned char *data,
@@ -194,6 +210,16 @@ namespace rfb {
 
     void setAPIMessager(network::GetAPIMessager *msgr) { apimessager = msgr; }
 
+    // With -UpdateThread, that thread holds this lock while it compares
+    // and sends a frame, and so must anything else touching the server or
+    // its clients. The methods of this class take it themselves, and it
+    // may be taken again by the thread holding it. Only resizing the
+    // framebuffer waits for it, everything else from the main loop is
+    // queued until the frame is done.
+    void lock();
+    bool tryLock();
+    void unlock();
+
     void handleClipboardAnnounce(VNCSConnectionST* client, bool available);
     void handleClipboardAnnounceBinary(VNCSConnectionST* client, const unsigned num,
                                        const char mimes[][32]);
@@ -245,9 +271,13 @@ namespace rfb {
     bool needRenderedCursor();
     void startFrameClock();
     void stopFrameClock();
+    void inputReceived();
+    void flushInputDamage();
     int msToNextUpdate();
+    int checkServerTimeouts();
     void writeUpdate();
-    void blackOut();
+    void writeClientUpdates(const std::vector<VNCSConnectionST*> &toUpdate);
+    void blackOut(const PixelBuffer *src);
     Region getPendingRegion();
     const RenderedCursor* getRenderedCursor();
 
@@ -266,6 +296,80 @@ namespace rfb {
 
     Timer frameTimer;
 
+    // Set by client input until the next damage, which is then sent
+    // after -InputFrameDelay if it comes within a frame interval
+    bool inputDamagePending;
+    struct timeval inputDamageTime;
+
+    // -UpdateThread. The main thread copies what changed into the back
+    // snapshot once per frame, and the update thread makes it the front
+    // one, which the clients read, before it compares and sends it.
+    class UpdateThread;
+    friend class UpdateThread;
+
+    os::Mutex *serverMutex;
+    UpdateThread *updateThread;
+
+    void updateLoop();
+    void writeSnapshot();
+    int snapshotFrame();
+    void resetSnapshots();
+    PixelBuffer* framePb() const {
+      return updateThread ? snapshots[frontSnapshot] : pb;
+    }
+
+    // What the main loop couldn't do while a frame was being sent. Done
+    // in order by lockForEvents(), once the main loop has the lock.
+    struct QueuedEvent {
+      enum Type {
+        AddSocket, ApproveConnection, CloseClients, SetName, SetCursor,
+        SetCursorPos, SetLEDState, Bell, AnnounceClipboard,
+        SendBinaryClipboard, ClearBinaryClipboard
+      };
+
+      QueuedEvent(Type type_)
+        : type(type_), sock(NULL), flag(false), value(0), cursor(NULL) {}
+      ~QueuedEvent() { delete cursor; }
+
+      Type type;
+      network::Socket* sock;
+      // Outgoing, accepted, warped, available or resizing
+      bool flag;
+      unsigned value;
+      Point pos;
+      Cursor* cursor;
+      // Reason, name or MIME type
+      CharArray text;
+      std::vector<rdr::U8> data;
+    };
+
+    struct StalledSocket {
+      bool read, write, readStopped;
+    };
+
+    bool lockForEvents(bool wait=false);
+    void queueEvent(QueuedEvent* ev);
+    void handleEvent(QueuedEvent* ev);
+
+    // Only touched by the main thread
+    std::list<QueuedEvent*> queuedEvents;
+    std::map<network::Socket*, StalledSocket> stalledSockets;
+    Region snapshotStale[2];
+    bool frameClockRunning;
+    struct timeval frameClockStart;
+    int frameClockDelay;
+
+    // Protected by frameMutex
+    os::Mutex *frameMutex;
+    os::Condition *frameCond;
+    SimpleUpdateTracker damage;
+    SimpleUpdateTracker snapshotDamage;
+    ManagedPixelBuffer *snapshots[2];
+    int frontSnapshot;
+    bool snapshotReady;
+    bool snapshotsValid;
+    bool stopping;
+
     int inotifyfd;
 
     network::GetAPIMessager *apimessager;
@@ -60,6 +60,15 @@ bool supportsSSE2() {
 	return false;
 }
 
+bool supportsAVX2() {
+	getcpuid();
+#if defined(__x86_64__) || defined(__i386__)
+	#define bit_AVX2        (1 << 5)
+	return extcpuid[1] & bit_AVX2;
+#endif
+	return false;
+}
+
 bool supportsAVX512f() {
 	getcpuid();
 #if defined(__x86_64__) || defined(__i386__)
@@ -22,6 +22,7 @@
 namespace rfb {
 
 	bool supportsSSE2();
+	bool supportsAVX2();
 	bool supportsAVX512f();
 };
 
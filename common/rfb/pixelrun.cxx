@@ -0,0 +1,74 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <rfb/cpuid.h>
+#include <rfb/pixelrun.h>
+
+namespace rfb {
+
+unsigned C_pixelRun(const rdr::U32 *buf, unsigned len, const rdr::U32 colour) {
+	unsigned i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] != colour)
+			return i;
+	}
+
+	return len;
+}
+
+static std::vector<PixelRunImpl> findImpls() {
+	std::vector<PixelRunImpl> impls;
+	const PixelRunImpl c = { "C", C_pixelRun };
+
+	impls.push_back(c);
+
+#ifdef COMPILER_SUPPORTS_SSE2
+	if (supportsSSE2()) {
+		const PixelRunImpl sse2 = { "SSE2", SSE2_pixelRun };
+		impls.push_back(sse2);
+	}
+#endif
+#ifdef COMPILER_SUPPORTS_AVX2
+	if (supportsAVX2()) {
+		const PixelRunImpl avx2 = { "AVX2", AVX2_pixelRun };
+		impls.push_back(avx2);
+	}
+#endif
+#ifdef COMPILER_SUPPORTS_AVX512F
+	if (supportsAVX512f()) {
+		const PixelRunImpl avx512 = { "AVX-512", AVX512_pixelRun };
+		impls.push_back(avx512);
+	}
+#endif
+
+	return impls;
+}
+
+const std::vector<PixelRunImpl> &pixelRunImpls() {
+	static const std::vector<PixelRunImpl> impls = findImpls();
+	return impls;
+}
+
+PixelRunFunc pixelRun = pixelRunImpls().back().func;
+
+}; // namespace rfb
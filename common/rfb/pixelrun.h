@@ -0,0 +1,55 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+//
+// Pixel run search for the rect analysis. pixelRun() returns how many
+// pixels from the start of a buffer equal a colour, which is enough both
+// for solid checks and for counting runs and palette colours. It is
+// done with the widest vectors the CPU has, picked at startup.
+//
+
+#ifndef __RFB_PIXELRUN_H__
+#define __RFB_PIXELRUN_H__
+
+#include <vector>
+
+#include <rdr/types.h>
+
+namespace rfb {
+
+	typedef unsigned (*PixelRunFunc)(const rdr::U32 *buf, unsigned len,
+					 const rdr::U32 colour);
+
+	unsigned C_pixelRun(const rdr::U32 *buf, unsigned len, const rdr::U32 colour);
+	unsigned SSE2_pixelRun(const rdr::U32 *buf, unsigned len, const rdr::U32 colour);
+	unsigned AVX2_pixelRun(const rdr::U32 *buf, unsigned len, const rdr::U32 colour);
+	unsigned AVX512_pixelRun(const rdr::U32 *buf, unsigned len, const rdr::U32 colour);
+
+	struct PixelRunImpl {
+		const char *name;
+		PixelRunFunc func;
+	};
+
+	// The versions this build has that the CPU can run, plain C first
+	// and the one in use last
+	const std::vector<PixelRunImpl> &pixelRunImpls();
+
+	extern PixelRunFunc pixelRun;
+};
+
+#endif
@@ -0,0 +1,45 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <immintrin.h>
+
+#include <rfb/pixelrun.h>
+
+namespace rfb {
+
+unsigned AVX2_pixelRun(const rdr::U32 *buf, unsigned len, const rdr::U32 colour) {
+	const __m256i ref = _mm256_set1_epi32(colour);
+	unsigned i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		const __m256i px = _mm256_loadu_si256((const __m256i *) (buf + i));
+		const unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi32(px, ref));
+
+		if (mask != 0xffffffff)
+			return i + __builtin_ctz(~mask) / 4;
+	}
+
+	for (; i < len; i++) {
+		if (buf[i] != colour)
+			return i;
+	}
+
+	return len;
+}
+
+}; // namespace rfb
@@ -0,0 +1,50 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#include <immintrin.h>
+
+#include <rfb/pixelrun.h>
+
+namespace rfb {
+
+unsigned AVX512_pixelRun(const rdr::U32 *buf, unsigned len, const rdr::U32 colour) {
+	const __m512i ref = _mm512_set1_epi32(colour);
+	unsigned i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		const __m512i px = _mm512_loadu_si512(buf + i);
+		const __mmask16 diff = _mm512_cmpneq_epi32_mask(px, ref);
+
+		if (diff)
+			return i + __builtin_ctz(diff);
+	}
+
+	// Masked loads don't touch the pixels past the end
+	if (i < len) {
+		const __mmask16 valid = (1 << (len - i)) - 1;
+		const __m512i px = _mm512_maskz_loadu_epi32(valid, buf + i);
+		const __mmask16 diff = _mm512_mask_cmpneq_epi32_mask(valid, px, ref);
+
+		if (diff)
+			return i + __builtin_ctz(diff);
+	}
+
+	return len;
+}
+
+}; // namespace rfb
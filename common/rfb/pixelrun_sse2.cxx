@@ -0,0 +1,49 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+#ifdef __aarch64__
+#include "sse2neon.h"
+#else
+#include <emmintrin.h>
+#endif
+
+#include <rfb/pixelrun.h>
+
+namespace rfb {
+
+unsigned SSE2_pixelRun(const rdr::U32 *buf, unsigned len, const rdr::U32 colour) {
+	const __m128i ref = _mm_set1_epi32(colour);
+	unsigned i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		const __m128i px = _mm_loadu_si128((const __m128i *) (buf + i));
+		const unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi32(px, ref));
+
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask) / 4;
+	}
+
+	for (; i < len; i++) {
+		if (buf[i] != colour)
+			return i;
+	}
+
+	return len;
+}
+
+}; // namespace rfb
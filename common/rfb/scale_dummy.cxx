@@ -31,7 +31,7 @@ void SSE2_scale(const uint8_t *oldpx,
 		const uint16_t tgtw, const uint16_t tgth,
 		uint8_t *newpx,
 		const unsigned oldstride, const unsigned newstride,
-		const float tgtdiff) {
+		const float tgtdiff, const uint16_t starty) {
 }
 
 }; // namespace rfb
@@ -116,12 +116,13 @@ void SSE2_halve(const uint8_t *oldpx,
 	}
 }
 
-// Handles factors between 0.5 and 1.0
+// Handles factors between 0.5 and 1.0. Only rows starty..tgth-1 are written,
+// so that bands of one image can be scaled in parallel.
 void SSE2_scale(const uint8_t *oldpx,
 		const uint16_t tgtw, const uint16_t tgth,
 		uint8_t *newpx,
 		const unsigned oldstride, const unsigned newstride,
-		const float tgtdiff) {
+		const float tgtdiff, const uint16_t starty) {
 
 	uint16_t x, y;
 	const __m128i zero = _mm_setzero_si128();
@@ -129,7 +130,7 @@ void SSE2_scale(const uint8_t *oldpx,
 	const __m128i high = _mm_set_epi32(0xffffffff, 0xffffffff, 0, 0);
 	const float invdiff = 1 / tgtdiff;
 
-	for (y = 0; y < tgth; y++) {
+	for (y = starty; y < tgth; y++) {
 		const float ny = y * invdiff;
 		const uint16_t lowy = ny;
 		const uint16_t highy = lowy + 1;
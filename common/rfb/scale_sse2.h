@@ -32,7 +32,7 @@ namespace rfb {
 			const uint16_t tgtw, const uint16_t tgth,
 			uint8_t *newpx,
 			const unsigned oldstride, const unsigned newstride,
-			const float tgtdiff);
+			const float tgtdiff, const uint16_t starty = 0);
 };
 
 #endif
@@ -0,0 +1,165 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+/*
+ * This program measures the cost of compressing small rects as JPEG
+ * with a new compressor per rect, against one compressor reused for
+ * all of them, and against TightJPEGEncoder::compressOnly() which
+ * keeps one per thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <vector>
+
+#include <rfb/ConnParams.h>
+#include <rfb/JpegCompressor.h>
+#include <rfb/PixelBuffer.h>
+#include <rfb/TightJPEGEncoder.h>
+#include <rfb/encodings.h>
+
+#include "util.h"
+
+static const int fbsize = 1024;
+static const int runs = 10000;
+
+static rfb::ManagedPixelBuffer *fb;
+
+typedef void (*testfn) (const rfb::Rect&);
+
+struct TestEntry {
+  const char *label;
+  testfn fn;
+};
+
+static void testFresh(const rfb::Rect &r)
+{
+  rfb::JpegCompressor jc;
+  const rdr::U8 *buffer;
+  int stride;
+
+  buffer = fb->getBuffer(r, &stride);
+  jc.compress(buffer, stride, r, fb->getPF(), 41, rfb::subsample4X);
+}
+
+static void testReused(const rfb::Rect &r)
+{
+  static rfb::JpegCompressor jc;
+  const rdr::U8 *buffer;
+  int stride;
+
+  buffer = fb->getBuffer(r, &stride);
+  jc.clear();
+  jc.compress(buffer, stride, r, fb->getPF(), 41, rfb::subsample4X);
+}
+
+static void testCompressOnly(const rfb::Rect &r)
+{
+  // Quality level 2 is JPEG quality 41 with 4X subsampling, as above.
+  // compressOnly() does not touch the connection.
+  static const rfb::TightJPEGEncoder encoder(NULL);
+  std::vector<uint8_t> out;
+  int stride;
+
+  rdr::U8 *buffer = fb->getBufferRW(r, &stride);
+  const rfb::FullFramePixelBuffer sub(fb->getPF(), r.width(), r.height(),
+                                      buffer, stride);
+  encoder.compressOnly(&sub, 2, out, false);
+}
+
+static void doTest(testfn fn, int tile)
+{
+  int i;
+
+  startCpuCounter();
+
+  for (i = 0;i < runs;i++) {
+    int x, y;
+    x = rand() % (fbsize - tile);
+    y = rand() % (fbsize - tile);
+    fn(rfb::Rect(x, y, x + tile, y + tile));
+  }
+
+  endCpuCounter();
+
+  printf("%g", getCpuCounter() * 1000.0 * 1000.0 / runs);
+}
+
+struct TestEntry tests[] = {
+  {"fresh", testFresh},
+  {"reused", testReused},
+  {"compressOnly", testCompressOnly},
+};
+
+static const int tiles[] = { 16, 32, 64, 128 };
+
+static void doTests(const rfb::PixelFormat &pf)
+{
+  size_t i, j;
+  int stride;
+  rdr::U8 *buffer;
+  char pfb[256];
+
+  fb = new rfb::ManagedPixelBuffer(pf, fbsize, fbsize);
+
+  buffer = fb->getBufferRW(fb->getRect(), &stride);
+  for (i = 0;i < (size_t)(stride * fbsize * pf.bpp/8);i++)
+    buffer[i] = rand();
+  fb->commitBufferRW(fb->getRect());
+
+  pf.print(pfb, sizeof(pfb));
+
+  for (i = 0;i < sizeof(tiles)/sizeof(tiles[0]);i++) {
+    printf("%s,%dx%d", pfb, tiles[i], tiles[i]);
+    for (j = 0;j < sizeof(tests)/sizeof(tests[0]);j++) {
+      printf(",");
+      doTest(tests[j].fn, tiles[i]);
+    }
+    printf("\n");
+  }
+
+  delete fb;
+}
+
+int main(int argc, char **argv)
+{
+  size_t i;
+
+  time_t t;
+  char datebuffer[256];
+
+  time(&t);
+  strftime(datebuffer, sizeof(datebuffer), "%Y-%m-%d %H:%M UTC", gmtime(&t));
+
+  printf("# JPEG compression of small rects, %s\n", datebuffer);
+  printf("# Values are CPU time per rect in microseconds\n");
+  printf("#\n");
+
+  printf("Pixel format,Rect size");
+  for (i = 0;i < sizeof(tests)/sizeof(tests[0]);i++)
+    printf(",%s", tests[i].label);
+  printf("\n");
+
+  // Native to libjpeg, and one that needs converting first
+  doTests(rfb::PixelFormat(32, 24, false, true, 255, 255, 255, 0, 8, 16));
+  doTests(rfb::PixelFormat(16, 16, false, true, 31, 63, 31, 11, 5, 0));
+
+  return 0;
+}
@@ -0,0 +1,142 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+/*
+ * Checks that every vector version of the pixel run search the CPU can
+ * run gives the same answers as the plain C one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <rfb/pixelrun.h>
+
+static const unsigned maxLen = 300;
+// Room to start at every offset within the widest vector
+static const unsigned maxOffset = 16;
+
+static rdr::U32 buffer[maxLen + maxOffset];
+
+// A mismatch in a single byte must be found wherever it is
+static const rdr::U32 colour = 0x80c0e0f0;
+static const rdr::U32 others[] = {
+  0x80c0e0f1, 0x80c0e1f0, 0x80c1e0f0, 0x81c0e0f0, 0x00c0e0f0, 0x7fffffff,
+};
+
+static bool testMismatch(const rfb::PixelRunImpl &impl)
+{
+  unsigned len, offset, pos, i;
+
+  for (len = 0;len <= maxLen;len++) {
+    for (offset = 0;offset < maxOffset;offset++) {
+      rdr::U32 *buf = buffer + offset;
+
+      for (i = 0;i < len;i++)
+        buf[i] = colour;
+
+      // No mismatch at all, with a different pixel right after the end
+      buf[len] = others[0];
+      if (impl.func(buf, len, colour) != len) {
+        printf("%s: solid run of %u at offset %u wrong\n",
+               impl.name, len, offset);
+        return false;
+      }
+
+      for (pos = 0;pos < len;pos++) {
+        buf[pos] = others[(len + pos) % (sizeof(others)/sizeof(others[0]))];
+        if (impl.func(buf, len, colour) != pos) {
+          printf("%s: mismatch at %u of %u, offset %u, not found\n",
+                 impl.name, pos, len, offset);
+          return false;
+        }
+        buf[pos] = colour;
+      }
+    }
+  }
+
+  return true;
+}
+
+// Runs and palette as the rect analysis sees them
+static void runs(rfb::PixelRunFunc func, const rdr::U32 *buf, unsigned len,
+                 std::vector<unsigned> *out)
+{
+  unsigned x, run;
+
+  x = 0;
+  while (x < len) {
+    run = func(buf + x, len - x, buf[x]);
+    out->push_back(buf[x]);
+    out->push_back(run);
+    x += run;
+  }
+}
+
+static bool testRandom(const rfb::PixelRunImpl &impl)
+{
+  unsigned iter, len, i;
+
+  for (iter = 0;iter < 10000;iter++) {
+    std::vector<unsigned> expected, actual;
+
+    len = rand() % maxLen;
+
+    // Few colours in runs of random lengths
+    i = 0;
+    while (i < len) {
+      unsigned run = rand() % 40 + 1;
+      rdr::U32 c = others[rand() % (sizeof(others)/sizeof(others[0]))];
+      while (run-- && i < len)
+        buffer[i++] = c;
+    }
+
+    runs(rfb::C_pixelRun, buffer, len, &expected);
+    runs(impl.func, buffer, len, &actual);
+
+    if (expected != actual) {
+      printf("%s: runs of random buffer %u differ\n", impl.name, iter);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  const std::vector<rfb::PixelRunImpl> &impls = rfb::pixelRunImpls();
+  size_t i;
+  bool ok;
+
+  printf("Pixel Run Correctness Test\n");
+
+  ok = true;
+  for (i = 0;i < impls.size();i++) {
+    printf("%s: ", impls[i].name);
+    if (testMismatch(impls[i]) && testRandom(impls[i]))
+      printf("OK\n");
+    else
+      ok = false;
+  }
+
+  printf("In use: %s\n", impls.back().name);
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,220 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+/*
+ * TLS handshake benchmark for the websocket front end. Makes short HTTPS
+ * requests to a running server, the way API clients do, and reports how
+ * many handshakes per second it managed, first with full handshakes and
+ * then resuming a session saved from an earlier connection.
+ */
+
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <string>
+
+struct Worker {
+  pthread_t thread;
+  bool resume;
+  unsigned ok, resumed, failed;
+  SSL_SESSION *session;
+};
+
+static struct addrinfo *ai;
+static SSL_CTX *ctx;
+static std::string req;
+static unsigned count = 1000;
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// One request, reading the reply until the server closes
+static bool fetch(Worker *w)
+{
+  char buf[4096];
+  bool ok = false;
+  SSL *ssl;
+  int fd;
+
+  fd = socket(ai->ai_family, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+  if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+    close(fd);
+    return false;
+  }
+
+  ssl = SSL_new(ctx);
+  SSL_set_fd(ssl, fd);
+  if (w->resume && w->session)
+    SSL_set_session(ssl, w->session);
+
+  if (SSL_connect(ssl) == 1 &&
+      SSL_write(ssl, req.data(), req.size()) == (int)req.size()) {
+    while (SSL_read(ssl, buf, sizeof(buf)) > 0)
+      ;
+
+    ok = true;
+    if (SSL_session_reused(ssl))
+      w->resumed++;
+
+    // TLS 1.3 tickets arrive after the handshake, so only now is the
+    // session complete
+    if (w->resume && !SSL_session_reused(ssl)) {
+      SSL_SESSION_free(w->session);
+      w->session = SSL_get1_session(ssl);
+    }
+  }
+
+  // Otherwise OpenSSL marks the saved session as not resumable
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  close(fd);
+
+  return ok;
+}
+
+static void *work(void *arg)
+{
+  Worker *w = (Worker *)arg;
+  unsigned i;
+
+  for (i = 0;i < count;i++) {
+    if (fetch(w))
+      w->ok++;
+    else
+      w->failed++;
+  }
+
+  return NULL;
+}
+
+static bool run(bool resume, unsigned threads)
+{
+  Worker *workers = new Worker[threads];
+  unsigned i, ok = 0, resumed = 0, failed = 0;
+  double start, elapsed;
+
+  start = now();
+
+  for (i = 0;i < threads;i++) {
+    memset(&workers[i], 0, sizeof(Worker));
+    workers[i].resume = resume;
+    pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+  }
+
+  for (i = 0;i < threads;i++) {
+    pthread_join(workers[i].thread, NULL);
+    ok += workers[i].ok;
+    resumed += workers[i].resumed;
+    failed += workers[i].failed;
+    SSL_SESSION_free(workers[i].session);
+  }
+
+  elapsed = now() - start;
+
+  printf("%s: %u handshakes (%u resumed), %u failed in %.2f s, "
+         "%.0f handshakes/s\n", resume ? "Resumed" : "Full",
+         ok, resumed, failed, elapsed, ok / elapsed);
+
+  delete [] workers;
+
+  return !failed && (!resume || resumed);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-n requests per thread] [-j threads] "
+          "[-g path] host port\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned threads = 4;
+  const char *host, *port, *path = "/";
+  struct addrinfo hints;
+  bool ok;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:j:g:")) != -1) {
+    switch (opt) {
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'g':
+      path = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (argc - optind != 2 || !threads)
+    usage(argv[0]);
+  host = argv[optind];
+  port = argv[optind + 1];
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &ai) != 0) {
+    fprintf(stderr, "Unable to resolve %s\n", host);
+    return 1;
+  }
+
+  req = std::string("GET ") + path + " HTTP/1.1\r\n"
+        "Host: " + host + "\r\n\r\n";
+
+  SSL_library_init();
+  SSL_load_error_strings();
+
+  // The server's certificate is usually self-signed, and isn't what is
+  // being measured
+  ctx = SSL_CTX_new(SSLv23_client_method());
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  // The server just closes after the reply, and treating that as an
+  // error would stop the session from being resumed
+  SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+  ok = run(false, threads);
+  ok = run(true, threads) && ok;
+
+  SSL_CTX_free(ctx);
+  freeaddrinfo(ai);
+
+  return ok ? 0 : 1;
+}
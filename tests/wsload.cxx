@@ -0,0 +1,335 @@
+/* Copyright (C) 2021 Kasm Web
+ *
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ * USA.
+ */
+
+/*
+ * Load test for the websocket front end. Opens many connections to a
+ * running server at once and keeps them all open until each one has
+ * either seen the VNC greeting through the websocket, or, with -g, has
+ * fetched a file or API path over plain HTTP.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+struct Client {
+  int fd;
+  bool connected;
+  bool done;
+  bool failed;
+  std::string out;
+  size_t sent;
+  std::string in;
+  double start;
+  double finish;
+};
+
+static const char *path = NULL;
+static std::string auth;
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static std::string base64(const std::string &in)
+{
+  static const char table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  size_t i;
+
+  for (i = 0;i < in.size();i += 3) {
+    unsigned v = (unsigned char)in[i] << 16;
+    if (i + 1 < in.size())
+      v |= (unsigned char)in[i + 1] << 8;
+    if (i + 2 < in.size())
+      v |= (unsigned char)in[i + 2];
+
+    out += table[(v >> 18) & 63];
+    out += table[(v >> 12) & 63];
+    out += i + 1 < in.size() ? table[(v >> 6) & 63] : '=';
+    out += i + 2 < in.size() ? table[v & 63] : '=';
+  }
+
+  return out;
+}
+
+static std::string request(const char *host)
+{
+  std::string req;
+
+  if (path) {
+    // The reply is read until the server closes
+    req = std::string("GET ") + path + " HTTP/1.1\r\n"
+          "Host: " + host + "\r\n"
+          "Connection: close\r\n";
+  } else {
+    req = std::string("GET /websockify HTTP/1.1\r\n"
+          "Host: ") + host + "\r\n"
+          "Upgrade: websocket\r\n"
+          "Connection: Upgrade\r\n"
+          "Origin: http://" + host + "\r\n"
+          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+          "Sec-WebSocket-Version: 13\r\n"
+          "Sec-WebSocket-Protocol: binary\r\n";
+  }
+
+  if (!auth.empty())
+    req += "Authorization: Basic " + base64(auth) + "\r\n";
+
+  return req + "\r\n";
+}
+
+// Whether the client has got what it came for
+static bool complete(const Client &c)
+{
+  size_t end;
+
+  if (path)
+    return false; // Read until the server closes
+
+  if (c.in.compare(0, 12, "HTTP/1.1 101") != 0)
+    return false;
+
+  end = c.in.find("\r\n\r\n");
+  if (end == std::string::npos)
+    return false;
+
+  // The greeting arrives as one small binary frame
+  return c.in.size() >= end + 4 + 2 + 12 &&
+         c.in.compare(end + 4 + 2, 12, "RFB 003.008\n") == 0;
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-c connections] [-u user:password] "
+          "[-g path] [-t timeout] host port\n", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned count = 1000, timeout = 30;
+  const char *host, *port;
+  struct addrinfo hints, *ai;
+  struct rlimit rl;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:u:g:t:")) != -1) {
+    switch (opt) {
+    case 'c':
+      count = atoi(optarg);
+      break;
+    case 'u':
+      auth = optarg;
+      break;
+    case 'g':
+      path = optarg;
+      break;
+    case 't':
+      timeout = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (argc - optind != 2)
+    usage(argv[0]);
+  host = argv[optind];
+  port = argv[optind + 1];
+
+  // Every client needs a descriptor of its own
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < count + 16) {
+    fprintf(stderr, "Descriptor limit %lu is too low for %u connections\n",
+            (unsigned long)rl.rlim_cur, count);
+    return 1;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &ai) != 0) {
+    fprintf(stderr, "Unable to resolve %s\n", host);
+    return 1;
+  }
+
+  std::vector<Client> clients(count);
+  std::vector<struct pollfd> fds(count);
+  const std::string req = request(host);
+  const double begin = now();
+  unsigned i, pending;
+
+  for (i = 0;i < count;i++) {
+    Client &c = clients[i];
+
+    c.fd = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (c.fd < 0) {
+      perror("socket");
+      return 1;
+    }
+    fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) | O_NONBLOCK);
+
+    c.connected = c.done = c.failed = false;
+    c.out = req;
+    c.sent = 0;
+    c.start = now();
+
+    if (connect(c.fd, ai->ai_addr, ai->ai_addrlen) < 0 &&
+        errno != EINPROGRESS) {
+      c.done = c.failed = true;
+      c.finish = now();
+    }
+
+    fds[i].fd = c.fd;
+  }
+
+  freeaddrinfo(ai);
+
+  while (true) {
+    pending = 0;
+    for (i = 0;i < count;i++) {
+      Client &c = clients[i];
+
+      fds[i].events = 0;
+      fds[i].revents = 0;
+      if (c.done)
+        continue;
+
+      pending++;
+      if (!c.connected || c.sent < c.out.size())
+        fds[i].events = POLLOUT;
+      else
+        fds[i].events = POLLIN;
+    }
+
+    if (!pending || now() - begin > timeout)
+      break;
+
+    if (poll(&fds[0], count, 1000) < 0) {
+      perror("poll");
+      return 1;
+    }
+
+    for (i = 0;i < count;i++) {
+      Client &c = clients[i];
+      char buf[4096];
+      ssize_t len;
+
+      if (!fds[i].revents)
+        continue;
+
+      if (!c.connected) {
+        int err;
+        socklen_t errlen = sizeof(err);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if (err) {
+          c.done = c.failed = true;
+          c.finish = now();
+          continue;
+        }
+        c.connected = true;
+      }
+
+      if (c.sent < c.out.size()) {
+        len = send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent,
+                   MSG_NOSIGNAL);
+        if (len < 0 && errno != EAGAIN) {
+          c.done = c.failed = true;
+          c.finish = now();
+        } else if (len > 0) {
+          c.sent += len;
+        }
+        continue;
+      }
+
+      len = recv(c.fd, buf, sizeof(buf), 0);
+      if (len < 0 && errno == EAGAIN)
+        continue;
+
+      if (len <= 0) {
+        // A plain HTTP reply ends when the server closes
+        c.done = true;
+        c.failed = !path || len < 0 ||
+                   c.in.compare(0, 12, "HTTP/1.1 200") != 0;
+        c.finish = now();
+        continue;
+      }
+
+      c.in.append(buf, len);
+      if (complete(c)) {
+        c.done = true;
+        c.finish = now();
+      }
+    }
+  }
+
+  // Everything is still open at this point, so all of the successful
+  // connections were being served at the same time
+  std::vector<double> times;
+  unsigned ok = 0, failed = 0, stalled = 0;
+
+  for (i = 0;i < count;i++) {
+    Client &c = clients[i];
+
+    if (!c.done)
+      stalled++;
+    else if (c.failed)
+      failed++;
+    else {
+      ok++;
+      times.push_back(c.finish - c.start);
+    }
+
+    close(c.fd);
+  }
+
+  printf("%s: %u connections, %u ok, %u failed, %u stalled in %.2f s\n",
+         path ? "HTTP" : "Websocket", count, ok, failed, stalled,
+         now() - begin);
+
+  if (!times.empty()) {
+    std::sort(times.begin(), times.end());
+    printf("Time to %s: median %.1f ms, 99th %.1f ms, max %.1f ms\n",
+           path ? "reply" : "greeting",
+           times[times.size() / 2] * 1000,
+           times[times.size() * 99 / 100] * 1000,
+           times.back() * 1000);
+  }
+
+  return (failed || stalled) ? 1 : 0;
+}
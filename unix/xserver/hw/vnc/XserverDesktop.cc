@@ -361,6 +361,13 @@ bool XserverDesktop::handleSocketEvent(int fd,
   if (write)
     sockserv->processSocketWriteEvent(*i);
 
+  // With -UpdateThread, what has to wait for the frame being sent would
+  // only wake us up again. checkSockets() watches it again afterwards.
+  bool readStalled, writeStalled;
+  server->getStalled(*i, &readStalled, &writeStalled);
+  if (readStalled || writeStalled)
+    vncSetNotifyFd(fd, screenIndex, !readStalled, false);
+
   return true;
 }
 
@@ -373,32 +380,18 @@ void XserverDesktop::blockHandler(int* timeout)
   vncInitInputDevice();
 
   try {
-    std::list<Socket*> sockets;
-    std::list<Socket*>::iterator i;
-    server->getSockets(&sockets);
-    for (i = sockets.begin(); i != sockets.end(); i++) {
-      int fd = (*i)->getFd();
-      if ((*i)->isShutdown()) {
-        vlog.debug("client gone, sock %d",fd);
-        vncRemoveNotifyFd(fd);
-        server->removeSocket(*i);
-        vncClientGone(fd);
-        delete (*i);
-      } else {
-        /* Update existing NotifyFD to listen for write (or not) */
-        vncSetNotifyFd(fd, screenIndex, true, (*i)->outStream().bufferUsage() > 0);
+    // With -UpdateThread, leave the clients alone while a frame is being
+    // sent rather than wait for it. checkTimeouts() brings us back soon,
+    // and does what was left for it meanwhile.
+    if (server->tryLock()) {
+      try {
+        checkSockets();
+        checkCursorPos();
+      } catch (...) {
+        server->unlock();
+        throw;
       }
-    }
-
-    // We are responsible for propagating mouse movement between clients
-    int cursorX, cursorY;
-    vncGetPointerPos(&cursorX, &cursorY);
-    cursorX -= vncGetScreenX(screenIndex);
-    cursorY -= vncGetScreenY(screenIndex);
-    if (oldCursorPos.x != cursorX || oldCursorPos.y != cursorY) {
-      oldCursorPos.x = cursorX;
-      oldCursorPos.y = cursorY;
-      server->setCursorPos(oldCursorPos, false);
+      server->unlock();
     }
 
     // Trigger timers and check when the next will expire
@@ -410,6 +403,40 @@ void XserverDesktop::blockHandler(int* timeout)
   }
 }
 
+void XserverDesktop::checkSockets()
+{
+  std::list<Socket*> sockets;
+  std::list<Socket*>::iterator i;
+  server->getSockets(&sockets);
+  for (i = sockets.begin(); i != sockets.end(); i++) {
+    int fd = (*i)->getFd();
+    if ((*i)->isShutdown()) {
+      vlog.debug("client gone, sock %d",fd);
+      vncRemoveNotifyFd(fd);
+      server->removeSocket(*i);
+      vncClientGone(fd);
+      delete (*i);
+    } else {
+      /* Update existing NotifyFD to listen for write (or not) */
+      vncSetNotifyFd(fd, screenIndex, true, (*i)->outStream().bufferUsage() > 0);
+    }
+  }
+}
+
+void XserverDesktop::checkCursorPos()
+{
+  // We are responsible for propagating mouse movement between clients
+  int cursorX, cursorY;
+  vncGetPointerPos(&cursorX, &cursorY);
+  cursorX -= vncGetScreenX(screenIndex);
+  cursorY -= vncGetScreenY(screenIndex);
+  if (oldCursorPos.x != cursorX || oldCursorPos.y != cursorY) {
+    oldCursorPos.x = cursorX;
+    oldCursorPos.y = cursorY;
+    server->setCursorPos(oldCursorPos, false);
+  }
+}
+
 void XserverDesktop::addClient(Socket* sock, bool reverse)
 {
   vlog.debug("new client, sock %d reverse %d",sock->getFd(),reverse);
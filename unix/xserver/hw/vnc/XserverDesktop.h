@@ -117,6 +117,9 @@ protected:
                          network::SocketServer* sockserv,
                          bool read, bool write);
 
+  void checkSockets();
+  void checkCursorPos();
+
   virtual bool handleTimeout(rfb::Timer* t);
 
 private:
@@ -123,9 +123,11 @@ static void vncSocketNotify(int fd, int xevents, void *data)
   int scrIdx;
 
   scrIdx = (intptr_t)data;
+  // Errors include zero-copy completions waiting on the socket, which
+  // are collected when it is flushed
   vncHandleSocketEvent(fd, scrIdx,
                        xevents & X_NOTIFY_READ,
-                       xevents & X_NOTIFY_WRITE);
+                       xevents & (X_NOTIFY_WRITE | X_NOTIFY_ERROR));
 }
 #endif
 